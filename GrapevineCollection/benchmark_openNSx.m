@@ -0,0 +1,40 @@
+function benchmark_openNSx(fname, subset)
+% benchmark_openNSx(fname, subset)
+%
+% openNSx timings for comparison with nsx_read_benchmark. Runs the reads of
+% nsx_read_benchmark.cpp through openNSx.m on the same file. Files with pauses cannot be
+% read with 't:' in openNSx, so the random windows are only timed for single data packet
+% files.
+
+if ~exist('subset', 'var'); subset = 16; end
+
+tic;
+NSx = openNSx(fname, 'noread');
+fprintf('open                 %8.3f s  %d channels, %d data packets\n', toc, ...
+        NSx.MetaTags.ChannelCount, length(NSx.MetaTags.DataPoints));
+nCh = NSx.MetaTags.ChannelCount;
+
+tic; NSx = openNSx(fname, 'read');                                   %#ok<NASGU>
+fprintf('all channels         %8.3f s\n', toc); clear NSx;
+
+tic; NSx = openNSx(fname, 'read', ['c:1:' num2str(subset)]);         %#ok<NASGU>
+fprintf('first channels       %8.3f s\n', toc); clear NSx;
+
+tic; NSx = openNSx(fname, 'read', 'channels', 1:4:nCh);              %#ok<NASGU>
+fprintf('every 4th channel    %8.3f s\n', toc); clear NSx;
+
+tic; NSx = openNSx(fname, 'read', 'skipfactor', 15);                 %#ok<NASGU>
+fprintf('all, skipfactor 15   %8.3f s\n', toc); clear NSx;
+
+Hdr = openNSx(fname, 'noread');
+if length(Hdr.MetaTags.DataPoints) == 1
+    total = Hdr.MetaTags.DataPoints;
+    rate  = Hdr.MetaTags.SamplingFreq;
+    tic;
+    for k = 1:200
+        first = randi(total - rate);
+        NSx = openNSx(fname, 'read', 'c:1:1', ['t:' num2str(first) ':' num2str(first + rate - 1)], 'sample'); %#ok<NASGU>
+    end
+    fprintf('random 1 s windows   %8.3f s  200 windows, channel 1\n', toc);
+end
+end
@@ -0,0 +1,672 @@
+//
+//  hdemg_archive.h
+//
+//  Chunked, channel-major archive of int16 HD-EMG recordings (".hda"). NSx interleaves
+//  all channels in every frame, so reading one channel touches the whole file; here the
+//  frames are cut into chunks of a fixed NIP time window and a fixed block of channels,
+//  and every chunk stores its channels one after the other:
+//
+//      header      "HDEMGARC", channel count, NIP ticks per frame, chunk shape, units
+//      chunks      64 byte chunk header (time range, channel range, codec, CRC32C of the
+//                  data) followed by [channels][frames] int16, each chunk page aligned
+//      index       one entry per chunk, then a trailer with the index offset and "HDEMGEND"
+//
+//  Chunk windows are aligned to the NIP clock: window k holds the frames with NIP time in
+//  [k * chunkFrames * period, (k+1) * chunkFrames * period). A window is split into several
+//  runs when the stream has a gap inside it. The reader looks chunks up through a table
+//  indexed by window, so finding the chunk of a (time, channel) pair does not search.
+//  Windows therefore never decrease through the file: the writer refuses a block that goes
+//  back in NIP time to an earlier window (e.g. after a NIP restart, which needs a new
+//  archive), and the reader rejects a file whose windows decrease.
+//
+//  With HDEMG_ARCHIVE_CODEC_DELTA the rows of a chunk are compressed by hdemg_codec.h; the
+//  data then starts with the encoded size of every row. A chunk that does not get smaller
+//  is stored raw.
+//
+//  Archives that were not closed have no index; the reader then rebuilds it by walking the
+//  chunk headers.
+//
+
+#ifndef HDEMG_ARCHIVE_H
+#define HDEMG_ARCHIVE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_codec.h"
+#include "hdemg_frames.h"
+#include "hdemg_mmap.h"
+#include "hdemg_simd.h"
+
+static const char     HDEMG_ARCHIVE_MAGIC[8]        = {'H','D','E','M','G','A','R','C'};
+static const char     HDEMG_ARCHIVE_END[8]          = {'H','D','E','M','G','E','N','D'};
+static const uint32_t HDEMG_ARCHIVE_CHUNK_MAGIC     = 0x4B434448;  // "HDCK"
+static const uint32_t HDEMG_ARCHIVE_VERSION         = 1;
+static const uint32_t HDEMG_ARCHIVE_ALIGNMENT       = 4096;
+static const uint32_t HDEMG_ARCHIVE_CHUNK_FRAMES    = 4096;
+static const uint32_t HDEMG_ARCHIVE_CHUNK_CHANNELS  = 32;
+static const uint32_t HDEMG_ARCHIVE_NOT_FOUND       = 0xFFFFFFFF;
+static const uint32_t HDEMG_ARCHIVE_CODEC_RAW       = 0;    //!< [channels][frames] int16
+static const uint32_t HDEMG_ARCHIVE_CODEC_DELTA     = 1;    //!< row sizes, then HdemgEncodeRow() rows
+
+#pragma pack(push, 1)
+
+//! \brief start of the file, padded to HDEMG_ARCHIVE_ALIGNMENT
+struct HdemgArchiveHeader
+{
+    char     magic[8];          //!< HDEMG_ARCHIVE_MAGIC
+    uint32_t version;
+    uint32_t channelCount;
+    uint32_t period;            //!< NIP ticks per frame
+    uint32_t chunkFrames;       //!< frames per chunk window
+    uint32_t chunkChannels;     //!< channels per chunk (the last block may be smaller)
+    double   unitsPerCount;     //!< analog value of one count
+    char     units[16];
+};
+
+//! \brief in front of every chunk
+struct HdemgArchiveChunkHeader
+{
+    uint32_t magic;             //!< HDEMG_ARCHIVE_CHUNK_MAGIC
+    uint32_t checksum;          //!< CRC32C of the data
+    uint32_t startTime;         //!< NIP time of the first frame
+    uint32_t frameCount;
+    uint32_t window;            //!< NIP time window, startTime / (chunkFrames * period)
+    uint16_t firstChannel;
+    uint16_t channelCount;
+    uint32_t dataBytes;         //!< size of the data as stored
+    uint32_t codec;             //!< HDEMG_ARCHIVE_CODEC_*
+    uint8_t  reserved[32];
+};
+
+//! \brief index entry of a chunk
+struct HdemgArchiveEntry
+{
+    uint64_t offset;            //!< file offset of the chunk header
+    uint32_t startTime;
+    uint32_t frameCount;
+    uint32_t window;
+    uint16_t firstChannel;
+    uint16_t channelCount;
+};
+
+//! \brief last bytes of a closed archive
+struct HdemgArchiveTrailer
+{
+    uint64_t indexOffset;
+    uint32_t entryCount;
+    uint32_t checksum;          //!< CRC32C of the index entries
+    char     magic[8];          //!< HDEMG_ARCHIVE_END
+};
+
+#pragma pack(pop)
+
+//! \brief Shape and units of an archive
+struct HdemgArchiveSettings
+{
+    uint32_t     chunkFrames;       //!< frames per NIP time window
+    uint32_t     chunkChannels;     //!< channels per chunk
+    float        countsPerUnit;     //!< block samples are multiplied by this before rounding
+    double       unitsPerCount;     //!< stored in the header for readers
+    const char * pUnits;
+    uint32_t     codec;             //!< HDEMG_ARCHIVE_CODEC_RAW or HDEMG_ARCHIVE_CODEC_DELTA
+
+    HdemgArchiveSettings()
+        : chunkFrames(HDEMG_ARCHIVE_CHUNK_FRAMES), chunkChannels(HDEMG_ARCHIVE_CHUNK_CHANNELS),
+          countsPerUnit(1.0f), unitsPerCount(0.25), pUnits("uV"), codec(HDEMG_ARCHIVE_CODEC_RAW) {}
+};
+
+/*! \brief Records HdemgBlocks into an archive.
+ *
+ *  One window of frames is staged; when the window is complete, or the stream has a gap,
+ *  the staged frames are written as one chunk per channel block.
+ */
+class HdemgArchiveWriter
+{
+public:
+    HdemgArchiveWriter()
+        : pFile(NULL), channelCount(0), period(0), chunkFrames(0), chunkChannels(0), sampleRate(0.0),
+          countsPerUnit(1.0f), codec(HDEMG_ARCHIVE_CODEC_RAW), windowTicks(0), framesStored(0), staged(0), runStart(0), window(0), expectedTime(0),
+          offset(0), failed(false) {}
+
+    ~HdemgArchiveWriter() { Close(); }
+
+    /**
+        Creates the archive and writes its header.
+
+        \arg pPath    - file name, e.g. "session.hda"
+        \arg channels - channels per frame of the blocks that will be written
+        \arg rate     - frame rate in Hz, must divide the NIP clock
+        \arg settings - chunk shape and units
+
+        \return true if the file was created
+      */
+    bool Open(const char * pPath, uint32_t channels, double rate, const HdemgArchiveSettings & settings = HdemgArchiveSettings())
+    {
+        Close();
+
+        uint32_t ticks = (rate > 0.0) ? (uint32_t)(HDEMG_NIP_CLOCK_HZ / rate + 0.5) : 0;
+        if(!pPath || channels == 0 || channels > 0xFFFF || ticks == 0 || HDEMG_NIP_CLOCK_HZ / (double)ticks != rate
+           || settings.codec > HDEMG_ARCHIVE_CODEC_DELTA || settings.chunkFrames == 0 || settings.chunkChannels == 0 || settings.chunkChannels > 0xFFFF)
+        {
+            printf("ERROR: invalid archive configuration channels[%u] rate[%.3f]\n", channels, rate);
+            return false;
+        }
+
+        pFile = fopen(pPath, "wb");
+        if(!pFile)
+        {
+            printf("ERROR: cannot create [%s]\n", pPath);
+            return false;
+        }
+
+        channelCount  = channels;
+        period        = ticks;
+        sampleRate    = rate;
+        chunkFrames   = settings.chunkFrames;
+        chunkChannels = (settings.chunkChannels < channels) ? settings.chunkChannels : channels;
+        countsPerUnit = settings.countsPerUnit;
+        codec         = settings.codec;
+        windowTicks   = (uint64_t)chunkFrames * period;
+        staging.assign((size_t)chunkFrames * channels, 0);
+        rows.assign((size_t)chunkFrames * chunkChannels, 0);
+        chunk.assign(sizeof(HdemgArchiveChunkHeader) + chunkChannels * sizeof(uint32_t)
+                     + chunkChannels * HdemgCodecBound(chunkFrames) + HDEMG_ARCHIVE_ALIGNMENT, 0);
+        storedBytes.assign(channels, 0);
+        framesStored = 0;
+        entries.clear();
+        staged  = 0;
+        offset  = 0;
+        failed  = false;
+
+        std::vector<uint8_t> page(HDEMG_ARCHIVE_ALIGNMENT, 0);
+        HdemgArchiveHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, HDEMG_ARCHIVE_MAGIC, sizeof(header.magic));
+        header.version       = HDEMG_ARCHIVE_VERSION;
+        header.channelCount  = channels;
+        header.period        = period;
+        header.chunkFrames   = chunkFrames;
+        header.chunkChannels = chunkChannels;
+        header.unitsPerCount = settings.unitsPerCount;
+        if(settings.pUnits)
+            memcpy(header.units, settings.pUnits, strnlen(settings.pUnits, sizeof(header.units)));
+        memcpy(&page[0], &header, sizeof(header));
+        Put(&page[0], page.size());
+        return !failed;
+    }
+
+    /**
+        Appends the frames of a block.
+
+        \arg block - channel count and rate must match Open()
+
+        \return false if the block does not match, goes back to an earlier window, or the file
+                could not be written
+      */
+    bool Write(const HdemgBlock & block)
+    {
+        if(!pFile || failed)
+            return false;
+        if(block.channelCount != channelCount || block.sampleRate != sampleRate)
+        {
+            printf("ERROR: archive block mismatch channels[%u] rate[%.3f]\n", block.channelCount, block.sampleRate);
+            return false;
+        }
+        if(block.frameCount == 0)
+            return true;
+
+        // the reader looks windows up in file order
+        uint32_t first = (uint32_t)(block.startTime / windowTicks);
+        uint32_t last  = staged ? window : (entries.empty() ? 0 : entries.back().window);
+        if(first < last)
+        {
+            printf("ERROR: archive block at NIP time [%u] goes back before window [%u], start a new archive\n",
+                   block.startTime, last);
+            return false;
+        }
+
+        if(staged > 0 && !HdemgIsContiguous(block, expectedTime))
+            FlushRun();
+
+        uint32_t i = 0;
+        while(i < block.frameCount && !failed)
+        {
+            uint32_t t = block.FrameTime(i);
+            uint32_t w = (uint32_t)(t / windowTicks);
+            if(staged > 0 && w != window)
+                FlushRun();
+            if(staged == 0)
+            {
+                runStart = t;
+                window   = w;
+            }
+
+            // frames of this block that still fall into the window
+            uint64_t end = (uint64_t)(w + 1) * windowTicks;
+            uint32_t n   = (uint32_t)((end - t + period - 1) / period);
+            if(n > block.frameCount - i)
+                n = block.frameCount - i;
+            if(n > chunkFrames - staged)
+                n = chunkFrames - staged;
+
+            HdemgFloatToInt16(&staging[(size_t)staged * channelCount], block.Frame(i), countsPerUnit, n * channelCount);
+            staged += n;
+            i      += n;
+
+            uint32_t next = (i < block.frameCount) ? block.FrameTime(i) : block.EndTime();
+            if(next >= end || staged == chunkFrames)
+                FlushRun();
+        }
+
+        expectedTime = block.EndTime();
+        return !failed;
+    }
+
+    //! \brief writes the staged frames, the index and the trailer, and closes the file
+    void Close()
+    {
+        if(!pFile)
+            return;
+        FlushRun();
+
+        HdemgArchiveTrailer trailer;
+        trailer.indexOffset = offset;
+        trailer.entryCount  = (uint32_t)entries.size();
+        trailer.checksum    = entries.empty() ? 0 : HdemgCrc32c(&entries[0], entries.size() * sizeof(HdemgArchiveEntry));
+        memcpy(trailer.magic, HDEMG_ARCHIVE_END, sizeof(trailer.magic));
+        if(!entries.empty())
+            Put(&entries[0], entries.size() * sizeof(HdemgArchiveEntry));
+        Put(&trailer, sizeof(trailer));
+
+        if(fclose(pFile) != 0)
+            failed = true;
+        pFile = NULL;
+    }
+
+    bool     IsOpen() const     { return pFile != NULL; }
+    bool     Failed() const     { return failed; }
+    uint32_t ChunkCount() const { return (uint32_t)entries.size(); }
+
+    //! \brief raw size / stored size of the frames of a channel written so far
+    double CompressionRatio(uint32_t channel) const
+    {
+        return storedBytes[channel] ? (double)framesStored * sizeof(int16_t) / storedBytes[channel] : 1.0;
+    }
+
+private:
+    void Put(const void * pData, size_t bytes)
+    {
+        if(failed)
+            return;
+        if(fwrite(pData, 1, bytes, pFile) != bytes)
+        {
+            printf("ERROR: archive write failed at offset [%llu]\n", (unsigned long long)offset);
+            failed = true;
+            return;
+        }
+        offset += bytes;
+    }
+
+    //! \brief writes the staged run as one chunk per channel block
+    void FlushRun()
+    {
+        if(staged == 0)
+            return;
+
+        for(uint32_t c0=0; c0<channelCount && !failed; c0+=chunkChannels)
+        {
+            uint32_t n     = (channelCount - c0 < chunkChannels) ? channelCount - c0 : chunkChannels;
+            uint32_t bytes = n * staged * (uint32_t)sizeof(int16_t);
+
+            for(uint32_t c=0; c<n; ++c)
+            {
+                const int16_t * pSrc = &staging[c0 + c];
+                int16_t *       pDst = &rows[(size_t)c * staged];
+                for(uint32_t f=0; f<staged; ++f)
+                    pDst[f] = pSrc[(size_t)f * channelCount];
+            }
+
+            // encoded rows behind their sizes, raw rows if that is not smaller
+            uint8_t * pData = &chunk[sizeof(HdemgArchiveChunkHeader)];
+            uint32_t  used  = HDEMG_ARCHIVE_CODEC_RAW;
+            if(codec == HDEMG_ARCHIVE_CODEC_DELTA)
+            {
+                uint32_t * pSizes = (uint32_t *)pData;
+                size_t     coded  = n * sizeof(uint32_t);
+                for(uint32_t c=0; c<n && coded<bytes; ++c)
+                {
+                    pSizes[c] = (uint32_t)HdemgEncodeRow(&rows[(size_t)c * staged], staged, pData + coded);
+                    coded    += pSizes[c];
+                }
+                if(coded < bytes)
+                {
+                    used  = HDEMG_ARCHIVE_CODEC_DELTA;
+                    bytes = (uint32_t)coded;
+                    for(uint32_t c=0; c<n; ++c)
+                        storedBytes[c0 + c] += pSizes[c];
+                }
+            }
+            if(used == HDEMG_ARCHIVE_CODEC_RAW)
+            {
+                memcpy(pData, &rows[0], bytes);
+                for(uint32_t c=0; c<n; ++c)
+                    storedBytes[c0 + c] += staged * sizeof(int16_t);
+            }
+
+            HdemgArchiveChunkHeader header;
+            memset(&header, 0, sizeof(header));
+            header.magic        = HDEMG_ARCHIVE_CHUNK_MAGIC;
+            header.checksum     = HdemgCrc32c(pData, bytes);
+            header.startTime    = runStart;
+            header.frameCount   = staged;
+            header.window       = window;
+            header.firstChannel = (uint16_t)c0;
+            header.channelCount = (uint16_t)n;
+            header.dataBytes    = bytes;
+            header.codec        = used;
+            memcpy(&chunk[0], &header, sizeof(header));
+
+            HdemgArchiveEntry entry;
+            entry.offset       = offset;
+            entry.startTime    = runStart;
+            entry.frameCount   = staged;
+            entry.window       = window;
+            entry.firstChannel = header.firstChannel;
+            entry.channelCount = header.channelCount;
+            entries.push_back(entry);
+
+            // pad to the next page so every chunk starts aligned
+            size_t total  = sizeof(header) + bytes;
+            size_t padded = (total + HDEMG_ARCHIVE_ALIGNMENT - 1) / HDEMG_ARCHIVE_ALIGNMENT * HDEMG_ARCHIVE_ALIGNMENT;
+            memset(&chunk[total], 0, padded - total);
+            Put(&chunk[0], padded);
+        }
+        framesStored += staged;
+        staged        = 0;
+    }
+
+    FILE *                         pFile;
+    uint32_t                       channelCount;
+    uint32_t                       period;
+    uint32_t                       chunkFrames;
+    uint32_t                       chunkChannels;
+    double                         sampleRate;
+    float                          countsPerUnit;
+    uint32_t                       codec;
+    uint64_t                       windowTicks;
+    std::vector<int16_t>           staging;     // [frame][channel] of the current run
+    std::vector<int16_t>           rows;        // [channel][frame] of one channel block
+    std::vector<uint8_t>           chunk;       // header, data and padding of one chunk
+    std::vector<uint64_t>          storedBytes; // per channel
+    uint64_t                       framesStored;
+    uint32_t                       staged;      // frames in staging
+    uint32_t                       runStart;    // NIP time of the first staged frame
+    uint32_t                       window;
+    uint32_t                       expectedTime;
+    uint64_t                       offset;      // bytes written
+    bool                           failed;
+    std::vector<HdemgArchiveEntry> entries;
+};
+
+/*! \brief Memory mapped archive with (time, channel) lookup.
+ */
+class HdemgArchiveReader
+{
+public:
+    HdemgArchiveReader() : pHeader(NULL), firstWindow(0), channelBlocks(0), recovered(false) {}
+
+    /**
+        Maps an archive and loads its index, or rebuilds the index from the chunk headers
+        if the archive was not closed.
+
+        \return true if the file is an archive
+      */
+    bool Open(const char * pPath)
+    {
+        Close();
+        if(!file.Open(pPath))
+            return false;
+
+        pHeader = (const HdemgArchiveHeader *)file.Data();
+        if(file.Size() < HDEMG_ARCHIVE_ALIGNMENT || memcmp(pHeader->magic, HDEMG_ARCHIVE_MAGIC, 8) != 0
+           || pHeader->version != HDEMG_ARCHIVE_VERSION || pHeader->channelCount == 0 || pHeader->period == 0
+           || pHeader->chunkFrames == 0 || pHeader->chunkChannels == 0)
+        {
+            printf("ERROR: [%s] is not an HD-EMG archive\n", pPath);
+            Close();
+            return false;
+        }
+        channelBlocks = (pHeader->channelCount + pHeader->chunkChannels - 1) / pHeader->chunkChannels;
+
+        if(!LoadIndex())
+        {
+            ScanChunks();
+            recovered = true;
+        }
+        if(!BuildWindowTable())
+        {
+            printf("ERROR: [%s] is damaged, its chunk windows go back in time\n", pPath);
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        file.Close();
+        pHeader   = NULL;
+        recovered = false;
+        entries.clear();
+        windows.clear();
+    }
+
+    bool     IsOpen() const         { return pHeader != NULL; }
+    bool     Recovered() const      { return recovered; }   //!< index rebuilt from the chunks
+    uint32_t ChannelCount() const   { return pHeader->channelCount; }
+    uint32_t Period() const         { return pHeader->period; }
+    double   SampleRate() const     { return (double)HDEMG_NIP_CLOCK_HZ / pHeader->period; }
+    double   UnitsPerCount() const  { return pHeader->unitsPerCount; }
+    uint32_t ChunkCount() const     { return (uint32_t)entries.size(); }
+    const HdemgArchiveEntry & Chunk(uint32_t k) const { return entries[k]; }
+
+    /**
+        Finds the chunk holding a channel at a NIP time.
+
+        \return chunk number, HDEMG_ARCHIVE_NOT_FOUND if the time is not recorded
+      */
+    uint32_t Find(uint32_t time, uint32_t channel) const
+    {
+        if(channel >= pHeader->channelCount || windows.empty())
+            return HDEMG_ARCHIVE_NOT_FOUND;
+        uint32_t w = (uint32_t)(time / ((uint64_t)pHeader->chunkFrames * pHeader->period));
+        if(w < firstWindow || w - firstWindow >= windows.size())
+            return HDEMG_ARCHIVE_NOT_FOUND;
+
+        // the runs of a window follow each other, each with one chunk per channel block
+        for(uint32_t k=windows[w - firstWindow]; k<entries.size() && entries[k].window == w; k+=channelBlocks)
+        {
+            const HdemgArchiveEntry & run = entries[k];
+            if(time >= run.startTime && (uint64_t)(time - run.startTime) < (uint64_t)run.frameCount * pHeader->period)
+            {
+                uint32_t found = k + channel / pHeader->chunkChannels;
+                return (found < entries.size()) ? found : HDEMG_ARCHIVE_NOT_FOUND;
+            }
+        }
+        return HDEMG_ARCHIVE_NOT_FOUND;
+    }
+
+    //! \brief HDEMG_ARCHIVE_CODEC_* of a chunk
+    uint32_t Codec(uint32_t k) const
+    {
+        return ((const HdemgArchiveChunkHeader *)(file.Data() + entries[k].offset))->codec;
+    }
+
+    //! \brief zero-copy row of a channel inside a raw chunk, Chunk(k).frameCount values
+    const int16_t * Row(uint32_t k, uint32_t channel) const
+    {
+        const HdemgArchiveEntry & entry = entries[k];
+        if(channel < entry.firstChannel || channel >= entry.firstChannel + entry.channelCount
+           || Codec(k) != HDEMG_ARCHIVE_CODEC_RAW)
+            return NULL;
+        const int16_t * pRows = (const int16_t *)(file.Data() + entry.offset + sizeof(HdemgArchiveChunkHeader));
+        return pRows + (size_t)(channel - entry.firstChannel) * entry.frameCount;
+    }
+
+    /**
+        Copies the row of a channel out of a chunk of any codec.
+
+        \arg pDst - receives Chunk(k).frameCount values
+
+        \return false if the channel is not in the chunk or the data is damaged
+      */
+    bool DecodeRow(uint32_t k, uint32_t channel, int16_t * pDst) const
+    {
+        const HdemgArchiveEntry & entry = entries[k];
+        if(Codec(k) == HDEMG_ARCHIVE_CODEC_RAW)
+        {
+            const int16_t * pRow = Row(k, channel);
+            if(pRow)
+                memcpy(pDst, pRow, entry.frameCount * sizeof(int16_t));
+            return pRow != NULL;
+        }
+        if(channel < entry.firstChannel || channel >= entry.firstChannel + entry.channelCount)
+            return false;
+
+        const HdemgArchiveChunkHeader * pChunk = (const HdemgArchiveChunkHeader *)(file.Data() + entry.offset);
+        const uint32_t * pSizes = (const uint32_t *)(pChunk + 1);
+        uint64_t start = entry.channelCount * sizeof(uint32_t);
+        for(uint32_t c=0; c<channel - entry.firstChannel; ++c)
+            start += pSizes[c];
+        uint64_t size  = pSizes[channel - entry.firstChannel];
+        if(start + size > pChunk->dataBytes)
+            return false;
+        return HdemgDecodeRow((const uint8_t *)(pChunk + 1) + start, (size_t)size, entry.frameCount, pDst);
+    }
+
+    //! \brief checks the CRC of a chunk
+    bool Verify(uint32_t k) const
+    {
+        const HdemgArchiveChunkHeader * pChunk = (const HdemgArchiveChunkHeader *)(file.Data() + entries[k].offset);
+        return HdemgCrc32c(pChunk + 1, pChunk->dataBytes) == pChunk->checksum;
+    }
+
+    /**
+        Copies consecutive frames of one channel, across chunks, until the requested count,
+        a gap or the end of the archive. Compressed chunks are decoded on the way.
+
+        \return number of frames copied
+      */
+    uint32_t ReadChannel(uint32_t channel, uint32_t time, uint32_t frameCount, int16_t * pDst) const
+    {
+        std::vector<int16_t> decoded;
+        uint32_t done = 0;
+        while(done < frameCount)
+        {
+            uint32_t k = Find(time, channel);
+            if(k == HDEMG_ARCHIVE_NOT_FOUND)
+                break;
+            const HdemgArchiveEntry & entry = entries[k];
+            uint32_t first = (time - entry.startTime) / pHeader->period;
+            uint32_t n     = entry.frameCount - first;
+            if(n > frameCount - done)
+                n = frameCount - done;
+            const int16_t * pRow = Row(k, channel);
+            if(!pRow)
+            {
+                decoded.resize(entry.frameCount);
+                if(!DecodeRow(k, channel, &decoded[0]))
+                    break;
+                pRow = &decoded[0];
+            }
+            memcpy(pDst + done, pRow + first, n * sizeof(int16_t));
+            done += n;
+            time  = entry.startTime + (first + n) * pHeader->period;
+        }
+        return done;
+    }
+
+private:
+    bool LoadIndex()
+    {
+        if(file.Size() < HDEMG_ARCHIVE_ALIGNMENT + sizeof(HdemgArchiveTrailer))
+            return false;
+        HdemgArchiveTrailer trailer;
+        memcpy(&trailer, file.Data() + file.Size() - sizeof(trailer), sizeof(trailer));
+        uint64_t bytes = (uint64_t)trailer.entryCount * sizeof(HdemgArchiveEntry);
+        if(memcmp(trailer.magic, HDEMG_ARCHIVE_END, 8) != 0 || trailer.indexOffset + bytes + sizeof(trailer) != file.Size())
+            return false;
+
+        entries.resize(trailer.entryCount);
+        if(bytes)
+            memcpy(&entries[0], file.Data() + trailer.indexOffset, (size_t)bytes);
+        if(bytes && HdemgCrc32c(&entries[0], (size_t)bytes) != trailer.checksum)
+        {
+            entries.clear();
+            return false;
+        }
+        return true;
+    }
+
+    //! \brief rebuilds the index of an archive that was not closed, up to the first damaged chunk
+    void ScanChunks()
+    {
+        entries.clear();
+        uint64_t offset = HDEMG_ARCHIVE_ALIGNMENT;
+        while(offset + sizeof(HdemgArchiveChunkHeader) <= file.Size())
+        {
+            const HdemgArchiveChunkHeader * pChunk = (const HdemgArchiveChunkHeader *)(file.Data() + offset);
+            uint64_t total = sizeof(HdemgArchiveChunkHeader) + (uint64_t)pChunk->dataBytes;
+            if(pChunk->magic != HDEMG_ARCHIVE_CHUNK_MAGIC || offset + total > file.Size()
+               || (pChunk->codec == HDEMG_ARCHIVE_CODEC_RAW
+                   && pChunk->dataBytes != (uint32_t)pChunk->channelCount * pChunk->frameCount * sizeof(int16_t))
+               || (pChunk->codec == HDEMG_ARCHIVE_CODEC_DELTA && pChunk->dataBytes < pChunk->channelCount * sizeof(uint32_t))
+               || pChunk->codec > HDEMG_ARCHIVE_CODEC_DELTA
+               || HdemgCrc32c(pChunk + 1, pChunk->dataBytes) != pChunk->checksum)
+                break;
+
+            HdemgArchiveEntry entry;
+            entry.offset       = offset;
+            entry.startTime    = pChunk->startTime;
+            entry.frameCount   = pChunk->frameCount;
+            entry.window       = pChunk->window;
+            entry.firstChannel = pChunk->firstChannel;
+            entry.channelCount = pChunk->channelCount;
+            entries.push_back(entry);
+            offset += (total + HDEMG_ARCHIVE_ALIGNMENT - 1) / HDEMG_ARCHIVE_ALIGNMENT * HDEMG_ARCHIVE_ALIGNMENT;
+        }
+
+        // a run is only usable with all of its channel blocks
+        entries.resize(entries.size() / channelBlocks * channelBlocks);
+    }
+
+    //! \brief false if the windows decrease, which the writer never does
+    bool BuildWindowTable()
+    {
+        windows.clear();
+        if(entries.empty())
+            return true;
+        for(size_t k=1; k<entries.size(); ++k)
+        {
+            if(entries[k].window < entries[k - 1].window)
+                return false;
+        }
+        firstWindow = entries.front().window;
+        windows.assign(entries.back().window - firstWindow + 1, HDEMG_ARCHIVE_NOT_FOUND);
+        for(uint32_t k=(uint32_t)entries.size(); k-- > 0; )
+            windows[entries[k].window - firstWindow] = k;   // first run of every window
+        return true;
+    }
+
+    HdemgMappedFile                file;
+    const HdemgArchiveHeader *     pHeader;
+    std::vector<HdemgArchiveEntry> entries;
+    std::vector<uint32_t>          windows;         // first chunk of every window since firstWindow
+    uint32_t                       firstWindow;
+    uint32_t                       channelBlocks;
+    bool                           recovered;
+};
+
+#endif // HDEMG_ARCHIVE_H
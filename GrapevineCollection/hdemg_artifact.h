@@ -0,0 +1,277 @@
+//
+//  hdemg_artifact.h
+//
+//  Stimulation artifact blanking. Stimulus pulses (e.g. FES) saturate the amplifiers for a
+//  few milliseconds, and that window is replaced on all channels by a straight line between
+//  the last clean frame before it and the first clean frame after it.
+//
+//  Stimulus times come from the digital I/O front end (module 34, stream 1,
+//  XippLegacyDigitalDataPacket; a rising edge on a selected SMA input or on the parallel
+//  port, passed in with ProcessPacket() or as HdemgEvents with ProcessEvent()), from
+//  AddEvent(), or from threshold detection on the data itself.
+//
+//  The blanker does not make a pass of its own. It is attached to the HdemgDecimator that
+//  filters the assembled raw frames (see hdemg_decimator.h) and edits the decimator's input
+//  buffer right after each block is copied in, before any filter tap reads it. To see the
+//  clean frame after a window the decimator holds back DelayFrames() input frames
+//  (pre + post + 1 frames, a few milliseconds), which must be less than one block.
+//
+
+#ifndef HDEMG_ARTIFACT_H
+#define HDEMG_ARTIFACT_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "hdemg_events.h"
+#include "hdemg_frames.h"
+
+// digital inputs that can mark a stimulus, combined into the inputMask of Configure()
+static const uint32_t HDEMG_ARTIFACT_SMA1         = 1u << HDEMG_DIGITAL_SMA1;
+static const uint32_t HDEMG_ARTIFACT_SMA2         = 1u << HDEMG_DIGITAL_SMA2;
+static const uint32_t HDEMG_ARTIFACT_SMA3         = 1u << HDEMG_DIGITAL_SMA3;
+static const uint32_t HDEMG_ARTIFACT_SMA4         = 1u << HDEMG_DIGITAL_SMA4;
+static const uint32_t HDEMG_ARTIFACT_PARALLEL     = 1u << HDEMG_DIGITAL_PARALLEL;   // any bit of the parallel port
+
+static const uint32_t HDEMG_ARTIFACT_MAX_PENDING  = 64;     // stimuli waiting for their window
+
+/*! \brief Finds stimulus windows and interpolates across them.
+ */
+class HdemgArtifactBlanker
+{
+public:
+    HdemgArtifactBlanker()
+        : channelCount(0), sampleRate(0.0), preFrames(0), postFrames(0), inputMask(0), threshold(0.0f), minChannels(0),
+          lastInputs(0), detectHold(0), eventCount(0), lateEvents(0), droppedEvents(0) {}
+
+    /**
+        Sets up the blanker.
+
+        \arg channels        - channels per frame of the blocks that will be blanked
+        \arg rate            - frame rate of those blocks in Hz (HDEMG_NIP_CLOCK_HZ for raw frames)
+        \arg preMs           - time blanked before each stimulus
+        \arg postMs          - time blanked after each stimulus
+        \arg inputs          - HDEMG_ARTIFACT_* digital inputs that mark a stimulus, 0 for none
+        \arg thresholdCounts - absolute sample value that marks an artifact, 0 disables
+                               threshold detection
+        \arg minChannelCount - channels that must reach the threshold in the same frame
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, double rate, double preMs, double postMs, uint32_t inputs,
+                   float thresholdCounts = 0.0f, uint32_t minChannelCount = 1)
+    {
+        if(channels == 0 || rate <= 0.0 || preMs < 0.0 || postMs < 0.0 || thresholdCounts < 0.0f
+           || minChannelCount == 0 || minChannelCount > channels)
+        {
+            printf("ERROR: invalid artifact blanker configuration\n");
+            return false;
+        }
+        if(inputs == 0 && thresholdCounts == 0.0f)
+            printf("WARNING: artifact blanker only sees events passed to AddEvent()\n");
+
+        channelCount = channels;
+        sampleRate   = rate;
+        preFrames    = (uint32_t)ceil(preMs * 1e-3 * rate);
+        postFrames   = (uint32_t)ceil(postMs * 1e-3 * rate);
+        inputMask    = inputs;
+        threshold    = thresholdCounts;
+        minChannels  = minChannelCount;
+        pending.reserve(HDEMG_ARTIFACT_MAX_PENDING);
+        Reset();
+        return true;
+    }
+
+    //! \brief Forgets pending stimuli and the state of the digital inputs
+    void Reset()
+    {
+        pending.clear();
+        lastInputs = 0;
+        detectHold = 0;
+    }
+
+    /**
+        Feeds one XIPP packet. Packets other than legacy digital data from module 34 are
+        ignored, so every packet of a datagram can be passed in.
+
+        \return true if the packet marked a stimulus
+      */
+    bool ProcessPacket(const XippPacket * pPacket)
+    {
+        uint32_t values[HDEMG_DIGITAL_INPUTS];
+        if(!HdemgReadDigitalInputs(pPacket, values))
+            return false;
+
+        uint32_t inputs = 0;
+        for(uint32_t i=0; i<HDEMG_DIGITAL_INPUTS; ++i)
+        {
+            if(values[i])
+                inputs |= 1u << i;
+        }
+
+        uint32_t rising = inputs & ~lastInputs & inputMask;
+        lastInputs = inputs;
+        if(!rising)
+            return false;
+
+        AddEvent(pPacket->header.time);
+        return true;
+    }
+
+    /**
+        Takes the stimuli from an event stream instead of the packets; rising edges of the
+        selected inputs mark a stimulus. Use either this or ProcessPacket(), not both.
+
+        \return true if the event marked a stimulus
+      */
+    bool ProcessEvent(const HdemgEvent & event)
+    {
+        if(event.kind != HDEMG_EVENT_DIGITAL_RISE || event.source >= HDEMG_DIGITAL_INPUTS
+           || !(inputMask & (1u << event.source)))
+            return false;
+        AddEvent(event.time);
+        return true;
+    }
+
+    //! \brief Marks a stimulus at a NIP time, e.g. from a stimulator's own event log
+    void AddEvent(uint32_t time)
+    {
+        if(pending.size() == HDEMG_ARTIFACT_MAX_PENDING)
+        {
+            droppedEvents++;
+            return;
+        }
+
+        // keep the list ordered by time, events normally arrive in order
+        std::vector<uint32_t>::iterator it = pending.end();
+        while(it != pending.begin() && (int32_t)(*(it - 1) - time) > 0)
+            --it;
+        pending.insert(it, time);
+        eventCount++;
+    }
+
+    //! \brief input frames a consumer must hold back so every window can be closed
+    uint32_t DelayFrames() const { return preFrames + postFrames + 1; }
+    uint32_t ChannelCount() const { return channelCount; }
+    double   SampleRate() const { return sampleRate; }
+
+    uint64_t EventCount() const    { return eventCount; }     //!< stimuli seen so far
+    uint64_t LateEvents() const    { return lateEvents; }     //!< windows that were partly filtered already
+    uint64_t DroppedEvents() const { return droppedEvents; }  //!< stimuli lost to a full pending list
+
+    /**
+        Detects artifacts in newly arrived frames and interpolates across every window whose
+        trailing clean frame is available. Called by the consumer that owns the frame buffer.
+
+        \arg pFrames       - sample-major frames: history followed by the new frames
+        \arg frameCount    - frames in pFrames
+        \arg newIndex      - index of the first new frame
+        \arg openIndex     - first frame that has not been used for output yet; frames
+                             before it are never changed
+        \arg newTime       - NIP time of the first new frame
+        \arg ticksPerFrame - NIP ticks between frames
+      */
+    void Apply(float * pFrames, uint32_t frameCount, uint32_t newIndex, uint32_t openIndex,
+               uint32_t newTime, double ticksPerFrame)
+    {
+        const uint32_t nCh = channelCount;
+
+        if(threshold > 0.0f)
+        {
+            for(uint32_t f=newIndex; f<frameCount; ++f)
+            {
+                if(detectHold)
+                {
+                    detectHold--;
+                    continue;
+                }
+                const float * x = pFrames + (size_t)f * nCh;
+                uint32_t hits = 0;
+                for(uint32_t c=0; c<nCh; ++c)
+                    hits += (fabsf(x[c]) >= threshold);
+                if(hits >= minChannels)
+                {
+                    AddEvent(newTime + (uint32_t)floor(((double)f - newIndex) * ticksPerFrame + 0.5));
+                    detectHold = postFrames;
+                }
+            }
+        }
+
+        // windows in frame indices, overlapping windows are merged and closed together
+        size_t used = 0;
+        while(used < pending.size())
+        {
+            int64_t first = WindowStart(pending[used], newIndex, newTime, ticksPerFrame);
+            int64_t last  = first + preFrames + postFrames;
+            size_t  next  = used + 1;
+            while(next < pending.size())
+            {
+                int64_t s = WindowStart(pending[next], newIndex, newTime, ticksPerFrame);
+                if(s > last + 1)
+                    break;
+                last = std::max(last, s + (int64_t)(preFrames + postFrames));
+                next++;
+            }
+
+            if(last + 1 >= (int64_t)frameCount)
+                break;                      // the clean frame after the window has not arrived
+
+            if(last >= (int64_t)openIndex)
+            {
+                if(first < (int64_t)openIndex)
+                {
+                    first = openIndex;
+                    lateEvents++;
+                }
+                Interpolate(pFrames, (uint32_t)first, (uint32_t)last);
+            }
+            else
+                lateEvents += next - used;
+            used = next;
+        }
+        pending.erase(pending.begin(), pending.begin() + used);
+    }
+
+private:
+    //! \brief first frame index of the window of a stimulus
+    int64_t WindowStart(uint32_t time, uint32_t newIndex, uint32_t newTime, double ticksPerFrame) const
+    {
+        int32_t ticks = (int32_t)(time - newTime);
+        return (int64_t)newIndex + (int64_t)floor(ticks / ticksPerFrame + 0.5) - preFrames;
+    }
+
+    //! \brief replaces frames [first, last] by the line between frame first-1 and frame last+1
+    void Interpolate(float * pFrames, uint32_t first, uint32_t last)
+    {
+        const uint32_t nCh   = channelCount;
+        const float *  after = pFrames + (size_t)(last + 1) * nCh;
+        const float *  before = (first > 0) ? pFrames + (size_t)(first - 1) * nCh : after;
+        const float    span  = (float)(last - first + 2);
+        for(uint32_t f=first; f<=last; ++f)
+        {
+            const float w = (float)(f - first + 1) / span;
+            float * x = pFrames + (size_t)f * nCh;
+            for(uint32_t c=0; c<nCh; ++c)
+                x[c] = before[c] + w * (after[c] - before[c]);
+        }
+    }
+
+    uint32_t              channelCount;
+    double                sampleRate;
+    uint32_t              preFrames;
+    uint32_t              postFrames;
+    uint32_t              inputMask;
+    float                 threshold;
+    uint32_t              minChannels;
+    uint32_t              lastInputs;     // HDEMG_ARTIFACT_* state of the last digital packet
+    uint32_t              detectHold;     // frames until threshold detection is armed again
+    std::vector<uint32_t> pending;        // NIP times of stimuli whose window is still open
+    uint64_t              eventCount;
+    uint64_t              lateEvents;
+    uint64_t              droppedEvents;
+};
+
+#endif // HDEMG_ARTIFACT_H
@@ -0,0 +1,851 @@
+//
+//  hdemg_async_writer.h
+//
+//  Moves file writes off the acquisition thread. The caller fills buffers from a fixed pool
+//  and submits them; a writer thread hands them to the kernel and returns them to the pool
+//  when the write completed. A slow disk then only uses up the pool instead of holding up
+//  the thread that reads the UDP socket, and memory never grows past the pool.
+//
+//  On Linux the writer thread keeps several writes in flight through io_uring (raw system
+//  calls, no liburing needed) on a file opened with O_DIRECT, and reserves file space ahead
+//  of the write position with fallocate(). When io_uring or O_DIRECT is not available (old
+//  kernels, containers, tmpfs) it falls back to pwrite() and buffered I/O; other systems
+//  always use the fallback. io_uring is only used when the kernel reports IORING_OP_WRITE
+//  in its probe (Linux 5.6 and later); the rings alone exist since 5.1.
+//
+//  O_DIRECT needs sector aligned offsets and sizes. A submitted buffer is padded to the
+//  next HDEMG_ASYNC_ALIGNMENT boundary, and the next buffer starts with the partial sector
+//  again, so the file never has a hole; Close() cuts the file to the bytes submitted.
+//
+//  Queue() runs a task on the writer thread in order with the writes, e.g. the journal
+//  record of a checkpoint once the data before it is on the disk.
+//
+//  Stats() reports queue depth, write latency and the time the caller waited for a free
+//  buffer, to size bufferBytes and bufferCount for a given disk.
+//
+
+#ifndef HDEMG_ASYNC_WRITER_H
+#define HDEMG_ASYNC_WRITER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+  #include <fcntl.h>
+  #include <io.h>
+  #include <sys/stat.h>
+#else
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#if defined(__linux__)
+  #include <linux/io_uring.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #if !defined(__NR_io_uring_setup)
+    #define __NR_io_uring_setup    425
+    #define __NR_io_uring_enter    426
+    #define __NR_io_uring_register 427
+  #endif
+#endif
+
+#include "hdemg_frames.h"
+
+static const uint32_t HDEMG_ASYNC_ALIGNMENT      = 4096;
+static const uint32_t HDEMG_ASYNC_BUFFER_BYTES   = 4 << 20;
+static const uint32_t HDEMG_ASYNC_BUFFER_COUNT   = 8;
+static const uint32_t HDEMG_ASYNC_QUEUE_DEPTH    = 4;
+static const uint64_t HDEMG_ASYNC_PREALLOCATE    = 256ull << 20;
+
+//! \brief Pool size and I/O path of an HdemgAsyncWriter
+struct HdemgAsyncWriterSettings
+{
+    uint32_t bufferBytes;           //!< size of one pool buffer, rounded up to HDEMG_ASYNC_ALIGNMENT
+    uint32_t bufferCount;           //!< pool size, memory used is bufferBytes * bufferCount
+    uint32_t queueDepth;            //!< writes in flight at the same time
+    uint64_t preallocateBytes;      //!< file space reserved ahead of the data, 0 for none
+    bool     directIo;              //!< bypass the page cache (O_DIRECT)
+    bool     ioUring;               //!< submit through io_uring
+
+    HdemgAsyncWriterSettings()
+        : bufferBytes(HDEMG_ASYNC_BUFFER_BYTES), bufferCount(HDEMG_ASYNC_BUFFER_COUNT),
+          queueDepth(HDEMG_ASYNC_QUEUE_DEPTH), preallocateBytes(HDEMG_ASYNC_PREALLOCATE),
+          directIo(true), ioUring(true) {}
+};
+
+//! \brief Counters of an HdemgAsyncWriter since Open()
+struct HdemgAsyncWriterStats
+{
+    uint32_t queued;                //!< buffers waiting for the writer thread
+    uint32_t inFlight;              //!< writes handed to the kernel
+    uint32_t maxQueueDepth;         //!< largest queued + inFlight seen
+    uint64_t writes;
+    uint64_t bytes;
+    uint64_t latencyNs;             //!< sum of submit to completion times
+    uint64_t maxLatencyNs;
+    uint64_t stalls;                //!< Acquire() calls that had to wait for a free buffer
+    uint64_t stallNs;               //!< total time waited in Acquire()
+    uint64_t maxStallNs;
+    bool     ioUring;               //!< io_uring is in use
+    bool     directIo;              //!< O_DIRECT is in use
+
+    double MeanLatencyMs() const { return writes ? latencyNs * 1e-6 / writes : 0.0; }
+};
+
+#if defined(__linux__)
+
+/*! \brief Minimal io_uring submission / completion ring for writes.
+ */
+class HdemgIoUring
+{
+public:
+    HdemgIoUring() : ringFd(-1), pSq(NULL), pCq(NULL), pSqes(NULL), sqBytes(0), cqBytes(0), sqesBytes(0) {}
+    ~HdemgIoUring() { Exit(); }
+
+    //! \return false if the kernel does not provide io_uring or its write operation
+    bool Init(uint32_t entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if(ringFd < 0)
+            return false;
+        if(!Supports(IORING_OP_WRITE))
+        {
+            Exit();
+            return false;
+        }
+
+        sqBytes   = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqBytes   = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+        pSq   = (uint8_t *)mmap(NULL, sqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        pCq   = (uint8_t *)mmap(NULL, cqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        pSqes = (struct io_uring_sqe *)mmap(NULL, sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           ringFd, IORING_OFF_SQES);
+        if(pSq == MAP_FAILED || pCq == MAP_FAILED || (void *)pSqes == MAP_FAILED)
+        {
+            pSq   = (pSq == MAP_FAILED) ? NULL : pSq;
+            pCq   = (pCq == MAP_FAILED) ? NULL : pCq;
+            pSqes = ((void *)pSqes == MAP_FAILED) ? NULL : pSqes;
+            Exit();
+            return false;
+        }
+        pSqHead  = (uint32_t *)(pSq + params.sq_off.head);
+        pSqTail  = (uint32_t *)(pSq + params.sq_off.tail);
+        sqMask   = *(uint32_t *)(pSq + params.sq_off.ring_mask);
+        pSqArray = (uint32_t *)(pSq + params.sq_off.array);
+        pCqHead  = (uint32_t *)(pCq + params.cq_off.head);
+        pCqTail  = (uint32_t *)(pCq + params.cq_off.tail);
+        cqMask   = *(uint32_t *)(pCq + params.cq_off.ring_mask);
+        pCqes    = (struct io_uring_cqe *)(pCq + params.cq_off.cqes);
+        return true;
+    }
+
+    void Exit()
+    {
+        if(pSqes)
+            munmap(pSqes, sqesBytes);
+        if(pCq)
+            munmap(pCq, cqBytes);
+        if(pSq)
+            munmap(pSq, sqBytes);
+        if(ringFd >= 0)
+            close(ringFd);
+        pSqes  = NULL;
+        pCq    = NULL;
+        pSq    = NULL;
+        ringFd = -1;
+    }
+
+    bool IsOpen() const { return ringFd >= 0; }
+
+    //! \brief true if the kernel probe lists the operation; kernels before 5.6 have no probe
+    bool Supports(uint8_t op) const
+    {
+        std::vector<uint8_t> buffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+        struct io_uring_probe * pProbe = (struct io_uring_probe *)&buffer[0];
+        if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, pProbe, 256) < 0)
+            return false;
+        return op <= pProbe->last_op && op < pProbe->ops_len && (pProbe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    //! \brief queues and submits one write, tag comes back with its completion
+    bool Write(int fd, const void * pData, uint32_t bytes, uint64_t offset, uint64_t tag)
+    {
+        uint32_t tail = *pSqTail;
+        uint32_t slot = tail & sqMask;
+        struct io_uring_sqe * pSqe = &pSqes[slot];
+        memset(pSqe, 0, sizeof(*pSqe));
+        pSqe->opcode    = IORING_OP_WRITE;
+        pSqe->fd        = fd;
+        pSqe->addr      = (uint64_t)(uintptr_t)pData;
+        pSqe->len       = bytes;
+        pSqe->off       = offset;
+        pSqe->user_data = tag;
+        pSqArray[slot]  = slot;
+        __atomic_store_n(pSqTail, tail + 1, __ATOMIC_RELEASE);
+
+        while(true)
+        {
+            int n = (int)syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, NULL, 0);
+            if(n >= 0)
+                return n == 1;
+            if(errno != EINTR && errno != EAGAIN)
+                return false;
+        }
+    }
+
+    /**
+        Takes one completion.
+
+        \arg block - wait for one if none is ready
+
+        \return false if no completion was taken
+      */
+    bool Complete(uint64_t * pTag, int * pResult, bool block)
+    {
+        while(true)
+        {
+            uint32_t head = *pCqHead;
+            if(head != __atomic_load_n(pCqTail, __ATOMIC_ACQUIRE))
+            {
+                const struct io_uring_cqe & cqe = pCqes[head & cqMask];
+                *pTag    = cqe.user_data;
+                *pResult = cqe.res;
+                __atomic_store_n(pCqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            if(!block)
+                return false;
+            if(syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return false;
+        }
+    }
+
+private:
+    int                    ringFd;
+    uint8_t *              pSq;
+    uint8_t *              pCq;
+    struct io_uring_sqe *  pSqes;
+    size_t                 sqBytes;
+    size_t                 cqBytes;
+    size_t                 sqesBytes;
+    uint32_t *             pSqHead;
+    uint32_t *             pSqTail;
+    uint32_t *             pSqArray;
+    uint32_t               sqMask;
+    uint32_t *             pCqHead;
+    uint32_t *             pCqTail;
+    uint32_t               cqMask;
+    struct io_uring_cqe *  pCqes;
+};
+
+#endif // __linux__
+
+/*! \brief Buffer pool and writer thread for one output file.
+ *
+ *  Acquire(), Submit(), Write(), Patch(), Queue() and Flush() are called from one producer
+ *  thread.
+ *  Data is given either by Write() or by filling the buffer of Acquire() and passing it to
+ *  Submit(); a buffer taken with Acquire() must be submitted before Flush().
+ */
+class HdemgAsyncWriter
+{
+public:
+    HdemgAsyncWriter()
+        : fd(-1), patchFd(-1), pBase(NULL), bufferSize(0), depth(0), alignment(1), preallocate(0), allocated(0),
+          offset(0), current(NOT_ACQUIRED), head(0), pending(0), stop(false), failed(false), useUring(false)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    ~HdemgAsyncWriter() { Close(); }
+
+    /**
+        Creates the file and starts the writer thread.
+
+        \arg pPath    - file name
+        \arg settings - pool size and I/O path
+
+        \return true if the file was created
+      */
+    bool Open(const char * pPath, const HdemgAsyncWriterSettings & settings = HdemgAsyncWriterSettings())
+    {
+        Close();
+        if(!pPath || settings.bufferCount < 2 || settings.queueDepth == 0 || settings.bufferBytes < HDEMG_ASYNC_ALIGNMENT)
+        {
+            printf("ERROR: invalid async writer configuration\n");
+            return false;
+        }
+
+        bool direct = false;
+#if defined(_WIN32)
+        fd = _open(pPath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  #if defined(O_DIRECT)
+        if(settings.directIo)
+        {
+            fd     = open(pPath, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+            direct = fd >= 0;
+        }
+  #endif
+        if(fd < 0)
+            fd = open(pPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd >= 0 && direct)
+            patchFd = open(pPath, O_WRONLY);
+#endif
+        if(fd < 0 || (direct && patchFd < 0))
+        {
+            printf("ERROR: cannot create [%s]\n", pPath);
+            Close();
+            return false;
+        }
+
+        alignment  = direct ? HDEMG_ASYNC_ALIGNMENT : 1;
+        bufferSize = (settings.bufferBytes + HDEMG_ASYNC_ALIGNMENT - 1) / HDEMG_ASYNC_ALIGNMENT * HDEMG_ASYNC_ALIGNMENT;
+        storage.assign((size_t)bufferSize * settings.bufferCount + HDEMG_ASYNC_ALIGNMENT, 0);
+        uintptr_t base = (uintptr_t)&storage[0];
+        pBase = &storage[0] + ((HDEMG_ASYNC_ALIGNMENT - base % HDEMG_ASYNC_ALIGNMENT) % HDEMG_ASYNC_ALIGNMENT);
+        buffers.assign(settings.bufferCount, Buffer());
+        freeList.clear();
+        for(uint32_t b=settings.bufferCount; b-- > 0; )
+            freeList.push_back(b);
+
+        depth       = settings.queueDepth;
+        preallocate = settings.preallocateBytes;
+        allocated   = 0;
+        offset      = 0;
+        head        = 0;
+        current     = NOT_ACQUIRED;
+        stop        = false;
+        failed      = false;
+        memset(&stats, 0, sizeof(stats));
+
+#if defined(__linux__)
+        useUring = settings.ioUring && uring.Init(depth);
+#endif
+        stats.ioUring  = useUring;
+        stats.directIo = direct;
+        Reserve(0);
+        writer = std::thread(&HdemgAsyncWriter::Worker, this);
+        return true;
+    }
+
+    /**
+        Takes a buffer from the pool, waiting while all buffers are queued or being written.
+
+        \arg pCapacity - receives the number of bytes that may be filled
+
+        \return start of the bytes to fill, NULL if the writer failed or is not open
+      */
+    uint8_t * Acquire(size_t * pCapacity)
+    {
+        if(fd < 0)
+            return NULL;
+        if(current == NOT_ACQUIRED)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if(freeList.empty())
+            {
+                uint64_t start = HdemgNowNs();
+                while(freeList.empty() && !failed)
+                    released.wait(lock);
+                uint64_t waited = HdemgNowNs() - start;
+                stats.stalls++;
+                stats.stallNs   += waited;
+                stats.maxStallNs = (waited > stats.maxStallNs) ? waited : stats.maxStallNs;
+            }
+            if(failed)
+                return NULL;
+            current = freeList.back();
+            freeList.pop_back();
+
+            // the partial sector at the end of the file is written again in front of the new data
+            memcpy(BufferData(current), tail, head);
+        }
+        *pCapacity = bufferSize - head;
+        return BufferData(current) + head;
+    }
+
+    /**
+        Queues the acquired buffer for writing at Offset().
+
+        \arg bytes - bytes filled since Acquire()
+
+        \return false if the writer failed
+      */
+    bool Submit(size_t bytes)
+    {
+        if(current == NOT_ACQUIRED)
+            return !failed;
+        if(bytes > bufferSize - head)
+            bytes = bufferSize - head;
+
+        Job job;
+        job.buffer = current;
+        job.offset = offset - head;
+        job.bytes  = (uint32_t)(head + bytes);
+        job.drain  = head > 0;     // rewrites the sector of the previous write
+        offset    += bytes;
+
+        // keep the new partial sector for the next buffer; the padding up to the next
+        // sector is written as zeros and cut off by Close()
+        uint8_t * pData = BufferData(current);
+        head = (uint32_t)(offset % alignment);
+        memcpy(tail, pData + job.bytes - head, head);
+        size_t padded = (job.bytes + alignment - 1) / alignment * alignment;
+        memset(pData + job.bytes, 0, padded - job.bytes);
+        job.bytes   = (uint32_t)padded;
+        current     = NOT_ACQUIRED;
+
+        Post(job);
+        return !failed;
+    }
+
+    //! \brief copies bytes into pool buffers and submits every full buffer
+    bool Write(const void * pData, size_t bytes)
+    {
+        const uint8_t * pSrc = (const uint8_t *)pData;
+        while(bytes > 0)
+        {
+            size_t    capacity;
+            uint8_t * pDst = Acquire(&capacity);
+            if(!pDst)
+                return false;
+            size_t used = pending;
+            size_t n    = (bytes < capacity - used) ? bytes : capacity - used;
+            memcpy(pDst + used, pSrc, n);
+            pending += n;
+            pSrc    += n;
+            bytes   -= n;
+            if(pending == capacity)
+            {
+                pending = 0;
+                Submit(capacity);
+            }
+        }
+        return !failed;
+    }
+
+    /**
+        Overwrites bytes that were already submitted, e.g. a length field in a header. The
+        patch is applied after every write queued before it.
+
+        \return false if the range was not submitted yet or the writer failed
+      */
+    bool Patch(uint64_t at, const void * pData, size_t bytes)
+    {
+        if(fd < 0 || at + bytes > offset)
+            return false;
+
+        // the bytes may also sit in the partial sector that will be written again
+        uint64_t tailStart = offset - head;
+        for(size_t i=0; i<bytes; ++i)
+        {
+            if(at + i >= tailStart)
+            {
+                tail[at + i - tailStart] = ((const uint8_t *)pData)[i];
+                if(current != NOT_ACQUIRED)
+                    BufferData(current)[at + i - tailStart] = ((const uint8_t *)pData)[i];
+            }
+        }
+
+        Job job;
+        job.buffer = PATCH;
+        job.offset = at;
+        job.bytes  = (uint32_t)bytes;
+        job.drain  = true;
+        job.patch.assign((const uint8_t *)pData, (const uint8_t *)pData + bytes);
+        Post(job);
+        return !failed;
+    }
+
+    /**
+        Runs a task on the writer thread once every write queued before it completed, without
+        waiting for it. The task is skipped once the writer failed.
+
+        \arg task    - e.g. records a checkpoint of the data written so far
+        \arg durable - make those writes durable (fdatasync) before the task
+
+        \return false if the writer failed
+      */
+    bool Queue(const std::function<void()> & task, bool durable)
+    {
+        if(fd < 0)
+            return false;
+        Job job;
+        job.offset = offset;
+        job.bytes  = 0;
+        job.drain  = true;
+        if(durable)
+        {
+            job.buffer = SYNC;
+            Post(job);
+        }
+        job.buffer = TASK;
+        job.task   = task;
+        Post(job);
+        return !failed;
+    }
+
+    /**
+        Submits the bytes given to Write() and waits until everything submitted is written.
+
+        \arg durable - also wait until the data reached the disk (fdatasync)
+
+        \return false if a write failed
+      */
+    bool Flush(bool durable = false)
+    {
+        if(fd < 0)
+            return false;
+        if(pending > 0)
+        {
+            Submit(pending);
+            pending = 0;
+        }
+        if(durable)
+        {
+            Job job;
+            job.buffer = SYNC;
+            job.offset = 0;
+            job.bytes  = 0;
+            job.drain  = true;
+            Post(job);
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        while((!queue.empty() || stats.inFlight > 0) && !failed)
+            idle.wait(lock);
+        return !failed;
+    }
+
+    //! \brief writes everything submitted, cuts the file to Offset() and closes it
+    void Close()
+    {
+        if(writer.joinable())
+        {
+            Flush();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            work.notify_one();
+            writer.join();
+        }
+#if defined(__linux__)
+        uring.Exit();
+#endif
+        if(fd >= 0)
+        {
+#if defined(_WIN32)
+            if(_chsize_s(fd, (__int64)offset) != 0)
+                failed = true;
+            _close(fd);
+#else
+            if(ftruncate(fd, (off_t)offset) != 0)
+                failed = true;
+            close(fd);
+            if(patchFd >= 0)
+                close(patchFd);
+#endif
+        }
+        fd      = -1;
+        patchFd = -1;
+        current = NOT_ACQUIRED;
+        pending = 0;
+    }
+
+    bool     IsOpen() const { return fd >= 0; }
+    bool     Failed() const { return failed; }
+    uint64_t Offset() const { return offset; }    //!< bytes submitted, the size of the file after Close()
+
+    HdemgAsyncWriterStats Stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.queued = (uint32_t)queue.size();
+        return stats;
+    }
+
+private:
+    static const uint32_t NOT_ACQUIRED = 0xFFFFFFFF;
+    static const uint32_t PATCH        = 0xFFFFFFFE;
+    static const uint32_t SYNC         = 0xFFFFFFFD;
+    static const uint32_t TASK         = 0xFFFFFFFC;
+
+    struct Buffer
+    {
+        uint64_t submitNs;
+        uint64_t offset;
+        uint32_t bytes;
+        uint32_t written;   // bytes completed, a short write is submitted again from there
+        bool     busy;      // handed to io_uring
+    };
+
+    struct Job
+    {
+        uint32_t              buffer;   // pool buffer, PATCH, SYNC or TASK
+        uint64_t              offset;
+        uint32_t              bytes;
+        bool                  drain;    // wait until no write is in flight
+        std::vector<uint8_t>  patch;
+        std::function<void()> task;
+    };
+
+    uint8_t * BufferData(uint32_t b) { return pBase + (size_t)b * bufferSize; }
+
+    void Post(Job & job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(Job());
+            queue.back().buffer = job.buffer;
+            queue.back().offset = job.offset;
+            queue.back().bytes  = job.bytes;
+            queue.back().drain  = job.drain;
+            queue.back().patch.swap(job.patch);
+            queue.back().task.swap(job.task);
+            uint32_t queueDepth = (uint32_t)queue.size() + stats.inFlight;
+            stats.maxQueueDepth = (queueDepth > stats.maxQueueDepth) ? queueDepth : stats.maxQueueDepth;
+        }
+        work.notify_one();
+    }
+
+    void Worker()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            if(!queue.empty() && stats.inFlight < depth && !(queue.front().drain && stats.inFlight > 0))
+            {
+                Job job;
+                job.buffer = queue.front().buffer;
+                job.offset = queue.front().offset;
+                job.bytes  = queue.front().bytes;
+                job.patch.swap(queue.front().patch);
+                job.task.swap(queue.front().task);
+                queue.pop_front();
+                stats.inFlight++;
+                lock.unlock();
+                Start(job);
+                lock.lock();
+                continue;
+            }
+            if(stats.inFlight > 0)
+            {
+                lock.unlock();
+                WaitCompletion();
+                lock.lock();
+                continue;
+            }
+            if(stop && queue.empty())
+                break;
+            idle.notify_all();
+            work.wait(lock);
+        }
+    }
+
+    //! \brief writes a job, or hands it to io_uring; called without the lock
+    void Start(const Job & job)
+    {
+        if(failed)
+        {
+            Finish(job.buffer, 0);
+            return;
+        }
+        if(job.buffer == TASK)
+        {
+            job.task();
+            Finish(job.buffer, 0);
+            return;
+        }
+        if(job.buffer == PATCH || job.buffer == SYNC)
+        {
+            bool ok;
+            if(job.buffer == PATCH)
+                ok = WriteAt(patchFd >= 0 ? patchFd : fd, &job.patch[0], job.bytes, job.offset);
+            else
+#if defined(_WIN32)
+                ok = _commit(fd) == 0;
+#elif defined(__linux__)
+                ok = fdatasync(fd) == 0;
+#else
+                ok = fsync(fd) == 0;
+#endif
+            if(!ok)
+                Fail(job.offset);
+            Finish(job.buffer, 0);
+            return;
+        }
+
+        Reserve(job.offset + job.bytes);
+        Buffer & buffer = buffers[job.buffer];
+        buffer.submitNs = HdemgNowNs();
+        buffer.offset   = job.offset;
+        buffer.bytes    = job.bytes;
+        buffer.written  = 0;
+#if defined(__linux__)
+        if(useUring)
+        {
+            buffer.busy = uring.Write(fd, BufferData(job.buffer), job.bytes, job.offset, job.buffer);
+            if(!buffer.busy)
+            {
+                Fail(job.offset);
+                Finish(job.buffer, 0);
+            }
+            return;
+        }
+#endif
+        bool ok = WriteAt(fd, BufferData(job.buffer), job.bytes, job.offset);
+        if(!ok)
+            Fail(job.offset);
+        Finish(job.buffer, HdemgNowNs() - buffers[job.buffer].submitNs);
+    }
+
+    void WaitCompletion()
+    {
+#if defined(__linux__)
+        uint64_t tag;
+        int      result;
+        if(useUring && uring.Complete(&tag, &result, true))
+        {
+            uint32_t b       = (uint32_t)tag;
+            Buffer & buffer  = buffers[b];
+            uint32_t left    = buffer.bytes - buffer.written;
+            if(result > 0 && (uint32_t)result < left && !failed)
+            {
+                // short write, e.g. a full disk or a signal: submit the rest
+                buffer.written += (uint32_t)result;
+                if(uring.Write(fd, BufferData(b) + buffer.written, buffer.bytes - buffer.written,
+                               buffer.offset + buffer.written, b))
+                    return;
+            }
+            else if(result == (int)left)
+                buffer.written = buffer.bytes;
+            buffer.busy = false;
+            if(buffer.written != buffer.bytes)
+                Fail(buffer.offset + buffer.written);
+            Finish(b, HdemgNowNs() - buffer.submitNs);
+            return;
+        }
+#endif
+        // nothing can complete any more, give up on the writes still in flight
+        uint64_t at = ~0ull;
+        for(size_t b=0; b<buffers.size(); ++b)
+        {
+            if(buffers[b].busy && buffers[b].offset < at)
+                at = buffers[b].offset;
+            buffers[b].busy = false;
+        }
+        Fail(at);
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.inFlight = 0;
+    }
+
+    //! \brief returns a buffer to the pool and counts the write
+    void Finish(uint32_t b, uint64_t latencyNs)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.inFlight--;
+            if(b < buffers.size())
+            {
+                stats.writes++;
+                stats.bytes       += buffers[b].bytes;
+                stats.latencyNs   += latencyNs;
+                stats.maxLatencyNs = (latencyNs > stats.maxLatencyNs) ? latencyNs : stats.maxLatencyNs;
+                freeList.push_back(b);
+            }
+        }
+        released.notify_one();
+    }
+
+    void Fail(uint64_t at)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!failed)
+            printf("ERROR: async write failed at offset [%llu]\n", (unsigned long long)at);
+        failed = true;
+        released.notify_all();
+        idle.notify_all();
+    }
+
+    //! \brief extends the reserved file space so it stays preallocate bytes ahead of end
+    void Reserve(uint64_t end)
+    {
+#if defined(__linux__)
+        if(preallocate == 0 || (allocated > 0 && end <= allocated))
+            return;
+        uint64_t target = end + preallocate;
+        if(fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)allocated, (off_t)(target - allocated)) == 0)
+            allocated = target;
+        else
+            preallocate = 0;    // not supported by the file system
+#else
+        (void)end;
+#endif
+    }
+
+    static bool WriteAt(int file, const void * pData, size_t bytes, uint64_t at)
+    {
+#if defined(_WIN32)
+        return _lseeki64(file, (__int64)at, SEEK_SET) == (__int64)at && _write(file, pData, (unsigned)bytes) == (int)bytes;
+#else
+        const uint8_t * p = (const uint8_t *)pData;
+        while(bytes > 0)
+        {
+            ssize_t n = pwrite(file, p, bytes, (off_t)at);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                return false;
+            p     += n;
+            at    += (uint64_t)n;
+            bytes -= (size_t)n;
+        }
+        return true;
+#endif
+    }
+
+    int                      fd;
+    int                      patchFd;       // same file without O_DIRECT, for Patch()
+    std::vector<uint8_t>     storage;       // all pool buffers, with room for alignment
+    uint8_t *                pBase;         // aligned start of buffer 0
+    uint32_t                 bufferSize;
+    uint32_t                 depth;
+    uint32_t                 alignment;     // HDEMG_ASYNC_ALIGNMENT with O_DIRECT, else 1
+    uint64_t                 preallocate;
+    uint64_t                 allocated;     // file space reserved so far
+    uint64_t                 offset;        // bytes submitted
+    uint32_t                 current;       // acquired buffer
+    uint32_t                 head;          // bytes of the partial last sector
+    uint8_t                  tail[HDEMG_ASYNC_ALIGNMENT];
+    size_t                   pending;       // bytes of Write() in the acquired buffer
+    std::vector<Buffer>      buffers;
+    std::vector<uint32_t>    freeList;
+    std::deque<Job>          queue;
+    mutable std::mutex       mutex;
+    std::condition_variable  work;          // a job was queued or the writer is stopping
+    std::condition_variable  released;      // a buffer went back to the pool
+    std::condition_variable  idle;          // the queue is empty and nothing is in flight
+    std::thread              writer;
+    bool                     stop;
+    std::atomic<bool>        failed;        // also read by the producer without the lock
+    bool                     useUring;
+    mutable HdemgAsyncWriterStats stats;
+#if defined(__linux__)
+    HdemgIoUring             uring;
+#endif
+};
+
+#endif // HDEMG_ASYNC_WRITER_H
@@ -0,0 +1,268 @@
+//
+//  hdemg_channel_stats.h
+//
+//  Per-channel running statistics of int16 recordings for QC reports: mean, standard
+//  deviation, RMS, minimum, maximum and the number of samples at either amplifier rail.
+//
+//  Frames are taken in chunks of HDEMG_STATS_CHUNK_FRAMES. The sum, sum of squares,
+//  extremes and rail counts of a chunk are exact integers, accumulated eight channels at a
+//  time with SSE2; the chunk is then merged into the running mean and sum of squared
+//  deviations with the pairwise form of Welford's update (Chan et al.), which does not lose
+//  precision over long recordings the way a plain sum of squares does. The same merge
+//  combines the statistics of data packets, files or whole sessions.
+//
+//  HdemgNsxWriter keeps the statistics of every file in its sidecar index
+//  (hdemg_nsx_index.h), so a QC report of a session does not read the data.
+//
+
+#ifndef HDEMG_CHANNEL_STATS_H
+#define HDEMG_CHANNEL_STATS_H
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_simd.h"
+
+static const uint32_t HDEMG_STATS_CHUNK_FRAMES = 4096;     // int16 rail counters and int32 sums do not overflow
+
+#pragma pack(push, 1)
+
+//! \brief statistics of one channel, stored as is in the NSx index
+struct HdemgChannelStats
+{
+    uint64_t count;                 //!< samples
+    double   mean;
+    double   m2;                    //!< sum of squared deviations from the mean
+    int16_t  minimum;
+    int16_t  maximum;
+    uint64_t clippedLow;            //!< samples at or below the low rail
+    uint64_t clippedHigh;           //!< samples at or above the high rail
+
+    void Clear()
+    {
+        count       = 0;
+        mean        = 0.0;
+        m2          = 0.0;
+        minimum     = 32767;
+        maximum     = -32768;
+        clippedLow  = 0;
+        clippedHigh = 0;
+    }
+
+    double Variance() const        { return count ? m2 / count : 0.0; }        //!< population variance
+    double StdDev() const          { return sqrt(Variance()); }
+    double Rms() const             { return sqrt(Variance() + mean * mean); }
+    double ClippedFraction() const { return count ? (double)(clippedLow + clippedHigh) / count : 0.0; }
+
+    //! \brief adds the samples of other, e.g. of the next data packet or file
+    void Merge(const HdemgChannelStats & other)
+    {
+        if(other.count == 0)
+            return;
+        if(count == 0)
+        {
+            *this = other;
+            return;
+        }
+        double n     = (double)count + (double)other.count;
+        double delta = other.mean - mean;
+        mean        += delta * ((double)other.count / n);
+        m2          += other.m2 + delta * delta * ((double)count * (double)other.count / n);
+        count       += other.count;
+        minimum      = (other.minimum < minimum) ? other.minimum : minimum;
+        maximum      = (other.maximum > maximum) ? other.maximum : maximum;
+        clippedLow  += other.clippedLow;
+        clippedHigh += other.clippedHigh;
+    }
+};
+
+#pragma pack(pop)
+
+/**
+    Merges the statistics of one recording into those of another, channel by channel
+
+    \return false if the channel counts differ
+  */
+inline bool
+HdemgMergeChannelStats(std::vector<HdemgChannelStats> & total, const std::vector<HdemgChannelStats> & part)
+{
+    if(total.empty())
+    {
+        total = part;
+        return true;
+    }
+    if(total.size() != part.size())
+        return false;
+    for(size_t c=0; c<part.size(); ++c)
+        total[c].Merge(part[c]);
+    return true;
+}
+
+/*! \brief Accumulates the statistics of every channel of interleaved int16 frames.
+ */
+class HdemgChannelStatsAccumulator
+{
+public:
+    HdemgChannelStatsAccumulator() : channelCount(0) {}
+
+    /**
+        \arg channels - int16 samples per frame
+        \arg low      - low rail of every channel, samples at or below it count as clipped
+        \arg high     - high rail of every channel, samples at or above it count as clipped
+      */
+    void Configure(uint32_t channels, int16_t low = -32768, int16_t high = 32767)
+    {
+        channelCount = channels;
+        lowRails.assign(channels, low);
+        highRails.assign(channels, high);
+        stats.resize(channels);
+        sums.resize(channels);
+        squares.resize(channels);
+        lows.resize(channels);
+        highs.resize(channels);
+        minima.resize(channels);
+        maxima.resize(channels);
+        Reset();
+    }
+
+    void Reset()
+    {
+        for(uint32_t c=0; c<channelCount; ++c)
+            stats[c].Clear();
+    }
+
+    //! \brief adds frames of ChannelCount() samples
+    void Add(const int16_t * pFrames, uint64_t frames)
+    {
+        while(frames)
+        {
+            uint32_t n = (frames < HDEMG_STATS_CHUNK_FRAMES) ? (uint32_t)frames : HDEMG_STATS_CHUNK_FRAMES;
+            AddChunk(pFrames, n);
+            pFrames += (size_t)n * channelCount;
+            frames  -= n;
+        }
+    }
+
+    //! \brief rails of one channel, e.g. from its NSx extended header
+    void SetRails(uint32_t channel, int16_t low, int16_t high)
+    {
+        lowRails[channel]  = low;
+        highRails[channel] = high;
+    }
+
+    uint32_t ChannelCount() const { return channelCount; }
+    const std::vector<HdemgChannelStats> & Stats() const { return stats; }
+
+private:
+    void AddChunk(const int16_t * pFrames, uint32_t frames)
+    {
+        uint32_t c = 0;
+#if defined(__AVX__) || defined(HDEMG_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        for(; c+8<=channelCount; c+=8)
+        {
+            const __m128i vlow  = _mm_loadu_si128((const __m128i *)&lowRails[c]);
+            const __m128i vhigh = _mm_loadu_si128((const __m128i *)&highRails[c]);
+            __m128i lo = _mm_set1_epi16(32767), hi = _mm_set1_epi16(-32768);
+            __m128i nLow = zero, nHigh = zero;
+            __m128i s0 = zero, s1 = zero;                       // int32 sums of channels c..c+3, c+4..c+7
+            __m128i q0 = zero, q1 = zero, q2 = zero, q3 = zero; // int64 sums of squares, two channels each
+            const int16_t * pSrc = pFrames + c;
+            for(uint32_t f=0; f<frames; ++f, pSrc+=channelCount)
+            {
+                __m128i x = _mm_loadu_si128((const __m128i *)pSrc);
+                lo    = _mm_min_epi16(lo, x);
+                hi    = _mm_max_epi16(hi, x);
+                nLow  = _mm_sub_epi16(nLow, _mm_cmpeq_epi16(_mm_min_epi16(x, vlow), x));
+                nHigh = _mm_sub_epi16(nHigh, _mm_cmpeq_epi16(_mm_max_epi16(x, vhigh), x));
+                s0    = _mm_add_epi32(s0, _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+                s1    = _mm_add_epi32(s1, _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+
+                // (x, 0) pairs make madd give x * x per channel
+                __m128i xl = _mm_unpacklo_epi16(x, zero);
+                __m128i xh = _mm_unpackhi_epi16(x, zero);
+                __m128i ql = _mm_madd_epi16(xl, xl);
+                __m128i qh = _mm_madd_epi16(xh, xh);
+                q0 = _mm_add_epi64(q0, _mm_unpacklo_epi32(ql, zero));
+                q1 = _mm_add_epi64(q1, _mm_unpackhi_epi32(ql, zero));
+                q2 = _mm_add_epi64(q2, _mm_unpacklo_epi32(qh, zero));
+                q3 = _mm_add_epi64(q3, _mm_unpackhi_epi32(qh, zero));
+            }
+
+            int16_t counts[16];
+            int32_t s[8];
+            _mm_storeu_si128((__m128i *)&minima[c], lo);
+            _mm_storeu_si128((__m128i *)&maxima[c], hi);
+            _mm_storeu_si128((__m128i *)counts, nLow);
+            _mm_storeu_si128((__m128i *)(counts + 8), nHigh);
+            _mm_storeu_si128((__m128i *)s, s0);
+            _mm_storeu_si128((__m128i *)(s + 4), s1);
+            _mm_storeu_si128((__m128i *)&squares[c], q0);
+            _mm_storeu_si128((__m128i *)&squares[c + 2], q1);
+            _mm_storeu_si128((__m128i *)&squares[c + 4], q2);
+            _mm_storeu_si128((__m128i *)&squares[c + 6], q3);
+            for(uint32_t k=0; k<8; ++k)
+            {
+                sums[c + k]  = s[k];
+                lows[c + k]  = (uint16_t)counts[k];
+                highs[c + k] = (uint16_t)counts[8 + k];
+            }
+        }
+#endif
+        // remaining channels
+        if(c < channelCount)
+        {
+            for(uint32_t k=c; k<channelCount; ++k)
+            {
+                sums[k]    = 0;
+                squares[k] = 0;
+                lows[k]    = 0;
+                highs[k]   = 0;
+                minima[k]  = 32767;
+                maxima[k]  = -32768;
+            }
+            const int16_t * pSrc = pFrames;
+            for(uint32_t f=0; f<frames; ++f, pSrc+=channelCount)
+            {
+                for(uint32_t k=c; k<channelCount; ++k)
+                {
+                    int32_t x = pSrc[k];
+                    sums[k]    += x;
+                    squares[k] += (int64_t)(x * x);
+                    lows[k]    += (x <= lowRails[k]);
+                    highs[k]   += (x >= highRails[k]);
+                    minima[k]   = (x < minima[k]) ? (int16_t)x : minima[k];
+                    maxima[k]   = (x > maxima[k]) ? (int16_t)x : maxima[k];
+                }
+            }
+        }
+
+        // the chunk as exact moments, merged into the running statistics
+        for(uint32_t k=0; k<channelCount; ++k)
+        {
+            HdemgChannelStats chunk;
+            chunk.count       = frames;
+            chunk.mean        = (double)sums[k] / frames;
+            chunk.m2          = (double)squares[k] - (double)sums[k] * chunk.mean;
+            chunk.minimum     = minima[k];
+            chunk.maximum     = maxima[k];
+            chunk.clippedLow  = lows[k];
+            chunk.clippedHigh = highs[k];
+            stats[k].Merge(chunk);
+        }
+    }
+
+    uint32_t                       channelCount;
+    std::vector<int16_t>           lowRails;
+    std::vector<int16_t>           highRails;
+    std::vector<HdemgChannelStats> stats;
+    std::vector<int64_t>           sums;        // of the current chunk
+    std::vector<int64_t>           squares;
+    std::vector<uint32_t>          lows;
+    std::vector<uint32_t>          highs;
+    std::vector<int16_t>           minima;
+    std::vector<int16_t>           maxima;
+};
+
+#endif // HDEMG_CHANNEL_STATS_H
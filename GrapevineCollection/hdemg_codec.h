@@ -0,0 +1,315 @@
+//
+//  hdemg_codec.h
+//
+//  Lossless codec for rows of int16 samples of one channel (the channel-major rows of
+//  hdemg_archive.h chunks). Neighbouring EMG samples at 30 kS/s differ by far less than the
+//  int16 range, so each sample is predicted from the previous ones and only the residual is
+//  stored:
+//
+//      order 1    r[i] = x[i] - x[i-1]
+//      order 2    r[i] = x[i] - 2 x[i-1] + x[i-2]
+//
+//  Residuals are zigzag mapped to unsigned values and bit-packed in groups of
+//  HDEMG_CODEC_GROUP samples. Every group starts with one byte holding its bit width and
+//  predictor order (the one giving the smaller width), followed by 16 * width bytes. The
+//  packing is interleaved across four 32 bit lanes (value i goes to lane i % 4), so the SSE2
+//  path packs and unpacks four values per instruction; the plain loops produce the same
+//  bytes. Samples before the start of a row are taken as 0.
+//
+
+#ifndef HDEMG_CODEC_H
+#define HDEMG_CODEC_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "hdemg_simd.h"
+
+static const uint32_t HDEMG_CODEC_GROUP      = 128;
+static const uint32_t HDEMG_CODEC_MAX_BITS   = 17;      // order 1 residuals of int16 always fit
+static const uint8_t  HDEMG_CODEC_ORDER2_BIT = 0x40;
+
+/**
+    Largest encoded size of a row of n samples
+  */
+inline size_t
+HdemgCodecBound(uint32_t n)
+{
+    return (size_t)((n + HDEMG_CODEC_GROUP - 1) / HDEMG_CODEC_GROUP) * (1 + HDEMG_CODEC_GROUP / 8 * HDEMG_CODEC_MAX_BITS);
+}
+
+//! \brief number of bits needed for the largest of the OR-ed values
+inline uint32_t
+HdemgCodecWidth(uint32_t bits)
+{
+    uint32_t width = 0;
+    for(; bits; bits >>= 1)
+        ++width;
+    return width;
+}
+
+/**
+    Packs HDEMG_CODEC_GROUP values of width bits each into 16 * width bytes
+  */
+inline void
+HdemgCodecPack(uint8_t * pDst, const uint32_t * pValues, uint32_t width)
+{
+    if(width == 0)
+        return;
+#if defined(__AVX__) || defined(HDEMG_SSE2)
+    __m128i acc   = _mm_setzero_si128();
+    uint32_t shift = 0;
+    for(uint32_t j=0; j<HDEMG_CODEC_GROUP/4; ++j)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(pValues + 4*j));
+        acc = _mm_or_si128(acc, _mm_sll_epi32(v, _mm_cvtsi32_si128((int)shift)));
+        shift += width;
+        if(shift >= 32)
+        {
+            _mm_storeu_si128((__m128i *)pDst, acc);
+            pDst  += 16;
+            shift -= 32;
+            acc    = shift ? _mm_srl_epi32(v, _mm_cvtsi32_si128((int)(width - shift))) : _mm_setzero_si128();
+        }
+    }
+#else
+    for(uint32_t lane=0; lane<4; ++lane)
+    {
+        uint32_t acc = 0, shift = 0, word = 0;
+        for(uint32_t j=0; j<HDEMG_CODEC_GROUP/4; ++j)
+        {
+            uint32_t v = pValues[4*j + lane];
+            acc |= v << shift;
+            shift += width;
+            if(shift >= 32)
+            {
+                memcpy(pDst + 16*word + 4*lane, &acc, 4);
+                ++word;
+                shift -= 32;
+                acc    = shift ? v >> (width - shift) : 0;
+            }
+        }
+    }
+#endif
+}
+
+/**
+    Unpacks HDEMG_CODEC_GROUP values of width bits each from 16 * width bytes
+  */
+inline void
+HdemgCodecUnpack(uint32_t * pValues, const uint8_t * pSrc, uint32_t width)
+{
+    if(width == 0)
+    {
+        memset(pValues, 0, HDEMG_CODEC_GROUP * sizeof(uint32_t));
+        return;
+    }
+    const uint32_t mask = (width < 32) ? (1u << width) - 1 : 0xFFFFFFFF;
+#if defined(__AVX__) || defined(HDEMG_SSE2)
+    const __m128i vmask = _mm_set1_epi32((int)mask);
+    __m128i  word  = _mm_loadu_si128((const __m128i *)pSrc);
+    uint32_t shift = 0;
+    for(uint32_t j=0; j<HDEMG_CODEC_GROUP/4; ++j)
+    {
+        __m128i v = _mm_srl_epi32(word, _mm_cvtsi32_si128((int)shift));
+        shift += width;
+        if(shift >= 32)
+        {
+            shift -= 32;
+            if(j + 1 < HDEMG_CODEC_GROUP/4 || shift)
+            {
+                pSrc += 16;
+                word  = _mm_loadu_si128((const __m128i *)pSrc);
+                if(shift)
+                    v = _mm_or_si128(v, _mm_sll_epi32(word, _mm_cvtsi32_si128((int)(width - shift))));
+            }
+        }
+        _mm_storeu_si128((__m128i *)(pValues + 4*j), _mm_and_si128(v, vmask));
+    }
+#else
+    for(uint32_t lane=0; lane<4; ++lane)
+    {
+        uint32_t shift = 0, wordIndex = 0, word;
+        memcpy(&word, pSrc + 4*lane, 4);
+        for(uint32_t j=0; j<HDEMG_CODEC_GROUP/4; ++j)
+        {
+            uint32_t v = (shift < 32) ? word >> shift : 0;
+            shift += width;
+            if(shift >= 32)
+            {
+                shift -= 32;
+                if(j + 1 < HDEMG_CODEC_GROUP/4 || shift)
+                {
+                    ++wordIndex;
+                    memcpy(&word, pSrc + 16*wordIndex + 4*lane, 4);
+                    if(shift)
+                        v |= word << (width - shift);
+                }
+            }
+            pValues[4*j + lane] = v & mask;
+        }
+    }
+#endif
+}
+
+/**
+    Encodes a row of samples.
+
+    \arg x    - samples
+    \arg n    - number of samples
+    \arg pDst - at least HdemgCodecBound(n) bytes
+
+    \return encoded size in bytes
+  */
+inline size_t
+HdemgEncodeRow(const int16_t * x, uint32_t n, uint8_t * pDst)
+{
+    int32_t  history[HDEMG_CODEC_GROUP + 2];
+    uint32_t r1[HDEMG_CODEC_GROUP];
+    uint32_t r2[HDEMG_CODEC_GROUP];
+    uint8_t * pStart = pDst;
+    int32_t  prev1 = 0, prev2 = 0;      // x[i-1], x[i-2] before the group
+
+    for(uint32_t s=0; s<n; s+=HDEMG_CODEC_GROUP)
+    {
+        uint32_t count = (n - s < HDEMG_CODEC_GROUP) ? n - s : HDEMG_CODEC_GROUP;
+        history[0] = prev2;
+        history[1] = prev1;
+        for(uint32_t i=0; i<count; ++i)
+            history[i+2] = x[s+i];
+        for(uint32_t i=count; i<HDEMG_CODEC_GROUP; ++i)
+            history[i+2] = history[count+1];    // residual 0 for order 1 past the end
+
+        uint32_t or1 = 0, or2 = 0;
+        uint32_t i = 0;
+#if defined(__AVX__) || defined(HDEMG_SSE2)
+        __m128i vor1 = _mm_setzero_si128();
+        __m128i vor2 = _mm_setzero_si128();
+        for(; i<HDEMG_CODEC_GROUP; i+=4)
+        {
+            __m128i x0 = _mm_loadu_si128((const __m128i *)(history + i + 2));
+            __m128i x1 = _mm_loadu_si128((const __m128i *)(history + i + 1));
+            __m128i x2 = _mm_loadu_si128((const __m128i *)(history + i));
+            __m128i d1 = _mm_sub_epi32(x0, x1);
+            __m128i d2 = _mm_sub_epi32(d1, _mm_sub_epi32(x1, x2));
+            __m128i z1 = _mm_xor_si128(_mm_slli_epi32(d1, 1), _mm_srai_epi32(d1, 31));
+            __m128i z2 = _mm_xor_si128(_mm_slli_epi32(d2, 1), _mm_srai_epi32(d2, 31));
+            _mm_storeu_si128((__m128i *)(r1 + i), z1);
+            _mm_storeu_si128((__m128i *)(r2 + i), z2);
+            vor1 = _mm_or_si128(vor1, z1);
+            vor2 = _mm_or_si128(vor2, z2);
+        }
+        uint32_t lanes[8];
+        _mm_storeu_si128((__m128i *)lanes, vor1);
+        _mm_storeu_si128((__m128i *)(lanes + 4), vor2);
+        or1 = lanes[0] | lanes[1] | lanes[2] | lanes[3];
+        or2 = lanes[4] | lanes[5] | lanes[6] | lanes[7];
+#endif
+        for(; i<HDEMG_CODEC_GROUP; ++i)
+        {
+            int32_t d1 = history[i+2] - history[i+1];
+            int32_t d2 = d1 - (history[i+1] - history[i]);
+            r1[i] = ((uint32_t)d1 << 1) ^ (uint32_t)(d1 >> 31);
+            r2[i] = ((uint32_t)d2 << 1) ^ (uint32_t)(d2 >> 31);
+            or1  |= r1[i];
+            or2  |= r2[i];
+        }
+
+        uint32_t width1 = HdemgCodecWidth(or1);
+        uint32_t width2 = HdemgCodecWidth(or2);
+        bool     order2 = width2 < width1;
+        uint32_t width  = order2 ? width2 : width1;
+        *pDst++ = (uint8_t)(width | (order2 ? HDEMG_CODEC_ORDER2_BIT : 0));
+        HdemgCodecPack(pDst, order2 ? r2 : r1, width);
+        pDst += 16 * width;
+
+        prev1 = history[count+1];
+        prev2 = history[count];
+    }
+    return (size_t)(pDst - pStart);
+}
+
+/**
+    Decodes a row of samples.
+
+    \arg pSrc  - encoded row
+    \arg bytes - size of the encoded row
+    \arg n     - number of samples
+    \arg x     - receives n samples
+
+    \return false if the data is damaged
+  */
+inline bool
+HdemgDecodeRow(const uint8_t * pSrc, size_t bytes, uint32_t n, int16_t * x)
+{
+    uint32_t r[HDEMG_CODEC_GROUP];
+    int32_t  out[HDEMG_CODEC_GROUP];
+    const uint8_t * pEnd = pSrc + bytes;
+    int32_t  prev1 = 0, prev2 = 0;
+
+    for(uint32_t s=0; s<n; s+=HDEMG_CODEC_GROUP)
+    {
+        if(pSrc >= pEnd)
+            return false;
+        uint32_t width  = *pSrc & 0x3F;
+        bool     order2 = (*pSrc & HDEMG_CODEC_ORDER2_BIT) != 0;
+        ++pSrc;
+        if(width > HDEMG_CODEC_MAX_BITS || (size_t)(pEnd - pSrc) < 16 * width)
+            return false;
+        HdemgCodecUnpack(r, pSrc, width);
+        pSrc += 16 * width;
+
+        uint32_t count = (n - s < HDEMG_CODEC_GROUP) ? n - s : HDEMG_CODEC_GROUP;
+        uint32_t i     = 0;
+#if defined(__AVX__) || defined(HDEMG_SSE2)
+        // zigzag back to signed, then one running sum per predictor order
+        __m128i one   = _mm_set1_epi32(1);
+        __m128i delta = _mm_set1_epi32(prev1 - prev2);
+        __m128i value = _mm_set1_epi32(prev1);
+        for(; i<HDEMG_CODEC_GROUP; i+=4)
+        {
+            __m128i u = _mm_loadu_si128((const __m128i *)(r + i));
+            __m128i d = _mm_xor_si128(_mm_srli_epi32(u, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(u, one)));
+            if(order2)
+            {
+                d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+                d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+                d = _mm_add_epi32(d, delta);
+                delta = _mm_shuffle_epi32(d, 0xFF);
+            }
+            d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+            d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+            d = _mm_add_epi32(d, value);
+            value = _mm_shuffle_epi32(d, 0xFF);
+            _mm_storeu_si128((__m128i *)(out + i), d);
+        }
+#else
+        int32_t delta = prev1 - prev2, value = prev1;
+        for(; i<HDEMG_CODEC_GROUP; ++i)
+        {
+            int32_t d = (int32_t)(r[i] >> 1) ^ -(int32_t)(r[i] & 1);
+            if(order2)
+            {
+                delta += d;
+                d      = delta;
+            }
+            value += d;
+            out[i] = value;
+        }
+#endif
+        i = 0;
+#if defined(__AVX__) || defined(HDEMG_SSE2)
+        for(; i+8<=count; i+=8)
+            _mm_storeu_si128((__m128i *)(x + s + i), _mm_packs_epi32(_mm_loadu_si128((const __m128i *)(out + i)),
+                                                                   _mm_loadu_si128((const __m128i *)(out + i + 4))));
+#endif
+        for(; i<count; ++i)
+            x[s+i] = (int16_t)out[i];
+
+        prev2 = (count > 1) ? out[count-2] : prev1;
+        prev1 = out[count-1];
+    }
+    return true;
+}
+
+#endif // HDEMG_CODEC_H
@@ -0,0 +1,436 @@
+//
+//  hdemg_covariance.h
+//
+//  Streaming covariance of extended observation vectors (the last `extension` frames of
+//  every channel, see hdemg_decomposition.h) and the whitening matrix derived from it.
+//
+//  Each block is added as one rank-k update of the sums of x and x*x^T, where k is the
+//  number of frames in the block. The lower triangle is updated in square tiles so that a
+//  tile accumulator and the matching slices of the observations stay in L1 while the
+//  k observations are applied. Exponential forgetting scales the sums once per block.
+//
+//  The whitening matrix can be computed on demand or by a background thread. In the
+//  background mode the data path only copies the sums into a snapshot when the worker is
+//  idle; the eigen decomposition runs on the worker and the result is handed back as a
+//  shared pointer.
+//
+//  The sums are taken around zero, so the input should be high-pass filtered.
+//
+
+#ifndef HDEMG_COVARIANCE_H
+#define HDEMG_COVARIANCE_H
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "hdemg_frames.h"
+#include "hdemg_linalg.h"
+#include "hdemg_simd.h"
+
+static const uint32_t HDEMG_COVARIANCE_TILE = 64;
+
+/*! \brief Whitening transform of the extended observations.
+ *
+ *  z = matrix * (x - mean), with row k = e_k / sqrt(lambda_k) for the eigenvalues above the
+ *  noise floor in descending order. Rows are padded with zeros to a multiple of four so that
+ *  they can be used with HdemgDot4.
+ */
+struct HdemgWhitening
+{
+    uint32_t            observationSize;
+    uint32_t            componentCount;
+    uint32_t            rowCount;      //!< componentCount rounded up to a multiple of four
+    double              weight;        //!< effective number of observations behind the estimate
+    std::vector<float>  mean;          //!< [observationSize]
+    std::vector<float>  matrix;        //!< [rowCount][observationSize]
+    std::vector<double> eigenvalues;   //!< kept eigenvalues, descending
+
+    inline const float * Row(uint32_t k) const { return &matrix[(size_t)k * observationSize]; }
+};
+
+/*! \brief Block-wise covariance accumulator with optional forgetting and a background
+ *  whitening worker.
+ */
+class HdemgCovarianceEngine
+{
+public:
+    HdemgCovarianceEngine()
+        : channelCount(0), extension(0), observationSize(0), maxBlockFrames(0), maxComponents(0), lambda(1.0),
+          weight(0.0), warmup(0), expectedTime(0), streamStarted(false), intervalFrames(0), sinceSnapshot(0),
+          snapshotWeight(0.0), snapshotReady(false), busy(false), stopping(false) {}
+
+    ~HdemgCovarianceEngine() { StopBackground(); }
+
+    /**
+        Sizes the engine.
+
+        \arg channels       - channels per frame
+        \arg ext            - frames per extended observation
+        \arg maxFrames      - largest block that will be passed in
+        \arg memoryFrames   - time constant of the exponential forgetting in frames, 0 keeps
+                              every observation with equal weight
+        \arg maxComp        - upper bound on whitened dimensions (0 = no bound)
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, uint32_t ext, uint32_t maxFrames, double memoryFrames, uint32_t maxComp)
+    {
+        if(channels == 0 || ext == 0 || maxFrames == 0 || memoryFrames < 0.0)
+        {
+            printf("ERROR: invalid covariance configuration\n");
+            return false;
+        }
+
+        StopBackground();
+        channelCount    = channels;
+        extension       = ext;
+        observationSize = channels * ext;
+        maxBlockFrames  = maxFrames;
+        maxComponents   = maxComp;
+        lambda          = (memoryFrames > 0.0) ? exp(-1.0 / memoryFrames) : 1.0;
+
+        sum.assign(observationSize, 0.0);
+        product.assign((size_t)observationSize * observationSize, 0.0);
+        work.assign((size_t)(ext - 1 + maxFrames) * channels, 0.0f);
+        blockSum.assign(observationSize, 0.0f);
+        frameWeight.assign(maxFrames, 0.0f);
+        tile.assign((size_t)HDEMG_COVARIANCE_TILE * HDEMG_COVARIANCE_TILE, 0.0f);
+        Reset();
+        return true;
+    }
+
+    //! \brief Clears the sums and the observation history
+    void Reset()
+    {
+        std::fill(sum.begin(), sum.end(), 0.0);
+        std::fill(product.begin(), product.end(), 0.0);
+        weight        = 0.0;
+        sinceSnapshot = 0;
+        streamStarted = false;
+        Restart();
+    }
+
+    //! \brief Clears the observation history only, e.g. after a gap in the stream
+    void Restart()
+    {
+        std::fill(work.begin(), work.end(), 0.0f);
+        warmup = extension - 1;
+    }
+
+    /**
+        Adds every observation that ends in the block. Restarts the history on NIP gaps.
+      */
+    bool Process(const HdemgBlock & in)
+    {
+        if(in.channelCount != channelCount || in.frameCount > maxBlockFrames)
+        {
+            printf("ERROR: covariance block [%u x %u] does not match configuration\n", in.frameCount, in.channelCount);
+            return false;
+        }
+        if(streamStarted && !HdemgIsContiguous(in, expectedTime))
+            Restart();
+        streamStarted = true;
+        expectedTime  = in.EndTime();
+
+        if(in.frameCount)
+            Accumulate(in.Frame(0), in.frameCount);
+        return true;
+    }
+
+    /**
+        Adds contiguous frames without time checks.
+
+        \arg pFrames - frames * channels values, sample-major
+        \arg frames  - number of frames (at most the configured maximum)
+      */
+    void Accumulate(const float * pFrames, uint32_t frames)
+    {
+        const uint32_t nCh     = channelCount;
+        const uint32_t history = extension - 1;
+
+        memcpy(&work[(size_t)history * nCh], pFrames, (size_t)frames * nCh * sizeof(float));
+
+        // observation f ends at block frame f and starts at work frame f; those that still
+        // reach into the cleared history are skipped
+        uint32_t first = std::min(warmup, frames);
+        uint32_t k     = frames - first;
+        warmup        -= first;
+
+        if(k)
+        {
+            // per-observation weights, the newest frame has weight 1
+            double decay = 1.0;
+            for(uint32_t i=k; i-- > 0; )
+            {
+                frameWeight[i] = (float)decay;
+                decay         *= lambda;
+            }
+
+            UpdateSum(first, k, decay);
+            UpdateProduct(first, k, decay);
+            weight = weight * decay;
+            for(uint32_t i=0; i<k; ++i)
+                weight += frameWeight[i];
+        }
+
+        if(history)
+            memmove(&work[0], &work[(size_t)frames * nCh], (size_t)history * nCh * sizeof(float));
+
+        sinceSnapshot += k;
+        if(intervalFrames && sinceSnapshot >= intervalFrames)
+            OfferSnapshot();
+    }
+
+    //! \brief effective number of observations in the sums
+    double Weight() const { return weight; }
+    uint32_t ObservationSize() const { return observationSize; }
+
+    /**
+        Computes the whitening transform from the current sums on the calling thread.
+      */
+    bool ComputeWhitening(HdemgWhitening & out) const
+    {
+        std::vector<double> cov(product);
+        return Whiten(sum, cov, weight, out);
+    }
+
+    /**
+        Starts a worker thread that recomputes the whitening transform every
+        intervalFrames observations. The latest result is available from Whitening().
+      */
+    bool StartBackground(uint32_t interval)
+    {
+        if(observationSize == 0 || interval == 0)
+        {
+            printf("ERROR: invalid background whitening interval\n");
+            return false;
+        }
+        StopBackground();
+        intervalFrames = interval;
+        sinceSnapshot  = 0;
+        stopping       = false;
+        worker         = std::thread(&HdemgCovarianceEngine::Worker, this);
+        return true;
+    }
+
+    void StopBackground()
+    {
+        if(!worker.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+        intervalFrames = 0;
+        snapshotReady  = false;
+        busy           = false;
+    }
+
+    //! \brief latest background result, empty until the first one is ready
+    std::shared_ptr<const HdemgWhitening> Whitening() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return latest;
+    }
+
+private:
+    //! \brief sum = decay * sum + sum of the weighted observations
+    void UpdateSum(uint32_t first, uint32_t k, double decay)
+    {
+        const uint32_t D = observationSize;
+        std::fill(blockSum.begin(), blockSum.end(), 0.0f);
+        for(uint32_t f=0; f<k; ++f)
+            HdemgAxpy(&blockSum[0], &work[(size_t)(first + f) * channelCount], frameWeight[f], D);
+        for(uint32_t i=0; i<D; ++i)
+            sum[i] = sum[i] * decay + blockSum[i];
+    }
+
+    /**
+        Rank-k update of the lower triangle, tile by tile:
+        product = decay * product + sum_i w_i * x_i * x_i^T
+      */
+    void UpdateProduct(uint32_t first, uint32_t k, double decay)
+    {
+        const uint32_t nCh = channelCount;
+        const uint32_t D   = observationSize;
+        const uint32_t T   = HDEMG_COVARIANCE_TILE;
+
+        for(uint32_t i0=0; i0<D; i0+=T)
+        {
+            uint32_t ni = std::min(T, D - i0);
+            for(uint32_t j0=0; j0<=i0; j0+=T)
+            {
+                uint32_t nj   = std::min(T, D - j0);
+                bool     diag = (i0 == j0);
+                std::fill(tile.begin(), tile.end(), 0.0f);
+
+                for(uint32_t f=0; f<k; ++f)
+                {
+                    const float * x  = &work[(size_t)(first + f) * nCh];
+                    const float   wf = frameWeight[f];
+                    for(uint32_t i=0; i<ni; ++i)
+                        HdemgAxpy(&tile[(size_t)i * T], x + j0, wf * x[i0 + i], diag ? i + 1 : nj);
+                }
+
+                for(uint32_t i=0; i<ni; ++i)
+                {
+                    double *      row = &product[(size_t)(i0 + i) * D + j0];
+                    const float * acc = &tile[(size_t)i * T];
+                    uint32_t      n   = diag ? i + 1 : nj;
+                    for(uint32_t j=0; j<n; ++j)
+                        row[j] = row[j] * decay + acc[j];
+                }
+            }
+        }
+    }
+
+    //! \brief called from the data path, hands the sums to the worker if it is idle
+    void OfferSnapshot()
+    {
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if(!lock.owns_lock() || busy || snapshotReady)
+            return;
+
+        const uint32_t D = observationSize;
+        snapshotSum = sum;
+        snapshotProduct.resize(product.size());
+        for(uint32_t i=0; i<D; ++i)
+            memcpy(&snapshotProduct[(size_t)i * D], &product[(size_t)i * D], (i + 1) * sizeof(double));
+        snapshotWeight = weight;
+        snapshotReady  = true;
+        sinceSnapshot  = 0;
+        lock.unlock();
+        wake.notify_one();
+    }
+
+    void Worker()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            while(!stopping && !snapshotReady)
+                wake.wait(lock);
+            if(stopping)
+                break;
+
+            // the snapshot belongs to the worker until busy is cleared
+            snapshotReady = false;
+            busy          = true;
+            lock.unlock();
+
+            std::shared_ptr<HdemgWhitening> result(new HdemgWhitening());
+            bool ok = Whiten(snapshotSum, snapshotProduct, snapshotWeight, *result);
+
+            lock.lock();
+            if(ok)
+                latest = result;
+            busy = false;
+        }
+    }
+
+    /**
+        Covariance = product / weight - mean * mean^T, then eigen decomposition and selection of
+        the components above the noise floor (mean of the smaller half of the eigenvalues).
+        cov is overwritten.
+      */
+    bool Whiten(const std::vector<double> & s, std::vector<double> & cov, double w, HdemgWhitening & out) const
+    {
+        const uint32_t D = observationSize;
+        if(w <= 1.0)
+        {
+            printf("ERROR: not enough observations to whiten\n");
+            return false;
+        }
+
+        std::vector<double> mu(D);
+        for(uint32_t i=0; i<D; ++i)
+            mu[i] = s[i] / w;
+        for(uint32_t i=0; i<D; ++i)
+            for(uint32_t j=0; j<=i; ++j)
+                cov[(size_t)i * D + j] = cov[(size_t)i * D + j] / w - mu[i] * mu[j];
+
+        std::vector<double> values;
+        if(!HdemgSymmetricEigen(cov, D, values))
+            return false;
+
+        double noise = 0.0;
+        for(uint32_t k=0; k<D/2; ++k)
+            noise += values[k];
+        noise = (D/2) ? noise / (D/2) : 0.0;
+
+        uint32_t K = 0;
+        for(uint32_t k=D; k-- > 0; )
+        {
+            if(values[k] <= noise || values[k] <= 0.0)
+                break;
+            if(maxComponents && K == maxComponents)
+                break;
+            K++;
+        }
+        if(K == 0)
+        {
+            printf("ERROR: covariance has no components above the noise floor\n");
+            return false;
+        }
+
+        out.observationSize = D;
+        out.componentCount  = K;
+        out.rowCount        = (K + 3) & ~3u;
+        out.weight          = w;
+        out.mean.resize(D);
+        for(uint32_t i=0; i<D; ++i)
+            out.mean[i] = (float)mu[i];
+        out.matrix.assign((size_t)out.rowCount * D, 0.0f);
+        out.eigenvalues.resize(K);
+        for(uint32_t k=0; k<K; ++k)
+        {
+            uint32_t src   = D - 1 - k;
+            double   scale = 1.0 / sqrt(values[src]);
+            out.eigenvalues[k] = values[src];
+            for(uint32_t i=0; i<D; ++i)
+                out.matrix[(size_t)k * D + i] = (float)(cov[(size_t)src * D + i] * scale);
+        }
+        return true;
+    }
+
+    uint32_t                              channelCount;
+    uint32_t                              extension;
+    uint32_t                              observationSize;
+    uint32_t                              maxBlockFrames;
+    uint32_t                              maxComponents;
+    double                                lambda;          // forgetting factor per frame
+    std::vector<double>                   sum;             // weighted sum of x
+    std::vector<double>                   product;         // weighted sum of x*x^T, lower triangle
+    double                                weight;
+    std::vector<float>                    work;            // [extension-1 history | block]
+    std::vector<float>                    blockSum;
+    std::vector<float>                    frameWeight;
+    std::vector<float>                    tile;            // [HDEMG_COVARIANCE_TILE]^2 accumulator
+    uint32_t                              warmup;          // frames until the history is valid again
+    uint32_t                              expectedTime;
+    bool                                  streamStarted;
+    uint32_t                              intervalFrames;  // observations between background snapshots
+    uint32_t                              sinceSnapshot;
+
+    // background whitening; everything below is guarded by mutex
+    std::vector<double>                   snapshotSum;
+    std::vector<double>                   snapshotProduct;
+    double                                snapshotWeight;
+    bool                                  snapshotReady;
+    bool                                  busy;
+    bool                                  stopping;
+    std::shared_ptr<const HdemgWhitening> latest;
+    mutable std::mutex                    mutex;
+    std::condition_variable               wake;
+    std::thread                           worker;
+};
+
+#endif // HDEMG_COVARIANCE_H
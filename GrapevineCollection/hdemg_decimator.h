@@ -0,0 +1,270 @@
+//
+//  hdemg_decimator.h
+//
+//  Polyphase FIR resampler that converts assembled 30 ksps frames (see hdemg_frames.h)
+//  to the lower rates used for surface HD-EMG, e.g. 2000, 2500, 3000 or 4000 Hz. Any
+//  rational ratio outRate/inRate = L/M is supported. The anti-alias filter is a Kaiser
+//  windowed sinc that is split into L phases so only the taps that touch real input
+//  samples are evaluated.
+//
+//  All buffers are sized in Configure(), Process() does not allocate.
+//
+//  An HdemgArtifactBlanker (hdemg_artifact.h) can be attached so stimulation artifacts are
+//  interpolated in the filter's own input buffer. The filter then runs DelayFrames() input
+//  frames behind the newest block; the output frames keep their true NIP times. A NIP gap
+//  drops the held back frames along with the rest of the filter history.
+//
+
+#ifndef HDEMG_DECIMATOR_H
+#define HDEMG_DECIMATOR_H
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_artifact.h"
+#include "hdemg_frames.h"
+#include "hdemg_simd.h"
+
+// default filter length in zero crossings on each side of the sinc main lobe
+static const uint32_t HDEMG_DECIMATOR_ZERO_CROSSINGS = 8;
+static const double   HDEMG_DECIMATOR_KAISER_BETA    = 8.0;  // ~80 dB stop band
+static const double   HDEMG_DECIMATOR_PASSBAND       = 0.9;  // cutoff relative to output Nyquist
+
+/**
+    Zeroth order modified Bessel function of the first kind (series expansion)
+  */
+inline double
+HdemgBesselI0(double x)
+{
+    double sum  = 1.0;
+    double term = 1.0;
+    for(int k=1; k<50; ++k)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum  += term;
+        if(term < 1e-12 * sum)
+            break;
+    }
+    return sum;
+}
+
+/**
+    Greatest common divisor of two rates
+  */
+inline uint32_t
+HdemgGcd(uint32_t a, uint32_t b)
+{
+    while(b)
+    {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/*! \brief Rational polyphase resampler for HdemgBlocks.
+ *
+ *  Output frame m is computed from input position m*M/L. Input history is carried across
+ *  blocks, and is cleared whenever the input jumps in NIP time so that filter state never
+ *  smears samples across a gap.
+ */
+class HdemgDecimator
+{
+public:
+    HdemgDecimator()
+        : channelCount(0), maxInFrames(0), L(1), M(1), protoTaps(0), phaseTaps(0), pBlanker(NULL),
+          delay(0), inPos(0), phase(0), expectedTime(0), prevArrivalNs(0), streamStarted(false) {}
+
+    /**
+        Designs the filter and sizes all buffers.
+
+        \arg channels       - channels per frame
+        \arg inRate         - input rate in Hz (HDEMG_NIP_CLOCK_HZ for raw frames)
+        \arg outRate        - requested output rate in Hz
+        \arg maxBlockFrames - largest input block that will be passed to Process()
+        \arg zeroCrossings  - filter half length in zero crossings (longer = sharper)
+        \arg pArtifacts     - optional configured artifact blanker for the input frames; it
+                              must outlive the decimator
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, uint32_t inRate, uint32_t outRate, uint32_t maxBlockFrames,
+                   uint32_t zeroCrossings = HDEMG_DECIMATOR_ZERO_CROSSINGS, HdemgArtifactBlanker * pArtifacts = NULL)
+    {
+        if(channels == 0 || inRate == 0 || outRate == 0 || maxBlockFrames == 0 || zeroCrossings == 0)
+        {
+            printf("ERROR: invalid decimator configuration\n");
+            return false;
+        }
+        if(pArtifacts && (pArtifacts->ChannelCount() != channels || pArtifacts->SampleRate() != inRate
+                          || pArtifacts->DelayFrames() >= maxBlockFrames))
+        {
+            printf("ERROR: artifact blanker does not match the decimator input or its window is not shorter than a block\n");
+            return false;
+        }
+
+        uint32_t g = HdemgGcd(inRate, outRate);
+        L = outRate / g;
+        M = inRate / g;
+        if(L > 1000 || M > 1000)
+        {
+            printf("ERROR: resampling ratio %u/%u is too fine grained\n", L, M);
+            return false;
+        }
+
+        channelCount = channels;
+        maxInFrames  = maxBlockFrames;
+        pBlanker     = pArtifacts;
+        delay        = pArtifacts ? pArtifacts->DelayFrames() : 0;
+
+        // prototype low pass at the upsampled rate L*inRate
+        uint32_t factor = (L > M) ? L : M;
+        uint32_t taps   = 2 * zeroCrossings * factor + 1;
+        double   fc     = HDEMG_DECIMATOR_PASSBAND / factor;    // relative to upsampled Nyquist
+        double   center = 0.5 * (taps - 1);
+        double   i0Beta = HdemgBesselI0(HDEMG_DECIMATOR_KAISER_BETA);
+
+        std::vector<double> proto(taps);
+        double dcGain = 0.0;
+        for(uint32_t j=0; j<taps; ++j)
+        {
+            double x    = j - center;
+            double sinc = (x == 0.0) ? 1.0 : sin(HDEMG_PI * fc * x) / (HDEMG_PI * fc * x);
+            double r    = x / center;
+            double win  = HdemgBesselI0(HDEMG_DECIMATOR_KAISER_BETA * sqrt(1.0 - r * r)) / i0Beta;
+            proto[j] = sinc * win;
+            dcGain  += proto[j];
+        }
+
+        // split into L phases, tap k of phase p is proto[p + k*L]; normalize so each phase has
+        // unity gain at DC (the zero stuffing of the upsampler costs a factor of L)
+        protoTaps = taps;
+        phaseTaps = (taps + L - 1) / L;
+        coeffs.assign((size_t)L * phaseTaps, 0.0f);
+        for(uint32_t p=0; p<L; ++p)
+        {
+            for(uint32_t k=0; k<phaseTaps; ++k)
+            {
+                uint32_t j = p + k * L;
+                if(j < taps)
+                    coeffs[(size_t)p * phaseTaps + k] = (float)(proto[j] * L / dcGain);
+            }
+        }
+
+        // filter history and held back frames, followed by room for the largest input block
+        work.assign((size_t)(phaseTaps - 1 + delay + maxBlockFrames) * channels, 0.0f);
+
+        uint32_t maxOut = (uint32_t)(((uint64_t)maxBlockFrames * L + M - 1) / M) + 1;
+        if(!out.Allocate(channels, maxOut, (double)outRate))
+            return false;
+
+        Reset();
+        return true;
+    }
+
+    //! \brief Clears the filter history so the next block starts a new stream
+    void Reset()
+    {
+        if(!work.empty())
+            memset(&work[0], 0, (size_t)(phaseTaps - 1 + delay) * channelCount * sizeof(float));
+        inPos         = delay;  // the held back frames of a new stream are not real input
+        phase         = 0;
+        streamStarted = false;
+    }
+
+    /**
+        Resamples one block of frames.
+
+        \arg in - input block, its channel count must match Configure()
+
+        \return block holding the output frames, valid until the next call. May contain zero
+                frames when the input block is shorter than the decimation factor.
+      */
+    const HdemgBlock & Process(const HdemgBlock & in)
+    {
+        out.frameCount = 0;
+        if(in.channelCount != channelCount || in.frameCount > maxInFrames)
+        {
+            printf("ERROR: decimator block mismatch channels[%u] frames[%u]\n", in.channelCount, in.frameCount);
+            return out;
+        }
+
+        if(streamStarted && !HdemgIsContiguous(in, expectedTime))
+            Reset();
+        streamStarted = true;
+
+        const uint32_t taps    = phaseTaps - 1;
+        const uint32_t history = taps + delay;
+        const uint32_t nIn     = in.frameCount;
+        memcpy(&work[(size_t)history * channelCount], in.Frame(0), (size_t)nIn * channelCount * sizeof(float));
+
+        // blank artifacts before any tap reads the new frames
+        if(pBlanker)
+            pBlanker->Apply(&work[0], history + nIn, history, taps + inPos, in.startTime, in.TicksPerFrame());
+
+        // the first output of this block lies at input position inPos + phase/L, counted from
+        // the oldest held back frame; with a blanker it may still belong to the previous block
+        out.arrivalNs = (inPos < delay && prevArrivalNs) ? prevArrivalNs : in.arrivalNs;
+        out.startTime = in.startTime + (uint32_t)(int32_t)floor(((double)inPos - delay + (double)phase / L) * in.TicksPerFrame() + 0.5);
+        prevArrivalNs = in.arrivalNs;
+
+        while(inPos < nIn)
+        {
+            float *       pAcc   = out.Frame(out.frameCount);
+            const float * pCoeff = &coeffs[(size_t)phase * phaseTaps];
+            const float * pNow   = &work[(size_t)(taps + inPos) * channelCount];
+
+            memset(pAcc, 0, channelCount * sizeof(float));
+            for(uint32_t k=0; k<phaseTaps; ++k)
+                HdemgAxpy(pAcc, pNow - (size_t)k * channelCount, pCoeff[k], channelCount);
+
+            out.frameCount++;
+
+            phase += M;
+            inPos += phase / L;
+            phase %= L;
+        }
+        inPos -= nIn;
+
+        // keep the most recent frames as history for the next block
+        if(nIn >= history)
+            memcpy(&work[0], &work[(size_t)nIn * channelCount], (size_t)history * channelCount * sizeof(float));
+        else
+            memmove(&work[0], &work[(size_t)nIn * channelCount], (size_t)history * channelCount * sizeof(float));
+
+        expectedTime = in.EndTime();
+        return out;
+    }
+
+    uint32_t Interpolation() const { return L; }
+    uint32_t Decimation() const    { return M; }
+    uint32_t TapsPerPhase() const  { return phaseTaps; }
+
+    //! \brief delay of the linear phase filter in output frames
+    double GroupDelayFrames() const { return 0.5 * (protoTaps - 1) / M; }
+
+    //! \brief input frames held back for the artifact blanker (0 without one)
+    uint32_t HeldFrames() const { return delay; }
+
+private:
+    uint32_t           channelCount;
+    uint32_t           maxInFrames;
+    uint32_t           L;               // interpolation factor
+    uint32_t           M;               // decimation factor
+    uint32_t           protoTaps;
+    uint32_t           phaseTaps;
+    std::vector<float> coeffs;          // [phase][tap]
+    std::vector<float> work;            // [history | held back | current block], sample-major
+    HdemgBlock         out;
+    HdemgArtifactBlanker * pBlanker;
+    uint32_t           delay;           // frames held back for the blanker
+    uint32_t           inPos;           // input frame of the next output, relative to block start
+    uint32_t           phase;           // upsampled sub-position of the next output
+    uint32_t           expectedTime;
+    uint64_t           prevArrivalNs;   // arrival of the previous block, owner of the held back frames
+    bool               streamStarted;
+};
+
+#endif // HDEMG_DECIMATOR_H
@@ -0,0 +1,440 @@
+//
+//  hdemg_decoder.h
+//
+//  Applies a trained linear or small neural network decoder to feature vectors as they are
+//  produced by HdemgFeatureExtractor. LDA, ridge regression and MLP models are all stored
+//  as a stack of dense layers; they differ only in the activation functions and in how the
+//  final layer is read (LDA picks the class with the largest score).
+//
+//  All buffers are sized when the model is loaded. Several feature vectors can be decoded
+//  as a batch, in which case each weight row is applied to the whole batch while it is in
+//  cache.
+//
+//  Latency is measured from HdemgBlock::arrivalNs, i.e. from the arrival of the first
+//  packet of the block that closed the feature window, to the moment the decoder output is
+//  ready. Since that packet arrived no later than the newest sample of the window the
+//  figure is an upper bound on packet-to-output latency.
+//
+
+#ifndef HDEMG_DECODER_H
+#define HDEMG_DECODER_H
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_features.h"
+#include "hdemg_simd.h"
+
+//! \defgroup HdemgDecoderTypes
+//! \{
+static const uint32_t HDEMG_DECODER_LDA   = 1; // linear class scores, output is the best class
+static const uint32_t HDEMG_DECODER_RIDGE = 2; // linear regression
+static const uint32_t HDEMG_DECODER_MLP   = 3; // dense layers with nonlinear activations
+//! \}
+
+//! \defgroup HdemgActivations
+//! \{
+static const uint32_t HDEMG_ACTIVATION_LINEAR  = 0;
+static const uint32_t HDEMG_ACTIVATION_RELU    = 1;
+static const uint32_t HDEMG_ACTIVATION_TANH    = 2;
+static const uint32_t HDEMG_ACTIVATION_SIGMOID = 3;
+//! \}
+
+static const uint32_t HDEMG_DECODER_MAX_LAYERS = 8;
+static const uint32_t HDEMG_DECODER_MAX_BATCH  = 32;
+
+//! \brief Result of decoding one feature vector
+struct HdemgDecoderOutput
+{
+    uint32_t time;        //!< NIP time of the last sample of the feature window
+    uint64_t latencyNs;   //!< block arrival to decoder output (upper bound)
+    int32_t  classIndex;  //!< best class for LDA models, -1 otherwise
+    uint32_t valueCount;
+    const float * pValues; //!< class scores or regression outputs, valid until the next decode
+};
+
+//! \brief Running latency statistics
+struct HdemgLatencyStats
+{
+    uint64_t count;
+    uint64_t overBudget;   //!< outputs slower than the budget
+    uint64_t maxNs;
+    double   sumNs;
+
+    double MeanMs() const { return count ? 1e-6 * sumNs / count : 0.0; }
+    double MaxMs() const  { return 1e-6 * maxNs; }
+};
+
+/*! \brief Dense layer decoder with fixed memory footprint.
+ *
+ *  Model files are plain text, '#' starts a comment:
+ *
+ *      model lda              (lda | ridge | mlp)
+ *      inputs 704
+ *      normalize              (optional: a row of means and a row of scales follow)
+ *      ...
+ *      layer 6 linear         (outputs and activation: linear | relu | tanh | sigmoid)
+ *      ...                    (one row per output: weights for every input, then the bias)
+ *
+ *  Inputs are the feature frame values in order (feature-major, see HdemgFeatureFrame).
+ *  SetChannelMask() replaces the inputs of bad channels by the training mean (zero for
+ *  models without normalization), so they add nothing to the normalized input.
+ */
+class HdemgDecoder
+{
+public:
+    HdemgDecoder() : type(0), inputCount(0), layerCount(0), masked(false), maxWidth(0), budgetNs(50000000ULL)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    /**
+        Loads a model file and sizes all buffers.
+
+        \return true if the file was read and the layer sizes are consistent
+      */
+    bool Load(const char * path)
+    {
+        FILE * pFile = fopen(path, "r");
+        if(!pFile)
+        {
+            printf("ERROR: could not open decoder model [%s]\n", path);
+            return false;
+        }
+
+        bool ok = ReadModel(pFile);
+        fclose(pFile);
+        if(!ok)
+        {
+            printf("ERROR: decoder model [%s] is invalid\n", path);
+            layerCount = 0;
+            return false;
+        }
+
+        // activation buffers for the widest layer and the largest batch
+        maxWidth = inputCount;
+        for(uint32_t l=0; l<layerCount; ++l)
+            if(layers[l].outputs > maxWidth)
+                maxWidth = layers[l].outputs;
+        bufA.assign((size_t)maxWidth * HDEMG_DECODER_MAX_BATCH, 0.0f);
+        bufB.assign((size_t)maxWidth * HDEMG_DECODER_MAX_BATCH, 0.0f);
+        memset(&stats, 0, sizeof(stats));
+
+        // input transform with every channel usable
+        center = mean.empty() ? std::vector<float>(inputCount, 0.0f) : mean;
+        gain   = scale.empty() ? std::vector<float>(inputCount, 1.0f) : scale;
+        masked = false;
+        return true;
+    }
+
+    /**
+        Excludes channels from the inputs without reallocating.
+
+        \arg pGood    - one entry per feature channel, nonzero for usable channels, or NULL
+                        to use every channel again
+        \arg channels - channels per feature frame; InputCount() must be a multiple of it
+
+        \return false if the channel count does not divide the inputs
+      */
+    bool SetChannelMask(const uint8_t * pGood, uint32_t channels)
+    {
+        if(layerCount == 0 || channels == 0 || inputCount % channels)
+        {
+            printf("ERROR: channel mask of [%u] channels does not fit [%u] decoder inputs\n", channels, inputCount);
+            return false;
+        }
+        masked = false;
+        for(uint32_t i=0; i<inputCount; ++i)
+        {
+            bool good = !pGood || pGood[i % channels];
+            gain[i] = good ? (scale.empty() ? 1.0f : scale[i]) : 0.0f;
+            masked  = masked || !good;
+        }
+        return true;
+    }
+
+    //! \brief sets the latency budget used for HdemgLatencyStats::overBudget
+    void SetLatencyBudgetMs(double ms) { budgetNs = (uint64_t)(ms * 1e6); }
+
+    uint32_t InputCount() const  { return inputCount; }
+    uint32_t OutputCount() const { return layerCount ? layers[layerCount-1].outputs : 0; }
+    const HdemgLatencyStats & Latency() const { return stats; }
+
+    /**
+        Decodes one feature frame.
+
+        \return output, or an output with valueCount 0 if the frame does not match the model
+      */
+    HdemgDecoderOutput Decode(const HdemgFeatureFrame & features)
+    {
+        HdemgDecoderOutput out;
+        uint64_t arrival = features.arrivalNs;
+        DecodeBatch(&features.values[0], (uint32_t)features.values.size(), 1, &features.time, &arrival, &out);
+        return out;
+    }
+
+    /**
+        Decodes a batch of feature vectors stored back to back.
+
+        \arg pInputs    - batch * InputCount() values
+        \arg valueCount - number of values per vector (must equal InputCount())
+        \arg batch      - number of vectors (1 - HDEMG_DECODER_MAX_BATCH)
+        \arg pTimes     - NIP time of every vector
+        \arg pArrivals  - block arrival time of every vector (HdemgNowNs() clock)
+        \arg pOutputs   - receives batch outputs; pValues point into the decoder and stay valid
+                          until the next call
+
+        \return false if the batch does not match the model
+      */
+    bool DecodeBatch(const float * pInputs, uint32_t valueCount, uint32_t batch,
+                     const uint32_t * pTimes, const uint64_t * pArrivals, HdemgDecoderOutput * pOutputs)
+    {
+        if(layerCount == 0 || valueCount != inputCount || batch == 0 || batch > HDEMG_DECODER_MAX_BATCH)
+        {
+            printf("ERROR: decoder input mismatch values[%u] batch[%u]\n", valueCount, batch);
+            for(uint32_t b=0; b<batch && b<HDEMG_DECODER_MAX_BATCH; ++b)
+            {
+                pOutputs[b].valueCount = 0;
+                pOutputs[b].pValues    = NULL;
+                pOutputs[b].classIndex = -1;
+            }
+            return false;
+        }
+
+        // normalized inputs, one vector per row of bufA
+        float * pIn = &bufA[0];
+        for(uint32_t b=0; b<batch; ++b)
+        {
+            const float * pSrc = pInputs + (size_t)b * inputCount;
+            float *       pDst = pIn + (size_t)b * maxWidth;
+            if(mean.empty() && !masked)
+                memcpy(pDst, pSrc, inputCount * sizeof(float));
+            else
+                for(uint32_t i=0; i<inputCount; ++i)
+                    pDst[i] = (pSrc[i] - center[i]) * gain[i];
+        }
+
+        float * pOut = &bufB[0];
+        for(uint32_t l=0; l<layerCount; ++l)
+        {
+            const Layer & layer = layers[l];
+            for(uint32_t o=0; o<layer.outputs; ++o)
+            {
+                const float * pW = &layer.weights[(size_t)o * layer.inputs];
+                for(uint32_t b=0; b<batch; ++b)
+                    pOut[(size_t)b * maxWidth + o] = HdemgDot(pW, pIn + (size_t)b * maxWidth, layer.inputs) + layer.bias[o];
+            }
+            for(uint32_t b=0; b<batch; ++b)
+                Activate(layer.activation, pOut + (size_t)b * maxWidth, layer.outputs);
+
+            float * pTmp = pIn;
+            pIn  = pOut;
+            pOut = pTmp;
+        }
+
+        uint64_t now = HdemgNowNs();
+        uint32_t nOut = OutputCount();
+        for(uint32_t b=0; b<batch; ++b)
+        {
+            HdemgDecoderOutput & out = pOutputs[b];
+            out.time       = pTimes[b];
+            out.valueCount = nOut;
+            out.pValues    = pIn + (size_t)b * maxWidth;
+            out.classIndex = -1;
+            if(type == HDEMG_DECODER_LDA)
+            {
+                out.classIndex = 0;
+                for(uint32_t o=1; o<nOut; ++o)
+                    if(out.pValues[o] > out.pValues[out.classIndex])
+                        out.classIndex = (int32_t)o;
+            }
+
+            // arrival 0 means the source did not stamp its blocks
+            out.latencyNs = (pArrivals[b] && now > pArrivals[b]) ? now - pArrivals[b] : 0;
+            if(pArrivals[b] == 0)
+                continue;
+            stats.count++;
+            stats.sumNs += (double)out.latencyNs;
+            if(out.latencyNs > stats.maxNs)
+                stats.maxNs = out.latencyNs;
+            if(out.latencyNs > budgetNs)
+                stats.overBudget++;
+        }
+        return true;
+    }
+
+private:
+    struct Layer
+    {
+        uint32_t           inputs;
+        uint32_t           outputs;
+        uint32_t           activation;
+        std::vector<float> weights;   // [output][input]
+        std::vector<float> bias;
+    };
+
+    static void Activate(uint32_t activation, float * p, uint32_t n)
+    {
+        switch(activation)
+        {
+            case HDEMG_ACTIVATION_RELU:
+                for(uint32_t i=0; i<n; ++i)
+                    p[i] = (p[i] > 0.0f) ? p[i] : 0.0f;
+                break;
+            case HDEMG_ACTIVATION_TANH:
+                for(uint32_t i=0; i<n; ++i)
+                    p[i] = tanhf(p[i]);
+                break;
+            case HDEMG_ACTIVATION_SIGMOID:
+                for(uint32_t i=0; i<n; ++i)
+                    p[i] = 1.0f / (1.0f + expf(-p[i]));
+                break;
+            default:
+                break;
+        }
+    }
+
+    //! \brief reads the next whitespace separated token, skipping '#' comments
+    static bool NextToken(FILE * pFile, char * pToken, size_t maxLen)
+    {
+        int ch;
+        for(;;)
+        {
+            ch = fgetc(pFile);
+            if(ch == EOF)
+                return false;
+            if(ch == '#')
+            {
+                while(ch != EOF && ch != '\n')
+                    ch = fgetc(pFile);
+                continue;
+            }
+            if(!isspace(ch))
+                break;
+        }
+
+        size_t len = 0;
+        while(ch != EOF && !isspace(ch) && ch != '#')
+        {
+            if(len + 1 < maxLen)
+                pToken[len++] = (char)ch;
+            ch = fgetc(pFile);
+        }
+        if(ch == '#')
+            ungetc(ch, pFile);
+        pToken[len] = '\0';
+        return true;
+    }
+
+    static bool ReadFloats(FILE * pFile, float * pDst, uint32_t n)
+    {
+        char token[64];
+        for(uint32_t i=0; i<n; ++i)
+        {
+            char * pEnd = NULL;
+            if(!NextToken(pFile, token, sizeof(token)))
+                return false;
+            pDst[i] = strtof(token, &pEnd);
+            if(pEnd == token)
+                return false;
+        }
+        return true;
+    }
+
+    bool ReadModel(FILE * pFile)
+    {
+        char token[64];
+        type       = 0;
+        inputCount = 0;
+        layerCount = 0;
+        mean.clear();
+        scale.clear();
+
+        while(NextToken(pFile, token, sizeof(token)))
+        {
+            if(!strcmp(token, "model"))
+            {
+                if(!NextToken(pFile, token, sizeof(token)))
+                    return false;
+                if(!strcmp(token, "lda"))        type = HDEMG_DECODER_LDA;
+                else if(!strcmp(token, "ridge")) type = HDEMG_DECODER_RIDGE;
+                else if(!strcmp(token, "mlp"))   type = HDEMG_DECODER_MLP;
+                else return false;
+            }
+            else if(!strcmp(token, "inputs"))
+            {
+                if(!NextToken(pFile, token, sizeof(token)))
+                    return false;
+                inputCount = (uint32_t)atoi(token);
+            }
+            else if(!strcmp(token, "normalize"))
+            {
+                if(inputCount == 0)
+                    return false;
+                mean.assign(inputCount, 0.0f);
+                scale.assign(inputCount, 1.0f);
+                if(!ReadFloats(pFile, &mean[0], inputCount) || !ReadFloats(pFile, &scale[0], inputCount))
+                    return false;
+            }
+            else if(!strcmp(token, "layer"))
+            {
+                if(inputCount == 0 || layerCount == HDEMG_DECODER_MAX_LAYERS || !NextToken(pFile, token, sizeof(token)))
+                    return false;
+
+                Layer & layer = layers[layerCount];
+                layer.inputs  = layerCount ? layers[layerCount-1].outputs : inputCount;
+                layer.outputs = (uint32_t)atoi(token);
+                if(layer.outputs == 0 || !NextToken(pFile, token, sizeof(token)))
+                    return false;
+
+                if(!strcmp(token, "linear"))       layer.activation = HDEMG_ACTIVATION_LINEAR;
+                else if(!strcmp(token, "relu"))    layer.activation = HDEMG_ACTIVATION_RELU;
+                else if(!strcmp(token, "tanh"))    layer.activation = HDEMG_ACTIVATION_TANH;
+                else if(!strcmp(token, "sigmoid")) layer.activation = HDEMG_ACTIVATION_SIGMOID;
+                else return false;
+
+                layer.weights.assign((size_t)layer.outputs * layer.inputs, 0.0f);
+                layer.bias.assign(layer.outputs, 0.0f);
+                for(uint32_t o=0; o<layer.outputs; ++o)
+                {
+                    if(!ReadFloats(pFile, &layer.weights[(size_t)o * layer.inputs], layer.inputs)
+                       || !ReadFloats(pFile, &layer.bias[o], 1))
+                        return false;
+                }
+                layerCount++;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        // linear models are a single linear layer
+        if(type == 0 || layerCount == 0)
+            return false;
+        if(type != HDEMG_DECODER_MLP && (layerCount != 1 || layers[0].activation != HDEMG_ACTIVATION_LINEAR))
+            return false;
+        return true;
+    }
+
+    uint32_t           type;
+    uint32_t           inputCount;
+    uint32_t           layerCount;
+    Layer              layers[HDEMG_DECODER_MAX_LAYERS];
+    std::vector<float> mean;
+    std::vector<float> scale;
+    std::vector<float> center;   // mean, or zeros without normalization
+    std::vector<float> gain;     // scale, zero for masked inputs
+    bool               masked;
+    uint32_t           maxWidth;
+    std::vector<float> bufA;     // [batch][maxWidth] ping-pong activations
+    std::vector<float> bufB;
+    uint64_t           budgetNs;
+    HdemgLatencyStats  stats;
+};
+
+#endif // HDEMG_DECODER_H
@@ -0,0 +1,661 @@
+//
+//  hdemg_decomposition.h
+//
+//  Online motor unit decomposition of a (filtered, usually decimated) HD-EMG block stream.
+//
+//  Every frame is turned into an extended observation vector holding the last `extension`
+//  frames of all channels. During a calibration period the engine collects frames, whitens
+//  the extended observations and runs FastICA with deflation to find separation vectors.
+//  Each source is then refined the way convolution kernel compensation does it: the
+//  separation vector becomes the mean whitened observation at the detected discharges.
+//  Sources with a clean discharge pattern (silhouette, discharge count) are kept as motor
+//  units.
+//
+//  After calibration the whitening and separation steps are folded into one filter per
+//  unit, so the online cost is one dot product of length channels * extension per unit and
+//  frame. Discharges are reported through a callback on the NIP timeline.
+//
+//  The covariance of the observations is accumulated while the calibration frames arrive
+//  (HdemgCovarianceEngine). Whitening and FastICA run inside Process() once the period is
+//  complete and can take a few seconds for large grids; blocks are not processed during
+//  that call.
+//
+
+#ifndef HDEMG_DECOMPOSITION_H
+#define HDEMG_DECOMPOSITION_H
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "hdemg_covariance.h"
+#include "hdemg_frames.h"
+#include "hdemg_simd.h"
+
+/*! \brief Decomposition parameters. The defaults suit a 2 ksps stream from a 64 electrode
+ *  grid.
+ */
+struct HdemgDecompositionSettings
+{
+    uint32_t extension;          //!< frames per extended observation (delayed copies of every channel)
+    double   calibrationSeconds; //!< length of the calibration period
+    uint32_t maxUnits;           //!< upper bound on accepted motor units
+    uint32_t maxComponents;      //!< upper bound on whitened dimensions (0 = no bound)
+    uint32_t icaIterations;      //!< FastICA fixed point iterations per source
+    uint32_t refineIterations;   //!< discharge based refinement passes per source
+    double   refractoryMs;       //!< minimum interval between two discharges of one unit
+    double   minSil;             //!< silhouette a source needs to be accepted as a unit
+    uint32_t minDischarges;      //!< discharges a source needs during calibration
+
+    HdemgDecompositionSettings()
+        : extension(16), calibrationSeconds(20.0), maxUnits(20), maxComponents(512), icaIterations(100),
+          refineIterations(10), refractoryMs(10.0), minSil(0.9), minDischarges(10) {}
+};
+
+//! \brief One motor unit discharge
+struct HdemgDischargeEvent
+{
+    uint32_t time;       //!< NIP time of the newest frame of the observation at the source peak
+    uint32_t unit;
+    float    amplitude;  //!< source peak relative to the unit's calibration discharges (about 1)
+};
+
+//! \brief Called for every detected discharge, in time order
+typedef void (*HdemgDischargeCallback)(const HdemgDischargeEvent & event, void * pUser);
+
+/*! \brief Calibrate-then-run motor unit decomposition.
+ */
+class HdemgDecomposer
+{
+public:
+    HdemgDecomposer()
+        : channelCount(0), extension(0), observationSize(0), maxBlockFrames(0), refractoryFrames(0),
+          holdFrames(0), calibrationFrames(0), calibrationCount(0), sinceGap(0), calibrated(false),
+          componentCount(0), unitCount(0), unitStride(0), frameIndex(0), warmup(0), expectedTime(0),
+          streamStarted(false), pCallback(NULL), pUser(NULL) {}
+
+    /**
+        Sizes the engine and starts collecting calibration data.
+
+        \arg channels      - channels per frame
+        \arg sampleRate    - frame rate of the input blocks in Hz
+        \arg maxFrames     - largest block that will be passed to Process()
+        \arg config        - decomposition parameters
+        \arg callback      - receives discharge events
+        \arg pUserData     - passed through to the callback
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, double sampleRate, uint32_t maxFrames, const HdemgDecompositionSettings & config,
+                   HdemgDischargeCallback callback, void * pUserData)
+    {
+        if(channels == 0 || sampleRate <= 0.0 || maxFrames == 0 || config.extension == 0 || config.maxUnits == 0
+           || config.calibrationSeconds <= 0.0 || !callback)
+        {
+            printf("ERROR: invalid decomposition configuration\n");
+            return false;
+        }
+
+        settings          = config;
+        channelCount      = channels;
+        extension         = config.extension;
+        observationSize   = channels * extension;
+        maxBlockFrames    = maxFrames;
+        refractoryFrames  = (uint32_t)(config.refractoryMs * 1e-3 * sampleRate + 0.5);
+        if(refractoryFrames < 2)
+            refractoryFrames = 2;
+        holdFrames        = refractoryFrames / 2;
+        calibrationFrames = (uint32_t)(config.calibrationSeconds * sampleRate + 0.5);
+        if(calibrationFrames < 4 * extension)
+        {
+            printf("ERROR: calibration period is too short for extension [%u]\n", extension);
+            return false;
+        }
+
+        // filters are stored in groups of four for HdemgDot4, unused rows stay zero
+        unitStride = (config.maxUnits + 3) & ~3u;
+        filters.assign((size_t)unitStride * observationSize, 0.0f);
+        thresholds.assign(unitStride, 0.0f);
+        work.assign((size_t)(extension - 1 + maxFrames) * channels, 0.0f);
+        sources.assign((size_t)maxFrames * unitStride, 0.0f);
+        detectors.resize(unitStride);
+        mean.assign(channels, 0.0f);
+        if(!covariance.Configure(channels, extension, maxFrames, 0.0, config.maxComponents))
+            return false;
+
+        pCallback = callback;
+        pUser     = pUserData;
+        Recalibrate();
+        return true;
+    }
+
+    //! \brief Drops all units and starts collecting a new calibration period
+    void Recalibrate()
+    {
+        calibration.assign((size_t)calibrationFrames * channelCount, 0.0f);
+        calibrationValid.assign(calibrationFrames, 0);
+        calibrationCount = 0;
+        sinceGap         = 0;
+        calibrated       = false;
+        componentCount   = 0;
+        unitCount        = 0;
+        std::fill(filters.begin(), filters.end(), 0.0f);
+        std::fill(thresholds.begin(), thresholds.end(), 0.0f);
+        covariance.Reset();
+        streamStarted = false;
+    }
+
+    /**
+        Adds a block of frames. Collects calibration data until the calibration period is
+        complete, decomposes online afterwards.
+      */
+    bool Process(const HdemgBlock & in)
+    {
+        if(in.channelCount != channelCount || in.frameCount > maxBlockFrames)
+        {
+            printf("ERROR: decomposition block [%u x %u] does not match configuration\n", in.frameCount, in.channelCount);
+            return false;
+        }
+
+        bool gap = streamStarted && !HdemgIsContiguous(in, expectedTime);
+        streamStarted = true;
+        expectedTime  = in.EndTime();
+
+        if(!calibrated)
+        {
+            Collect(in, gap);
+            return true;
+        }
+
+        if(gap)
+            ResetStream();
+        Decompose(in);
+        return true;
+    }
+
+    bool     Calibrated() const      { return calibrated; }
+    //! \brief fraction of the calibration period collected so far
+    double   CalibrationProgress() const { return calibrated ? 1.0 : (double)calibrationCount / calibrationFrames; }
+    uint32_t UnitCount() const       { return unitCount; }
+    uint32_t ComponentCount() const  { return componentCount; }
+    uint32_t ObservationSize() const { return observationSize; }
+    //! \brief combined whitening and separation filter of a unit, ObservationSize() values
+    const float * Filter(uint32_t unit) const { return &filters[(size_t)unit * observationSize]; }
+
+private:
+    struct Detector
+    {
+        bool     active;       // candidate peak pending
+        uint64_t frame;        // frame index of the candidate
+        uint32_t time;
+        float    value;
+        uint64_t lastFrame;    // frame index of the last discharge
+        bool     fired;
+    };
+
+    void Collect(const HdemgBlock & in, bool gap)
+    {
+        if(gap)
+        {
+            sinceGap = 0;
+            covariance.Restart();
+        }
+
+        // an observation is valid once extension contiguous frames have been seen
+        uint32_t n = std::min(in.frameCount, calibrationFrames - calibrationCount);
+        for(uint32_t f=0; f<n; ++f)
+        {
+            memcpy(&calibration[(size_t)calibrationCount * channelCount], in.Frame(f), channelCount * sizeof(float));
+            sinceGap++;
+            calibrationValid[calibrationCount] = (sinceGap >= extension);
+            calibrationCount++;
+        }
+        if(n)
+            covariance.Accumulate(in.Frame(0), n);
+
+        if(calibrationCount == calibrationFrames)
+        {
+            if(Calibrate())
+            {
+                calibrated = true;
+                calibration.clear();
+                calibration.shrink_to_fit();
+                ResetStream();
+                printf("decomposition calibrated: %u components, %u units\n", componentCount, unitCount);
+            }
+            else
+            {
+                printf("ERROR: decomposition calibration failed, collecting a new calibration period\n");
+                calibrationCount = 0;
+                sinceGap         = 0;
+                covariance.Reset();
+            }
+        }
+    }
+
+    //! \brief clears the observation history and discharge detectors, e.g. after a gap
+    void ResetStream()
+    {
+        std::fill(work.begin(), work.end(), 0.0f);
+        warmup = extension - 1;
+        for(uint32_t u=0; u<unitStride; ++u)
+        {
+            detectors[u].active = false;
+            detectors[u].fired  = false;
+        }
+    }
+
+    void Decompose(const HdemgBlock & in)
+    {
+        const uint32_t nCh     = channelCount;
+        const uint32_t history = extension - 1;
+        const uint32_t frames  = in.frameCount;
+
+        // [history | block], centered with the calibration mean
+        for(uint32_t f=0; f<frames; ++f)
+        {
+            const float * x   = in.Frame(f);
+            float *       dst = &work[(size_t)(history + f) * nCh];
+            for(uint32_t c=0; c<nCh; ++c)
+                dst[c] = x[c] - mean[c];
+        }
+
+        // the observation ending at block frame f starts at work frame f; four filters at a
+        // time are applied to every observation of the block while they stay in cache
+        for(uint32_t u=0; u<unitCount; u+=4)
+        {
+            const float * b0 = &filters[(size_t)u * observationSize];
+            for(uint32_t f=0; f<frames; ++f)
+                HdemgDot4(b0, b0 + observationSize, b0 + 2 * observationSize, b0 + 3 * observationSize,
+                          &work[(size_t)f * nCh], observationSize, &sources[(size_t)f * unitStride + u]);
+        }
+
+        for(uint32_t f=0; f<frames; ++f, ++frameIndex)
+        {
+            if(warmup)
+            {
+                warmup--;
+                continue;
+            }
+            const float * s    = &sources[(size_t)f * unitStride];
+            uint32_t      time = in.FrameTime(f);
+            for(uint32_t u=0; u<unitCount; ++u)
+                Detect(u, s[u] * fabsf(s[u]), time);
+        }
+
+        if(history)
+            memmove(&work[0], &work[(size_t)frames * nCh], (size_t)history * nCh * sizeof(float));
+    }
+
+    //! \brief peak picking on y = s|s|: the largest value above threshold within holdFrames wins
+    void Detect(uint32_t unit, float y, uint32_t time)
+    {
+        Detector & d = detectors[unit];
+        if(d.active && frameIndex - d.frame >= holdFrames)
+        {
+            HdemgDischargeEvent event;
+            event.time      = d.time;
+            event.unit      = unit;
+            event.amplitude = d.value;
+            pCallback(event, pUser);
+            d.active    = false;
+            d.fired     = true;
+            d.lastFrame = d.frame;
+        }
+
+        if(y > thresholds[unit] && (!d.fired || frameIndex - d.lastFrame >= refractoryFrames))
+        {
+            if(!d.active || y > d.value)
+            {
+                d.active = true;
+                d.frame  = frameIndex;
+                d.time   = time;
+                d.value  = y;
+            }
+        }
+    }
+
+    /**
+        Whitening, FastICA and refinement on the collected calibration frames.
+      */
+    bool Calibrate()
+    {
+        const uint32_t nCh = channelCount;
+        const uint32_t D   = observationSize;
+
+        std::vector<uint32_t> obs;
+        for(uint32_t t=0; t<calibrationCount; ++t)
+            if(calibrationValid[t])
+                obs.push_back(t);
+        if(obs.size() < 4 * (size_t)extension)
+            return false;
+
+        // whitening from the covariance accumulated while the frames were collected
+        HdemgWhitening white;
+        if(!covariance.ComputeWhitening(white))
+            return false;
+        componentCount = white.componentCount;
+        const uint32_t K  = white.componentCount;
+        const uint32_t Kp = white.rowCount;
+
+        // center with the mean of the newest frame of the observations
+        for(uint32_t c=0; c<nCh; ++c)
+            mean[c] = white.mean[(size_t)(extension - 1) * nCh + c];
+        for(uint32_t t=0; t<calibrationCount; ++t)
+            for(uint32_t c=0; c<nCh; ++c)
+                calibration[(size_t)t * nCh + c] -= mean[c];
+
+        // whitened observations, [obs][Kp]
+        const size_t N = obs.size();
+        std::vector<float> z(N * Kp, 0.0f);
+        for(uint32_t k=0; k<Kp; k+=4)
+        {
+            const float * w0 = white.Row(k);
+            for(size_t o=0; o<N; ++o)
+            {
+                float out[4];
+                HdemgDot4(w0, w0 + D, w0 + 2 * D, w0 + 3 * D, Observation(obs[o]), D, out);
+                memcpy(&z[o * Kp + k], out, sizeof(out));
+            }
+        }
+
+        // initialize from the most active observations
+        std::vector<std::pair<float, uint32_t> > activity(N);
+        for(size_t o=0; o<N; ++o)
+            activity[o] = std::make_pair(HdemgDot(&z[o * Kp], &z[o * Kp], Kp), (uint32_t)o);
+        std::sort(activity.begin(), activity.end(), std::greater<std::pair<float, uint32_t> >());
+
+        std::vector<float>                  basis;        // extracted separation vectors, [n][Kp]
+        std::vector<std::vector<uint32_t> > unitSpikes;
+        std::vector<float>                  w(Kp), wNew(Kp), s(N), y(N);
+        std::vector<uint32_t>               spikes;
+        std::vector<uint8_t>                explained(N, 0); // near a discharge of an extracted source
+        uint32_t attempts = std::min(K, 3 * settings.maxUnits);
+        size_t   next     = 0;
+        unitCount = 0;
+
+        for(uint32_t a=0; a<attempts && unitCount<settings.maxUnits; ++a)
+        {
+            // every delayed copy of a unit is a separate source, so start from observations
+            // the sources found so far do not explain
+            while(next < N && explained[activity[next].second])
+                next++;
+            if(next == N)
+                break;
+            memcpy(&w[0], &z[(size_t)activity[next++].second * Kp], Kp * sizeof(float));
+            Orthogonalize(&w[0], basis, Kp);
+            if(!Normalize(&w[0], Kp))
+                continue;
+
+            // FastICA fixed point with g(s) = s^2
+            for(uint32_t it=0; it<settings.icaIterations; ++it)
+            {
+                Project(z, N, Kp, &w[0], &s[0]);
+                double gPrime = 0.0;
+                for(size_t o=0; o<N; ++o)
+                {
+                    gPrime += 2.0 * s[o];
+                    y[o]    = s[o] * s[o];
+                }
+                WeightedMean(z, N, Kp, &y[0], NULL, 0, &wNew[0]);
+                float mg = (float)(gPrime / N);
+                for(uint32_t k=0; k<Kp; ++k)
+                    wNew[k] -= mg * w[k];
+                Orthogonalize(&wNew[0], basis, Kp);
+                if(!Normalize(&wNew[0], Kp))
+                    break;
+                float change = fabsf(HdemgDot(&w[0], &wNew[0], Kp));
+                w.swap(wNew);
+                if(change > 1.0f - 1e-4f)
+                    break;
+            }
+            basis.insert(basis.end(), w.begin(), w.end());
+
+            // refinement: separation vector = mean whitened observation at the discharges
+            double centroid = 0.0, threshold = 0.0, sil = 0.0;
+            for(uint32_t it=0; it<=settings.refineIterations; ++it)
+            {
+                Project(z, N, Kp, &w[0], &s[0]);
+                double skew = 0.0;
+                for(size_t o=0; o<N; ++o)
+                    skew += (double)s[o] * s[o] * s[o];
+                if(skew < 0.0)
+                {
+                    for(uint32_t k=0; k<Kp; ++k)
+                        w[k] = -w[k];
+                    for(size_t o=0; o<N; ++o)
+                        s[o] = -s[o];
+                }
+                for(size_t o=0; o<N; ++o)
+                    y[o] = s[o] * fabsf(s[o]);
+
+                sil = Classify(&y[0], N, spikes, centroid, threshold);
+                if(spikes.empty() || it == settings.refineIterations)
+                    break;
+
+                WeightedMean(z, N, Kp, NULL, &spikes[0], (uint32_t)spikes.size(), &w[0]);
+                if(!Normalize(&w[0], Kp))
+                    break;
+            }
+
+            for(size_t i=0; i<spikes.size(); ++i)
+            {
+                size_t lo = (spikes[i] > holdFrames) ? spikes[i] - holdFrames : 0;
+                size_t hi = std::min(N - 1, (size_t)spikes[i] + holdFrames);
+                for(size_t o=lo; o<=hi; ++o)
+                    explained[o] = 1;
+            }
+
+            if(spikes.size() < settings.minDischarges || sil < settings.minSil || centroid <= 0.0)
+                continue;
+            bool duplicate = false;
+            for(size_t u=0; u<unitSpikes.size() && !duplicate; ++u)
+                duplicate = IsDuplicate(spikes, unitSpikes[u], N);
+            if(duplicate)
+                continue;
+
+            // fold whitening and separation into one filter scaled so discharges peak at 1
+            float * b     = &filters[(size_t)unitCount * D];
+            float   scale = (float)(1.0 / sqrt(centroid));
+            memset(b, 0, D * sizeof(float));
+            for(uint32_t k=0; k<K; ++k)
+                HdemgAxpy(b, white.Row(k), w[k] * scale, D);
+            thresholds[unitCount] = (float)(threshold / centroid);
+            unitSpikes.push_back(spikes);
+            unitCount++;
+        }
+        return true;
+    }
+
+    //! \brief extended observation ending at calibration frame t, extension*channelCount values
+    inline const float * Observation(uint32_t t) const
+    {
+        return &calibration[(size_t)(t + 1 - extension) * channelCount];
+    }
+
+    static void Project(const std::vector<float> & z, size_t n, uint32_t kp, const float * w, float * s)
+    {
+        for(size_t o=0; o<n; ++o)
+            s[o] = HdemgDot(&z[o * kp], w, kp);
+    }
+
+    /**
+        Mean of the whitened observations, either weighted by pWeight over all observations or
+        taken over the observations listed in pIndex. Accumulated in float over short runs and
+        folded into double.
+      */
+    static void WeightedMean(const std::vector<float> & z, size_t n, uint32_t kp, const float * pWeight,
+                             const uint32_t * pIndex, uint32_t nIndex, float * pOut)
+    {
+        std::vector<double> acc(kp, 0.0);
+        std::vector<float>  part(kp, 0.0f);
+        size_t count = pIndex ? nIndex : n;
+        for(size_t i=0; i<count; ++i)
+        {
+            if(pIndex)
+                HdemgAxpy(&part[0], &z[(size_t)pIndex[i] * kp], 1.0f, kp);
+            else
+                HdemgAxpy(&part[0], &z[i * kp], pWeight[i], kp);
+            if((i + 1) % 1024 == 0 || i + 1 == count)
+            {
+                for(uint32_t k=0; k<kp; ++k)
+                {
+                    acc[k] += part[k];
+                    part[k] = 0.0f;
+                }
+            }
+        }
+        for(uint32_t k=0; k<kp; ++k)
+            pOut[k] = count ? (float)(acc[k] / count) : 0.0f;
+    }
+
+    //! \brief Gram-Schmidt against the extracted separation vectors
+    static void Orthogonalize(float * w, const std::vector<float> & basis, uint32_t kp)
+    {
+        for(size_t b=0; b<basis.size(); b+=kp)
+            HdemgAxpy(w, &basis[b], -HdemgDot(&basis[b], w, kp), kp);
+    }
+
+    static bool Normalize(float * w, uint32_t kp)
+    {
+        float norm = sqrtf(HdemgDot(w, w, kp));
+        if(!(norm > 1e-12f))
+            return false;
+        for(uint32_t k=0; k<kp; ++k)
+            w[k] /= norm;
+        return true;
+    }
+
+    /**
+        Picks the local maxima of y (one per holdFrames neighbourhood), splits their heights
+        into two classes with k-means and keeps the upper class as discharges.
+
+        \return silhouette of the discharge class
+      */
+    double Classify(const float * y, size_t n, std::vector<uint32_t> & spikes, double & centroid, double & threshold) const
+    {
+        std::vector<uint32_t> peaks;
+        for(size_t t=0; t<n; ++t)
+        {
+            if(y[t] <= 0.0f)
+                continue;
+            size_t lo = (t > holdFrames) ? t - holdFrames : 0;
+            size_t hi = std::min(n - 1, t + holdFrames);
+            bool   isMax = true;
+            for(size_t i=lo; i<=hi && isMax; ++i)
+                isMax = (y[i] < y[t]) || (y[i] == y[t] && i >= t);
+            if(isMax)
+                peaks.push_back((uint32_t)t);
+        }
+
+        spikes.clear();
+        centroid  = 0.0;
+        threshold = 0.0;
+        if(peaks.size() < 2)
+            return 0.0;
+
+        double lo = y[peaks[0]], hi = y[peaks[0]];
+        for(size_t p=1; p<peaks.size(); ++p)
+        {
+            lo = std::min(lo, (double)y[peaks[p]]);
+            hi = std::max(hi, (double)y[peaks[p]]);
+        }
+        for(int it=0; it<20; ++it)
+        {
+            double mid = 0.5 * (lo + hi), sumLo = 0.0, sumHi = 0.0;
+            size_t nLo = 0, nHi = 0;
+            for(size_t p=0; p<peaks.size(); ++p)
+            {
+                double v = y[peaks[p]];
+                if(v > mid) { sumHi += v; nHi++; }
+                else        { sumLo += v; nLo++; }
+            }
+            if(nHi == 0 || nLo == 0)
+                break;
+            double newLo = sumLo / nLo, newHi = sumHi / nHi;
+            if(newLo == lo && newHi == hi)
+                break;
+            lo = newLo;
+            hi = newHi;
+        }
+
+        threshold = 0.5 * (lo + hi);
+        centroid  = hi;
+        double within = 0.0, between = 0.0;
+        for(size_t p=0; p<peaks.size(); ++p)
+        {
+            double v = y[peaks[p]];
+            if(v > threshold)
+            {
+                spikes.push_back(peaks[p]);
+                within  += fabs(v - hi);
+                between += fabs(v - lo);
+            }
+        }
+        double denom = std::max(within, between);
+        return denom > 0.0 ? (between - within) / denom : 0.0;
+    }
+
+    /**
+        True if two discharge trains agree at a constant lag. The same unit can be found at
+        any delay within the observation plus the discharge neighbourhood.
+      */
+    bool IsDuplicate(const std::vector<uint32_t> & a, const std::vector<uint32_t> & b, size_t n) const
+    {
+        if(a.empty() || b.empty())
+            return false;
+        std::vector<uint8_t> mark(n, 0);
+        for(size_t i=0; i<b.size(); ++i)
+            mark[b[i]] = 1;
+        size_t limit = std::min(a.size(), b.size());
+        int32_t maxLag = (int32_t)(extension + refractoryFrames);
+        for(int32_t lag=-maxLag; lag<=maxLag; ++lag)
+        {
+            size_t common = 0;
+            for(size_t i=0; i<a.size(); ++i)
+            {
+                int64_t t = (int64_t)a[i] + lag;
+                if(t >= 0 && t < (int64_t)n && mark[(size_t)t])
+                    common++;
+            }
+            if(common * 10 > limit * 3)
+                return true;
+        }
+        return false;
+    }
+
+    HdemgDecompositionSettings settings;
+    uint32_t                   channelCount;
+    uint32_t                   extension;
+    uint32_t                   observationSize;   // channelCount * extension
+    uint32_t                   maxBlockFrames;
+    uint32_t                   refractoryFrames;
+    uint32_t                   holdFrames;
+    uint32_t                   calibrationFrames;
+    uint32_t                   calibrationCount;
+    uint32_t                   sinceGap;
+    bool                       calibrated;
+    std::vector<float>         calibration;       // collected frames, sample-major
+    std::vector<uint8_t>       calibrationValid;  // frame ends a contiguous observation
+    HdemgCovarianceEngine      covariance;        // of the calibration observations
+    std::vector<float>         mean;              // channel mean of the calibration data
+    uint32_t                   componentCount;
+    uint32_t                   unitCount;
+    uint32_t                   unitStride;        // maxUnits rounded up to a multiple of four
+    std::vector<float>         filters;           // [unit][observationSize]
+    std::vector<float>         thresholds;        // discharge threshold on s|s| per unit
+    std::vector<float>         work;              // [extension-1 history | block], centered
+    std::vector<float>         sources;           // [frame][unitStride]
+    std::vector<Detector>      detectors;
+    uint64_t                   frameIndex;
+    uint32_t                   warmup;            // frames until the history is valid again
+    uint32_t                   expectedTime;
+    bool                       streamStarted;
+    HdemgDischargeCallback     pCallback;
+    void *                     pUser;
+};
+
+#endif // HDEMG_DECOMPOSITION_H
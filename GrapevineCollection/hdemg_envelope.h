@@ -0,0 +1,290 @@
+//
+//  hdemg_envelope.h
+//
+//  Sliding window RMS, mean absolute value (MAV) and low-pass envelope for every channel
+//  of a block stream. Running sums of x^2 and |x| are kept per window length and updated
+//  with one add and one subtract per sample, so the cost does not depend on the window
+//  length. Several window lengths share one history ring. The sums are recomputed from
+//  the ring once per ring cycle to stop rounding drift from accumulating.
+//
+//  The envelope is the rectified signal passed through a 2nd order Butterworth low pass.
+//
+//  Results are published as HdemgEnvelopeFrames at a fixed rate through a callback, the
+//  same way HdemgFrameAssembler delivers blocks.
+//
+
+#ifndef HDEMG_ENVELOPE_H
+#define HDEMG_ENVELOPE_H
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "hdemg_frames.h"
+#include "hdemg_simd.h"
+
+static const uint32_t HDEMG_ENVELOPE_MAX_WINDOWS = 8;
+
+/*! \brief Snapshot of all envelope values at one point in time.
+ *
+ *  rms and mav are [window][channel] arrays, envelope is [channel].
+ */
+struct HdemgEnvelopeFrame
+{
+    uint32_t time;          //!< NIP time of the most recent sample included
+    uint64_t arrivalNs;     //!< arrival of the block holding that sample (see HdemgBlock)
+    uint32_t channelCount;
+    uint32_t windowCount;
+    uint32_t windowFrames[HDEMG_ENVELOPE_MAX_WINDOWS];
+    std::vector<float> rms;
+    std::vector<float> mav;
+    std::vector<float> envelope;
+
+    inline const float * Rms(uint32_t window) const { return &rms[(size_t)window * channelCount]; }
+    inline const float * Mav(uint32_t window) const { return &mav[(size_t)window * channelCount]; }
+};
+
+//! \brief Called every time a new envelope frame is published
+typedef void (*HdemgEnvelopeCallback)(const HdemgEnvelopeFrame & frame, void * pUser);
+
+/*! \brief Incremental RMS / MAV / envelope engine.
+ */
+class HdemgEnvelopeEngine
+{
+public:
+    HdemgEnvelopeEngine()
+        : channelCount(0), windowCount(0), ringFrames(0), ringPos(0), filled(0),
+          publishInterval(0), sincePublishFrames(0), expectedTime(0), streamStarted(false),
+          pCallback(NULL), pUser(NULL)
+    {
+        memset(windowFrames, 0, sizeof(windowFrames));
+        memset(b, 0, sizeof(b));
+        memset(a, 0, sizeof(a));
+    }
+
+    /**
+        Sizes the engine.
+
+        \arg channels      - channels per frame
+        \arg sampleRate    - frame rate of the input blocks in Hz
+        \arg pWindowsMs    - window lengths in milliseconds
+        \arg nWindows      - number of window lengths (1 - HDEMG_ENVELOPE_MAX_WINDOWS)
+        \arg envelopeHz    - cutoff of the envelope low pass
+        \arg publishHz     - rate at which envelope frames are published
+        \arg callback      - receives the published frames
+        \arg pUserData     - passed through to the callback
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, double sampleRate, const double * pWindowsMs, uint32_t nWindows,
+                   double envelopeHz, double publishHz, HdemgEnvelopeCallback callback, void * pUserData)
+    {
+        if(channels == 0 || sampleRate <= 0.0 || !pWindowsMs || nWindows == 0 || nWindows > HDEMG_ENVELOPE_MAX_WINDOWS
+           || envelopeHz <= 0.0 || envelopeHz >= 0.5 * sampleRate || publishHz <= 0.0 || !callback)
+        {
+            printf("ERROR: invalid envelope configuration\n");
+            return false;
+        }
+
+        channelCount = channels;
+        windowCount  = nWindows;
+        ringFrames   = 0;
+        for(uint32_t w=0; w<nWindows; ++w)
+        {
+            windowFrames[w] = (uint32_t)(pWindowsMs[w] * 1e-3 * sampleRate + 0.5);
+            if(windowFrames[w] == 0)
+                windowFrames[w] = 1;
+            if(windowFrames[w] > ringFrames)
+                ringFrames = windowFrames[w];
+        }
+
+        publishInterval = (uint32_t)(sampleRate / publishHz + 0.5);
+        if(publishInterval == 0)
+            publishInterval = 1;
+
+        // bilinear transform of a 2nd order Butterworth low pass
+        double k    = tan(HDEMG_PI * envelopeHz / sampleRate);
+        double norm = 1.0 / (1.0 + sqrt(2.0) * k + k * k);
+        b[0] = (float)(k * k * norm);
+        b[1] = 2.0f * b[0];
+        b[2] = b[0];
+        a[1] = (float)(2.0 * (k * k - 1.0) * norm);
+        a[2] = (float)((1.0 - sqrt(2.0) * k + k * k) * norm);
+
+        ring.assign((size_t)ringFrames * channels, 0.0f);
+        sumSq.assign((size_t)nWindows * channels, 0.0);
+        sumAbs.assign((size_t)nWindows * channels, 0.0);
+        z1.assign(channels, 0.0f);
+        z2.assign(channels, 0.0f);
+
+        frame.channelCount = channels;
+        frame.windowCount  = nWindows;
+        memcpy(frame.windowFrames, windowFrames, sizeof(windowFrames));
+        frame.rms.assign((size_t)nWindows * channels, 0.0f);
+        frame.mav.assign((size_t)nWindows * channels, 0.0f);
+        frame.envelope.assign(channels, 0.0f);
+
+        pCallback = callback;
+        pUser     = pUserData;
+        Reset();
+        return true;
+    }
+
+    //! \brief Clears all history, e.g. after a gap in the stream
+    void Reset()
+    {
+        std::fill(ring.begin(), ring.end(), 0.0f);
+        std::fill(sumSq.begin(), sumSq.end(), 0.0);
+        std::fill(sumAbs.begin(), sumAbs.end(), 0.0);
+        std::fill(z1.begin(), z1.end(), 0.0f);
+        std::fill(z2.begin(), z2.end(), 0.0f);
+        ringPos            = 0;
+        filled             = 0;
+        sincePublishFrames = 0;
+        streamStarted      = false;
+    }
+
+    /**
+        Adds a block of frames. Envelope frames are published from within this call whenever
+        the publish interval elapses.
+      */
+    bool Process(const HdemgBlock & in)
+    {
+        if(in.channelCount != channelCount)
+        {
+            printf("ERROR: envelope block has [%u] channels, expected [%u]\n", in.channelCount, channelCount);
+            return false;
+        }
+
+        if(streamStarted && !HdemgIsContiguous(in, expectedTime))
+            Reset();
+        streamStarted = true;
+
+        const uint32_t nCh = channelCount;
+        for(uint32_t f=0; f<in.frameCount; ++f)
+        {
+            const float * HDEMG_RESTRICT x = in.Frame(f);
+
+            // running sums, the sample leaving window w is ringFrames-windowFrames[w] ahead of ringPos
+            for(uint32_t w=0; w<windowCount; ++w)
+            {
+                uint32_t oldPos = ringPos + ringFrames - windowFrames[w];
+                if(oldPos >= ringFrames)
+                    oldPos -= ringFrames;
+                const float * HDEMG_RESTRICT old = &ring[(size_t)oldPos * nCh];
+                double * HDEMG_RESTRICT sq  = &sumSq[(size_t)w * nCh];
+                double * HDEMG_RESTRICT ab  = &sumAbs[(size_t)w * nCh];
+                for(uint32_t c=0; c<nCh; ++c)
+                {
+                    sq[c] += (double)x[c] * x[c] - (double)old[c] * old[c];
+                    ab[c] += (double)fabsf(x[c]) - (double)fabsf(old[c]);
+                }
+            }
+
+            // envelope biquad (transposed direct form II) on the rectified signal
+            float * HDEMG_RESTRICT s1 = &z1[0];
+            float * HDEMG_RESTRICT s2 = &z2[0];
+            float * HDEMG_RESTRICT env = &frame.envelope[0];
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                float r = fabsf(x[c]);
+                float y = b[0] * r + s1[c];
+                s1[c] = b[1] * r - a[1] * y + s2[c];
+                s2[c] = b[2] * r - a[2] * y;
+                env[c] = y;
+            }
+
+            memcpy(&ring[(size_t)ringPos * nCh], x, nCh * sizeof(float));
+            if(++ringPos == ringFrames)
+            {
+                ringPos = 0;
+                Resum();
+            }
+            if(filled < ringFrames)
+                filled++;
+
+            if(++sincePublishFrames == publishInterval)
+            {
+                sincePublishFrames = 0;
+                Publish(in.FrameTime(f), in.arrivalNs);
+            }
+        }
+
+        expectedTime = in.EndTime();
+        return true;
+    }
+
+    uint32_t WindowFrames(uint32_t window) const { return windowFrames[window]; }
+    uint32_t PublishInterval() const             { return publishInterval; }
+
+private:
+    //! \brief recomputes the running sums exactly from the ring (ringPos is 0 here)
+    void Resum()
+    {
+        const uint32_t nCh = channelCount;
+        for(uint32_t w=0; w<windowCount; ++w)
+        {
+            double * sq = &sumSq[(size_t)w * nCh];
+            double * ab = &sumAbs[(size_t)w * nCh];
+            memset(sq, 0, nCh * sizeof(double));
+            memset(ab, 0, nCh * sizeof(double));
+            for(uint32_t i=ringFrames-windowFrames[w]; i<ringFrames; ++i)
+            {
+                const float * x = &ring[(size_t)i * nCh];
+                for(uint32_t c=0; c<nCh; ++c)
+                {
+                    sq[c] += (double)x[c] * x[c];
+                    ab[c] += fabsf(x[c]);
+                }
+            }
+        }
+    }
+
+    void Publish(uint32_t time, uint64_t arrivalNs)
+    {
+        const uint32_t nCh = channelCount;
+        for(uint32_t w=0; w<windowCount; ++w)
+        {
+            // until the window has filled, average over the samples seen so far
+            uint32_t n   = (filled < windowFrames[w]) ? filled : windowFrames[w];
+            double   inv = 1.0 / n;
+            const double * sq  = &sumSq[(size_t)w * nCh];
+            const double * ab  = &sumAbs[(size_t)w * nCh];
+            float *        rms = &frame.rms[(size_t)w * nCh];
+            float *        mav = &frame.mav[(size_t)w * nCh];
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                double ms = sq[c] * inv;
+                rms[c] = (float)sqrt(ms > 0.0 ? ms : 0.0);
+                mav[c] = (float)(ab[c] * inv);
+            }
+        }
+        frame.time      = time;
+        frame.arrivalNs = arrivalNs;
+        pCallback(frame, pUser);
+    }
+
+    uint32_t              channelCount;
+    uint32_t              windowCount;
+    uint32_t              windowFrames[HDEMG_ENVELOPE_MAX_WINDOWS];
+    uint32_t              ringFrames;
+    uint32_t              ringPos;
+    uint32_t              filled;
+    uint32_t              publishInterval;
+    uint32_t              sincePublishFrames;
+    uint32_t              expectedTime;
+    bool                  streamStarted;
+    float                 b[3];
+    float                 a[3];
+    std::vector<float>    ring;     // last ringFrames input frames, sample-major
+    std::vector<double>   sumSq;    // [window][channel]
+    std::vector<double>   sumAbs;   // [window][channel]
+    std::vector<float>    z1;
+    std::vector<float>    z2;
+    HdemgEnvelopeFrame    frame;
+    HdemgEnvelopeCallback pCallback;
+    void *                pUser;
+};
+
+#endif // HDEMG_ENVELOPE_H
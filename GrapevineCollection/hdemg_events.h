@@ -0,0 +1,184 @@
+//
+//  hdemg_events.h
+//
+//  Timestamped event stream shared by the processing stages. Edges of the digital I/O
+//  front end (module 34, XippLegacyDigitalDataPacket) and events detected in the signals,
+//  such as contraction onsets (hdemg_onset.h), are posted as HdemgEvents with their NIP
+//  time so they can be logged, used for trial segmentation or compared against each other
+//  on one clock.
+//
+//  Events are forwarded to a callback as they are posted and the most recent ones are kept
+//  in a fixed size history for polling. Detectors that need a few frames to confirm an
+//  event post it with the time it started, so the stream is ordered by posting and only
+//  nearly ordered by time.
+//
+
+#ifndef HDEMG_EVENTS_H
+#define HDEMG_EVENTS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "xippmin.h"
+
+// module of the digital I/O front end (see the end of the stream notes in xippmin.h)
+static const uint8_t  HDEMG_DIGITAL_MODULE_ID = 34;
+static const uint8_t  HDEMG_DIGITAL_STREAM_ID = 1;
+
+//! \defgroup HdemgDigitalInputs
+//! \{
+//! \brief Event sources of the digital I/O front end
+static const uint16_t HDEMG_DIGITAL_SMA1      = 0;
+static const uint16_t HDEMG_DIGITAL_SMA2      = 1;
+static const uint16_t HDEMG_DIGITAL_SMA3      = 2;
+static const uint16_t HDEMG_DIGITAL_SMA4      = 3;
+static const uint16_t HDEMG_DIGITAL_PARALLEL  = 4;
+static const uint16_t HDEMG_DIGITAL_INPUTS    = 5;
+//! \}
+
+//! \defgroup HdemgEventKinds
+//! \{
+//! \brief Digital events are posted when an input changes; RISE if the new value is nonzero
+static const uint16_t HDEMG_EVENT_DIGITAL_RISE = 1;  //!< source: HDEMG_DIGITAL_*, value: new input value
+static const uint16_t HDEMG_EVENT_DIGITAL_FALL = 2;  //!< source: HDEMG_DIGITAL_*, value: 0
+static const uint16_t HDEMG_EVENT_ONSET        = 3;  //!< source: channel or region
+static const uint16_t HDEMG_EVENT_OFFSET       = 4;  //!< source: channel or region
+//! \}
+
+//! \brief One event on the NIP clock
+struct HdemgEvent
+{
+    uint32_t time;      //!< NIP time
+    uint16_t kind;      //!< HDEMG_EVENT_*
+    uint16_t source;    //!< digital input, channel or region, depending on kind
+    uint32_t value;
+};
+
+//! \brief Called for every event posted to an HdemgEventStream
+typedef void (*HdemgEventCallback)(const HdemgEvent & event, void * pUser);
+
+/**
+    Reads the inputs of a legacy digital packet from the digital I/O front end.
+
+    \arg pPacket   - any XIPP packet
+    \arg pValues   - receives HDEMG_DIGITAL_INPUTS values (SMA levels, parallel port word)
+
+    \return false if the packet is not digital I/O data
+  */
+inline bool
+HdemgReadDigitalInputs(const XippPacket * pPacket, uint32_t * pValues)
+{
+    if(!pPacket || pPacket->header.processor != 1 || pPacket->header.module != HDEMG_DIGITAL_MODULE_ID
+       || pPacket->header.stream != HDEMG_DIGITAL_STREAM_ID)
+        return false;
+
+    const XippLegacyDigitalDataPacket * pDigital = (const XippLegacyDigitalDataPacket *)pPacket;
+    if(pDigital->streamType != XIPP_STREAM_LEGACY_DIGITAL)
+        return false;
+
+    for(uint32_t i=0; i<4; ++i)
+        pValues[HDEMG_DIGITAL_SMA1 + i] = pDigital->event[i];
+    pValues[HDEMG_DIGITAL_PARALLEL] = pDigital->parallel;
+    return true;
+}
+
+/*! \brief Fan-in point for events of all sources.
+ */
+class HdemgEventStream
+{
+public:
+    HdemgEventStream() : next(0), count(0), pCallback(NULL), pUser(NULL)
+    {
+        for(uint32_t i=0; i<HDEMG_DIGITAL_INPUTS; ++i)
+            lastInputs[i] = 0;
+    }
+
+    /**
+        Sizes the history.
+
+        \arg historySize - number of recent events kept for Recent()
+        \arg callback    - optional function receiving every event as it is posted
+        \arg pUserData   - passed through to the callback
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t historySize, HdemgEventCallback callback, void * pUserData)
+    {
+        if(historySize == 0)
+        {
+            printf("ERROR: event history must hold at least one event\n");
+            return false;
+        }
+        history.assign(historySize, HdemgEvent());
+        pCallback = callback;
+        pUser     = pUserData;
+        next      = 0;
+        count     = 0;
+        for(uint32_t i=0; i<HDEMG_DIGITAL_INPUTS; ++i)
+            lastInputs[i] = 0;
+        return true;
+    }
+
+    //! \brief adds an event to the history and forwards it to the callback
+    void Post(const HdemgEvent & event)
+    {
+        if(!history.empty())
+        {
+            history[next] = event;
+            next = (next + 1) % (uint32_t)history.size();
+        }
+        count++;
+        if(pCallback)
+            pCallback(event, pUser);
+    }
+
+    /**
+        Posts an event for every digital input that changed. Packets other than digital
+        I/O data are ignored, so every packet of a datagram can be passed in.
+
+        \return number of events posted
+      */
+    uint32_t ProcessPacket(const XippPacket * pPacket)
+    {
+        uint32_t values[HDEMG_DIGITAL_INPUTS];
+        if(!HdemgReadDigitalInputs(pPacket, values))
+            return 0;
+
+        uint32_t posted = 0;
+        for(uint16_t i=0; i<HDEMG_DIGITAL_INPUTS; ++i)
+        {
+            if(values[i] == lastInputs[i])
+                continue;
+
+            HdemgEvent event;
+            event.time   = pPacket->header.time;
+            event.kind   = values[i] ? HDEMG_EVENT_DIGITAL_RISE : HDEMG_EVENT_DIGITAL_FALL;
+            event.source = i;
+            event.value  = values[i];
+            lastInputs[i] = values[i];
+            Post(event);
+            posted++;
+        }
+        return posted;
+    }
+
+    uint64_t Count() const { return count; }   //!< events posted so far
+
+    //! \brief the k-th most recent event (0 = newest), k < min(Count(), history size)
+    const HdemgEvent & Recent(uint32_t k) const
+    {
+        uint32_t size = (uint32_t)history.size();
+        return history[(next + size - 1 - k % size) % size];
+    }
+
+private:
+    std::vector<HdemgEvent> history;     // ring of recent events
+    uint32_t                next;        // slot of the next event
+    uint64_t                count;
+    uint32_t                lastInputs[HDEMG_DIGITAL_INPUTS];
+    HdemgEventCallback      pCallback;
+    void *                  pUser;
+};
+
+#endif // HDEMG_EVENTS_H
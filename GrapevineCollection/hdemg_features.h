@@ -0,0 +1,368 @@
+//
+//  hdemg_features.h
+//
+//  Classic time-domain EMG features computed over overlapping windows on every channel:
+//  mean absolute value (MAV), waveform length (WL), zero crossings (ZC), slope sign changes
+//  (SSC), the three Hjorth parameters and autoregressive (AR) coefficients.
+//
+//  Windows are aligned to NIP time rather than to the start of the stream: a feature frame
+//  is produced whenever the frame count since NIP time 0 is a multiple of the hop size. Every
+//  feature is computed from the window contents alone, in a fixed order, so feeding the same
+//  samples in different block sizes (live UDP blocks or blocks read back from a file) gives
+//  bit-identical results.
+//
+
+#ifndef HDEMG_FEATURES_H
+#define HDEMG_FEATURES_H
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "hdemg_frames.h"
+#include "hdemg_simd.h"
+
+//! \defgroup HdemgFeatureFlags
+//! \{
+//! \brief Features to compute, combine with |
+static const uint32_t HDEMG_FEATURE_MAV    = 0x01;
+static const uint32_t HDEMG_FEATURE_WL     = 0x02;
+static const uint32_t HDEMG_FEATURE_ZC     = 0x04;
+static const uint32_t HDEMG_FEATURE_SSC    = 0x08;
+static const uint32_t HDEMG_FEATURE_HJORTH = 0x10; // activity, mobility, complexity
+static const uint32_t HDEMG_FEATURE_AR     = 0x20; // arOrder coefficients
+static const uint32_t HDEMG_FEATURE_ALL    = 0x3F;
+//! \}
+
+static const uint32_t HDEMG_FEATURE_MAX_AR_ORDER = 16;
+
+/*! \brief Features of one window. values is feature-major: value v of channel c is at
+ *  values[v*channelCount + c], where v counts the enabled features in flag order (Hjorth
+ *  contributes 3 values, AR contributes arOrder values).
+ */
+struct HdemgFeatureFrame
+{
+    uint32_t time;           //!< NIP time of the last frame of the window
+    uint64_t arrivalNs;      //!< arrival of the block holding that frame (see HdemgBlock)
+    uint32_t channelCount;
+    uint32_t valuesPerChannel;
+    std::vector<float> values;
+
+    inline const float * Feature(uint32_t v) const { return &values[(size_t)v * channelCount]; }
+};
+
+//! \brief Called every time a window has been evaluated
+typedef void (*HdemgFeatureCallback)(const HdemgFeatureFrame & frame, void * pUser);
+
+/*! \brief Sliding window feature extractor.
+ */
+class HdemgFeatureExtractor
+{
+public:
+    HdemgFeatureExtractor()
+        : channelCount(0), flags(0), arOrder(0), windowFrames(0), hopFrames(0),
+          zcThreshold(0.0f), sscThreshold(0.0f), ringPos(0), filled(0), expectedTime(0),
+          streamStarted(false), pCallback(NULL), pUser(NULL) {}
+
+    /**
+        Sizes the extractor.
+
+        \arg channels     - channels per frame
+        \arg window       - window length in frames
+        \arg hop          - frames between consecutive windows (window - overlap)
+        \arg featureFlags - HDEMG_FEATURE_* flags
+        \arg order        - AR model order (used with HDEMG_FEATURE_AR)
+        \arg zcThresh     - minimum step across zero for ZC (sample units)
+        \arg sscThresh    - minimum product of the two slopes for SSC (sample units squared)
+        \arg callback     - receives the feature frames
+        \arg pUserData    - passed through to the callback
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, uint32_t window, uint32_t hop, uint32_t featureFlags, uint32_t order,
+                   float zcThresh, float sscThresh, HdemgFeatureCallback callback, void * pUserData)
+    {
+        if(channels == 0 || window < 3 || hop == 0 || (featureFlags & HDEMG_FEATURE_ALL) == 0 || !callback
+           || ((featureFlags & HDEMG_FEATURE_AR) && (order == 0 || order > HDEMG_FEATURE_MAX_AR_ORDER || order >= window)))
+        {
+            printf("ERROR: invalid feature extractor configuration\n");
+            return false;
+        }
+
+        channelCount = channels;
+        flags        = featureFlags & HDEMG_FEATURE_ALL;
+        arOrder      = (flags & HDEMG_FEATURE_AR) ? order : 0;
+        windowFrames = window;
+        hopFrames    = hop;
+        zcThreshold  = zcThresh;
+        sscThreshold = sscThresh;
+        pCallback    = callback;
+        pUser        = pUserData;
+
+        uint32_t nValues = 0;
+        if(flags & HDEMG_FEATURE_MAV)    nValues += 1;
+        if(flags & HDEMG_FEATURE_WL)     nValues += 1;
+        if(flags & HDEMG_FEATURE_ZC)     nValues += 1;
+        if(flags & HDEMG_FEATURE_SSC)    nValues += 1;
+        if(flags & HDEMG_FEATURE_HJORTH) nValues += 3;
+        nValues += arOrder;
+
+        frame.channelCount     = channels;
+        frame.valuesPerChannel = nValues;
+        frame.values.assign((size_t)nValues * channels, 0.0f);
+
+        ring.assign((size_t)window * channels, 0.0f);
+        framePtr.assign(window, (const float *)NULL);
+
+        // per channel accumulators: |x|, x, x^2, |dx|, dx, dx^2, ddx, ddx^2, zc, ssc, prev dx, r[0..p]
+        acc.assign((size_t)(ACC_R0 + arOrder + 1) * channels, 0.0);
+
+        Reset();
+        return true;
+    }
+
+    //! \brief Clears the window history, e.g. after a gap in the stream
+    void Reset()
+    {
+        std::fill(ring.begin(), ring.end(), 0.0f);
+        ringPos       = 0;
+        filled        = 0;
+        streamStarted = false;
+    }
+
+    uint32_t ValuesPerChannel() const { return frame.valuesPerChannel; }
+
+    /**
+        Adds a block of frames and evaluates every window that ends inside it.
+      */
+    bool Process(const HdemgBlock & in)
+    {
+        if(in.channelCount != channelCount)
+        {
+            printf("ERROR: feature block has [%u] channels, expected [%u]\n", in.channelCount, channelCount);
+            return false;
+        }
+
+        const double ticks = in.TicksPerFrame();
+        if(streamStarted && !HdemgIsContiguous(in, expectedTime))
+            Reset();
+        streamStarted = true;
+
+        for(uint32_t f=0; f<in.frameCount; ++f)
+        {
+            memcpy(&ring[(size_t)ringPos * channelCount], in.Frame(f), channelCount * sizeof(float));
+            if(++ringPos == windowFrames)
+                ringPos = 0;
+            if(filled < windowFrames)
+                filled++;
+
+            // windows end on NIP aligned hop boundaries
+            uint32_t time       = in.FrameTime(f);
+            uint32_t frameIndex = (uint32_t)(time / ticks + 0.5);
+            if(filled == windowFrames && (frameIndex + 1) % hopFrames == 0)
+                Evaluate(time, in.arrivalNs);
+        }
+
+        expectedTime = in.EndTime();
+        return true;
+    }
+
+private:
+    enum
+    {
+        ACC_ABS = 0, ACC_X, ACC_X2, ACC_ABS_D, ACC_D, ACC_D2, ACC_DD, ACC_DD2, ACC_ZC, ACC_SSC, ACC_PREV_D, ACC_R0
+    };
+
+    inline double * Acc(uint32_t idx) { return &acc[(size_t)idx * channelCount]; }
+
+    void Evaluate(uint32_t time, uint64_t arrivalNs)
+    {
+        const uint32_t nCh = channelCount;
+        const uint32_t N   = windowFrames;
+
+        // oldest frame is at ringPos once the window is full
+        for(uint32_t i=0; i<N; ++i)
+        {
+            uint32_t pos = ringPos + i;
+            if(pos >= N)
+                pos -= N;
+            framePtr[i] = &ring[(size_t)pos * nCh];
+        }
+
+        std::fill(acc.begin(), acc.end(), 0.0);
+        double * HDEMG_RESTRICT sAbs  = Acc(ACC_ABS);
+        double * HDEMG_RESTRICT sX    = Acc(ACC_X);
+        double * HDEMG_RESTRICT sX2   = Acc(ACC_X2);
+        double * HDEMG_RESTRICT sAbsD = Acc(ACC_ABS_D);
+        double * HDEMG_RESTRICT sD    = Acc(ACC_D);
+        double * HDEMG_RESTRICT sD2   = Acc(ACC_D2);
+        double * HDEMG_RESTRICT sDD   = Acc(ACC_DD);
+        double * HDEMG_RESTRICT sDD2  = Acc(ACC_DD2);
+        double * HDEMG_RESTRICT nZc   = Acc(ACC_ZC);
+        double * HDEMG_RESTRICT nSsc  = Acc(ACC_SSC);
+        double * HDEMG_RESTRICT prevD = Acc(ACC_PREV_D);
+
+        const double zcThr  = zcThreshold;
+        const double sscThr = sscThreshold;
+
+        for(uint32_t i=0; i<N; ++i)
+        {
+            const float * HDEMG_RESTRICT x = framePtr[i];
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                sAbs[c] += fabs((double)x[c]);
+                sX[c]   += x[c];
+                sX2[c]  += (double)x[c] * x[c];
+            }
+            if(i == 0)
+                continue;
+
+            const float * HDEMG_RESTRICT xp = framePtr[i-1];
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                double d = (double)x[c] - xp[c];
+                sAbsD[c] += fabs(d);
+                sD[c]    += d;
+                sD2[c]   += d * d;
+                nZc[c]   += ((double)x[c] * xp[c] < 0.0 && fabs(d) >= zcThr) ? 1.0 : 0.0;
+                if(i >= 2)
+                {
+                    // slope sign change at the middle sample i-1
+                    double dd = d - prevD[c];
+                    sDD[c]  += dd;
+                    sDD2[c] += dd * dd;
+                    nSsc[c] += (-prevD[c] * d >= sscThr) ? 1.0 : 0.0;
+                }
+                prevD[c] = d;
+            }
+        }
+
+        // autocorrelation for the AR model
+        for(uint32_t k=0; k<=arOrder && (flags & HDEMG_FEATURE_AR); ++k)
+        {
+            double * HDEMG_RESTRICT r = Acc(ACC_R0 + k);
+            for(uint32_t i=k; i<N; ++i)
+            {
+                const float * HDEMG_RESTRICT x0 = framePtr[i];
+                const float * HDEMG_RESTRICT xk = framePtr[i-k];
+                for(uint32_t c=0; c<nCh; ++c)
+                    r[c] += (double)x0[c] * xk[c];
+            }
+        }
+
+        // turn the sums into feature values
+        uint32_t v = 0;
+        if(flags & HDEMG_FEATURE_MAV)
+            Store(v++, sAbs, 1.0 / N);
+        if(flags & HDEMG_FEATURE_WL)
+            Store(v++, sAbsD, 1.0);
+        if(flags & HDEMG_FEATURE_ZC)
+            Store(v++, nZc, 1.0);
+        if(flags & HDEMG_FEATURE_SSC)
+            Store(v++, nSsc, 1.0);
+        if(flags & HDEMG_FEATURE_HJORTH)
+        {
+            float * pAct = &frame.values[(size_t)(v+0) * nCh];
+            float * pMob = &frame.values[(size_t)(v+1) * nCh];
+            float * pCom = &frame.values[(size_t)(v+2) * nCh];
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                double varX  = Variance(sX[c],  sX2[c],  N);
+                double varD  = Variance(sD[c],  sD2[c],  N - 1);
+                double varDD = Variance(sDD[c], sDD2[c], N - 2);
+                double mobX  = (varX > 0.0) ? sqrt(varD / varX) : 0.0;
+                double mobD  = (varD > 0.0) ? sqrt(varDD / varD) : 0.0;
+                pAct[c] = (float)varX;
+                pMob[c] = (float)mobX;
+                pCom[c] = (float)((mobX > 0.0) ? mobD / mobX : 0.0);
+            }
+            v += 3;
+        }
+        if(flags & HDEMG_FEATURE_AR)
+        {
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                double r[HDEMG_FEATURE_MAX_AR_ORDER + 1];
+                double coef[HDEMG_FEATURE_MAX_AR_ORDER + 1];
+                for(uint32_t k=0; k<=arOrder; ++k)
+                    r[k] = Acc(ACC_R0 + k)[c];
+                LevinsonDurbin(r, arOrder, coef);
+                for(uint32_t k=0; k<arOrder; ++k)
+                    frame.values[(size_t)(v + k) * nCh + c] = (float)coef[k + 1];
+            }
+            v += arOrder;
+        }
+
+        frame.time      = time;
+        frame.arrivalNs = arrivalNs;
+        pCallback(frame, pUser);
+    }
+
+    void Store(uint32_t v, const double * pSum, double scale)
+    {
+        float * pDst = &frame.values[(size_t)v * channelCount];
+        for(uint32_t c=0; c<channelCount; ++c)
+            pDst[c] = (float)(pSum[c] * scale);
+    }
+
+    static double Variance(double sum, double sumSq, uint32_t n)
+    {
+        double mean = sum / n;
+        double var  = sumSq / n - mean * mean;
+        return (var > 0.0) ? var : 0.0;
+    }
+
+    /**
+        Solves the Yule-Walker equations for an AR model of the given order. On return
+        coef[1..order] hold the coefficients a_k of x[n] = sum_k a_k x[n-k] + e[n]. A silent
+        channel (r[0] == 0) gives all zero coefficients.
+      */
+    static void LevinsonDurbin(const double * r, uint32_t order, double * coef)
+    {
+        double tmp[HDEMG_FEATURE_MAX_AR_ORDER + 1];
+        for(uint32_t k=0; k<=order; ++k)
+            coef[k] = 0.0;
+        if(r[0] <= 0.0)
+            return;
+
+        double err = r[0];
+        for(uint32_t m=1; m<=order; ++m)
+        {
+            double k = r[m];
+            for(uint32_t j=1; j<m; ++j)
+                k -= coef[j] * r[m-j];
+            k /= err;
+
+            for(uint32_t j=1; j<m; ++j)
+                tmp[j] = coef[j] - k * coef[m-j];
+            for(uint32_t j=1; j<m; ++j)
+                coef[j] = tmp[j];
+            coef[m] = k;
+
+            err *= (1.0 - k * k);
+            if(err <= 0.0)
+                break;
+        }
+    }
+
+    uint32_t                     channelCount;
+    uint32_t                     flags;
+    uint32_t                     arOrder;
+    uint32_t                     windowFrames;
+    uint32_t                     hopFrames;
+    float                        zcThreshold;
+    float                        sscThreshold;
+    std::vector<float>           ring;      // last windowFrames frames, sample-major
+    std::vector<const float *>   framePtr;  // window frames, oldest first
+    std::vector<double>          acc;       // [accumulator][channel]
+    uint32_t                     ringPos;
+    uint32_t                     filled;
+    uint32_t                     expectedTime;
+    bool                         streamStarted;
+    HdemgFeatureFrame            frame;
+    HdemgFeatureCallback         pCallback;
+    void *                       pUser;
+};
+
+#endif // HDEMG_FEATURES_H
@@ -0,0 +1,170 @@
+//
+//  hdemg_fft.h
+//
+//  Real FFT of all channels of a sample-major segment at once. The butterflies work on
+//  whole frames, so every inner loop runs across channels like the other processing stages
+//  and is vectorized by the compiler. A real segment of n points is transformed as a
+//  complex FFT of n/2 points (even samples in the real part, odd samples in the imaginary
+//  part) followed by the usual split step.
+//
+
+#ifndef HDEMG_FFT_H
+#define HDEMG_FFT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_frames.h"
+#include "hdemg_simd.h"
+
+/*! \brief Radix-2 real FFT batched across channels.
+ */
+class HdemgBatchedRealFft
+{
+public:
+    HdemgBatchedRealFft() : size(0), half(0), channelCount(0) {}
+
+    /**
+        Sizes the transform.
+
+        \arg n        - transform length, a power of two (at least 4)
+        \arg channels - channels per frame
+
+        \return true if the size is valid
+      */
+    bool Configure(uint32_t n, uint32_t channels)
+    {
+        if(n < 4 || (n & (n - 1)) || channels == 0)
+        {
+            printf("ERROR: invalid FFT size [%u] or channel count [%u]\n", n, channels);
+            return false;
+        }
+
+        size         = n;
+        half         = n / 2;
+        channelCount = channels;
+
+        uint32_t bits = 0;
+        while((1u << bits) < half)
+            bits++;
+        reverse.resize(half);
+        for(uint32_t i=0; i<half; ++i)
+        {
+            uint32_t r = 0;
+            for(uint32_t b=0; b<bits; ++b)
+                r |= ((i >> b) & 1u) << (bits - 1 - b);
+            reverse[i] = r;
+        }
+
+        // twiddles of the half-size complex FFT and of the split step
+        twiddleRe.resize(half);
+        twiddleIm.resize(half);
+        for(uint32_t j=0; j<half; ++j)
+        {
+            twiddleRe[j] = (float)cos(2.0 * HDEMG_PI * j / half);
+            twiddleIm[j] = (float)-sin(2.0 * HDEMG_PI * j / half);
+        }
+        splitCos.resize(half + 1);
+        splitSin.resize(half + 1);
+        for(uint32_t k=0; k<=half; ++k)
+        {
+            splitCos[k] = (float)cos(2.0 * HDEMG_PI * k / n);
+            splitSin[k] = (float)sin(2.0 * HDEMG_PI * k / n);
+        }
+
+        workRe.assign((size_t)half * channels, 0.0f);
+        workIm.assign((size_t)half * channels, 0.0f);
+        return true;
+    }
+
+    uint32_t Size() const     { return size; }
+    uint32_t BinCount() const { return half + 1; }
+
+    /**
+        Transforms one segment.
+
+        \arg pIn    - Size() frames of channelCount values, sample-major
+        \arg pOutRe - receives BinCount() frames of real parts, [bin][channel]
+        \arg pOutIm - receives BinCount() frames of imaginary parts, [bin][channel]
+      */
+    void Transform(const float * pIn, float * pOutRe, float * pOutIm)
+    {
+        const uint32_t nCh = channelCount;
+        float * HDEMG_RESTRICT re = &workRe[0];
+        float * HDEMG_RESTRICT im = &workIm[0];
+
+        for(uint32_t i=0; i<half; ++i)
+        {
+            memcpy(re + (size_t)reverse[i] * nCh, pIn + (size_t)(2 * i) * nCh, nCh * sizeof(float));
+            memcpy(im + (size_t)reverse[i] * nCh, pIn + (size_t)(2 * i + 1) * nCh, nCh * sizeof(float));
+        }
+
+        for(uint32_t len=2; len<=half; len<<=1)
+        {
+            uint32_t span = len / 2;
+            uint32_t step = half / len;
+            for(uint32_t start=0; start<half; start+=len)
+            {
+                for(uint32_t j=0; j<span; ++j)
+                {
+                    const float wr = twiddleRe[j * step];
+                    const float wi = twiddleIm[j * step];
+                    float * HDEMG_RESTRICT ar = re + (size_t)(start + j) * nCh;
+                    float * HDEMG_RESTRICT ai = im + (size_t)(start + j) * nCh;
+                    float * HDEMG_RESTRICT br = re + (size_t)(start + j + span) * nCh;
+                    float * HDEMG_RESTRICT bi = im + (size_t)(start + j + span) * nCh;
+                    for(uint32_t c=0; c<nCh; ++c)
+                    {
+                        float tr = br[c] * wr - bi[c] * wi;
+                        float ti = br[c] * wi + bi[c] * wr;
+                        br[c] = ar[c] - tr;
+                        bi[c] = ai[c] - ti;
+                        ar[c] += tr;
+                        ai[c] += ti;
+                    }
+                }
+            }
+        }
+
+        // split: X[k] = E[k] + W^k O[k] with E, O the spectra of the even and odd samples
+        for(uint32_t k=0; k<=half; ++k)
+        {
+            uint32_t kk = (k == half) ? 0 : k;
+            uint32_t km = (k == 0) ? 0 : half - k;
+            const float * HDEMG_RESTRICT zr  = re + (size_t)kk * nCh;
+            const float * HDEMG_RESTRICT zi  = im + (size_t)kk * nCh;
+            const float * HDEMG_RESTRICT zmr = re + (size_t)km * nCh;
+            const float * HDEMG_RESTRICT zmi = im + (size_t)km * nCh;
+            float * HDEMG_RESTRICT xr = pOutRe + (size_t)k * nCh;
+            float * HDEMG_RESTRICT xi = pOutIm + (size_t)k * nCh;
+            const float cs = splitCos[k];
+            const float sn = splitSin[k];
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                float er = 0.5f * (zr[c] + zmr[c]);
+                float ei = 0.5f * (zi[c] - zmi[c]);
+                float orr = 0.5f * (zi[c] + zmi[c]);
+                float oi = -0.5f * (zr[c] - zmr[c]);
+                xr[c] = er + cs * orr + sn * oi;
+                xi[c] = ei + cs * oi - sn * orr;
+            }
+        }
+    }
+
+private:
+    uint32_t              size;
+    uint32_t              half;
+    uint32_t              channelCount;
+    std::vector<uint32_t> reverse;     // bit reversal of the half-size FFT
+    std::vector<float>    twiddleRe;
+    std::vector<float>    twiddleIm;
+    std::vector<float>    splitCos;
+    std::vector<float>    splitSin;
+    std::vector<float>    workRe;      // [half][channel]
+    std::vector<float>    workIm;
+};
+
+#endif // HDEMG_FFT_H
@@ -0,0 +1,341 @@
+//
+//  hdemg_frames.h
+//
+//  Assembles the XippContinousDataPacket streams published by several front ends into
+//  sample-major multichannel frames. A frame holds one sample from every selected channel
+//  at a single NIP time, and frames are collected into fixed capacity blocks that are
+//  handed to a consumer callback. All processing stages (decimation, spatial filtering,
+//  feature extraction, recording) operate on these blocks.
+//
+//  Blocks are always contiguous in NIP time. When a gap is detected (e.g. dropped UDP
+//  packets or a paused stream) the current block is delivered early and a new block is
+//  started at the new time, so consumers never have to look for holes inside a block.
+//
+
+#ifndef HDEMG_FRAMES_H
+#define HDEMG_FRAMES_H
+
+#if !defined(__cplusplus)
+  #error "hdemg_frames.h must be compiled as C++"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "xippmin.h"
+
+// front end geometry (see the [Raw Signals] section of xippmin.h)
+static const uint32_t HDEMG_CHANNELS_PER_FRONT_END = 32;
+static const uint32_t HDEMG_MAX_FRONT_ENDS         = 16;     // ports A-D, positions 1-4
+static const uint32_t HDEMG_NIP_CLOCK_HZ           = 30000;  // NIP timer rate
+static const uint8_t  HDEMG_RAW_STREAM_ID          = 1;
+
+static const double   HDEMG_PI = 3.14159265358979323846;
+
+/**
+    Host monotonic clock in nanoseconds, used to measure processing latency
+  */
+inline uint64_t
+HdemgNowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*! \brief Returns the module ID that publishes raw 30 ksps data for a base zero front end
+ *  number (0 = port A position 1, 4 = port B position 1, ...)
+ */
+inline uint8_t
+HdemgRawModuleId(uint32_t frontEnd)
+{
+    return (uint8_t)(2 * frontEnd + 1);
+}
+
+/*! \brief A block of sample-major frames. Sample c of frame i is at samples[i*channelCount + c].
+ *
+ *  The storage is allocated once by Allocate() and reused for every block afterwards. Samples
+ *  are stored as float so that raw int16 counts are represented exactly and filtered outputs
+ *  can use the same container.
+ */
+struct HdemgBlock
+{
+    uint32_t channelCount;  //!< number of channels in each frame
+    uint32_t capacity;      //!< maximum number of frames in the block
+    uint32_t frameCount;    //!< number of valid frames in the block
+    uint32_t startTime;     //!< NIP time of the first frame
+    double   sampleRate;    //!< frames per second (30000 for raw data)
+    uint64_t arrivalNs;     //!< HdemgNowNs() when the first packet of the block arrived
+    std::vector<float> samples;
+
+    HdemgBlock() : channelCount(0), capacity(0), frameCount(0), startTime(0), sampleRate(0.0), arrivalNs(0) {}
+
+    //! \brief sizes the block storage. Returns false if either dimension is zero.
+    bool Allocate(uint32_t channels, uint32_t frames, double rate)
+    {
+        if(channels == 0 || frames == 0)
+        {
+            printf("ERROR: cannot allocate a block with [%u] channels and [%u] frames\n", channels, frames);
+            return false;
+        }
+        channelCount = channels;
+        capacity     = frames;
+        frameCount   = 0;
+        startTime    = 0;
+        sampleRate   = rate;
+        samples.assign((size_t)channels * frames, 0.0f);
+        return true;
+    }
+
+    inline float *       Frame(uint32_t idx)       { return &samples[(size_t)idx * channelCount]; }
+    inline const float * Frame(uint32_t idx) const { return &samples[(size_t)idx * channelCount]; }
+
+    //! \brief NIP ticks between consecutive frames
+    inline double TicksPerFrame() const { return HDEMG_NIP_CLOCK_HZ / sampleRate; }
+
+    //! \brief NIP time of frame idx, rounded to the nearest tick
+    inline uint32_t FrameTime(uint32_t idx) const { return startTime + (uint32_t)(idx * TicksPerFrame() + 0.5); }
+
+    //! \brief NIP time of the frame following the last valid frame
+    inline uint32_t EndTime() const { return FrameTime(frameCount); }
+};
+
+/**
+    Returns true if a block continues a stream whose next frame was expected at expectedTime.
+    At rates that do not divide the NIP clock frame times are rounded, so up to half a frame
+    of difference is tolerated.
+  */
+inline bool
+HdemgIsContiguous(const HdemgBlock & block, uint32_t expectedTime)
+{
+    int32_t  diff      = (int32_t)(block.startTime - expectedTime);
+    uint32_t tolerance = (uint32_t)(0.5 * block.TicksPerFrame());
+    return (uint32_t)((diff < 0) ? -diff : diff) <= tolerance;
+}
+
+//! \brief Called by HdemgFrameAssembler every time a block is complete
+typedef void (*HdemgBlockCallback)(const HdemgBlock & block, void * pUser);
+
+/*! \brief Collects raw continuous packets from a set of front ends into HdemgBlocks.
+ *
+ *  Channels are ordered by the order of the front ends passed to Configure() and then by the
+ *  i16[] index of the packet, so with front ends {0,1} channel 0-31 come from port A position 1
+ *  and channel 32-63 from port A position 2.
+ */
+class HdemgFrameAssembler
+{
+public:
+    HdemgFrameAssembler()
+        : frontEndCount(0), pCallback(NULL), pUser(NULL),
+          pendingValid(false), pendingTime(0), pendingArrivalNs(0), pendingMask(0), fullMask(0),
+          frameCount(0), incompleteFrames(0), gapCount(0), lostFrames(0)
+    {
+        memset(slotForModule, 0xFF, sizeof(slotForModule));
+    }
+
+    /**
+        Sets up the assembler for a set of front ends.
+
+        \arg pFrontEnds  - base zero front end numbers in the desired channel order
+        \arg count       - number of entries in pFrontEnds
+        \arg blockFrames - number of frames delivered per block
+        \arg callback    - function receiving complete blocks
+        \arg pUserData   - passed through to the callback
+
+        \return true if the configuration is valid
+      */
+    bool Configure(const uint32_t * pFrontEnds, uint32_t count, uint32_t blockFrames,
+                   HdemgBlockCallback callback, void * pUserData)
+    {
+        if(!pFrontEnds || count == 0 || count > HDEMG_MAX_FRONT_ENDS || !callback)
+        {
+            printf("ERROR: invalid front end configuration\n");
+            return false;
+        }
+
+        memset(slotForModule, 0xFF, sizeof(slotForModule));
+        for(uint32_t i=0; i<count; ++i)
+        {
+            if(pFrontEnds[i] >= HDEMG_MAX_FRONT_ENDS || slotForModule[HdemgRawModuleId(pFrontEnds[i])] != 0xFF)
+            {
+                printf("ERROR: front end [%u] is invalid or listed twice\n", pFrontEnds[i]);
+                return false;
+            }
+            slotForModule[HdemgRawModuleId(pFrontEnds[i])] = (uint8_t)i;
+        }
+
+        frontEndCount = count;
+        fullMask      = (1u << count) - 1;
+        pCallback     = callback;
+        pUser         = pUserData;
+
+        if(!block.Allocate(count * HDEMG_CHANNELS_PER_FRONT_END, blockFrames, HDEMG_NIP_CLOCK_HZ))
+            return false;
+        pending.assign(count * HDEMG_CHANNELS_PER_FRONT_END, 0.0f);
+
+        pendingValid     = false;
+        pendingMask      = 0;
+        frameCount       = 0;
+        incompleteFrames = 0;
+        gapCount         = 0;
+        lostFrames       = 0;
+        return true;
+    }
+
+    /**
+        Feeds one XIPP packet to the assembler. Packets that are not raw continuous data from
+        one of the configured front ends are ignored, so every packet pulled out of a UDP
+        datagram can be passed in without pre-filtering.
+
+        \arg pPacket - packet as found in the UDP buffer
+
+        \return true if the packet was used
+      */
+    bool ProcessPacket(const XippPacket * pPacket)
+    {
+        if(!pPacket || pPacket->header.processor != 1 || pPacket->header.stream != HDEMG_RAW_STREAM_ID)
+            return false;
+
+        uint8_t slot = slotForModule[pPacket->header.module];
+        if(slot == 0xFF)
+            return false;
+
+        const XippContinousDataPacket * pContin = (const XippContinousDataPacket *)pPacket;
+        if(pContin->streamType != XIPP_STREAM_CONTINUOUS)
+            return false;
+
+        // a new time closes the frame that is being filled
+        uint32_t time = pPacket->header.time;
+        if(pendingValid && time != pendingTime)
+            CommitPending();
+
+        if(!pendingValid)
+        {
+            pendingValid     = true;
+            pendingTime      = time;
+            pendingMask      = 0;
+            pendingArrivalNs = HdemgNowNs();
+        }
+
+        // payload is the stream type word followed by the samples
+        uint32_t sampleCount = (pPacket->header.size > 1) ? 2 * (pPacket->header.size - 1) : 0;
+        if(sampleCount > HDEMG_CHANNELS_PER_FRONT_END)
+            sampleCount = HDEMG_CHANNELS_PER_FRONT_END;
+
+        float * pDst = &pending[slot * HDEMG_CHANNELS_PER_FRONT_END];
+        for(uint32_t i=0; i<sampleCount; ++i)
+            pDst[i] = (float)pContin->i16[i];
+
+        pendingMask |= (1u << slot);
+        if(pendingMask == fullMask)
+            CommitPending();
+
+        return true;
+    }
+
+    /**
+        Walks all XIPP packets in a UDP datagram and feeds them to ProcessPacket().
+
+        \arg pBuff     - datagram payload
+        \arg byteCount - number of bytes received
+      */
+    void ProcessDatagram(const char * pBuff, int byteCount)
+    {
+        int byteIdx = 0;
+        while(byteIdx + (int)sizeof(XippHeader) <= byteCount)
+        {
+            const XippPacket * pPacket = (const XippPacket *)(&pBuff[byteIdx]);
+            int packetByteCount = (pPacket->header.size + 2) * 4; // size excludes the two header quadlets
+            ProcessPacket(pPacket);
+            byteIdx += packetByteCount;
+        }
+    }
+
+    //! \brief Delivers the partially filled frame and block (e.g. when the stream stops)
+    void Flush()
+    {
+        if(pendingValid)
+            CommitPending();
+        DeliverBlock();
+    }
+
+    uint32_t ChannelCount() const     { return frontEndCount * HDEMG_CHANNELS_PER_FRONT_END; }
+    uint64_t FrameCount() const       { return frameCount; }       //!< frames assembled so far
+    uint64_t IncompleteFrames() const { return incompleteFrames; } //!< frames missing a front end (zero filled)
+    uint64_t GapCount() const         { return gapCount; }         //!< discontinuities in NIP time
+    uint64_t LostFrames() const       { return lostFrames; }       //!< frames skipped by those gaps
+
+private:
+    void CommitPending()
+    {
+        if(pendingMask != fullMask)
+        {
+            // zero fill front ends that did not report for this time
+            for(uint32_t i=0; i<frontEndCount; ++i)
+            {
+                if(!(pendingMask & (1u << i)))
+                    memset(&pending[i * HDEMG_CHANNELS_PER_FRONT_END], 0, HDEMG_CHANNELS_PER_FRONT_END * sizeof(float));
+            }
+            incompleteFrames++;
+        }
+
+        // keep blocks contiguous in NIP time
+        if(block.frameCount > 0)
+        {
+            uint32_t expected = block.startTime + block.frameCount;
+            if(pendingTime != expected)
+            {
+                // a backwards jump means the NIP timer was reset, nothing was lost
+                uint32_t skipped = pendingTime - expected;
+                if(skipped < 0x80000000)
+                    lostFrames += skipped;
+                gapCount++;
+                DeliverBlock();
+            }
+        }
+
+        if(block.frameCount == 0)
+        {
+            block.startTime = pendingTime;
+            block.arrivalNs = pendingArrivalNs;
+        }
+
+        memcpy(block.Frame(block.frameCount), &pending[0], pending.size() * sizeof(float));
+        block.frameCount++;
+        frameCount++;
+
+        pendingValid = false;
+        pendingMask  = 0;
+
+        if(block.frameCount == block.capacity)
+            DeliverBlock();
+    }
+
+    void DeliverBlock()
+    {
+        if(block.frameCount == 0)
+            return;
+        pCallback(block, pUser);
+        block.frameCount = 0;
+    }
+
+    uint8_t            slotForModule[256];
+    uint32_t           frontEndCount;
+    HdemgBlockCallback pCallback;
+    void *             pUser;
+    HdemgBlock         block;
+    std::vector<float> pending;
+    bool               pendingValid;
+    uint32_t           pendingTime;
+    uint64_t           pendingArrivalNs;
+    uint32_t           pendingMask;
+    uint32_t           fullMask;
+    uint64_t           frameCount;
+    uint64_t           incompleteFrames;
+    uint64_t           gapCount;
+    uint64_t           lostFrames;
+};
+
+#endif // HDEMG_FRAMES_H
@@ -0,0 +1,73 @@
+//
+//  hdemg_grid.h
+//
+//  Describes how the channels of an assembled frame (see hdemg_frames.h) are arranged on
+//  an electrode grid. Every grid cell holds the frame channel of the electrode at that
+//  position, or HDEMG_GRID_NO_ELECTRODE for cells without an electrode (e.g. the missing
+//  corner of a 13x5 grid).
+//
+
+#ifndef HDEMG_GRID_H
+#define HDEMG_GRID_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+static const int32_t HDEMG_GRID_NO_ELECTRODE = -1;
+
+/*! \brief Row/column geometry of one electrode grid
+ */
+struct HdemgGridGeometry
+{
+    uint32_t rows;
+    uint32_t cols;
+    std::vector<int32_t> channel; //!< [row*cols + col] -> frame channel or HDEMG_GRID_NO_ELECTRODE
+
+    HdemgGridGeometry() : rows(0), cols(0) {}
+
+    //! \brief sizes the grid with every cell empty
+    bool Resize(uint32_t nRows, uint32_t nCols)
+    {
+        if(nRows == 0 || nCols == 0)
+        {
+            printf("ERROR: invalid grid size [%u x %u]\n", nRows, nCols);
+            return false;
+        }
+        rows = nRows;
+        cols = nCols;
+        channel.assign((size_t)nRows * nCols, HDEMG_GRID_NO_ELECTRODE);
+        return true;
+    }
+
+    //! \brief returns the channel at (row, col) or HDEMG_GRID_NO_ELECTRODE if outside the grid
+    inline int32_t Channel(int32_t row, int32_t col) const
+    {
+        if(row < 0 || col < 0 || row >= (int32_t)rows || col >= (int32_t)cols)
+            return HDEMG_GRID_NO_ELECTRODE;
+        return channel[(size_t)row * cols + col];
+    }
+
+    inline void Set(uint32_t row, uint32_t col, int32_t ch) { channel[(size_t)row * cols + col] = ch; }
+
+    //! \brief number of cells that hold an electrode
+    uint32_t ElectrodeCount() const
+    {
+        uint32_t n = 0;
+        for(size_t i=0; i<channel.size(); ++i)
+            n += (channel[i] != HDEMG_GRID_NO_ELECTRODE);
+        return n;
+    }
+
+    //! \brief largest channel index referenced by the grid plus one
+    uint32_t ChannelSpan() const
+    {
+        int32_t maxCh = -1;
+        for(size_t i=0; i<channel.size(); ++i)
+            if(channel[i] > maxCh)
+                maxCh = channel[i];
+        return (uint32_t)(maxCh + 1);
+    }
+};
+
+#endif // HDEMG_GRID_H
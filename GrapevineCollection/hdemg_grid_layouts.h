@@ -0,0 +1,328 @@
+//
+//  hdemg_grid_layouts.h
+//
+//  Electrode grid layouts. The order of channels on the wire (front end module, then
+//  i16[] index) has nothing to do with the position of the electrodes on the skin, so a
+//  layout records for every grid cell which front end pin the electrode is wired to.
+//
+//  Layouts are built by constexpr generators, together with a neighbour table, so code
+//  that knows its grid at compile time can index neighbouring electrodes directly. Grids
+//  whose wiring is only known at run time are read from a text file instead (see
+//  HdemgLoadGridLayout). Both paths produce an HdemgGridGeometry for the processing
+//  stages.
+//
+//  Pins are numbered 0..(32*frontEnds - 1) starting at the first front end of the grid.
+//  A grid that needs two front ends and is plugged into port B position 3 uses the front
+//  ends at B3 and B4.
+//
+
+#ifndef HDEMG_GRID_LAYOUTS_H
+#define HDEMG_GRID_LAYOUTS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "hdemg_frames.h"
+#include "hdemg_grid.h"
+
+static const uint32_t HDEMG_GRID_MAX_CELLS = 256;
+
+//! \defgroup HdemgNeighbours
+//! \{
+//! \brief Index into HdemgGridLayout::neighbour
+static const uint32_t HDEMG_NEIGHBOUR_UP    = 0; // row - 1
+static const uint32_t HDEMG_NEIGHBOUR_DOWN  = 1; // row + 1
+static const uint32_t HDEMG_NEIGHBOUR_LEFT  = 2; // col - 1
+static const uint32_t HDEMG_NEIGHBOUR_RIGHT = 3; // col + 1
+//! \}
+
+/**
+    Returns the base zero front end number for a port ('A'-'D') and position (1-4), or -1
+    if either is out of range. Front ends are ordered by port and, within a port, by
+    position (A1..A4, B1..B4, ...), see xippmin.h.
+  */
+constexpr int32_t
+HdemgFrontEndNumber(char port, uint32_t position)
+{
+    return (port < 'A' || port > 'D' || position < 1 || position > 4)
+               ? -1
+               : (int32_t)((port - 'A') * 4 + (position - 1));
+}
+
+/*! \brief Wiring and neighbour tables of one electrode grid.
+ *
+ *  pin[cell] is the pin the electrode at cell = row*Cols + col is wired to, or -1 for an
+ *  empty cell. neighbour[cell][dir] is the cell index of the neighbouring electrode in
+ *  direction dir (HDEMG_NEIGHBOUR_*), or -1 when there is none.
+ */
+template <uint32_t Rows, uint32_t Cols>
+struct HdemgGridLayout
+{
+    static const uint32_t rows  = Rows;
+    static const uint32_t cols  = Cols;
+    static const uint32_t cells = Rows * Cols;
+
+    int16_t  pin[Rows * Cols];
+    int16_t  neighbour[Rows * Cols][4];
+    uint32_t frontEnds;  //!< number of 32 channel front ends the grid occupies
+
+    constexpr int32_t Cell(uint32_t row, uint32_t col) const { return (int32_t)(row * Cols + col); }
+
+    //! \brief pin at (row, col), -1 for empty cells or positions outside the grid
+    constexpr int32_t Pin(int32_t row, int32_t col) const
+    {
+        return (row < 0 || col < 0 || row >= (int32_t)Rows || col >= (int32_t)Cols) ? -1 : pin[row * Cols + col];
+    }
+};
+
+//! \defgroup HdemgLayoutOrders
+//! \{
+//! \brief Order in which the pins are assigned to the grid cells
+static const uint32_t HDEMG_LAYOUT_ROW_MAJOR    = 0; // pin 0 at (0,0), then along the row
+static const uint32_t HDEMG_LAYOUT_COLUMN_MAJOR = 1; // pin 0 at (0,0), then down the column
+static const uint32_t HDEMG_LAYOUT_COLUMN_SNAKE = 2; // down the first column, up the second, ...
+//! \}
+
+/**
+    Builds a layout by assigning consecutive pins to the cells in the given order. Cells
+    listed in pEmptyCells (row*Cols + col) are skipped and get no pin.
+
+    \arg order       - one of the HDEMG_LAYOUT_* orders
+    \arg pEmptyCells - cells without an electrode (may be nullptr)
+    \arg emptyCount  - number of entries in pEmptyCells
+  */
+template <uint32_t Rows, uint32_t Cols>
+constexpr HdemgGridLayout<Rows, Cols>
+HdemgMakeGridLayout(uint32_t order, const uint32_t * pEmptyCells = nullptr, uint32_t emptyCount = 0)
+{
+    static_assert(Rows * Cols <= HDEMG_GRID_MAX_CELLS, "grid has too many cells");
+
+    HdemgGridLayout<Rows, Cols> layout {};
+    int16_t nextPin = 0;
+
+    for(uint32_t i=0; i<Rows*Cols; ++i)
+    {
+        uint32_t row = 0;
+        uint32_t col = 0;
+        if(order == HDEMG_LAYOUT_ROW_MAJOR)
+        {
+            row = i / Cols;
+            col = i % Cols;
+        }
+        else
+        {
+            col = i / Rows;
+            row = i % Rows;
+            if(order == HDEMG_LAYOUT_COLUMN_SNAKE && (col & 1))
+                row = Rows - 1 - row;
+        }
+
+        uint32_t cell  = row * Cols + col;
+        bool     empty = false;
+        for(uint32_t e=0; e<emptyCount; ++e)
+            empty = empty || (pEmptyCells[e] == cell);
+
+        layout.pin[cell] = empty ? (int16_t)-1 : nextPin++;
+    }
+    layout.frontEnds = ((uint32_t)nextPin + HDEMG_CHANNELS_PER_FRONT_END - 1) / HDEMG_CHANNELS_PER_FRONT_END;
+
+    for(uint32_t row=0; row<Rows; ++row)
+    {
+        for(uint32_t col=0; col<Cols; ++col)
+        {
+            uint32_t cell = row * Cols + col;
+            layout.neighbour[cell][HDEMG_NEIGHBOUR_UP]    = (row > 0        && layout.pin[cell - Cols] >= 0) ? (int16_t)(cell - Cols) : (int16_t)-1;
+            layout.neighbour[cell][HDEMG_NEIGHBOUR_DOWN]  = (row + 1 < Rows && layout.pin[cell + Cols] >= 0) ? (int16_t)(cell + Cols) : (int16_t)-1;
+            layout.neighbour[cell][HDEMG_NEIGHBOUR_LEFT]  = (col > 0        && layout.pin[cell - 1] >= 0)    ? (int16_t)(cell - 1)    : (int16_t)-1;
+            layout.neighbour[cell][HDEMG_NEIGHBOUR_RIGHT] = (col + 1 < Cols && layout.pin[cell + 1] >= 0)    ? (int16_t)(cell + 1)    : (int16_t)-1;
+        }
+    }
+    return layout;
+}
+
+//
+// Standard grids. Check the pin order against the adapter before relying on these, and
+// add a new layout (or a layout file) for adapters that are wired differently.
+//
+
+//! \brief 8x8 grid, 64 electrodes on two front ends, numbered along the rows
+constexpr HdemgGridLayout<8, 8>  HDEMG_GRID_8X8 = HdemgMakeGridLayout<8, 8>(HDEMG_LAYOUT_ROW_MAJOR);
+
+//! \brief 13x5 grid, 64 electrodes on two front ends, top left corner empty, numbered down the columns
+constexpr uint32_t HDEMG_GRID_13X5_EMPTY[] = { 0 };
+constexpr HdemgGridLayout<13, 5> HDEMG_GRID_13X5 = HdemgMakeGridLayout<13, 5>(HDEMG_LAYOUT_COLUMN_MAJOR, HDEMG_GRID_13X5_EMPTY, 1);
+
+/**
+    Returns the frame channel of a grid pin given where the grid is plugged in and the
+    front end order the HdemgFrameAssembler was configured with, or -1 if the front end
+    carrying the pin is not part of the frame.
+
+    \arg pin        - pin of the grid (HdemgGridLayout::pin)
+    \arg firstFE    - front end number of the grid's first front end (HdemgFrontEndNumber)
+    \arg pFrontEnds - front end list passed to HdemgFrameAssembler::Configure()
+    \arg feCount    - number of entries in pFrontEnds
+  */
+constexpr int32_t
+HdemgPinToFrameChannel(int32_t pin, int32_t firstFE, const uint32_t * pFrontEnds, uint32_t feCount)
+{
+    if(pin < 0 || firstFE < 0)
+        return -1;
+
+    uint32_t fe = (uint32_t)firstFE + (uint32_t)pin / HDEMG_CHANNELS_PER_FRONT_END;
+    for(uint32_t slot=0; slot<feCount; ++slot)
+    {
+        if(pFrontEnds[slot] == fe)
+            return (int32_t)(slot * HDEMG_CHANNELS_PER_FRONT_END + (uint32_t)pin % HDEMG_CHANNELS_PER_FRONT_END);
+    }
+    return -1;
+}
+
+/**
+    Converts a compile time layout plugged into (port, position) into the run time geometry
+    used by the processing stages.
+
+    \return false if a front end of the grid is not part of the frame
+  */
+template <uint32_t Rows, uint32_t Cols>
+bool
+HdemgLayoutToGeometry(const HdemgGridLayout<Rows, Cols> & layout, char port, uint32_t position,
+                      const uint32_t * pFrontEnds, uint32_t feCount, HdemgGridGeometry & geometry)
+{
+    int32_t firstFE = HdemgFrontEndNumber(port, position);
+    if(firstFE < 0 || !geometry.Resize(Rows, Cols))
+    {
+        printf("ERROR: invalid grid connector %c%u\n", port, position);
+        return false;
+    }
+
+    for(uint32_t row=0; row<Rows; ++row)
+    {
+        for(uint32_t col=0; col<Cols; ++col)
+        {
+            int32_t pin = layout.pin[row * Cols + col];
+            if(pin < 0)
+                continue;
+            int32_t ch = HdemgPinToFrameChannel(pin, firstFE, pFrontEnds, feCount);
+            if(ch < 0)
+            {
+                printf("ERROR: grid at %c%u needs a front end that is not in the frame\n", port, position);
+                return false;
+            }
+            geometry.Set(row, col, ch);
+        }
+    }
+    return true;
+}
+
+/**
+    Reads a grid layout from a text file. Lines starting with '#' are comments. The file has
+    a "rows", "cols", "port" and "position" line followed by rows*cols pins in row-major
+    order, -1 marking empty cells:
+
+        rows 2
+        cols 3
+        port A
+        position 1
+        0 1 2
+        5 4 -1
+
+    \arg path       - layout file
+    \arg pFrontEnds - front end list passed to HdemgFrameAssembler::Configure()
+    \arg feCount    - number of entries in pFrontEnds
+    \arg geometry   - receives the resolved geometry
+
+    \return true if the file was read and every pin maps to a frame channel
+  */
+inline bool
+HdemgLoadGridLayout(const char * path, const uint32_t * pFrontEnds, uint32_t feCount, HdemgGridGeometry & geometry)
+{
+    FILE * pFile = fopen(path, "r");
+    if(!pFile)
+    {
+        printf("ERROR: could not open grid layout [%s]\n", path);
+        return false;
+    }
+
+    uint32_t rows     = 0;
+    uint32_t cols     = 0;
+    char     port     = 0;
+    uint32_t position = 0;
+    uint32_t cell     = 0;
+    bool     ok       = true;
+    char     line[1024];
+
+    while(ok && fgets(line, sizeof(line), pFile))
+    {
+        char * p = line;
+        while(*p == ' ' || *p == '\t')
+            ++p;
+        if(*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+
+        if(!strncmp(p, "rows", 4))          rows     = (uint32_t)atoi(p + 4);
+        else if(!strncmp(p, "cols", 4))     cols     = (uint32_t)atoi(p + 4);
+        else if(!strncmp(p, "position", 8)) position = (uint32_t)atoi(p + 8);
+        else if(!strncmp(p, "port", 4))
+        {
+            p += 4;
+            while(*p == ' ' || *p == '\t')
+                ++p;
+            port = (char)toupper(*p);
+        }
+        else
+        {
+            // a row of pins, the header must be complete by now
+            if(cell == 0)
+            {
+                int32_t firstFE = HdemgFrontEndNumber(port, position);
+                if(firstFE < 0 || rows * cols > HDEMG_GRID_MAX_CELLS || !geometry.Resize(rows, cols))
+                {
+                    printf("ERROR: grid layout [%s] has an invalid header\n", path);
+                    ok = false;
+                    break;
+                }
+            }
+
+            char * pEnd = p;
+            for(;;)
+            {
+                long pin = strtol(p, &pEnd, 10);
+                if(pEnd == p)
+                    break;
+                p = pEnd;
+
+                if(cell >= rows * cols)
+                {
+                    printf("ERROR: grid layout [%s] has more than %u cells\n", path, rows * cols);
+                    ok = false;
+                    break;
+                }
+                if(pin >= 0)
+                {
+                    int32_t ch = HdemgPinToFrameChannel((int32_t)pin, HdemgFrontEndNumber(port, position), pFrontEnds, feCount);
+                    if(ch < 0)
+                    {
+                        printf("ERROR: pin [%ld] of grid layout [%s] is not in the frame\n", pin, path);
+                        ok = false;
+                        break;
+                    }
+                    geometry.Set(cell / cols, cell % cols, ch);
+                }
+                cell++;
+            }
+        }
+    }
+    fclose(pFile);
+
+    if(ok && (cell == 0 || cell != rows * cols))
+    {
+        printf("ERROR: grid layout [%s] lists %u of %u cells\n", path, cell, rows * cols);
+        ok = false;
+    }
+    return ok;
+}
+
+#endif // HDEMG_GRID_LAYOUTS_H
@@ -0,0 +1,258 @@
+//
+//  hdemg_linalg.h
+//
+//  Dense symmetric eigen decomposition used to whiten extended HD-EMG observations.
+//  Householder reduction to tridiagonal form followed by the implicit QL algorithm
+//  (EISPACK tred2 / tql2), in double precision. The cost is O(n^3) with a small constant,
+//  which keeps a 1000 dimensional covariance in the range of a second.
+//
+
+#ifndef HDEMG_LINALG_H
+#define HDEMG_LINALG_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "hdemg_simd.h"
+
+/**
+    Eigen decomposition of a symmetric matrix.
+
+    \arg a       - n x n row-major matrix; only the lower triangle is read. Replaced by the
+                   eigenvectors, one per row (row k belongs to values[k])
+    \arg n       - matrix dimension
+    \arg values  - receives the n eigenvalues in ascending order
+
+    \return false if the QL iteration did not converge
+  */
+inline bool
+HdemgSymmetricEigen(std::vector<double> & a, uint32_t n, std::vector<double> & values)
+{
+    if(n == 0 || a.size() < (size_t)n * n)
+    {
+        printf("ERROR: invalid eigen decomposition size [%u]\n", n);
+        return false;
+    }
+
+    // v holds the transpose of the reference algorithm's V, V(i,j) = v[j*n + i], so that
+    // its inner loops and the QL rotations below run along contiguous rows
+    std::vector<double> & v = a;
+    std::vector<double>   e(n, 0.0);
+    std::vector<double> & d = values;
+    d.assign(n, 0.0);
+
+    for(uint32_t i=0; i<n; ++i)
+        for(uint32_t j=i+1; j<n; ++j)
+            v[(size_t)i*n + j] = v[(size_t)j*n + i];
+
+    // Householder reduction to tridiagonal form
+    for(uint32_t j=0; j<n; ++j)
+        d[j] = v[(size_t)j*n + n-1];
+
+    for(uint32_t i=n-1; i>0; --i)
+    {
+        double scale = 0.0;
+        double h     = 0.0;
+        for(uint32_t k=0; k<i; ++k)
+            scale += fabs(d[k]);
+
+        if(scale == 0.0)
+        {
+            e[i] = d[i-1];
+            for(uint32_t j=0; j<i; ++j)
+            {
+                d[j] = v[(size_t)j*n + i-1];
+                v[(size_t)j*n + i] = 0.0;
+                v[(size_t)i*n + j] = 0.0;
+            }
+        }
+        else
+        {
+            for(uint32_t k=0; k<i; ++k)
+            {
+                d[k] /= scale;
+                h += d[k] * d[k];
+            }
+            double f = d[i-1];
+            double g = sqrt(h);
+            if(f > 0.0)
+                g = -g;
+            e[i]   = scale * g;
+            h     -= f * g;
+            d[i-1] = f - g;
+            for(uint32_t j=0; j<i; ++j)
+                e[j] = 0.0;
+
+            for(uint32_t j=0; j<i; ++j)
+            {
+                f = d[j];
+                v[(size_t)i*n + j] = f;
+                g = e[j] + v[(size_t)j*n + j] * f;
+                for(uint32_t k=j+1; k<=i-1; ++k)
+                {
+                    g    += v[(size_t)j*n + k] * d[k];
+                    e[k] += v[(size_t)j*n + k] * f;
+                }
+                e[j] = g;
+            }
+
+            f = 0.0;
+            for(uint32_t j=0; j<i; ++j)
+            {
+                e[j] /= h;
+                f    += e[j] * d[j];
+            }
+            double hh = f / (h + h);
+            for(uint32_t j=0; j<i; ++j)
+                e[j] -= hh * d[j];
+
+            for(uint32_t j=0; j<i; ++j)
+            {
+                f = d[j];
+                g = e[j];
+                for(uint32_t k=j; k<=i-1; ++k)
+                    v[(size_t)j*n + k] -= (f * e[k] + g * d[k]);
+                d[j] = v[(size_t)j*n + i-1];
+                v[(size_t)j*n + i] = 0.0;
+            }
+        }
+        d[i] = h;
+    }
+
+    // accumulate the transformations
+    for(uint32_t i=0; i+1<n; ++i)
+    {
+        v[(size_t)i*n + n-1] = v[(size_t)i*n + i];
+        v[(size_t)i*n + i] = 1.0;
+        double h = d[i+1];
+        if(h != 0.0)
+        {
+            for(uint32_t k=0; k<=i; ++k)
+                d[k] = v[(size_t)(i+1)*n + k] / h;
+            for(uint32_t j=0; j<=i; ++j)
+            {
+                double g = 0.0;
+                for(uint32_t k=0; k<=i; ++k)
+                    g += v[(size_t)(i+1)*n + k] * v[(size_t)j*n + k];
+                for(uint32_t k=0; k<=i; ++k)
+                    v[(size_t)j*n + k] -= g * d[k];
+            }
+        }
+        for(uint32_t k=0; k<=i; ++k)
+            v[(size_t)(i+1)*n + k] = 0.0;
+    }
+    for(uint32_t j=0; j<n; ++j)
+    {
+        d[j] = v[(size_t)j*n + n-1];
+        v[(size_t)j*n + n-1] = 0.0;
+    }
+    v[(size_t)(n-1)*n + n-1] = 1.0;
+    e[0] = 0.0;
+
+    // implicit QL on the tridiagonal matrix
+    for(uint32_t i=1; i<n; ++i)
+        e[i-1] = e[i];
+    e[n-1] = 0.0;
+
+    double       f    = 0.0;
+    double       tst1 = 0.0;
+    const double eps  = 2.220446049250313e-16;
+    for(uint32_t l=0; l<n; ++l)
+    {
+        double t = fabs(d[l]) + fabs(e[l]);
+        if(t > tst1)
+            tst1 = t;
+        uint32_t m = l;
+        while(m < n-1 && fabs(e[m]) > eps * tst1)
+            m++;
+
+        if(m > l)
+        {
+            uint32_t iter = 0;
+            do
+            {
+                if(++iter > 60)
+                {
+                    printf("ERROR: eigen decomposition did not converge\n");
+                    return false;
+                }
+
+                double g = d[l];
+                double p = (d[l+1] - g) / (2.0 * e[l]);
+                double r = hypot(p, 1.0);
+                if(p < 0.0)
+                    r = -r;
+                d[l]   = e[l] / (p + r);
+                d[l+1] = e[l] * (p + r);
+                double dl1 = d[l+1];
+                double h   = g - d[l];
+                for(uint32_t i=l+2; i<n; ++i)
+                    d[i] -= h;
+                f += h;
+
+                p = d[m];
+                double c = 1.0, c2 = 1.0, c3 = 1.0;
+                double el1 = e[l+1];
+                double s = 0.0, s2 = 0.0;
+                for(uint32_t i=m; i-- > l; )
+                {
+                    c3 = c2;
+                    c2 = c;
+                    s2 = s;
+                    g  = c * e[i];
+                    h  = c * p;
+                    r  = hypot(p, e[i]);
+                    e[i+1] = s * r;
+                    s = e[i] / r;
+                    c = p / r;
+                    p = c * d[i] - s * g;
+                    d[i+1] = h + s * (c * g + s * d[i]);
+                    double * HDEMG_RESTRICT vi  = &v[(size_t)i*n];
+                    double * HDEMG_RESTRICT vi1 = &v[(size_t)(i+1)*n];
+                    for(uint32_t k=0; k<n; ++k)
+                    {
+                        double t0 = vi[k];
+                        double t1 = vi1[k];
+                        vi1[k] = s * t0 + c * t1;
+                        vi[k]  = c * t0 - s * t1;
+                    }
+                }
+                p    = -s * s2 * c3 * el1 * e[l] / dl1;
+                e[l] = s * p;
+                d[l] = c * p;
+            }
+            while(fabs(e[l]) > eps * tst1);
+        }
+        d[l] += f;
+        e[l]  = 0.0;
+    }
+
+    // sort ascending, eigenvector k is row k of v
+    std::vector<uint32_t> order(n);
+    for(uint32_t i=0; i<n; ++i)
+        order[i] = i;
+    for(uint32_t i=1; i<n; ++i)
+    {
+        uint32_t o = order[i];
+        uint32_t j = i;
+        for(; j>0 && d[order[j-1]] > d[o]; --j)
+            order[j] = order[j-1];
+        order[j] = o;
+    }
+
+    std::vector<double> vectors((size_t)n * n);
+    std::vector<double> sorted(n);
+    for(uint32_t k=0; k<n; ++k)
+    {
+        sorted[k] = d[order[k]];
+        for(uint32_t i=0; i<n; ++i)
+            vectors[(size_t)k*n + i] = v[(size_t)order[k]*n + i];
+    }
+    a.swap(vectors);
+    values.swap(sorted);
+    return true;
+}
+
+#endif // HDEMG_LINALG_H
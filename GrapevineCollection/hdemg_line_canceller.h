@@ -0,0 +1,451 @@
+//
+//  hdemg_line_canceller.h
+//
+//  Adaptive power-line interference canceller. Instead of notching fixed frequencies, the
+//  interference on every channel is modelled as a sum of mains harmonics
+//
+//      x_line[n] = sum_h  A_h cos(h theta[n]) + B_h sin(h theta[n])
+//
+//  driven by one oscillator theta that is locked to the actual mains frequency. The
+//  amplitudes A_h, B_h of every channel are projected out of an analysis window of
+//  HDEMG_LINE_WINDOW_CYCLES mains cycles, accumulated over as many blocks as it takes, and
+//  smoothed over a time constant of about a second. The cos / sin basis is only orthogonal
+//  over whole cycles, so the window does not depend on the block size: blocks of 1 ms (NIP
+//  packets at 2 kHz) give the same estimates as long ones. Every block has the current
+//  model subtracted as it passes, so no latency is added. Because the smoothing averages
+//  over many cycles the canceller only removes the narrow lines and leaves the EMG
+//  spectrum around them.
+//
+//  The oscillator frequency follows mains drift with a frequency locked loop: the rotation
+//  of the fundamental's window phasor from one window to the next is the frequency error.
+//  The rotation is taken either from a reference channel or jointly from all channels (sum
+//  of the per-channel phasor products, which weights channels by their interference power).
+//
+//  Per frame and harmonic the work is four multiply-adds per channel (two to project, two
+//  to subtract). Both passes take one vector register of channels at a time and keep all
+//  harmonics of those channels in registers, so each sample is loaded once per pass. That
+//  is cheaper than a bank of IIR notch filters, which reads and writes state for every
+//  biquad, and unlike fixed notches it follows the mains frequency.
+//
+
+#ifndef HDEMG_LINE_CANCELLER_H
+#define HDEMG_LINE_CANCELLER_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "hdemg_frames.h"
+#include "hdemg_simd.h"
+
+static const uint32_t HDEMG_LINE_MAX_HARMONICS   = 8;
+static const int32_t  HDEMG_LINE_JOINT_REFERENCE = -1;
+static const uint32_t HDEMG_LINE_FRAME_TILE      = 16;   // frames per cache-resident tile
+static const uint32_t HDEMG_LINE_WINDOW_CYCLES   = 5;    // nominal mains cycles per analysis window
+
+// one register of channels, with the same AVX / SSE2 / scalar choice as hdemg_simd.h
+#if defined(__AVX__)
+typedef __m256 HdemgLineVec;
+static const uint32_t HDEMG_LINE_LANES = 8;
+inline HdemgLineVec HdemgLineLoad(const float * p)                { return _mm256_loadu_ps(p); }
+inline void HdemgLineStore(float * p, HdemgLineVec v)             { _mm256_storeu_ps(p, v); }
+inline HdemgLineVec HdemgLineSet(float a)                         { return _mm256_set1_ps(a); }
+inline HdemgLineVec HdemgLineSub(HdemgLineVec a, HdemgLineVec b)  { return _mm256_sub_ps(a, b); }
+inline HdemgLineVec HdemgLineMulAdd(HdemgLineVec acc, HdemgLineVec a, HdemgLineVec b)
+{
+    return _mm256_add_ps(acc, _mm256_mul_ps(a, b));
+}
+#elif defined(HDEMG_SSE2)
+typedef __m128 HdemgLineVec;
+static const uint32_t HDEMG_LINE_LANES = 4;
+inline HdemgLineVec HdemgLineLoad(const float * p)                { return _mm_loadu_ps(p); }
+inline void HdemgLineStore(float * p, HdemgLineVec v)             { _mm_storeu_ps(p, v); }
+inline HdemgLineVec HdemgLineSet(float a)                         { return _mm_set1_ps(a); }
+inline HdemgLineVec HdemgLineSub(HdemgLineVec a, HdemgLineVec b)  { return _mm_sub_ps(a, b); }
+inline HdemgLineVec HdemgLineMulAdd(HdemgLineVec acc, HdemgLineVec a, HdemgLineVec b)
+{
+    return _mm_add_ps(acc, _mm_mul_ps(a, b));
+}
+#else
+typedef float HdemgLineVec;
+static const uint32_t HDEMG_LINE_LANES = 1;
+inline HdemgLineVec HdemgLineLoad(const float * p)                { return *p; }
+inline void HdemgLineStore(float * p, HdemgLineVec v)             { *p = v; }
+inline HdemgLineVec HdemgLineSet(float a)                         { return a; }
+inline HdemgLineVec HdemgLineSub(HdemgLineVec a, HdemgLineVec b)  { return a - b; }
+inline HdemgLineVec HdemgLineMulAdd(HdemgLineVec acc, HdemgLineVec a, HdemgLineVec b)
+{
+    return acc + a * b;
+}
+#endif
+
+/*! \brief Mains canceller operating in place on a block stream.
+ */
+class HdemgLineCanceller
+{
+public:
+    HdemgLineCanceller()
+        : channelCount(0), harmonicCount(0), reference(HDEMG_LINE_JOINT_REFERENCE), sampleRate(0.0), nominalHz(0.0),
+          rangeHz(0.0), frequency(0.0), timeConstant(0.0), loopGain(0.0), phase(0.0), windowFrames(0), windowFill(0),
+          windows(0), expectedTime(0), streamStarted(false) {}
+
+    /**
+        Sizes the canceller.
+
+        \arg channels       - channels per frame
+        \arg rate           - frame rate of the input blocks in Hz
+        \arg mainsHz        - nominal mains frequency (50 or 60)
+        \arg harmonics      - number of harmonics to cancel including the fundamental; harmonics
+                              at or above Nyquist are dropped
+        \arg referenceCh    - channel used to track the mains frequency, or
+                              HDEMG_LINE_JOINT_REFERENCE to track it jointly across channels
+        \arg smoothingSec   - time constant of the amplitude estimates
+        \arg maxFrames      - largest block that will be passed to Process(); blocks of any
+                              size from one frame work, the estimates are taken per window
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, double rate, double mainsHz, uint32_t harmonics, int32_t referenceCh,
+                   double smoothingSec, uint32_t maxFrames)
+    {
+        if(channels == 0 || rate <= 0.0 || mainsHz <= 0.0 || harmonics == 0 || harmonics > HDEMG_LINE_MAX_HARMONICS
+           || referenceCh >= (int32_t)channels || referenceCh < HDEMG_LINE_JOINT_REFERENCE || smoothingSec <= 0.0
+           || maxFrames == 0)
+        {
+            printf("ERROR: invalid line canceller configuration\n");
+            return false;
+        }
+
+        channelCount  = channels;
+        sampleRate    = rate;
+        nominalHz     = mainsHz;
+        rangeHz       = 0.02 * mainsHz;     // grids stay well within 2%
+        reference     = referenceCh;
+        timeConstant  = smoothingSec;
+        loopGain      = 0.2;
+        windowFrames  = (uint32_t)(HDEMG_LINE_WINDOW_CYCLES * rate / mainsHz + 0.5);
+        harmonicCount = 0;
+        while(harmonicCount < harmonics && (harmonicCount + 1) * (mainsHz + rangeHz) < 0.5 * rate)
+            harmonicCount++;
+        if(harmonicCount == 0)
+        {
+            printf("ERROR: mains frequency [%.1f] Hz is above Nyquist\n", mainsHz);
+            return false;
+        }
+
+        const size_t size = (size_t)harmonicCount * channels;
+        cosAmp.assign(size, 0.0f);
+        sinAmp.assign(size, 0.0f);
+        cosSum.assign(size, 0.0f);
+        sinSum.assign(size, 0.0f);
+        prevCos.assign(channels, 0.0f);
+        prevSin.assign(channels, 0.0f);
+        oscCos.assign((size_t)maxFrames * harmonicCount, 0.0f);
+        oscSin.assign((size_t)maxFrames * harmonicCount, 0.0f);
+        Reset();
+        return true;
+    }
+
+    //! \brief Forgets the interference estimates and restarts frequency tracking
+    void Reset()
+    {
+        std::fill(cosAmp.begin(), cosAmp.end(), 0.0f);
+        std::fill(sinAmp.begin(), sinAmp.end(), 0.0f);
+        frequency     = nominalHz;
+        phase         = 0.0;
+        windows       = 0;
+        streamStarted = false;
+        StartWindow();
+    }
+
+    /**
+        Removes the interference from a block in place. A NIP gap keeps the amplitude
+        estimates but moves the oscillator phase across the gap and starts a new analysis
+        window.
+      */
+    bool Process(HdemgBlock & block)
+    {
+        if(block.channelCount != channelCount || block.frameCount * harmonicCount > oscCos.size())
+        {
+            printf("ERROR: line canceller block [%u x %u] does not match configuration\n", block.frameCount, block.channelCount);
+            return false;
+        }
+        if(block.frameCount == 0)
+            return true;
+
+        // keep the oscillator on the NIP timeline across gaps
+        if(streamStarted && !HdemgIsContiguous(block, expectedTime))
+        {
+            double missing = ((int32_t)(block.startTime - expectedTime)) / block.TicksPerFrame();
+            phase = fmod(phase + 2.0 * HDEMG_PI * frequency * missing / sampleRate, 2.0 * HDEMG_PI);
+            windows = 0;  // the phasor of the previous window is no longer comparable
+            StartWindow();
+        }
+        streamStarted = true;
+        expectedTime  = block.EndTime();
+
+        const uint32_t H      = harmonicCount;
+        const uint32_t frames = block.frameCount;
+
+        // oscillator values for the block: the fundamental advances by rotation from the block
+        // phase (double precision keeps the drift over a block negligible), the harmonics by
+        // repeated rotation of the fundamental
+        const double step  = 2.0 * HDEMG_PI * frequency / sampleRate;
+        const double cStep = cos(step), sStep = sin(step);
+        double c1 = cos(phase), s1 = sin(phase);
+        for(uint32_t f=0; f<frames; ++f)
+        {
+            double c = c1, s = s1;
+            float * oc = &oscCos[(size_t)f * H];
+            float * os = &oscSin[(size_t)f * H];
+            for(uint32_t h=0; h<H; ++h)
+            {
+                oc[h] = (float)c;
+                os[h] = (float)s;
+                double cn = c * c1 - s * s1;
+                s = s * c1 + c * s1;
+                c = cn;
+            }
+            double cn = c1 * cStep - s1 * sStep;
+            s1 = s1 * cStep + c1 * sStep;
+            c1 = cn;
+        }
+        phase = fmod(phase + step * frames, 2.0 * HDEMG_PI);
+
+        // add each part of the block to its analysis window, update the model when the
+        // window is complete, and subtract the model
+        for(uint32_t first=0; first<frames; )
+        {
+            uint32_t count = std::min(frames - first, windowFrames - windowFill);
+            Dispatch(block, first, count, true);
+            windowFill += count;
+            if(windowFill == windowFrames)
+            {
+                UpdateModel();
+                StartWindow();
+            }
+            Dispatch(block, first, count, false);
+            first += count;
+        }
+        return true;
+    }
+
+    //! \brief current estimate of the mains frequency in Hz
+    double Frequency() const { return frequency; }
+    uint32_t HarmonicCount() const { return harmonicCount; }
+
+    //! \brief estimated interference amplitude of a harmonic (0 = fundamental) on a channel
+    float Amplitude(uint32_t harmonic, uint32_t channel) const
+    {
+        size_t i = (size_t)harmonic * channelCount + channel;
+        return sqrtf(cosAmp[i] * cosAmp[i] + sinAmp[i] * sinAmp[i]);
+    }
+
+private:
+    //! \brief clears the sums of the analysis window
+    void StartWindow()
+    {
+        std::fill(cosSum.begin(), cosSum.end(), 0.0f);
+        std::fill(sinSum.begin(), sinSum.end(), 0.0f);
+        windowFill = 0;
+    }
+
+    //! \brief window amplitudes 2/N * sum smoothed into the model, then the frequency loop
+    void UpdateModel()
+    {
+        const float norm  = 2.0f / windowFrames;
+        const float alpha = (float)(1.0 - exp(-(double)windowFrames / (timeConstant * sampleRate)));
+        for(size_t i=0; i<cosSum.size(); ++i)
+        {
+            cosSum[i] *= norm;
+            sinSum[i] *= norm;
+            cosAmp[i] += alpha * (cosSum[i] - cosAmp[i]);
+            sinAmp[i] += alpha * (sinSum[i] - sinAmp[i]);
+        }
+        TrackFrequency(windowFrames);
+    }
+
+    //! \brief runs Project or Subtract on frames [first, first + count) with the harmonic count as a compile time constant
+    void Dispatch(HdemgBlock & block, uint32_t first, uint32_t count, bool project)
+    {
+        switch(harmonicCount)
+        {
+            case 1: project ? Project<1>(block, first, count) : Subtract<1>(block, first, count); break;
+            case 2: project ? Project<2>(block, first, count) : Subtract<2>(block, first, count); break;
+            case 3: project ? Project<3>(block, first, count) : Subtract<3>(block, first, count); break;
+            case 4: project ? Project<4>(block, first, count) : Subtract<4>(block, first, count); break;
+            case 5: project ? Project<5>(block, first, count) : Subtract<5>(block, first, count); break;
+            case 6: project ? Project<6>(block, first, count) : Subtract<6>(block, first, count); break;
+            case 7: project ? Project<7>(block, first, count) : Subtract<7>(block, first, count); break;
+            default: project ? Project<8>(block, first, count) : Subtract<8>(block, first, count); break;
+        }
+    }
+
+    /**
+        cosSum[h][c] += sum_f x[f][c] cos(h theta_f), likewise sinSum, over frames
+        [first, first + count) of the block. The frames are walked in tiles of
+        HDEMG_LINE_FRAME_TILE that stay in L1, and within a tile channels are taken
+        HDEMG_LINE_LANES at a time so that the 2*H accumulators stay in registers. The
+        channels past the last full register are done one by one.
+      */
+    template<uint32_t H>
+    void Project(const HdemgBlock & block, uint32_t first, uint32_t count)
+    {
+        const uint32_t nCh    = channelCount;
+        const uint32_t frames = first + count;
+        const uint32_t full   = nCh - nCh % HDEMG_LINE_LANES;
+        for(uint32_t f0=first; f0<frames; f0+=HDEMG_LINE_FRAME_TILE)
+        {
+            const uint32_t f1 = std::min(frames, f0 + HDEMG_LINE_FRAME_TILE);
+            for(uint32_t c0=0; c0<full; c0+=HDEMG_LINE_LANES)
+            {
+                HdemgLineVec ac[H], as[H];
+                for(uint32_t h=0; h<H; ++h)
+                {
+                    ac[h] = HdemgLineLoad(&cosSum[(size_t)h * nCh + c0]);
+                    as[h] = HdemgLineLoad(&sinSum[(size_t)h * nCh + c0]);
+                }
+                for(uint32_t f=f0; f<f1; ++f)
+                {
+                    const HdemgLineVec x  = HdemgLineLoad(block.Frame(f) + c0);
+                    const float *      oc = &oscCos[(size_t)f * H];
+                    const float *      os = &oscSin[(size_t)f * H];
+                    for(uint32_t h=0; h<H; ++h)
+                    {
+                        ac[h] = HdemgLineMulAdd(ac[h], HdemgLineSet(oc[h]), x);
+                        as[h] = HdemgLineMulAdd(as[h], HdemgLineSet(os[h]), x);
+                    }
+                }
+                for(uint32_t h=0; h<H; ++h)
+                {
+                    HdemgLineStore(&cosSum[(size_t)h * nCh + c0], ac[h]);
+                    HdemgLineStore(&sinSum[(size_t)h * nCh + c0], as[h]);
+                }
+            }
+        }
+        for(uint32_t c=full; c<nCh; ++c)
+        {
+            float ac[H] = {}, as[H] = {};
+            for(uint32_t f=first; f<frames; ++f)
+            {
+                const float x = block.Frame(f)[c];
+                for(uint32_t h=0; h<H; ++h)
+                {
+                    ac[h] += oscCos[(size_t)f * H + h] * x;
+                    as[h] += oscSin[(size_t)f * H + h] * x;
+                }
+            }
+            for(uint32_t h=0; h<H; ++h)
+            {
+                cosSum[(size_t)h * nCh + c] += ac[h];
+                sinSum[(size_t)h * nCh + c] += as[h];
+            }
+        }
+    }
+
+    //! \brief x[f][c] -= sum_h cosAmp[h][c] cos(h theta_f) + sinAmp[h][c] sin(h theta_f) over frames [first, first + count)
+    template<uint32_t H>
+    void Subtract(HdemgBlock & block, uint32_t first, uint32_t count)
+    {
+        const uint32_t nCh    = channelCount;
+        const uint32_t frames = first + count;
+        const uint32_t full   = nCh - nCh % HDEMG_LINE_LANES;
+        for(uint32_t f0=first; f0<frames; f0+=HDEMG_LINE_FRAME_TILE)
+        {
+            const uint32_t f1 = std::min(frames, f0 + HDEMG_LINE_FRAME_TILE);
+            for(uint32_t c0=0; c0<full; c0+=HDEMG_LINE_LANES)
+            {
+                HdemgLineVec a[H], b[H];
+                for(uint32_t h=0; h<H; ++h)
+                {
+                    a[h] = HdemgLineLoad(&cosAmp[(size_t)h * nCh + c0]);
+                    b[h] = HdemgLineLoad(&sinAmp[(size_t)h * nCh + c0]);
+                }
+                for(uint32_t f=f0; f<f1; ++f)
+                {
+                    float *       x  = block.Frame(f) + c0;
+                    const float * oc = &oscCos[(size_t)f * H];
+                    const float * os = &oscSin[(size_t)f * H];
+                    HdemgLineVec lineCos = HdemgLineSet(0.0f);
+                    HdemgLineVec lineSin = HdemgLineSet(0.0f);
+                    for(uint32_t h=0; h<H; ++h)
+                    {
+                        lineCos = HdemgLineMulAdd(lineCos, a[h], HdemgLineSet(oc[h]));
+                        lineSin = HdemgLineMulAdd(lineSin, b[h], HdemgLineSet(os[h]));
+                    }
+                    HdemgLineStore(x, HdemgLineSub(HdemgLineSub(HdemgLineLoad(x), lineCos), lineSin));
+                }
+            }
+        }
+        for(uint32_t c=full; c<nCh; ++c)
+        {
+            for(uint32_t f=first; f<frames; ++f)
+            {
+                float line = 0.0f;
+                for(uint32_t h=0; h<H; ++h)
+                    line += cosAmp[(size_t)h * nCh + c] * oscCos[(size_t)f * H + h]
+                          + sinAmp[(size_t)h * nCh + c] * oscSin[(size_t)f * H + h];
+                block.Frame(f)[c] -= line;
+            }
+        }
+    }
+
+    /**
+        Frequency locked loop on the fundamental. With C = A - iB the window phasor, a
+        frequency error d rotates C by 2 pi d N / fs between consecutive windows of N frames.
+      */
+    void TrackFrequency(uint32_t frames)
+    {
+        const uint32_t nCh = channelCount;
+        const float *  a   = &cosSum[0];
+        const float *  b   = &sinSum[0];
+
+        // sum of C_k * conj(C_k-1) over the tracked channels
+        double re = 0.0, im = 0.0;
+        uint32_t first = (reference == HDEMG_LINE_JOINT_REFERENCE) ? 0 : (uint32_t)reference;
+        uint32_t last  = (reference == HDEMG_LINE_JOINT_REFERENCE) ? nCh : first + 1;
+        for(uint32_t c=first; c<last; ++c)
+        {
+            // (a - ib)(pa + i pb)
+            re += (double)a[c] * prevCos[c] + (double)b[c] * prevSin[c];
+            im += (double)a[c] * prevSin[c] - (double)b[c] * prevCos[c];
+        }
+        memcpy(&prevCos[0], a, nCh * sizeof(float));
+        memcpy(&prevSin[0], b, nCh * sizeof(float));
+
+        if(windows++ == 0 || (re == 0.0 && im == 0.0))
+            return;
+
+        double error = atan2(im, re) * sampleRate / (2.0 * HDEMG_PI * frames);
+        frequency += loopGain * error;
+        frequency  = std::max(nominalHz - rangeHz, std::min(nominalHz + rangeHz, frequency));
+    }
+
+    uint32_t           channelCount;
+    uint32_t           harmonicCount;
+    int32_t            reference;
+    double             sampleRate;
+    double             nominalHz;
+    double             rangeHz;       // tracking range around the nominal frequency
+    double             frequency;
+    double             timeConstant;  // seconds
+    double             loopGain;
+    double             phase;         // oscillator phase at the start of the next block
+    uint32_t           windowFrames;  // frames per analysis window
+    uint32_t           windowFill;    // frames of the current window projected so far
+    uint32_t           windows;       // windows since the phasor history was cleared
+    uint32_t           expectedTime;
+    bool               streamStarted;
+    std::vector<float> cosAmp;        // [harmonic][channel] smoothed model
+    std::vector<float> sinAmp;
+    std::vector<float> cosSum;        // [harmonic][channel] current window
+    std::vector<float> sinSum;
+    std::vector<float> prevCos;       // fundamental of the previous window, [channel]
+    std::vector<float> prevSin;
+    std::vector<float> oscCos;        // [frame][harmonic]
+    std::vector<float> oscSin;
+};
+
+#endif // HDEMG_LINE_CANCELLER_H
@@ -0,0 +1,117 @@
+//
+//  hdemg_mmap.h
+//
+//  Read-only memory mapping of a whole file, used by the file readers (hdemg_nsx_reader.h,
+//  hdemg_archive.h). POSIX mmap on Linux / macOS, a file mapping object on Windows.
+//
+
+#ifndef HDEMG_MMAP_H
+#define HDEMG_MMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(_WIN32)
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+/*! \brief A file mapped into memory for reading.
+ */
+class HdemgMappedFile
+{
+public:
+    HdemgMappedFile()
+        : pData(NULL), size(0)
+#if defined(_WIN32)
+          , hFile(INVALID_HANDLE_VALUE), hMapping(NULL)
+#endif
+    {}
+
+    ~HdemgMappedFile() { Close(); }
+
+    /**
+        Maps a file.
+
+        \return false if the file is missing, empty or cannot be mapped
+      */
+    bool Open(const char * pPath)
+    {
+        Close();
+#if defined(_WIN32)
+        hFile = CreateFileA(pPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+        LARGE_INTEGER fileSize;
+        if(hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart == 0)
+        {
+            printf("ERROR: cannot open [%s]\n", pPath);
+            Close();
+            return false;
+        }
+        size     = (uint64_t)fileSize.QuadPart;
+        hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        pData    = hMapping ? (const uint8_t *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+        int fd = open(pPath, O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            printf("ERROR: cannot open [%s]\n", pPath);
+            if(fd >= 0)
+                close(fd);
+            return false;
+        }
+        size = (uint64_t)st.st_size;
+        void * p = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        pData = (p == MAP_FAILED) ? NULL : (const uint8_t *)p;
+#endif
+        if(!pData)
+        {
+            printf("ERROR: cannot map [%s]\n", pPath);
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#if defined(_WIN32)
+        if(pData)
+            UnmapViewOfFile(pData);
+        if(hMapping)
+            CloseHandle(hMapping);
+        if(hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(hFile);
+        hMapping = NULL;
+        hFile    = INVALID_HANDLE_VALUE;
+#else
+        if(pData)
+            munmap((void *)pData, (size_t)size);
+#endif
+        pData = NULL;
+        size  = 0;
+    }
+
+    bool            IsOpen() const { return pData != NULL; }
+    const uint8_t * Data() const   { return pData; }
+    uint64_t        Size() const   { return size; }
+
+private:
+    HdemgMappedFile(const HdemgMappedFile &);
+    HdemgMappedFile & operator=(const HdemgMappedFile &);
+
+    const uint8_t * pData;
+    uint64_t        size;
+#if defined(_WIN32)
+    HANDLE          hFile;
+    HANDLE          hMapping;
+#endif
+};
+
+#endif // HDEMG_MMAP_H
@@ -0,0 +1,190 @@
+//
+//  hdemg_nsx.h
+//
+//  On-disk layout of Blackrock NSx 2.2 / 2.3 continuous files (.ns1 - .ns6) as written by
+//  Trellis and parsed by openNSx.m:
+//
+//      basic header      "NEURALCD", file spec, header size, label, comment, period,
+//                        time resolution, origin time and channel count (314 bytes)
+//      extended headers  one 66 byte "CC" header per channel
+//      data packets      0x01, uint32 timestamp, uint32 DataPoints, followed by
+//                        DataPoints sample-major frames of int16 counts
+//
+//  A recording that was paused or lost packets holds one data packet per contiguous
+//  segment. Timestamps are in ticks of the time resolution, which is the NIP clock.
+//
+
+#ifndef HDEMG_NSX_H
+#define HDEMG_NSX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+  #include <io.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+static const char     HDEMG_NSX_FILE_TYPE[8]     = {'N','E','U','R','A','L','C','D'};
+static const uint8_t  HDEMG_NSX_SPEC_MAJOR       = 2;
+static const uint8_t  HDEMG_NSX_DATA_HEADER_ID   = 0x01;
+static const uint32_t HDEMG_NSX_TIME_RESOLUTION  = 30000;   // same as HDEMG_NIP_CLOCK_HZ
+
+// pack the file structures to byte level
+#pragma pack(push, 1)
+
+//! \brief origin time of the recording, laid out like the Windows SYSTEMTIME
+struct HdemgNsxTime
+{
+    uint16_t year;
+    uint16_t month;
+    uint16_t dayOfWeek;     //!< 0 = Sunday
+    uint16_t day;
+    uint16_t hour;
+    uint16_t minute;
+    uint16_t second;
+    uint16_t millisecond;
+};
+
+//! \brief basic header at the start of the file
+struct HdemgNsxBasicHeader
+{
+    char         fileType[8];       //!< HDEMG_NSX_FILE_TYPE
+    uint8_t      specMajor;
+    uint8_t      specMinor;
+    uint32_t     headerBytes;       //!< basic and extended headers, i.e. offset of the first data packet
+    char         label[16];         //!< sampling group label, e.g. "raw"
+    char         comment[256];
+    uint32_t     period;            //!< time resolution ticks per sample
+    uint32_t     timeResolution;    //!< timestamp ticks per second
+    HdemgNsxTime origin;            //!< UTC
+    uint32_t     channelCount;
+};
+
+//! \brief per-channel extended header
+struct HdemgNsxChannelHeader
+{
+    char     type[2];               //!< "CC"
+    uint16_t electrodeId;
+    char     label[16];
+    uint8_t  connectorBank;         //!< 1 = A
+    uint8_t  connectorPin;
+    int16_t  minDigital;
+    int16_t  maxDigital;
+    int16_t  minAnalog;
+    int16_t  maxAnalog;
+    char     units[16];
+    uint32_t highFreqCorner;        //!< high pass corner in mHz
+    uint32_t highFreqOrder;
+    uint16_t highFilterType;        //!< 0 = none, 1 = Butterworth
+    uint32_t lowFreqCorner;         //!< low pass corner in mHz
+    uint32_t lowFreqOrder;
+    uint16_t lowFilterType;
+};
+
+//! \brief header in front of every contiguous segment of frames
+struct HdemgNsxDataHeader
+{
+    uint8_t  id;                    //!< HDEMG_NSX_DATA_HEADER_ID
+    uint32_t timestamp;             //!< time of the first frame
+    uint32_t dataPoints;            //!< frames in the segment
+};
+
+#pragma pack(pop)
+
+//! \brief a data packet located in a file
+struct HdemgNsxSegment
+{
+    uint64_t headerOffset;          //!< file offset of the HdemgNsxDataHeader
+    uint32_t timestamp;
+    uint32_t dataPoints;
+
+    //! \brief file offset of the first frame
+    uint64_t DataOffset() const { return headerOffset + sizeof(HdemgNsxDataHeader); }
+};
+
+/**
+    Seeks to an absolute offset of a file that may be larger than 2 GB
+
+    \return true on success
+  */
+inline bool
+HdemgNsxSeek(FILE * pFile, uint64_t offset)
+{
+#if defined(_WIN32)
+    return _fseeki64(pFile, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(pFile, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+/**
+    Writes the stdio buffer of a file and waits until its data is on the disk
+
+    \return false on error
+  */
+inline bool
+HdemgNsxSync(FILE * pFile)
+{
+    if(fflush(pFile) != 0)
+        return false;
+#if defined(_WIN32)
+    return _commit(_fileno(pFile)) == 0;
+#elif defined(__linux__)
+    return fdatasync(fileno(pFile)) == 0;
+#else
+    return fsync(fileno(pFile)) == 0;
+#endif
+}
+
+/**
+    Cuts a file opened for writing to a size
+
+    \return false on error
+  */
+inline bool
+HdemgNsxTruncate(FILE * pFile, uint64_t size)
+{
+    if(fflush(pFile) != 0)
+        return false;
+#if defined(_WIN32)
+    return _chsize_s(_fileno(pFile), (__int64)size) == 0;
+#else
+    return ftruncate(fileno(pFile), (off_t)size) == 0;
+#endif
+}
+
+/**
+    Reserves disk space for a file that will grow to about bytes, without changing its size.
+    Only supported on Linux.
+
+    \return false if no space was reserved
+  */
+inline bool
+HdemgNsxPreallocate(FILE * pFile, uint64_t bytes)
+{
+#if defined(__linux__)
+    return fallocate(fileno(pFile), FALLOC_FL_KEEP_SIZE, 0, (off_t)bytes) == 0;
+#else
+    (void)pFile;
+    (void)bytes;
+    return false;
+#endif
+}
+
+/**
+    Copies a string into a fixed size, zero padded header field
+  */
+inline void
+HdemgNsxSetField(char * pField, size_t size, const char * pText)
+{
+    memset(pField, 0, size);
+    if(pText)
+        memcpy(pField, pText, strnlen(pText, size));
+}
+
+#endif // HDEMG_NSX_H
@@ -0,0 +1,327 @@
+//
+//  hdemg_nsx_deinterleave.h
+//
+//  Parallel conversion of the sample-major frames of an NSx file (HdemgNsxReader) into
+//  channel-major int16 or float buffers, one contiguous row per channel, which is the
+//  layout analysis code wants. openNSx.m goes through double precision and the callers
+//  convert once more, so a 2 GB file ends up as 8 GB or more; here the int16 counts are
+//  transposed straight out of the file mapping.
+//
+//  The frame range is cut into chunks that a small pool of threads takes in turn. Runs of
+//  eight consecutive channels are transposed 8 x 8 with SSE2 unpacks, other channels are
+//  copied one by one.
+//
+
+#ifndef HDEMG_NSX_DEINTERLEAVE_H
+#define HDEMG_NSX_DEINTERLEAVE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "hdemg_nsx_reader.h"
+#include "hdemg_simd.h"
+
+static const uint32_t HDEMG_DEINTERLEAVE_CHUNK_FRAMES = 8192;   // frames handed to a thread at a time
+static const uint32_t HDEMG_DEINTERLEAVE_TILE_FRAMES  = 256;    // frames per channel group pass
+
+/*! \brief Thread pool that de-interleaves NSx frames.
+ *
+ *  The calling thread works on the chunks as well, so Start(1) (or no Start() at all) runs
+ *  everything on the caller.
+ */
+class HdemgNsxDeinterleaver
+{
+public:
+    HdemgNsxDeinterleaver()
+        : stopping(false), generation(0), running(0), pJob(NULL) {}
+
+    ~HdemgNsxDeinterleaver() { Stop(); }
+
+    /**
+        Starts the worker threads.
+
+        \arg threads - total threads including the caller, 0 for the hardware concurrency
+      */
+    void Start(uint32_t threads = 0)
+    {
+        Stop();
+        if(threads == 0)
+            threads = std::thread::hardware_concurrency();
+        stopping = false;
+        for(uint32_t t=1; t<threads; ++t)
+            workers.push_back(std::thread(&HdemgNsxDeinterleaver::Worker, this, generation));
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(size_t t=0; t<workers.size(); ++t)
+            workers[t].join();
+        workers.clear();
+    }
+
+    uint32_t ThreadCount() const { return (uint32_t)workers.size() + 1; }
+
+    /**
+        Reads frames of one data packet as channel-major int16 counts.
+
+        \arg reader     - open reader
+        \arg seg        - data packet
+        \arg firstFrame - first frame within the packet
+        \arg frameCount - frames to read
+        \arg pChannels  - channel indices in output row order, NULL for all channels
+        \arg channels   - number of entries in pChannels (ignored if pChannels is NULL)
+        \arg pDst       - row j, frame i is written to pDst[j * dstStride + i]
+        \arg dstStride  - distance between rows, at least frameCount
+
+        \return false if the range or a channel is invalid
+      */
+    bool Read(const HdemgNsxReader & reader, uint32_t seg, uint32_t firstFrame, uint32_t frameCount,
+              const uint32_t * pChannels, uint32_t channels, int16_t * pDst, size_t dstStride)
+    {
+        return Run(reader, seg, firstFrame, frameCount, pChannels, channels, pDst, NULL, dstStride, 1.0f);
+    }
+
+    /**
+        Reads frames of one data packet as channel-major float values, counts * scale
+        (e.g. the analog range over the digital range of the channel headers).
+      */
+    bool Read(const HdemgNsxReader & reader, uint32_t seg, uint32_t firstFrame, uint32_t frameCount,
+              const uint32_t * pChannels, uint32_t channels, float * pDst, size_t dstStride, float scale = 1.0f)
+    {
+        return Run(reader, seg, firstFrame, frameCount, pChannels, channels, NULL, pDst, dstStride, scale);
+    }
+
+private:
+    struct Job
+    {
+        const int16_t *       pSrc;         // first frame in the mapping
+        uint32_t              srcStride;    // channels in the file
+        uint32_t              frameCount;
+        const uint32_t *      pChannels;
+        uint32_t              channels;
+        int16_t *             pInt;         // one of the two outputs is used
+        float *               pFloat;
+        size_t                dstStride;
+        float                 scale;
+        uint32_t              chunkCount;
+        std::atomic<uint32_t> nextChunk;
+    };
+
+    bool Run(const HdemgNsxReader & reader, uint32_t seg, uint32_t firstFrame, uint32_t frameCount,
+             const uint32_t * pChannels, uint32_t channels, int16_t * pInt, float * pFloat, size_t dstStride, float scale)
+    {
+        if(!pChannels)
+            channels = reader.ChannelCount();
+        HdemgNsxView view = reader.View(seg, firstFrame, frameCount);
+        if(frameCount == 0 || view.frameCount != frameCount || dstStride < frameCount || channels == 0)
+        {
+            printf("ERROR: invalid de-interleave request frames[%u] stride[%zu]\n", frameCount, dstStride);
+            return false;
+        }
+        for(uint32_t j=0; pChannels && j<channels; ++j)
+        {
+            if(pChannels[j] >= reader.ChannelCount())
+            {
+                printf("ERROR: NSx file has no channel [%u]\n", pChannels[j]);
+                return false;
+            }
+        }
+
+        // channel index of every output row, so the kernels can look for runs of eight
+        rows.resize(channels);
+        for(uint32_t j=0; j<channels; ++j)
+            rows[j] = pChannels ? pChannels[j] : j;
+
+        Job job;
+        job.pSrc       = view.pData;
+        job.srcStride  = view.stride;
+        job.frameCount = frameCount;
+        job.pChannels  = &rows[0];
+        job.channels   = channels;
+        job.pInt       = pInt;
+        job.pFloat     = pFloat;
+        job.dstStride  = dstStride;
+        job.scale      = scale;
+        job.chunkCount = (frameCount + HDEMG_DEINTERLEAVE_CHUNK_FRAMES - 1) / HDEMG_DEINTERLEAVE_CHUNK_FRAMES;
+        job.nextChunk  = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pJob    = &job;
+            running = (uint32_t)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        Work(job);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while(running > 0)
+            done.wait(lock);
+        pJob = NULL;
+        return true;
+    }
+
+    void Worker(uint64_t seen)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            while(!stopping && generation == seen)
+                wake.wait(lock);
+            if(stopping)
+                break;
+            seen = generation;
+            Job * pCurrent = pJob;
+            lock.unlock();
+
+            Work(*pCurrent);
+
+            lock.lock();
+            if(--running == 0)
+                done.notify_one();
+        }
+    }
+
+    static void Work(Job & job)
+    {
+        for(;;)
+        {
+            uint32_t chunk = job.nextChunk.fetch_add(1);
+            if(chunk >= job.chunkCount)
+                break;
+            uint32_t first = chunk * HDEMG_DEINTERLEAVE_CHUNK_FRAMES;
+            uint32_t end   = first + HDEMG_DEINTERLEAVE_CHUNK_FRAMES;
+            if(end > job.frameCount)
+                end = job.frameCount;
+
+            // tiles of frames keep the rows written by one channel group in cache
+            for(uint32_t i0=first; i0<end; i0+=HDEMG_DEINTERLEAVE_TILE_FRAMES)
+            {
+                uint32_t i1 = (i0 + HDEMG_DEINTERLEAVE_TILE_FRAMES < end) ? i0 + HDEMG_DEINTERLEAVE_TILE_FRAMES : end;
+                uint32_t j  = 0;
+                while(j < job.channels)
+                {
+                    if(j + 8 <= job.channels && IsRun(job.pChannels + j))
+                    {
+                        TransposeGroup(job, j, i0, i1);
+                        j += 8;
+                    }
+                    else
+                    {
+                        CopyRow(job, j, i0, i1);
+                        j++;
+                    }
+                }
+            }
+        }
+    }
+
+    static bool IsRun(const uint32_t * pChannels)
+    {
+        for(uint32_t k=1; k<8; ++k)
+            if(pChannels[k] != pChannels[0] + k)
+                return false;
+        return true;
+    }
+
+    //! \brief output row j for frames [i0, i1)
+    static void CopyRow(const Job & job, uint32_t j, uint32_t i0, uint32_t i1)
+    {
+        const int16_t * pSrc = job.pSrc + (size_t)i0 * job.srcStride + job.pChannels[j];
+        if(job.pInt)
+        {
+            int16_t * pDst = job.pInt + j * job.dstStride;
+            for(uint32_t i=i0; i<i1; ++i, pSrc+=job.srcStride)
+                pDst[i] = *pSrc;
+        }
+        else
+        {
+            float * pDst = job.pFloat + j * job.dstStride;
+            for(uint32_t i=i0; i<i1; ++i, pSrc+=job.srcStride)
+                pDst[i] = *pSrc * job.scale;
+        }
+    }
+
+    //! \brief output rows j..j+7, which are consecutive file channels, for frames [i0, i1)
+    static void TransposeGroup(const Job & job, uint32_t j, uint32_t i0, uint32_t i1)
+    {
+        uint32_t i = i0;
+#if defined(__AVX__) || defined(HDEMG_SSE2)
+        const uint32_t c = job.pChannels[j];
+        const size_t   s = job.srcStride;
+        for(; i+8<=i1; i+=8)
+        {
+            const int16_t * p = job.pSrc + (size_t)i * s + c;
+            __m128i r0 = _mm_loadu_si128((const __m128i *)(p));
+            __m128i r1 = _mm_loadu_si128((const __m128i *)(p + s));
+            __m128i r2 = _mm_loadu_si128((const __m128i *)(p + 2 * s));
+            __m128i r3 = _mm_loadu_si128((const __m128i *)(p + 3 * s));
+            __m128i r4 = _mm_loadu_si128((const __m128i *)(p + 4 * s));
+            __m128i r5 = _mm_loadu_si128((const __m128i *)(p + 5 * s));
+            __m128i r6 = _mm_loadu_si128((const __m128i *)(p + 6 * s));
+            __m128i r7 = _mm_loadu_si128((const __m128i *)(p + 7 * s));
+
+            // 16 bit, 32 bit, then 64 bit interleaves turn eight frames into eight channels
+            __m128i t0 = _mm_unpacklo_epi16(r0, r1), t1 = _mm_unpackhi_epi16(r0, r1);
+            __m128i t2 = _mm_unpacklo_epi16(r2, r3), t3 = _mm_unpackhi_epi16(r2, r3);
+            __m128i t4 = _mm_unpacklo_epi16(r4, r5), t5 = _mm_unpackhi_epi16(r4, r5);
+            __m128i t6 = _mm_unpacklo_epi16(r6, r7), t7 = _mm_unpackhi_epi16(r6, r7);
+            __m128i u0 = _mm_unpacklo_epi32(t0, t2), u1 = _mm_unpackhi_epi32(t0, t2);
+            __m128i u2 = _mm_unpacklo_epi32(t1, t3), u3 = _mm_unpackhi_epi32(t1, t3);
+            __m128i u4 = _mm_unpacklo_epi32(t4, t6), u5 = _mm_unpackhi_epi32(t4, t6);
+            __m128i u6 = _mm_unpacklo_epi32(t5, t7), u7 = _mm_unpackhi_epi32(t5, t7);
+            __m128i col[8];
+            col[0] = _mm_unpacklo_epi64(u0, u4);
+            col[1] = _mm_unpackhi_epi64(u0, u4);
+            col[2] = _mm_unpacklo_epi64(u1, u5);
+            col[3] = _mm_unpackhi_epi64(u1, u5);
+            col[4] = _mm_unpacklo_epi64(u2, u6);
+            col[5] = _mm_unpackhi_epi64(u2, u6);
+            col[6] = _mm_unpacklo_epi64(u3, u7);
+            col[7] = _mm_unpackhi_epi64(u3, u7);
+
+            if(job.pInt)
+            {
+                for(uint32_t k=0; k<8; ++k)
+                    _mm_storeu_si128((__m128i *)(job.pInt + (j + k) * job.dstStride + i), col[k]);
+            }
+            else
+            {
+                __m128 scale = _mm_set1_ps(job.scale);
+                for(uint32_t k=0; k<8; ++k)
+                {
+                    // sign extend by placing each value in the upper half of a 32 bit lane
+                    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(col[k], col[k]), 16);
+                    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(col[k], col[k]), 16);
+                    float * pDst = job.pFloat + (j + k) * job.dstStride + i;
+                    _mm_storeu_ps(pDst,     _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+                    _mm_storeu_ps(pDst + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+                }
+            }
+        }
+#endif
+        for(uint32_t k=0; k<8 && i<i1; ++k)
+            CopyRow(job, j + k, i, i1);
+    }
+
+    std::vector<std::thread>  workers;
+    std::vector<uint32_t>     rows;         // file channel of every output row
+    std::mutex                mutex;
+    std::condition_variable   wake;         // a job was posted or the pool is stopping
+    std::condition_variable   done;         // the last worker finished the job
+    bool                      stopping;
+    uint64_t                  generation;   // number of jobs posted
+    uint32_t                  running;      // workers still on the current job
+    Job *                     pJob;
+};
+
+#endif // HDEMG_NSX_DEINTERLEAVE_H
@@ -0,0 +1,630 @@
+//
+//  hdemg_nsx_digest.h
+//
+//  Min/max digest of an NSx file, stored next to it as "<file>.dig", for plotting long
+//  recordings without reading their data (what XIPP_STREAM_DIGEST does for live raster
+//  displays). Level 0 holds the minimum and maximum of every channel over each bucket of
+//  bucketFrames frames; every level above merges factor buckets of the level below, so an
+//  hour of 30 kHz data has a level with a few thousand buckets for a screen wide plot.
+//  Buckets count the frames of the file in order, across the gaps between data packets.
+//
+//      header     "NSXDIGST", version, channels, period, bucketFrames, factor, buckets per
+//                 page and origin time of the NSx file
+//      pages      page header (level, first bucket, bucket count, CRC32C of the data)
+//                 followed by [bucket][channel] {min, max} int16
+//      tables     first frame and timestamp of every data packet, buckets per level, page
+//                 offsets, then a trailer with the table offset and "DIGSTEND"
+//
+//  HdemgNsxWriter builds the digest while recording; the levels are written a page at a
+//  time as they fill, so memory does not grow with the recording. HdemgNsxDigestBuild()
+//  makes the digest of an existing file. A digest without a trailer, from a writer that did
+//  not close it, is not used.
+//
+//  HdemgNsxDigest::Read() picks the coarsest level that still has a bucket per pixel for a
+//  time range and returns one min/max pair per pixel.
+//
+
+#ifndef HDEMG_NSX_DIGEST_H
+#define HDEMG_NSX_DIGEST_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_mmap.h"
+#include "hdemg_nsx.h"
+#include "hdemg_nsx_reader.h"
+#include "hdemg_simd.h"
+
+static const char     HDEMG_NSX_DIGEST_MAGIC[8]       = {'N','S','X','D','I','G','S','T'};
+static const char     HDEMG_NSX_DIGEST_END[8]         = {'D','I','G','S','T','E','N','D'};
+static const uint32_t HDEMG_NSX_DIGEST_PAGE_MAGIC     = 0x47504744;  // "DGPG"
+static const uint32_t HDEMG_NSX_DIGEST_VERSION        = 1;
+static const uint32_t HDEMG_NSX_DIGEST_BUCKET_FRAMES  = 256;
+static const uint32_t HDEMG_NSX_DIGEST_FACTOR         = 8;
+static const uint32_t HDEMG_NSX_DIGEST_PAGE_BUCKETS   = 64;
+static const uint32_t HDEMG_NSX_DIGEST_MAX_LEVELS     = 12;
+
+#pragma pack(push, 1)
+
+//! \brief start of the digest file
+struct HdemgNsxDigestHeader
+{
+    char         magic[8];          //!< HDEMG_NSX_DIGEST_MAGIC
+    uint32_t     version;
+    uint32_t     channelCount;
+    uint32_t     period;            //!< NIP ticks per frame
+    uint32_t     bucketFrames;      //!< frames per bucket of level 0
+    uint32_t     factor;            //!< buckets of a level merged into one bucket of the next
+    uint32_t     pageBuckets;       //!< buckets per page, the last page of a level may hold fewer
+    HdemgNsxTime origin;            //!< origin time of the NSx file
+};
+
+//! \brief start of a page of buckets
+struct HdemgNsxDigestPage
+{
+    uint32_t magic;                 //!< HDEMG_NSX_DIGEST_PAGE_MAGIC
+    uint32_t checksum;              //!< CRC32C of the buckets
+    uint32_t level;
+    uint32_t firstBucket;
+    uint32_t bucketCount;
+};
+
+//! \brief data packet of the NSx file
+struct HdemgNsxDigestSegment
+{
+    uint32_t timestamp;             //!< NIP time of the first frame
+    uint64_t firstFrame;            //!< frames of the file before the packet
+};
+
+//! \brief table entry of a page
+struct HdemgNsxDigestEntry
+{
+    uint64_t offset;                //!< file offset of the HdemgNsxDigestPage
+    uint32_t level;
+    uint32_t firstBucket;
+    uint32_t bucketCount;
+};
+
+//! \brief end of the file
+struct HdemgNsxDigestTrailer
+{
+    uint64_t tableOffset;           //!< segments, buckets per level (uint64) and page entries
+    uint64_t frameCount;
+    uint32_t segmentCount;
+    uint32_t levelCount;
+    uint32_t pageCount;
+    uint32_t checksum;              //!< CRC32C of the tables
+    char     magic[8];              //!< HDEMG_NSX_DIGEST_END
+};
+
+#pragma pack(pop)
+
+/**
+    Writes the name of the digest file of an NSx file into pDigestPath
+
+    \return false if the name does not fit
+  */
+inline bool
+HdemgNsxDigestPath(const char * pPath, char * pDigestPath, size_t size)
+{
+    int n = snprintf(pDigestPath, size, "%s.dig", pPath);
+    return n > 0 && (size_t)n < size;
+}
+
+/*! \brief Builds the digest of an NSx file from the frames as they are written.
+ */
+class HdemgNsxDigestWriter
+{
+public:
+    HdemgNsxDigestWriter() : pFile(NULL), offset(0), frameCount(0), failed(false) { memset(&header, 0, sizeof(header)); }
+    ~HdemgNsxDigestWriter() { Close(); }
+
+    /**
+        Creates the digest file.
+
+        \arg pPath        - digest file name, see HdemgNsxDigestPath()
+        \arg channels     - channels per frame
+        \arg period       - NIP ticks per frame
+        \arg bucketFrames - frames per bucket of level 0
+        \arg origin       - origin time from the basic header
+
+        \return true if the file was created
+      */
+    bool Create(const char * pPath, uint32_t channels, uint32_t period, uint32_t bucketFrames, const HdemgNsxTime & origin)
+    {
+        Close();
+        if(channels == 0 || bucketFrames == 0)
+            return false;
+        pFile = fopen(pPath, "wb");
+        if(!pFile)
+        {
+            printf("ERROR: cannot create [%s]\n", pPath);
+            return false;
+        }
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, HDEMG_NSX_DIGEST_MAGIC, sizeof(header.magic));
+        header.version      = HDEMG_NSX_DIGEST_VERSION;
+        header.channelCount = channels;
+        header.period       = period;
+        header.bucketFrames = bucketFrames;
+        header.factor       = HDEMG_NSX_DIGEST_FACTOR;
+        header.pageBuckets  = HDEMG_NSX_DIGEST_PAGE_BUCKETS;
+        header.origin       = origin;
+        offset     = 0;
+        frameCount = 0;
+        failed     = false;
+        levels.clear();
+        segments.clear();
+        entries.clear();
+        AddLevel();
+        Put(&header, sizeof(header));
+        return !failed;
+    }
+
+    //! \brief changes the origin time written into the header at Close()
+    void SetOrigin(const HdemgNsxTime & origin) { header.origin = origin; }
+
+    //! \brief the next frames start a data packet at a NIP time
+    void StartSegment(uint32_t timestamp)
+    {
+        if(!pFile)
+            return;
+        HdemgNsxDigestSegment segment;
+        segment.timestamp  = timestamp;
+        segment.firstFrame = frameCount;
+        if(!segments.empty() && segments.back().firstFrame == frameCount)
+            segments.back() = segment;
+        else
+            segments.push_back(segment);
+    }
+
+    /**
+        Adds frames of the current data packet.
+
+        \arg pFrames    - frames of ChannelCount() int16 samples
+        \arg frames     - number of frames
+      */
+    void Add(const int16_t * pFrames, uint32_t frames)
+    {
+        if(!pFile || failed)
+            return;
+        const uint32_t channels = header.channelCount;
+        for(uint32_t i=0; i<frames; )
+        {
+            Level &  base = levels[0];         // Emit() may add levels
+            uint32_t n = header.bucketFrames - base.count;
+            if(n > frames - i)
+                n = frames - i;
+            int16_t * pLo = &base.lo[0];
+            int16_t * pHi = &base.hi[0];
+            for(uint32_t f=0; f<n; ++f, pFrames+=channels)
+            {
+                for(uint32_t c=0; c<channels; ++c)
+                {
+                    pLo[c] = (pFrames[c] < pLo[c]) ? pFrames[c] : pLo[c];
+                    pHi[c] = (pFrames[c] > pHi[c]) ? pFrames[c] : pHi[c];
+                }
+            }
+            base.count += n;
+            frameCount += n;
+            i          += n;
+            if(base.count == header.bucketFrames)
+                Emit(0);
+        }
+    }
+
+    /**
+        Writes the partial buckets, the tables and the trailer, and closes the file.
+
+        \return false if the file could not be written
+      */
+    bool Close()
+    {
+        if(!pFile)
+            return false;
+
+        // partial buckets at the end, each completes the level above
+        for(uint32_t l=0; l<levels.size(); ++l)
+        {
+            if(levels[l].count)
+                Emit(l);
+        }
+
+        // levels up to the first one with a single bucket
+        uint32_t levelCount = 0;
+        while(levelCount < levels.size() && levels[levelCount].buckets)
+        {
+            if(levels[levelCount++].buckets == 1)
+                break;
+        }
+        std::vector<uint64_t> buckets;
+        for(uint32_t l=0; l<levelCount; ++l)
+        {
+            if(levels[l].pageBuckets)
+                WritePage(l);
+            buckets.push_back(levels[l].buckets);
+        }
+
+        HdemgNsxDigestTrailer trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        trailer.tableOffset  = offset;
+        trailer.frameCount   = frameCount;
+        trailer.segmentCount = (uint32_t)segments.size();
+        trailer.levelCount   = levelCount;
+        trailer.pageCount    = (uint32_t)entries.size();
+        memcpy(trailer.magic, HDEMG_NSX_DIGEST_END, sizeof(trailer.magic));
+
+        std::vector<uint8_t> tables;
+        Table(tables, segments.empty() ? NULL : &segments[0], segments.size() * sizeof(HdemgNsxDigestSegment));
+        Table(tables, buckets.empty() ? NULL : &buckets[0], buckets.size() * sizeof(uint64_t));
+        Table(tables, entries.empty() ? NULL : &entries[0], entries.size() * sizeof(HdemgNsxDigestEntry));
+        trailer.checksum = HdemgCrc32c(tables.empty() ? NULL : &tables[0], tables.size());
+        if(!tables.empty())
+            Put(&tables[0], tables.size());
+        Put(&trailer, sizeof(trailer));
+
+        // the origin may have changed since Create()
+        if(!failed && (!HdemgNsxSeek(pFile, 0) || fwrite(&header, sizeof(header), 1, pFile) != 1))
+            failed = true;
+        if(fclose(pFile) != 0)
+            failed = true;
+        pFile = NULL;
+        levels.clear();
+        return !failed;
+    }
+
+    bool     IsOpen() const     { return pFile != NULL; }
+    bool     Failed() const     { return failed; }
+    uint64_t FrameCount() const { return frameCount; }
+
+private:
+    struct Level
+    {
+        std::vector<int16_t> lo;            // current bucket
+        std::vector<int16_t> hi;
+        uint32_t             count;         // frames (level 0) or buckets below in the current bucket
+        std::vector<int16_t> page;          // [bucket][channel] {min, max}
+        uint32_t             pageBuckets;
+        uint64_t             buckets;       // completed buckets, including the page
+    };
+
+    void AddLevel()
+    {
+        Level level;
+        level.lo.assign(header.channelCount, 32767);
+        level.hi.assign(header.channelCount, -32768);
+        level.count       = 0;
+        level.page.resize((size_t)header.pageBuckets * header.channelCount * 2);
+        level.pageBuckets = 0;
+        level.buckets     = 0;
+        levels.push_back(level);
+    }
+
+    // ends the current bucket of a level and merges it into the level above
+    void Emit(uint32_t l)
+    {
+        const uint32_t channels = header.channelCount;
+        if(l + 1 < HDEMG_NSX_DIGEST_MAX_LEVELS && l + 1 == levels.size())
+            AddLevel();
+
+        Level &   level = levels[l];
+        int16_t * pDst  = &level.page[(size_t)level.pageBuckets * channels * 2];
+        for(uint32_t c=0; c<channels; ++c)
+        {
+            pDst[2 * c]     = level.lo[c];
+            pDst[2 * c + 1] = level.hi[c];
+        }
+        if(l + 1 < levels.size())
+        {
+            Level & up = levels[l + 1];
+            for(uint32_t c=0; c<channels; ++c)
+            {
+                up.lo[c] = (level.lo[c] < up.lo[c]) ? level.lo[c] : up.lo[c];
+                up.hi[c] = (level.hi[c] > up.hi[c]) ? level.hi[c] : up.hi[c];
+            }
+            up.count++;
+        }
+        level.lo.assign(channels, 32767);
+        level.hi.assign(channels, -32768);
+        level.count = 0;
+        level.buckets++;
+        if(++level.pageBuckets == header.pageBuckets)
+            WritePage(l);
+
+        if(l + 1 < levels.size() && levels[l + 1].count == header.factor)
+            Emit(l + 1);
+    }
+
+    void WritePage(uint32_t l)
+    {
+        Level &            level = levels[l];
+        HdemgNsxDigestPage page;
+        size_t             bytes = (size_t)level.pageBuckets * header.channelCount * 2 * sizeof(int16_t);
+        page.magic       = HDEMG_NSX_DIGEST_PAGE_MAGIC;
+        page.checksum    = HdemgCrc32c(&level.page[0], bytes);
+        page.level       = l;
+        page.firstBucket = (uint32_t)(level.buckets - level.pageBuckets);
+        page.bucketCount = level.pageBuckets;
+
+        HdemgNsxDigestEntry entry;
+        entry.offset      = offset;
+        entry.level       = l;
+        entry.firstBucket = page.firstBucket;
+        entry.bucketCount = page.bucketCount;
+        entries.push_back(entry);
+
+        Put(&page, sizeof(page));
+        Put(&level.page[0], bytes);
+        level.pageBuckets = 0;
+    }
+
+    static void Table(std::vector<uint8_t> & tables, const void * pData, size_t bytes)
+    {
+        if(bytes)
+            tables.insert(tables.end(), (const uint8_t *)pData, (const uint8_t *)pData + bytes);
+    }
+
+    void Put(const void * pData, size_t bytes)
+    {
+        if(failed)
+            return;
+        if(fwrite(pData, 1, bytes, pFile) != bytes)
+        {
+            printf("ERROR: digest write failed at offset [%llu]\n", (unsigned long long)offset);
+            failed = true;
+            return;
+        }
+        offset += bytes;
+    }
+
+    FILE *                             pFile;
+    HdemgNsxDigestHeader               header;
+    uint64_t                           offset;
+    uint64_t                           frameCount;
+    bool                               failed;
+    std::vector<Level>                 levels;
+    std::vector<HdemgNsxDigestSegment> segments;
+    std::vector<HdemgNsxDigestEntry>   entries;
+};
+
+/*! \brief Memory mapped digest of an NSx file.
+ */
+class HdemgNsxDigest
+{
+public:
+    HdemgNsxDigest() : pHeader(NULL), frameCount(0) {}
+
+    /**
+        Maps a digest file and loads its tables.
+
+        \return false if the file is missing, damaged or was not closed
+      */
+    bool Open(const char * pPath)
+    {
+        Close();
+        if(!file.Open(pPath))
+            return false;
+
+        pHeader = (const HdemgNsxDigestHeader *)file.Data();
+        if(file.Size() < sizeof(HdemgNsxDigestHeader) + sizeof(HdemgNsxDigestTrailer)
+           || memcmp(pHeader->magic, HDEMG_NSX_DIGEST_MAGIC, 8) != 0 || pHeader->version != HDEMG_NSX_DIGEST_VERSION
+           || pHeader->channelCount == 0 || pHeader->bucketFrames == 0 || pHeader->factor < 2 || pHeader->pageBuckets == 0
+           || !LoadTables())
+        {
+            printf("ERROR: [%s] is not a complete NSx digest\n", pPath);
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        file.Close();
+        pHeader    = NULL;
+        frameCount = 0;
+        segments.clear();
+        buckets.clear();
+        pages.clear();
+    }
+
+    bool     IsOpen() const       { return pHeader != NULL; }
+    uint32_t ChannelCount() const { return pHeader->channelCount; }
+    uint32_t Period() const       { return pHeader->period; }
+    uint64_t FrameCount() const   { return frameCount; }
+    uint32_t LevelCount() const   { return (uint32_t)buckets.size(); }
+    uint64_t BucketCount(uint32_t level) const { return buckets[level]; }
+
+    //! \brief origin time of the NSx file the digest was made for
+    const HdemgNsxTime & Origin() const { return pHeader->origin; }
+
+    //! \brief frames per bucket of a level, the last bucket of a level may hold fewer
+    uint64_t BucketFrames(uint32_t level) const
+    {
+        uint64_t frames = pHeader->bucketFrames;
+        for(uint32_t l=0; l<level; ++l)
+            frames *= pHeader->factor;
+        return frames;
+    }
+
+    //! \brief bucket b of a level, {min, max} of every channel
+    const int16_t * Bucket(uint32_t level, uint64_t b) const
+    {
+        const std::vector<const int16_t *> & list = pages[level];
+        return list[(size_t)(b / pHeader->pageBuckets)] + (size_t)(b % pHeader->pageBuckets) * pHeader->channelCount * 2;
+    }
+
+    //! \brief frame of the file at or after a NIP time, FrameCount() after the last frame
+    uint64_t FrameAt(uint32_t time) const
+    {
+        // last data packet starting at or before time
+        uint32_t lo = 0, hi = (uint32_t)segments.size();
+        while(lo < hi)
+        {
+            uint32_t mid = (lo + hi) / 2;
+            if(segments[mid].timestamp <= time)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if(lo == 0)
+            return segments.empty() ? frameCount : 0;
+
+        const HdemgNsxDigestSegment & segment = segments[lo - 1];
+        uint64_t end   = (lo < segments.size()) ? segments[lo].firstFrame : frameCount;
+        uint64_t frame = segment.firstFrame + ((uint64_t)(time - segment.timestamp) + pHeader->period - 1) / pHeader->period;
+        return (frame < end) ? frame : end;
+    }
+
+    /**
+        Picks the coarsest level that has at least one bucket per pixel.
+
+        \arg frames - frames to plot
+        \arg pixels - width of the plot
+
+        \return level; level 0 may still be coarser than a pixel when few frames are plotted,
+                the data itself should then be read
+      */
+    uint32_t LevelFor(uint64_t frames, uint32_t pixels) const
+    {
+        uint64_t perPixel = pixels ? frames / pixels : frames;
+        uint32_t level    = 0;
+        while(level + 1 < buckets.size() && BucketFrames(level + 1) <= perPixel)
+            ++level;
+        return level;
+    }
+
+    /**
+        Gives the minimum and maximum of a channel over each pixel of a plot of a time range.
+        A pixel with no data, inside a pause or past the end of the file, gets a minimum of
+        32767 and a maximum of -32768.
+
+        \arg startTime - NIP time of the left edge
+        \arg endTime   - NIP time of the right edge
+        \arg pixels    - width of the plot
+        \arg channel   - channel of the NSx file
+        \arg pMin      - receives pixels minima
+        \arg pMax      - receives pixels maxima
+        \arg pLevel    - receives the level used, may be NULL
+
+        \return false if the range or the channel is invalid
+      */
+    bool Read(uint32_t startTime, uint32_t endTime, uint32_t pixels, uint32_t channel, int16_t * pMin, int16_t * pMax,
+              uint32_t * pLevel = NULL) const
+    {
+        if(!IsOpen() || endTime <= startTime || pixels == 0 || channel >= pHeader->channelCount || buckets.empty())
+            return false;
+
+        const uint64_t span  = (uint64_t)(endTime - startTime);
+        const uint32_t level = LevelFor(FrameAt(endTime) - FrameAt(startTime), pixels);
+        const uint64_t size  = BucketFrames(level);
+        if(pLevel)
+            *pLevel = level;
+
+        uint64_t first = FrameAt(startTime);
+        for(uint32_t p=0; p<pixels; ++p)
+        {
+            uint64_t end = FrameAt(startTime + (uint32_t)(span * (p + 1) / pixels));
+            int16_t  lo  = 32767;
+            int16_t  hi  = -32768;
+            if(end > first)
+            {
+                for(uint64_t b=first / size; b<=(end - 1) / size && b<buckets[level]; ++b)
+                {
+                    const int16_t * pBucket = Bucket(level, b) + 2 * channel;
+                    lo = (pBucket[0] < lo) ? pBucket[0] : lo;
+                    hi = (pBucket[1] > hi) ? pBucket[1] : hi;
+                }
+            }
+            pMin[p] = lo;
+            pMax[p] = hi;
+            first   = end;
+        }
+        return true;
+    }
+
+private:
+    bool LoadTables()
+    {
+        HdemgNsxDigestTrailer trailer;
+        memcpy(&trailer, file.Data() + file.Size() - sizeof(trailer), sizeof(trailer));
+        uint64_t bytes = (uint64_t)trailer.segmentCount * sizeof(HdemgNsxDigestSegment)
+                         + (uint64_t)trailer.levelCount * sizeof(uint64_t)
+                         + (uint64_t)trailer.pageCount * sizeof(HdemgNsxDigestEntry);
+        if(memcmp(trailer.magic, HDEMG_NSX_DIGEST_END, 8) != 0 || trailer.tableOffset + bytes + sizeof(trailer) != file.Size()
+           || HdemgCrc32c(file.Data() + trailer.tableOffset, (size_t)bytes) != trailer.checksum
+           || trailer.levelCount > HDEMG_NSX_DIGEST_MAX_LEVELS)
+            return false;
+
+        const uint8_t * pTable = file.Data() + trailer.tableOffset;
+        segments.resize(trailer.segmentCount);
+        if(trailer.segmentCount)
+            memcpy(&segments[0], pTable, trailer.segmentCount * sizeof(HdemgNsxDigestSegment));
+        pTable += trailer.segmentCount * sizeof(HdemgNsxDigestSegment);
+        buckets.resize(trailer.levelCount);
+        if(trailer.levelCount)
+            memcpy(&buckets[0], pTable, trailer.levelCount * sizeof(uint64_t));
+        pTable += trailer.levelCount * sizeof(uint64_t);
+        frameCount = trailer.frameCount;
+
+        // pages of a level are written in order, page k holds buckets from k * pageBuckets
+        const size_t bucketBytes = (size_t)pHeader->channelCount * 2 * sizeof(int16_t);
+        pages.assign(trailer.levelCount, std::vector<const int16_t *>());
+        for(uint32_t k=0; k<trailer.pageCount; ++k)
+        {
+            HdemgNsxDigestEntry entry;
+            memcpy(&entry, pTable + k * sizeof(HdemgNsxDigestEntry), sizeof(entry));
+            if(entry.level >= trailer.levelCount || entry.firstBucket != pages[entry.level].size() * pHeader->pageBuckets
+               || entry.offset + sizeof(HdemgNsxDigestPage) + entry.bucketCount * bucketBytes > trailer.tableOffset)
+                return false;
+            const HdemgNsxDigestPage * pPage = (const HdemgNsxDigestPage *)(file.Data() + entry.offset);
+            if(pPage->magic != HDEMG_NSX_DIGEST_PAGE_MAGIC || pPage->bucketCount != entry.bucketCount)
+                return false;
+            pages[entry.level].push_back((const int16_t *)(pPage + 1));
+        }
+        for(uint32_t l=0; l<trailer.levelCount; ++l)
+        {
+            if(pages[l].size() != (buckets[l] + pHeader->pageBuckets - 1) / pHeader->pageBuckets)
+                return false;
+        }
+        return true;
+    }
+
+    HdemgMappedFile                            file;
+    const HdemgNsxDigestHeader *               pHeader;
+    uint64_t                                   frameCount;
+    std::vector<HdemgNsxDigestSegment>         segments;
+    std::vector<uint64_t>                      buckets;     // per level
+    std::vector<std::vector<const int16_t *> > pages;       // per level, bucket data of each page
+};
+
+/**
+    Makes the digest of an existing NSx file, e.g. one recorded by Trellis.
+
+    \arg reader       - open 2.2 / 2.3 file
+    \arg pPath        - digest file name, see HdemgNsxDigestPath()
+    \arg bucketFrames - frames per bucket of level 0
+
+    \return true if the digest was written
+  */
+inline bool
+HdemgNsxDigestBuild(const HdemgNsxReader & reader, const char * pPath, uint32_t bucketFrames = HDEMG_NSX_DIGEST_BUCKET_FRAMES)
+{
+    if(!reader.IsOpen() || !reader.BasicHeader())
+        return false;
+    HdemgNsxDigestWriter digest;
+    if(!digest.Create(pPath, reader.ChannelCount(), reader.Period(), bucketFrames, reader.BasicHeader()->origin))
+        return false;
+    for(uint32_t s=0; s<reader.SegmentCount(); ++s)
+    {
+        const HdemgNsxSegment & segment = reader.Segment(s);
+        digest.StartSegment(segment.timestamp);
+        HdemgNsxView view = reader.View(s, 0, segment.dataPoints);
+        digest.Add(view.pData, view.frameCount);
+    }
+    return digest.Close();
+}
+
+#endif // HDEMG_NSX_DIGEST_H
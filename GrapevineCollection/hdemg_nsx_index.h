@@ -0,0 +1,215 @@
+//
+//  hdemg_nsx_index.h
+//
+//  Sidecar index of the data packets of an NSx file, stored next to it as "<file>.idx".
+//  Finding the data packets of a paused file otherwise means visiting every packet header
+//  (openNSx.m seeks through all of them), which is slow for long recordings of unreliable
+//  sessions with many gaps. The index holds
+//
+//      header     "NSXINDEX", version, size and origin time of the NSx file it describes
+//      segments   offset, timestamp and DataPoints of every data packet (HdemgNsxSegment)
+//
+//  Frames inside a data packet have a fixed size and period, so the segments alone give
+//  the file offset of any time (HdemgNsxReader::Locate()).
+//
+//  Files of a recording split into several files (hdemg_nsx_session.h) also keep their
+//  place in the session: the file number and the frames recorded in the files before.
+//
+//  Files written by HdemgNsxWriter, or converted by nsx_to_archive.cpp, also carry the QC
+//  statistics of every channel (hdemg_channel_stats.h) after the segments.
+//
+//  HdemgNsxWriter keeps the index up to date at every Flush(). HdemgNsxReader uses it when
+//  it matches the file and rebuilds it otherwise, e.g. for files recorded by Trellis or by
+//  a writer that did not close its file.
+//
+
+#ifndef HDEMG_NSX_INDEX_H
+#define HDEMG_NSX_INDEX_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_channel_stats.h"
+#include "hdemg_nsx.h"
+
+static const char     HDEMG_NSX_INDEX_MAGIC[8]   = {'N','S','X','I','N','D','E','X'};
+static const uint32_t HDEMG_NSX_INDEX_VERSION    = 4;
+static const size_t   HDEMG_NSX_INDEX_MAX_PATH   = 1024;
+
+#pragma pack(push, 1)
+
+//! \brief start of the index file
+struct HdemgNsxIndexHeader
+{
+    char         magic[8];          //!< HDEMG_NSX_INDEX_MAGIC
+    uint32_t     version;
+    uint32_t     channelCount;
+    uint32_t     period;
+    uint64_t     fileSize;          //!< size of the NSx file when the index was written
+    HdemgNsxTime origin;            //!< origin time of the NSx file
+    uint32_t     segmentCount;
+    uint32_t     sessionFile;       //!< number of the file in its session from 1, 0 if not split
+    uint64_t     sessionFrames;     //!< frames of the session in the files before this one
+    uint32_t     statsCount;        //!< HdemgChannelStats after the segments, channelCount or 0
+};
+
+#pragma pack(pop)
+
+/**
+    Writes the name of the index file of an NSx file into pIndexPath
+
+    \return false if the name does not fit
+  */
+inline bool
+HdemgNsxIndexPath(const char * pPath, char * pIndexPath, size_t size)
+{
+    int n = snprintf(pIndexPath, size, "%s.idx", pPath);
+    return n > 0 && (size_t)n < size;
+}
+
+/*! \brief Data packet list of one NSx file.
+ */
+class HdemgNsxIndex
+{
+public:
+    HdemgNsxIndex() { memset(&header, 0, sizeof(header)); }
+
+    /**
+        Builds the index from the data packets of a file.
+
+        \arg segments     - data packets in file order
+        \arg channels     - channels per frame
+        \arg period       - NIP ticks per frame
+        \arg fileSize     - current size of the NSx file
+        \arg origin       - origin time from its basic header
+      */
+    void Build(const std::vector<HdemgNsxSegment> & segments, uint32_t channels, uint32_t period,
+               uint64_t fileSize, const HdemgNsxTime & origin)
+    {
+        memcpy(header.magic, HDEMG_NSX_INDEX_MAGIC, sizeof(header.magic));
+        header.version      = HDEMG_NSX_INDEX_VERSION;
+        header.channelCount = channels;
+        header.period       = period;
+        header.fileSize     = fileSize;
+        header.origin       = origin;
+        segmentList         = segments;
+        header.segmentCount = (uint32_t)segmentList.size();
+    }
+
+    /**
+        Writes the index file. It is written under a temporary name and renamed, so a crash
+        never leaves a half written index behind.
+
+        \return true on success
+      */
+    bool Save(const char * pIndexPath) const
+    {
+        char temp[HDEMG_NSX_INDEX_MAX_PATH];
+        if(snprintf(temp, sizeof(temp), "%s.tmp", pIndexPath) >= (int)sizeof(temp))
+            return false;
+
+        FILE * pFile = fopen(temp, "wb");
+        if(!pFile)
+        {
+            printf("ERROR: cannot create [%s]\n", temp);
+            return false;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, pFile) == 1;
+        if(ok && !segmentList.empty())
+            ok = fwrite(&segmentList[0], sizeof(HdemgNsxSegment), segmentList.size(), pFile) == segmentList.size();
+        if(ok && !stats.empty())
+            ok = fwrite(&stats[0], sizeof(HdemgChannelStats), stats.size(), pFile) == stats.size();
+        ok = (fclose(pFile) == 0) && ok;
+
+        remove(pIndexPath);     // rename() does not replace files on Windows
+        if(!ok || rename(temp, pIndexPath) != 0)
+        {
+            printf("ERROR: cannot write [%s]\n", pIndexPath);
+            remove(temp);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+        Reads an index file and checks that it describes the given NSx file.
+
+        \return false if the index is missing, damaged or stale; the index is then empty
+                except for the session fields of a stale index of the same recording, so a
+                rebuilt index keeps them. Its channel statistics describe other data and
+                are dropped; nsx_recover.cpp and nsx_qc.cpp compute them again.
+      */
+    bool Load(const char * pIndexPath, uint32_t channels, uint32_t period, uint64_t fileSize, const HdemgNsxTime & origin)
+    {
+        Clear();
+        FILE * pFile = fopen(pIndexPath, "rb");
+        if(!pFile)
+            return false;
+
+        bool ok = fread(&header, sizeof(header), 1, pFile) == 1
+                  && memcmp(header.magic, HDEMG_NSX_INDEX_MAGIC, sizeof(header.magic)) == 0
+                  && header.version == HDEMG_NSX_INDEX_VERSION && header.channelCount == channels
+                  && header.period == period && header.fileSize == fileSize
+                  && memcmp(&header.origin, &origin, sizeof(origin)) == 0 && header.segmentCount > 0
+                  && (header.statsCount == 0 || header.statsCount == channels);
+        if(ok)
+        {
+            segmentList.resize(header.segmentCount);
+            stats.resize(header.statsCount);
+            ok = fread(&segmentList[0], sizeof(HdemgNsxSegment), segmentList.size(), pFile) == segmentList.size()
+                 && (stats.empty() || fread(&stats[0], sizeof(HdemgChannelStats), stats.size(), pFile) == stats.size());
+        }
+        fclose(pFile);
+
+        if(!ok)
+        {
+            // same recording, e.g. grown or repaired since the index was written
+            bool     session = memcmp(header.magic, HDEMG_NSX_INDEX_MAGIC, sizeof(header.magic)) == 0
+                               && header.version == HDEMG_NSX_INDEX_VERSION && header.channelCount == channels
+                               && memcmp(&header.origin, &origin, sizeof(origin)) == 0;
+            uint32_t file    = header.sessionFile;
+            uint64_t frames  = header.sessionFrames;
+            Clear();
+            if(session)
+                SetSession(file, frames);
+        }
+        return ok;
+    }
+
+    void Clear()
+    {
+        memset(&header, 0, sizeof(header));
+        segmentList.clear();
+        stats.clear();
+    }
+
+    //! \brief place of the file in a split recording, kept by Build()
+    void SetSession(uint32_t file, uint64_t framesBefore)
+    {
+        header.sessionFile   = file;
+        header.sessionFrames = framesBefore;
+    }
+
+    uint32_t SessionFile() const   { return header.sessionFile; }
+    uint64_t SessionFrames() const { return header.sessionFrames; }
+
+    //! \brief QC statistics of every channel over the data the index describes, kept by Build()
+    void SetStats(const std::vector<HdemgChannelStats> & channelStats)
+    {
+        stats             = channelStats;
+        header.statsCount = (uint32_t)stats.size();
+    }
+
+    //! \brief empty if the file has no statistics
+    const std::vector<HdemgChannelStats> & Stats() const { return stats; }
+
+    const std::vector<HdemgNsxSegment> & Segments() const { return segmentList; }
+
+private:
+    HdemgNsxIndexHeader            header;
+    std::vector<HdemgNsxSegment>   segmentList;
+    std::vector<HdemgChannelStats> stats;
+};
+
+#endif // HDEMG_NSX_INDEX_H
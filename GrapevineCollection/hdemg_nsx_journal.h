@@ -0,0 +1,333 @@
+//
+//  hdemg_nsx_journal.h
+//
+//  Write-ahead journal of an NSx recording, stored next to it as "<file>.jnl" while the
+//  file is being written. NSx keeps the length of a data packet in its header, which is
+//  only patched when the packet ends; after a crash openNSx.m has to guess it from the
+//  file size, and every packet is lost or wrong. At every checkpoint the writer
+//
+//      1. writes its buffer and waits until the data is on the disk
+//      2. appends the state of the data packets that changed, the last record marked
+//         as commit, and waits until the journal is on the disk
+//
+//  so a committed checkpoint never describes data that was not written. Both steps wait
+//  for the disk, so the writer does not run them on the acquisition thread: Post() hands
+//  them to a thread of the journal (or HdemgAsyncWriter::Queue() to the thread that writes
+//  the data). nsx_recover.cpp
+//  patches DataPoints from the last committed checkpoint and cuts the file to the data it
+//  covers, without reading the data. The journal is removed when the file is closed.
+//
+//      header     "NSXJOURN", version, channels, period, header size and origin time of
+//                 the NSx file, CRC32C
+//      records    checkpoint number, flags, durable file size, data packet number and
+//                 its HdemgNsxSegment, CRC32C
+//
+
+#ifndef HDEMG_NSX_JOURNAL_H
+#define HDEMG_NSX_JOURNAL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "hdemg_nsx.h"
+#include "hdemg_nsx_index.h"
+#include "hdemg_simd.h"
+
+static const char     HDEMG_NSX_JOURNAL_MAGIC[8] = {'N','S','X','J','O','U','R','N'};
+static const uint32_t HDEMG_NSX_JOURNAL_VERSION  = 1;
+static const uint32_t HDEMG_NSX_JOURNAL_COMMIT   = 0x1;     // last record of a checkpoint
+
+#pragma pack(push, 1)
+
+//! \brief start of the journal file
+struct HdemgNsxJournalHeader
+{
+    char         magic[8];          //!< HDEMG_NSX_JOURNAL_MAGIC
+    uint32_t     version;
+    uint32_t     channelCount;
+    uint32_t     period;
+    uint32_t     headerBytes;       //!< basic and extended headers of the NSx file
+    HdemgNsxTime origin;            //!< origin time of the NSx file
+    uint32_t     checksum;          //!< CRC32C of the fields above
+};
+
+//! \brief state of one data packet at a checkpoint
+struct HdemgNsxJournalRecord
+{
+    uint32_t        sequence;       //!< checkpoint number, from 1
+    uint32_t        flags;          //!< HDEMG_NSX_JOURNAL_COMMIT
+    uint64_t        dataEnd;        //!< bytes of the NSx file on the disk at the checkpoint
+    uint32_t        index;          //!< data packet number
+    HdemgNsxSegment segment;
+    uint32_t        checksum;       //!< CRC32C of the fields above
+};
+
+#pragma pack(pop)
+
+/**
+    Writes the name of the journal file of an NSx file into pJournalPath
+
+    \return false if the name does not fit
+  */
+inline bool
+HdemgNsxJournalPath(const char * pPath, char * pJournalPath, size_t size)
+{
+    int n = snprintf(pJournalPath, size, "%s.jnl", pPath);
+    return n > 0 && (size_t)n < size;
+}
+
+/*! \brief Journal of the data packets of one NSx file being written.
+ */
+class HdemgNsxJournal
+{
+public:
+    HdemgNsxJournal()
+        : pFile(NULL), sequence(0), dataEnd(0), busy(false), stop(false), pPostedData(NULL), postedEnd(0), syncFailed(false)
+    {
+        memset(&header, 0, sizeof(header));
+    }
+    ~HdemgNsxJournal() { Close(false); }
+
+    /**
+        Creates the journal of a new NSx file.
+
+        \arg pPath       - journal file name, see HdemgNsxJournalPath()
+        \arg channels    - channels per frame
+        \arg period      - NIP ticks per frame
+        \arg headerBytes - size of the NSx headers
+        \arg origin      - origin time from the basic header
+
+        \return true if the journal was created and is on the disk
+      */
+    bool Create(const char * pPath, uint32_t channels, uint32_t period, uint32_t headerBytes, const HdemgNsxTime & origin)
+    {
+        Close(false);
+        pFile = fopen(pPath, "wb");
+        if(!pFile)
+        {
+            printf("ERROR: cannot create [%s]\n", pPath);
+            return false;
+        }
+        snprintf(path, sizeof(path), "%s", pPath);
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, HDEMG_NSX_JOURNAL_MAGIC, sizeof(header.magic));
+        header.version      = HDEMG_NSX_JOURNAL_VERSION;
+        header.channelCount = channels;
+        header.period       = period;
+        header.headerBytes  = headerBytes;
+        header.origin       = origin;
+        header.checksum     = HdemgCrc32c(&header, offsetof(HdemgNsxJournalHeader, checksum));
+        sequence   = 0;
+        dataEnd    = 0;
+        syncFailed = false;
+        segments.clear();
+
+        if(fwrite(&header, sizeof(header), 1, pFile) != 1 || !HdemgNsxSync(pFile))
+        {
+            printf("ERROR: cannot write [%s]\n", pPath);
+            Close(true);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+        Appends a checkpoint with the data packets that changed since the previous one.
+        The caller must have made the NSx file durable up to end.
+
+        \arg list - data packets of the file
+        \arg end  - bytes of the NSx file that are on the disk
+
+        \return false if the journal could not be written
+      */
+    bool Checkpoint(const std::vector<HdemgNsxSegment> & list, uint64_t end)
+    {
+        if(!pFile)
+            return false;
+
+        std::vector<HdemgNsxJournalRecord> records;
+        for(uint32_t s=0; s<list.size(); ++s)
+        {
+            if(s < segments.size() && segments[s].dataPoints == list[s].dataPoints)
+                continue;
+            HdemgNsxJournalRecord record;
+            memset(&record, 0, sizeof(record));
+            record.sequence = sequence + 1;
+            record.dataEnd  = end;
+            record.index    = s;
+            record.segment  = list[s];
+            records.push_back(record);
+        }
+        if(records.empty())
+            return true;
+
+        records.back().flags = HDEMG_NSX_JOURNAL_COMMIT;
+        for(size_t r=0; r<records.size(); ++r)
+            records[r].checksum = HdemgCrc32c(&records[r], offsetof(HdemgNsxJournalRecord, checksum));
+        if(fwrite(&records[0], sizeof(HdemgNsxJournalRecord), records.size(), pFile) != records.size()
+           || !HdemgNsxSync(pFile))
+        {
+            printf("ERROR: cannot write [%s]\n", path);
+            return false;
+        }
+        ++sequence;
+        segments = list;
+        dataEnd  = end;
+        return true;
+    }
+
+    /**
+        Makes the NSx file durable and appends a checkpoint from the thread of the journal,
+        so the caller does not wait for the disk. A checkpoint still being written makes
+        this one be skipped; the next one covers its data.
+
+        \arg list  - data packets of the file
+        \arg end   - bytes of the NSx file written so far
+        \arg pData - the NSx file, synced before the journal
+
+        \return false if the checkpoint was skipped
+      */
+    bool Post(const std::vector<HdemgNsxSegment> & list, uint64_t end, FILE * pData)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!pFile || busy)
+                return false;
+            posted      = list;
+            postedEnd   = end;
+            pPostedData = pData;
+            busy        = true;
+        }
+        if(!worker.joinable())
+            worker = std::thread(&HdemgNsxJournal::Worker, this);
+        wake.notify_one();
+        return true;
+    }
+
+    //! \brief true once the thread of the journal could not make the NSx file durable
+    bool DataSyncFailed() const { return syncFailed; }
+
+    //! \brief closes the journal, and deletes it once the NSx file is complete
+    void Close(bool remove)
+    {
+        if(worker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_one();
+            worker.join();
+            stop = false;
+            busy = false;
+        }
+        if(pFile)
+        {
+            fclose(pFile);
+            if(remove)
+                ::remove(path);
+        }
+        pFile = NULL;
+    }
+
+    /**
+        Reads a journal up to its last committed checkpoint. Records after it, e.g. from a
+        checkpoint torn by the crash, are ignored.
+
+        \return false if the file is missing or not a journal
+      */
+    bool Load(const char * pPath)
+    {
+        Close(false);
+        sequence = 0;
+        dataEnd  = 0;
+        segments.clear();
+
+        FILE * pIn = fopen(pPath, "rb");
+        if(!pIn)
+            return false;
+        bool ok = fread(&header, sizeof(header), 1, pIn) == 1
+                  && memcmp(header.magic, HDEMG_NSX_JOURNAL_MAGIC, sizeof(header.magic)) == 0
+                  && header.version == HDEMG_NSX_JOURNAL_VERSION
+                  && header.checksum == HdemgCrc32c(&header, offsetof(HdemgNsxJournalHeader, checksum));
+
+        std::vector<HdemgNsxSegment> pending = segments;
+        HdemgNsxJournalRecord        record;
+        while(ok && fread(&record, sizeof(record), 1, pIn) == 1)
+        {
+            if(record.checksum != HdemgCrc32c(&record, offsetof(HdemgNsxJournalRecord, checksum))
+               || record.sequence != sequence + 1 || record.index > pending.size())
+                break;
+            if(record.index == pending.size())
+                pending.push_back(record.segment);
+            else
+                pending[record.index] = record.segment;
+            if(record.flags & HDEMG_NSX_JOURNAL_COMMIT)
+            {
+                segments = pending;
+                dataEnd  = record.dataEnd;
+                ++sequence;
+            }
+        }
+        fclose(pIn);
+        return ok;
+    }
+
+    const HdemgNsxJournalHeader &        Header() const     { return header; }
+    const std::vector<HdemgNsxSegment> & Segments() const   { return segments; }   //!< at the last checkpoint
+    uint64_t                             DataEnd() const    { return dataEnd; }    //!< durable bytes at the last checkpoint
+    uint32_t                             Checkpoints() const { return sequence; }
+
+private:
+    //! \brief writes the posted checkpoints until Close()
+    void Worker()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            while(!busy && !stop)
+                wake.wait(lock);
+            if(!busy)
+                break;
+            std::vector<HdemgNsxSegment> list;
+            list.swap(posted);
+            lock.unlock();
+
+            if(HdemgNsxSync(pPostedData))
+                Checkpoint(list, postedEnd);
+            else if(!syncFailed)
+            {
+                printf("ERROR: cannot sync NSx file\n");
+                syncFailed = true;
+            }
+
+            lock.lock();
+            busy = false;
+        }
+    }
+
+    FILE *                       pFile;
+    char                         path[HDEMG_NSX_INDEX_MAX_PATH];
+    HdemgNsxJournalHeader        header;
+    uint32_t                     sequence;      // checkpoints written or loaded
+    uint64_t                     dataEnd;
+    std::vector<HdemgNsxSegment> segments;
+
+    std::thread                  worker;        // started by the first Post()
+    std::mutex                   mutex;
+    std::condition_variable      wake;          // a checkpoint was posted or Close() was called
+    bool                         busy;          // a posted checkpoint is not written yet
+    bool                         stop;
+    std::vector<HdemgNsxSegment> posted;
+    FILE *                       pPostedData;
+    uint64_t                     postedEnd;
+    std::atomic<bool>            syncFailed;
+};
+
+#endif // HDEMG_NSX_JOURNAL_H
@@ -0,0 +1,506 @@
+//
+//  hdemg_nsx_reader.h
+//
+//  Memory mapped reader for NSx files (see hdemg_nsx.h). The headers and the data packets
+//  of paused files are parsed the way openNSx.m does, including its fixes for files written
+//  by older Central versions, but nothing is read until it is asked for: a one hour file
+//  opens in the time it takes to walk its data packet headers.
+//
+//  The data packet list is taken from the sidecar index (hdemg_nsx_index.h) when it matches
+//  the file; otherwise the packet headers are walked and the index is written for the next
+//  time the file is opened.
+//
+//  Data can be accessed as zero-copy views into the mapping, which are sample-major with a
+//  stride of ChannelCount(), or gathered into a caller buffer or an HdemgBlock for any
+//  subset of channels and range of frames.
+//
+
+#ifndef HDEMG_NSX_READER_H
+#define HDEMG_NSX_READER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_channel_stats.h"
+#include "hdemg_frames.h"
+#include "hdemg_mmap.h"
+#include "hdemg_nsx.h"
+#include "hdemg_nsx_index.h"
+
+// file type of the older NSx 2.1 files, which have no extended headers and one data segment
+static const char HDEMG_NSX_FILE_TYPE_21[8] = {'N','E','U','R','A','L','S','G'};
+
+/*! \brief Read-only view of consecutive frames inside the file mapping
+ */
+struct HdemgNsxView
+{
+    const int16_t * pData;          //!< first frame
+    uint32_t        frameCount;
+    uint32_t        stride;         //!< int16 values between frames (ChannelCount())
+    uint32_t        timestamp;      //!< NIP time of the first frame
+
+    inline const int16_t * Frame(uint32_t idx) const { return pData + (size_t)idx * stride; }
+};
+
+/*! \brief Memory mapped NSx 2.1 / 2.2 / 2.3 file.
+ */
+class HdemgNsxReader
+{
+public:
+    HdemgNsxReader()
+        : pMap(NULL), fileSize(0), specMajor(0), specMinor(0), channelCount(0), period(0), timeResolution(0), dataStart(0),
+          indexUsed(false)
+    {
+        memset(label, 0, sizeof(label));
+    }
+
+    ~HdemgNsxReader() { Close(); }
+
+    /**
+        Maps a file and parses its headers and data packet headers.
+
+        \arg pPath    - NSx file name
+        \arg useIndex - take the data packets from the sidecar index, and write the index if
+                        it is missing or stale
+
+        \return true if the file is a valid NSx file
+      */
+    bool Open(const char * pPath, bool useIndex = true)
+    {
+        Close();
+        if(!file.Open(pPath))
+            return false;
+        pMap     = file.Data();
+        fileSize = file.Size();
+
+        if(fileSize >= sizeof(HdemgNsxBasicHeader) && memcmp(pMap, HDEMG_NSX_FILE_TYPE, 8) == 0)
+        {
+            char indexPath[HDEMG_NSX_INDEX_MAX_PATH];
+            useIndex = useIndex && HdemgNsxIndexPath(pPath, indexPath, sizeof(indexPath));
+            if(ParseHeaders22())
+            {
+                if(useIndex && LoadIndex(indexPath))
+                    return true;
+                if(ParseSegments())
+                {
+                    if(useIndex)
+                    {
+                        index.Build(segments, channelCount, period, fileSize, BasicHeader()->origin);
+                        index.Save(indexPath);
+                    }
+                    return true;
+                }
+            }
+        }
+        else if(fileSize >= 32 && memcmp(pMap, HDEMG_NSX_FILE_TYPE_21, 8) == 0)
+        {
+            if(ParseHeaders21())
+                return true;
+        }
+        else
+            printf("ERROR: [%s] is not an NSx 2.1 - 2.3 file\n", pPath);
+
+        Close();
+        return false;
+    }
+
+    //! \brief unmaps the file
+    void Close()
+    {
+        file.Close();
+        pMap         = NULL;
+        fileSize     = 0;
+        channelCount = 0;
+        indexUsed    = false;
+        segments.clear();
+        index.Clear();
+        electrodeIds.clear();
+    }
+
+    bool     IsOpen() const         { return pMap != NULL; }
+    uint64_t FileSize() const       { return fileSize; }
+    uint8_t  SpecMajor() const      { return specMajor; }
+    uint8_t  SpecMinor() const      { return specMinor; }
+    uint32_t ChannelCount() const   { return channelCount; }
+    uint32_t Period() const         { return period; }          //!< timestamp ticks per frame
+    uint32_t TimeResolution() const { return timeResolution; }  //!< timestamp ticks per second
+    double   SampleRate() const     { return (double)timeResolution / period; }
+    const char * Label() const      { return label; }           //!< sampling group label
+
+    //! \brief basic header of a 2.2 / 2.3 file, NULL for 2.1
+    const HdemgNsxBasicHeader * BasicHeader() const
+    {
+        return (specMinor >= 2) ? (const HdemgNsxBasicHeader *)pMap : NULL;
+    }
+
+    //! \brief extended header of channel c of a 2.2 / 2.3 file, NULL for 2.1
+    const HdemgNsxChannelHeader * ChannelHeader(uint32_t c) const
+    {
+        if(specMinor < 2 || c >= channelCount)
+            return NULL;
+        return (const HdemgNsxChannelHeader *)(pMap + sizeof(HdemgNsxBasicHeader)) + c;
+    }
+
+    uint16_t ElectrodeId(uint32_t c) const { return electrodeIds[c]; }
+
+    //! \brief channel holding an electrode, ChannelCount() if it is not in the file
+    uint32_t ChannelOf(uint16_t electrodeId) const
+    {
+        for(uint32_t c=0; c<channelCount; ++c)
+            if(electrodeIds[c] == electrodeId)
+                return c;
+        return channelCount;
+    }
+
+    //! \brief true if the data packets were taken from the sidecar index
+    bool IndexUsed() const { return indexUsed; }
+
+    //! \brief sidecar index of a 2.2 / 2.3 file opened with useIndex
+    const HdemgNsxIndex & Index() const { return index; }
+
+    uint32_t SegmentCount() const { return (uint32_t)segments.size(); }
+    const HdemgNsxSegment & Segment(uint32_t s) const { return segments[s]; }
+
+    /**
+        Finds the frame at or after a NIP time.
+
+        \arg time    - timestamp in TimeResolution() ticks
+        \arg pSeg    - receives the segment holding the frame
+        \arg pFrame  - receives the frame within that segment
+
+        \return false if the time lies after the end of the recording. A time inside a pause
+                gives the first frame of the following segment.
+      */
+    bool Locate(uint32_t time, uint32_t * pSeg, uint32_t * pFrame) const
+    {
+        // last segment starting at or before time
+        uint32_t lo = 0, hi = (uint32_t)segments.size();
+        while(lo < hi)
+        {
+            uint32_t mid = (lo + hi) / 2;
+            if(segments[mid].timestamp <= time)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for(uint32_t s=(lo > 0) ? lo - 1 : 0; s<segments.size(); ++s)
+        {
+            const HdemgNsxSegment & seg = segments[s];
+            uint64_t frame = (time > seg.timestamp) ? ((uint64_t)(time - seg.timestamp) + period - 1) / period : 0;
+            if(frame < seg.dataPoints)
+            {
+                *pSeg   = s;
+                *pFrame = (uint32_t)frame;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+        Returns a zero-copy view of frames of one segment. The view stays valid until the
+        reader is closed.
+
+        \return view with frameCount 0 if the range is outside the segment
+      */
+    HdemgNsxView View(uint32_t seg, uint32_t firstFrame, uint32_t frameCount) const
+    {
+        HdemgNsxView view;
+        view.pData      = NULL;
+        view.frameCount = 0;
+        view.stride     = channelCount;
+        view.timestamp  = 0;
+        if(!CheckRange(seg, firstFrame, frameCount))
+            return view;
+
+        view.pData      = (const int16_t *)(pMap + segments[seg].DataOffset()) + (size_t)firstFrame * channelCount;
+        view.frameCount = frameCount;
+        view.timestamp  = segments[seg].timestamp + firstFrame * period;
+        return view;
+    }
+
+    /**
+        Gathers a subset of channels of a range of frames, like openNSx(..., 'c:', 't:',
+        'skipfactor') does for one segment.
+
+        \arg seg        - segment index
+        \arg firstFrame - first frame within the segment
+        \arg frameCount - frames to read, counted before skipping
+        \arg pChannels  - channel indices in the desired output order, NULL for all channels
+        \arg channels   - number of entries in pChannels (ignored if pChannels is NULL)
+        \arg pDst       - receives ceil(frameCount / step) frames, sample-major
+        \arg step       - keep every step-th frame
+
+        \return number of frames written to pDst
+      */
+    uint32_t Read(uint32_t seg, uint32_t firstFrame, uint32_t frameCount, const uint32_t * pChannels,
+                  uint32_t channels, int16_t * pDst, uint32_t step = 1) const
+    {
+        if(!pChannels)
+            channels = channelCount;
+        if(step == 0 || !CheckRange(seg, firstFrame, frameCount) || !CheckChannels(pChannels, channels))
+            return 0;
+
+        const int16_t * pSrc = View(seg, firstFrame, frameCount).pData;
+        const size_t    jump = (size_t)step * channelCount;
+        uint32_t        out  = 0;
+
+        // a run of consecutive channels is copied frame by frame
+        uint32_t first = pChannels ? pChannels[0] : 0;
+        bool     run   = IsRun(pChannels, channels);
+        for(uint32_t i=0; i<frameCount; i+=step, pSrc+=jump, pDst+=channels, ++out)
+        {
+            if(run)
+                memcpy(pDst, pSrc + first, channels * sizeof(int16_t));
+            else
+                for(uint32_t j=0; j<channels; ++j)
+                    pDst[j] = pSrc[pChannels[j]];
+        }
+        return out;
+    }
+
+    /**
+        Gathers frames into an HdemgBlock so a recording can be replayed through the
+        processing stages. The block is allocated on the first call or when its shape changes.
+
+        \return false if the range or a channel is invalid
+      */
+    bool ReadBlock(uint32_t seg, uint32_t firstFrame, uint32_t frameCount, const uint32_t * pChannels,
+                   uint32_t channels, HdemgBlock & block) const
+    {
+        if(!pChannels)
+            channels = channelCount;
+        if(!CheckRange(seg, firstFrame, frameCount) || !CheckChannels(pChannels, channels) || frameCount == 0)
+            return false;
+        if(block.channelCount != channels || block.capacity < frameCount || block.sampleRate != SampleRate())
+        {
+            if(!block.Allocate(channels, frameCount, SampleRate()))
+                return false;
+        }
+
+        const int16_t * pSrc = View(seg, firstFrame, frameCount).pData;
+        for(uint32_t i=0; i<frameCount; ++i, pSrc+=channelCount)
+        {
+            float * pDst = block.Frame(i);
+            for(uint32_t j=0; j<channels; ++j)
+                pDst[j] = (float)pSrc[pChannels ? pChannels[j] : j];
+        }
+        block.frameCount = frameCount;
+        block.startTime  = segments[seg].timestamp + firstFrame * period;
+        block.arrivalNs  = 0;
+        return true;
+    }
+
+private:
+    bool ParseHeaders22()
+    {
+        const HdemgNsxBasicHeader * pBasic = (const HdemgNsxBasicHeader *)pMap;
+        specMajor      = pBasic->specMajor;
+        specMinor      = pBasic->specMinor;
+        channelCount   = pBasic->channelCount;
+        period         = pBasic->period;
+        timeResolution = pBasic->timeResolution;
+        memcpy(label, pBasic->label, sizeof(pBasic->label));
+        label[sizeof(pBasic->label)] = 0;
+
+        // data follows the extended headers, as in openNSx.m (HeaderBytes is not used)
+        dataStart = sizeof(HdemgNsxBasicHeader) + (uint64_t)channelCount * sizeof(HdemgNsxChannelHeader);
+        if(channelCount == 0 || period == 0 || timeResolution == 0 || dataStart > fileSize)
+        {
+            printf("ERROR: NSx header is invalid channels[%u] period[%u]\n", channelCount, period);
+            return false;
+        }
+
+        electrodeIds.resize(channelCount);
+        for(uint32_t c=0; c<channelCount; ++c)
+        {
+            const HdemgNsxChannelHeader * pExt = ChannelHeader(c);
+            if(pExt->type[0] != 'C' || pExt->type[1] != 'C')
+            {
+                printf("ERROR: extended header [%u] is not supported\n", c);
+                return false;
+            }
+            electrodeIds[c] = pExt->electrodeId;
+        }
+        return true;
+    }
+
+    bool ParseHeaders21()
+    {
+        // "NEURALSG", label[16], period, channel count, channel IDs, then a single run of frames
+        memcpy(label, pMap + 8, 16);
+        label[16] = 0;
+        memcpy(&period, pMap + 24, sizeof(uint32_t));
+        memcpy(&channelCount, pMap + 28, sizeof(uint32_t));
+        specMajor      = 2;
+        specMinor      = 1;
+        timeResolution = HDEMG_NSX_TIME_RESOLUTION;
+        dataStart      = 32 + (uint64_t)channelCount * sizeof(uint32_t);
+        if(channelCount == 0 || period == 0 || dataStart > fileSize)
+        {
+            printf("ERROR: NSx 2.1 header is invalid channels[%u] period[%u]\n", channelCount, period);
+            return false;
+        }
+
+        electrodeIds.resize(channelCount);
+        for(uint32_t c=0; c<channelCount; ++c)
+        {
+            uint32_t id;
+            memcpy(&id, pMap + 32 + c * sizeof(uint32_t), sizeof(uint32_t));
+            electrodeIds[c] = (uint16_t)id;
+        }
+
+        // the segment "header" is virtual, DataOffset() lands on the first frame
+        HdemgNsxSegment segment;
+        segment.headerOffset = dataStart - sizeof(HdemgNsxDataHeader);
+        segment.timestamp    = 0;
+        segment.dataPoints   = (uint32_t)((fileSize - dataStart) / ((uint64_t)channelCount * sizeof(int16_t)));
+        segments.push_back(segment);
+        return true;
+    }
+
+    bool ParseSegments()
+    {
+        const uint64_t frameBytes = (uint64_t)channelCount * sizeof(int16_t);
+        uint64_t offset = dataStart;
+        while(offset + sizeof(HdemgNsxDataHeader) <= fileSize && pMap[offset] == HDEMG_NSX_DATA_HEADER_ID)
+        {
+            HdemgNsxDataHeader header;
+            memcpy(&header, pMap + offset, sizeof(header));
+
+            HdemgNsxSegment segment;
+            segment.headerOffset = offset;
+            segment.timestamp    = header.timestamp;
+            segment.dataPoints   = header.dataPoints;
+
+            // DataPoints left at zero by a writer that did not finish (or by Central 6.01),
+            // or pointing past the end: the segment runs to the end of the file
+            uint64_t data = segment.DataOffset();
+            uint64_t end  = data + segment.dataPoints * frameBytes;
+            bool     open = (segment.dataPoints == 0 && data < fileSize && pMap[data] != HDEMG_NSX_DATA_HEADER_ID);
+            if(open || end > fileSize)
+            {
+                segment.dataPoints = (uint32_t)((fileSize - data) / frameBytes);
+                end = data + segment.dataPoints * frameBytes;
+            }
+            segments.push_back(segment);
+            offset = end;
+        }
+
+        // Central 6.03 writes an empty packet at time zero in front of the real one
+        if(segments.size() > 1 && segments[0].timestamp == 0 && segments[1].timestamp == 0)
+            segments.erase(segments.begin());
+
+        if(segments.empty())
+        {
+            printf("ERROR: NSx file has no data packets\n");
+            return false;
+        }
+        return true;
+    }
+
+    bool LoadIndex(const char * pIndexPath)
+    {
+        if(!index.Load(pIndexPath, channelCount, period, fileSize, BasicHeader()->origin))
+            return false;
+
+        // the first and last packet headers must be where the index puts them
+        const std::vector<HdemgNsxSegment> & list = index.Segments();
+        const uint64_t frameBytes = (uint64_t)channelCount * sizeof(int16_t);
+        for(uint32_t k=0; k<2; ++k)
+        {
+            const HdemgNsxSegment & segment = k ? list.back() : list.front();
+            HdemgNsxDataHeader header;
+            if(segment.DataOffset() + segment.dataPoints * frameBytes > fileSize)
+                return false;
+            memcpy(&header, pMap + segment.headerOffset, sizeof(header));
+            if(header.id != HDEMG_NSX_DATA_HEADER_ID || header.timestamp != segment.timestamp)
+                return false;
+        }
+        segments  = list;
+        indexUsed = true;
+        return true;
+    }
+
+    bool CheckRange(uint32_t seg, uint32_t firstFrame, uint32_t frameCount) const
+    {
+        if(seg >= segments.size() || (uint64_t)firstFrame + frameCount > segments[seg].dataPoints)
+        {
+            printf("ERROR: NSx range segment[%u] frames[%u, +%u] is outside the file\n", seg, firstFrame, frameCount);
+            return false;
+        }
+        return true;
+    }
+
+    bool CheckChannels(const uint32_t * pChannels, uint32_t channels) const
+    {
+        if(channels == 0)
+            return false;
+        for(uint32_t j=0; pChannels && j<channels; ++j)
+        {
+            if(pChannels[j] >= channelCount)
+            {
+                printf("ERROR: NSx file has no channel [%u]\n", pChannels[j]);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool IsRun(const uint32_t * pChannels, uint32_t channels)
+    {
+        for(uint32_t j=1; pChannels && j<channels; ++j)
+            if(pChannels[j] != pChannels[0] + j)
+                return false;
+        return true;
+    }
+
+    HdemgMappedFile               file;
+    const uint8_t *               pMap;             // file.Data()
+    uint64_t                      fileSize;
+    uint8_t                       specMajor;
+    uint8_t                       specMinor;
+    uint32_t                      channelCount;
+    uint32_t                      period;
+    uint32_t                      timeResolution;
+    uint64_t                      dataStart;        // end of the headers
+    char                          label[17];
+    std::vector<uint16_t>         electrodeIds;
+    std::vector<HdemgNsxSegment>  segments;
+    HdemgNsxIndex                 index;
+    bool                          indexUsed;
+};
+
+/**
+    Sizes a statistics accumulator for the channels of a file, with the digital range of
+    the extended header of every channel as its rails
+  */
+inline void
+HdemgNsxConfigureStats(const HdemgNsxReader & reader, HdemgChannelStatsAccumulator & stats)
+{
+    stats.Configure(reader.ChannelCount());
+    for(uint32_t c=0; c<reader.ChannelCount(); ++c)
+    {
+        const HdemgNsxChannelHeader * pExt = reader.ChannelHeader(c);
+        if(pExt && pExt->minDigital < pExt->maxDigital)
+            stats.SetRails(c, pExt->minDigital, pExt->maxDigital);
+    }
+}
+
+//! \brief reads every frame of a file and returns the statistics of its channels
+inline std::vector<HdemgChannelStats>
+HdemgNsxReadStats(const HdemgNsxReader & reader)
+{
+    HdemgChannelStatsAccumulator stats;
+    HdemgNsxConfigureStats(reader, stats);
+    for(uint32_t s=0; s<reader.SegmentCount(); ++s)
+    {
+        HdemgNsxView view = reader.View(s, 0, reader.Segment(s).dataPoints);
+        stats.Add(view.pData, view.frameCount);
+    }
+    return stats.Stats();
+}
+
+#endif // HDEMG_NSX_READER_H
@@ -0,0 +1,507 @@
+//
+//  hdemg_nsx_session.h
+//
+//  Recording split into consecutive NSx files "<base>-001<ext>", "<base>-002<ext>", ... by
+//  size or duration, like the autoSegEnabled / autoSegSize / autoSegUnits settings of
+//  XippRecordingTrialDescriptor do for Trellis recordings.
+//
+//  The split is made at a frame: the last frame of a file is followed by the first frame of
+//  the next one without a gap and without repeating a frame. Each file is an ordinary NSx
+//  file written by HdemgNsxWriter; its sidecar index (hdemg_nsx_index.h) records its number
+//  in the session and the frames recorded in the files before it.
+//
+//  The next file is created, and its disk space reserved, on a background thread while the
+//  current one is written, so switching files at the split only swaps two writers. The
+//  finished file is closed on another background thread.
+//
+//  HdemgNsxSessionReader opens all files of a session and reads them as one timeline, and
+//  merges the QC statistics the files keep in their indexes.
+//
+
+#ifndef HDEMG_NSX_SESSION_H
+#define HDEMG_NSX_SESSION_H
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "hdemg_channel_stats.h"
+#include "hdemg_frames.h"
+#include "hdemg_nsx.h"
+#include "hdemg_nsx_index.h"
+#include "hdemg_nsx_reader.h"
+#include "hdemg_nsx_writer.h"
+
+// units of autoSegSize, in the order of XippRecordingTrialDescriptor::autoSegUnits
+static const int32_t  HDEMG_NSX_SEGMENT_MEGABYTES = 0;
+static const int32_t  HDEMG_NSX_SEGMENT_MINUTES   = 1;
+static const int32_t  HDEMG_NSX_SEGMENT_HOURS     = 2;
+static const int32_t  HDEMG_NSX_SEGMENT_DAYS      = 3;
+
+static const uint32_t HDEMG_NSX_SESSION_MAX_FILES       = 999;
+static const uint64_t HDEMG_NSX_SESSION_MAX_PREALLOCATE = 1ull << 30;
+
+//! \brief Files of a recording, the autoSeg fields are those of XippRecordingTrialDescriptor
+struct HdemgNsxSessionSettings
+{
+    HdemgNsxWriterSettings file;            //!< settings of every file, its strings must outlive the writer
+    uint32_t               autoSegEnabled;  //!< split the recording into files
+    float                  autoSegSize;     //!< size of a file in autoSegUnits
+    int32_t                autoSegUnits;    //!< HDEMG_NSX_SEGMENT_MEGABYTES, _MINUTES, _HOURS or _DAYS
+
+    HdemgNsxSessionSettings() : autoSegEnabled(0), autoSegSize(0.0f), autoSegUnits(HDEMG_NSX_SEGMENT_MINUTES) {}
+};
+
+/**
+    Writes the name of file number file (from 1) of a session into pPath
+
+    \return false if the name does not fit
+  */
+inline bool
+HdemgNsxSessionPath(const char * pBase, const char * pExtension, uint32_t file, char * pPath, size_t size)
+{
+    int n = snprintf(pPath, size, "%s-%03u%s", pBase, file, pExtension);
+    return n > 0 && (size_t)n < size;
+}
+
+/*! \brief Streaming NSx recorder that starts a new file every autoSegSize.
+ */
+class HdemgNsxSessionWriter
+{
+public:
+    HdemgNsxSessionWriter()
+        : pCurrent(&writers[0]), pNext(&writers[1]), pOld(&writers[2]), channelCount(0), sampleRate(0.0),
+          frameLimit(0), fileNumber(0), framesInFile(0), framesWritten(0), nextOpen(false), oldFailed(false),
+          failed(false) {}
+
+    ~HdemgNsxSessionWriter() { Close(); }
+
+    /**
+        Creates the first file of a session.
+
+        \arg pBase         - file name without number and extension, e.g. "session"
+        \arg pExtension    - e.g. ".ns5"
+        \arg channels      - channels per frame of the blocks that will be written
+        \arg rate          - frame rate in Hz, must divide the NIP clock
+        \arg pElectrodeIds - electrode ID of each channel, NULL for 1..channels
+        \arg settings      - header contents of the files and where to split
+
+        \return true if the first file was created
+      */
+    bool Open(const char * pBase, const char * pExtension, uint32_t channels, double rate, const uint16_t * pElectrodeIds,
+              const HdemgNsxSessionSettings & settings = HdemgNsxSessionSettings())
+    {
+        Close();
+        if(!pBase || !pExtension || rate <= 0.0 || (settings.autoSegEnabled && settings.autoSegSize <= 0.0f))
+        {
+            printf("ERROR: invalid NSx session configuration\n");
+            return false;
+        }
+
+        snprintf(base, sizeof(base), "%s", pBase);
+        snprintf(extension, sizeof(extension), "%s", pExtension);
+        channelCount = channels;
+        sampleRate   = rate;
+        fileSettings = settings.file;
+        electrodeIds.clear();
+        if(pElectrodeIds)
+            electrodeIds.assign(pElectrodeIds, pElectrodeIds + channels);
+
+        // frames per file; a pause adds a data header, so sized files may be a few bytes larger
+        const uint64_t frameBytes  = (uint64_t)channels * sizeof(int16_t);
+        const uint64_t headerBytes = sizeof(HdemgNsxBasicHeader) + channels * sizeof(HdemgNsxChannelHeader)
+                                     + sizeof(HdemgNsxDataHeader);
+        frameLimit = 0;
+        if(settings.autoSegEnabled)
+        {
+            double frames = 0.0;
+            switch(settings.autoSegUnits)
+            {
+            case HDEMG_NSX_SEGMENT_MEGABYTES:
+                frames = (settings.autoSegSize * 1048576.0 - headerBytes) / frameBytes;
+                break;
+            case HDEMG_NSX_SEGMENT_MINUTES: frames = settings.autoSegSize * 60.0 * rate;    break;
+            case HDEMG_NSX_SEGMENT_HOURS:   frames = settings.autoSegSize * 3600.0 * rate;  break;
+            case HDEMG_NSX_SEGMENT_DAYS:    frames = settings.autoSegSize * 86400.0 * rate; break;
+            default:
+                printf("ERROR: invalid NSx session units [%d]\n", settings.autoSegUnits);
+                return false;
+            }
+            frameLimit = (frames >= 1.0) ? (uint64_t)frames : 1;
+            if(frameLimit > 0xFFFFFFFFull)
+                frameLimit = 0xFFFFFFFFull;
+
+            // reserve a whole file unless asked otherwise
+            if(fileSettings.preallocateBytes == 0)
+            {
+                fileSettings.preallocateBytes = headerBytes + frameLimit * frameBytes;
+                if(fileSettings.preallocateBytes > HDEMG_NSX_SESSION_MAX_PREALLOCATE)
+                    fileSettings.preallocateBytes = HDEMG_NSX_SESSION_MAX_PREALLOCATE;
+            }
+        }
+
+        failed        = false;
+        framesWritten = 0;
+        framesInFile  = 0;
+        fileNumber    = 1;
+        if(!OpenFile(*pCurrent, fileNumber))
+            return false;
+        pCurrent->SetSession(fileNumber, 0);
+        if(frameLimit)
+            opener = std::thread(&HdemgNsxSessionWriter::OpenNext, this);
+        return true;
+    }
+
+    /**
+        Appends the frames of a block, continuing in the next file when the current one is full.
+
+        \arg block - channel count and rate must match Open()
+
+        \return false if the block does not match or a file could not be written
+      */
+    bool Write(const HdemgBlock & block)
+    {
+        if(!IsOpen() || failed)
+            return false;
+
+        uint32_t done = 0;
+        while(done < block.frameCount)
+        {
+            if(frameLimit && framesInFile == frameLimit && !Rotate())
+                return false;
+            uint32_t n = block.frameCount - done;
+            if(frameLimit && n > frameLimit - framesInFile)
+                n = (uint32_t)(frameLimit - framesInFile);
+            if(!pCurrent->Write(block, done, n))
+            {
+                failed = pCurrent->Failed();
+                return false;
+            }
+            done          += n;
+            framesInFile  += n;
+            framesWritten += n;
+        }
+        return true;
+    }
+
+    //! \brief ends the current data packet, see HdemgNsxWriter::Pause()
+    void Pause()
+    {
+        if(IsOpen())
+            pCurrent->Pause();
+    }
+
+    //! \brief writes the buffered frames of the current file, see HdemgNsxWriter::Flush()
+    bool Flush()
+    {
+        if(!IsOpen() || failed)
+            return false;
+        failed = !pCurrent->Flush();
+        return !failed;
+    }
+
+    //! \brief closes the current file and deletes the next one, which was not used
+    void Close()
+    {
+        if(opener.joinable())
+            opener.join();
+        if(closer.joinable())
+            closer.join();
+        failed = failed || oldFailed;
+        oldFailed = false;
+
+        if(pCurrent->IsOpen())
+        {
+            pCurrent->Close();
+            failed = failed || pCurrent->Failed();
+        }
+        if(nextOpen)
+        {
+            pNext->Close();
+            RemoveFile(fileNumber + 1);
+        }
+        nextOpen = false;
+    }
+
+    bool     IsOpen() const        { return pCurrent->IsOpen(); }
+    bool     Failed() const        { return failed; }           //!< a file could not be created or written
+    uint32_t FileCount() const     { return fileNumber; }       //!< files of the session so far
+    uint64_t FramesWritten() const { return framesWritten; }    //!< frames of all files
+    uint64_t FrameLimit() const    { return frameLimit; }       //!< frames per file, 0 if not split
+
+    //! \brief writer of the file being recorded
+    const HdemgNsxWriter & Current() const { return *pCurrent; }
+
+private:
+    bool OpenFile(HdemgNsxWriter & writer, uint32_t number)
+    {
+        char path[HDEMG_NSX_INDEX_MAX_PATH];
+        if(number > HDEMG_NSX_SESSION_MAX_FILES || !HdemgNsxSessionPath(base, extension, number, path, sizeof(path)))
+        {
+            printf("ERROR: cannot name file [%u] of NSx session [%s]\n", number, base);
+            return false;
+        }
+        return writer.Open(path, channelCount, sampleRate, electrodeIds.empty() ? NULL : &electrodeIds[0], fileSettings);
+    }
+
+    // background thread: creates the next file while the current one is written
+    void OpenNext()
+    {
+        nextOpen = OpenFile(*pNext, fileNumber + 1);
+    }
+
+    void RemoveFile(uint32_t number)
+    {
+        char path[HDEMG_NSX_INDEX_MAX_PATH];
+        char sidecar[HDEMG_NSX_INDEX_MAX_PATH];
+        if(!HdemgNsxSessionPath(base, extension, number, path, sizeof(path)))
+            return;
+        remove(path);
+        if(HdemgNsxIndexPath(path, sidecar, sizeof(sidecar)))
+            remove(sidecar);
+        if(HdemgNsxDigestPath(path, sidecar, sizeof(sidecar)))
+            remove(sidecar);
+    }
+
+    // continues the recording in the file opened by OpenNext()
+    bool Rotate()
+    {
+        if(opener.joinable())
+            opener.join();
+        if(closer.joinable())
+            closer.join();
+        if(oldFailed || !nextOpen)
+        {
+            printf("ERROR: NSx session [%s] cannot continue after file [%u]\n", base, fileNumber);
+            failed = true;
+            return false;
+        }
+
+        HdemgNsxWriter * pDone = pCurrent;
+        pCurrent = pNext;
+        pNext    = pOld;
+        pOld     = pDone;
+        nextOpen = false;
+
+        ++fileNumber;
+        framesInFile = 0;
+        pCurrent->StampOrigin();
+        pCurrent->SetSession(fileNumber, framesWritten);
+
+        closer = std::thread([this]()
+        {
+            pOld->Close();
+            oldFailed = pOld->Failed();
+        });
+        opener = std::thread(&HdemgNsxSessionWriter::OpenNext, this);
+        return true;
+    }
+
+    HdemgNsxWriter         writers[3];
+    HdemgNsxWriter *       pCurrent;        // file being written
+    HdemgNsxWriter *       pNext;           // opened ahead by the opener thread
+    HdemgNsxWriter *       pOld;            // closed by the closer thread
+    std::thread            opener;
+    std::thread            closer;
+    char                   base[HDEMG_NSX_INDEX_MAX_PATH];
+    char                   extension[32];
+    uint32_t               channelCount;
+    double                 sampleRate;
+    std::vector<uint16_t>  electrodeIds;
+    HdemgNsxWriterSettings fileSettings;
+    uint64_t               frameLimit;      // 0 if not split
+    uint32_t               fileNumber;      // of the current file, from 1
+    uint64_t               framesInFile;
+    uint64_t               framesWritten;
+    bool                   nextOpen;        // set by the opener thread
+    bool                   oldFailed;       // set by the closer thread
+    bool                   failed;
+};
+
+/*! \brief Reads the files of a session as one recording.
+ */
+class HdemgNsxSessionReader
+{
+public:
+    HdemgNsxSessionReader() : totalFrames(0) {}
+    ~HdemgNsxSessionReader() { Close(); }
+
+    /**
+        Opens "<base>-001<ext>" and the files numbered after it, up to the first one missing.
+        Files whose index gives their place in the session must be in that place.
+
+        \return false if the first file is missing or the files are not one recording
+      */
+    bool Open(const char * pBase, const char * pExtension)
+    {
+        Close();
+        for(uint32_t number=1; number<=HDEMG_NSX_SESSION_MAX_FILES; ++number)
+        {
+            char path[HDEMG_NSX_INDEX_MAX_PATH];
+            if(!HdemgNsxSessionPath(pBase, pExtension, number, path, sizeof(path)))
+                break;
+            FILE * pFile = fopen(path, "rb");
+            if(!pFile)
+                break;
+            fclose(pFile);
+
+            HdemgNsxReader * pReader = new HdemgNsxReader();
+            files.push_back(pReader);
+            if(!pReader->Open(path))
+            {
+                Close();
+                return false;
+            }
+
+            const HdemgNsxIndex & index = pReader->Index();
+            if(pReader->ChannelCount() != files[0]->ChannelCount() || pReader->Period() != files[0]->Period()
+               || (index.SessionFile() && (index.SessionFile() != number || index.SessionFrames() != totalFrames)))
+            {
+                printf("ERROR: [%s] is not file [%u] of the session\n", path, number);
+                Close();
+                return false;
+            }
+
+            firstFrames.push_back(totalFrames);
+            for(uint32_t s=0; s<pReader->SegmentCount(); ++s)
+                totalFrames += pReader->Segment(s).dataPoints;
+        }
+
+        if(files.empty())
+        {
+            printf("ERROR: cannot open NSx session [%s-001%s]\n", pBase, pExtension);
+            return false;
+        }
+        return true;
+    }
+
+    //! \brief closes all files
+    void Close()
+    {
+        for(size_t f=0; f<files.size(); ++f)
+            delete files[f];
+        files.clear();
+        firstFrames.clear();
+        totalFrames = 0;
+    }
+
+    bool     IsOpen() const         { return !files.empty(); }
+    uint32_t FileCount() const      { return (uint32_t)files.size(); }
+    uint64_t FrameCount() const     { return totalFrames; }                    //!< frames of all files
+    uint32_t ChannelCount() const   { return files[0]->ChannelCount(); }
+    uint32_t Period() const         { return files[0]->Period(); }
+    double   SampleRate() const     { return files[0]->SampleRate(); }
+
+    //! \brief file f of the session, from 0
+    const HdemgNsxReader & File(uint32_t f) const { return *files[f]; }
+
+    //! \brief frames of the session in the files before file f
+    uint64_t FirstFrame(uint32_t f) const { return firstFrames[f]; }
+
+    /**
+        Merges the QC statistics of all files from their indexes, without reading the data.
+
+        \return false if a file has no statistics
+      */
+    bool Stats(std::vector<HdemgChannelStats> & total) const
+    {
+        total.clear();
+        for(size_t f=0; f<files.size(); ++f)
+        {
+            if(files[f]->Index().Stats().empty() || !HdemgMergeChannelStats(total, files[f]->Index().Stats()))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+        Finds the frame at or after a NIP time.
+
+        \return false if the time lies after the end of the session
+      */
+    bool Locate(uint32_t time, uint32_t * pFile, uint32_t * pSeg, uint32_t * pFrame) const
+    {
+        for(uint32_t f=0; f<files.size(); ++f)
+        {
+            if(files[f]->Locate(time, pSeg, pFrame))
+            {
+                *pFile = f;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+        Gathers frames from time on into an HdemgBlock, across data packets and files as long
+        as the recording continues without a gap. The block is allocated on the first call or
+        when its shape changes.
+
+        \return false if the time lies after the end of the session or a channel is invalid;
+                block.frameCount is less than frameCount if a gap or the end was reached
+      */
+    bool ReadBlock(uint32_t time, uint32_t frameCount, const uint32_t * pChannels, uint32_t channels,
+                   HdemgBlock & block) const
+    {
+        uint32_t f, s, frame;
+        if(!pChannels)
+            channels = ChannelCount();
+        for(uint32_t j=0; pChannels && j<channels; ++j)
+        {
+            if(pChannels[j] >= ChannelCount())
+            {
+                printf("ERROR: NSx session channel [%u] is outside the file\n", pChannels[j]);
+                return false;
+            }
+        }
+        if(frameCount == 0 || channels == 0 || !Locate(time, &f, &s, &frame))
+            return false;
+        if(block.channelCount != channels || block.capacity < frameCount || block.sampleRate != SampleRate())
+        {
+            if(!block.Allocate(channels, frameCount, SampleRate()))
+                return false;
+        }
+
+        const uint32_t period = Period();
+        block.startTime  = files[f]->Segment(s).timestamp + frame * period;
+        block.arrivalNs  = 0;
+        block.frameCount = 0;
+        while(block.frameCount < frameCount)
+        {
+            const HdemgNsxReader & file = *files[f];
+            uint32_t n = file.Segment(s).dataPoints - frame;
+            if(n > frameCount - block.frameCount)
+                n = frameCount - block.frameCount;
+
+            HdemgNsxView view = file.View(s, frame, n);
+            for(uint32_t i=0; i<view.frameCount; ++i)
+            {
+                const int16_t * pSrc = view.Frame(i);
+                float *         pDst = block.Frame(block.frameCount + i);
+                for(uint32_t j=0; j<channels; ++j)
+                    pDst[j] = (float)pSrc[pChannels ? pChannels[j] : j];
+            }
+            block.frameCount += view.frameCount;
+
+            // next data packet, in this file or at the start of the next one
+            frame = 0;
+            if(++s == file.SegmentCount())
+            {
+                s = 0;
+                if(++f == files.size())
+                    break;
+            }
+            if(files[f]->Segment(s).timestamp != block.startTime + block.frameCount * period)
+                break;
+        }
+        return true;
+    }
+
+private:
+    std::vector<HdemgNsxReader *> files;
+    std::vector<uint64_t>         firstFrames;
+    uint64_t                      totalFrames;
+};
+
+#endif // HDEMG_NSX_SESSION_H
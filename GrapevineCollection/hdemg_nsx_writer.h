@@ -0,0 +1,592 @@
+//
+//  hdemg_nsx_writer.h
+//
+//  Records HdemgBlocks straight to NSx 2.2 / 2.3 files (see hdemg_nsx.h), so the assembled
+//  or decimated streams can be stored without driving Trellis. The files open in
+//  openNSx.m like the ones Trellis writes.
+//
+//  Every NIP gap, and every Pause(), closes the current data packet and the next block
+//  starts a new one with its own timestamp. DataPoints of a packet are written as zero and
+//  patched when the packet ends, or at each Flush() for the packet still being written.
+//
+//  The sidecar index of the data packets (hdemg_nsx_index.h) is rewritten at every Flush()
+//  and at Close(), so it always matches the part of the file that is on disk. It also holds
+//  the QC statistics of every channel (hdemg_channel_stats.h), taken from the int16 frames
+//  as they are written.
+//
+//  With digestFrames, the min/max digest of the file (hdemg_nsx_digest.h) is built from the
+//  frames as they are written and saved as "<file>.dig" at Close().
+//
+//  With checkpointMs, Write() also checkpoints the data packets into a journal every
+//  checkpointMs (hdemg_nsx_journal.h): the data is made durable first, then the journal.
+//  Both run in the background, on the thread of the journal or, with asyncWrite, in order
+//  with the writes on the HdemgAsyncWriter thread, so Write() never waits for fdatasync.
+//  nsx_recover.cpp repairs a file from its journal after a crash.
+//
+//  Frames are converted to int16 directly into one large page aligned buffer that is
+//  handed to the OS in whole buffer writes with stdio buffering switched off. With
+//  asyncWrite the buffers come from an HdemgAsyncWriter pool instead and are written by
+//  its thread (io_uring, O_DIRECT), so Write() does not wait for the disk.
+//
+
+#ifndef HDEMG_NSX_WRITER_H
+#define HDEMG_NSX_WRITER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "hdemg_async_writer.h"
+#include "hdemg_channel_stats.h"
+#include "hdemg_frames.h"
+#include "hdemg_nsx.h"
+#include "hdemg_nsx_digest.h"
+#include "hdemg_nsx_index.h"
+#include "hdemg_nsx_journal.h"
+#include "hdemg_simd.h"
+
+static const uint32_t HDEMG_NSX_WRITE_BUFFER_BYTES = 4 << 20;
+static const uint32_t HDEMG_NSX_BUFFER_ALIGNMENT   = 4096;
+static const uint32_t HDEMG_NSX_CHECKPOINT_MS      = 1000;
+
+//! \brief Header contents of a recording, the defaults describe raw counts of a 0.25 uV front end
+struct HdemgNsxWriterSettings
+{
+    uint8_t      specMinor;         //!< 2 or 3
+    const char * pLabel;            //!< sampling group label, NULL for "<rate> S/s"
+    const char * pComment;
+    float        countsPerUnit;     //!< block samples are multiplied by this before rounding
+    int16_t      minDigital;
+    int16_t      maxDigital;
+    int16_t      minAnalog;         //!< analog value of minDigital
+    int16_t      maxAnalog;         //!< analog value of maxDigital
+    const char * pUnits;
+    uint32_t     highFreqCorner;    //!< high pass corner in mHz, 0 if none
+    uint32_t     highFreqOrder;
+    uint32_t     lowFreqCorner;     //!< low pass corner in mHz, 0 if none
+    uint32_t     lowFreqOrder;
+    uint32_t     bufferBytes;       //!< size of the write buffer
+    bool         writeIndex;        //!< keep "<file>.idx" up to date
+    uint32_t     digestFrames;      //!< frames per bucket of the "<file>.dig" min/max digest, 0 for none
+    uint32_t     checkpointMs;      //!< journal interval in "<file>.jnl", 0 for no journal
+    uint64_t     preallocateBytes;  //!< disk space reserved at Open(), e.g. the expected file size
+    bool         asyncWrite;        //!< write from a background thread (HdemgAsyncWriter)
+    HdemgAsyncWriterSettings async; //!< pool and I/O path with asyncWrite, bufferBytes is taken from above
+
+    HdemgNsxWriterSettings()
+        : specMinor(3), pLabel(NULL), pComment(NULL), countsPerUnit(1.0f), minDigital(-32768),
+          maxDigital(32767), minAnalog(-8192), maxAnalog(8192), pUnits("uV"), highFreqCorner(0),
+          highFreqOrder(0), lowFreqCorner(0), lowFreqOrder(0), bufferBytes(HDEMG_NSX_WRITE_BUFFER_BYTES),
+          writeIndex(true), digestFrames(HDEMG_NSX_DIGEST_BUCKET_FRAMES), checkpointMs(HDEMG_NSX_CHECKPOINT_MS), preallocateBytes(0),
+          asyncWrite(false) {}
+};
+
+/*! \brief Streaming NSx recorder for one sampling group.
+ *
+ *  Channel c of every frame becomes extended header c. Electrode IDs default to c+1; with
+ *  front end channel numbering (128 per port) they also give the connector bank and pin.
+ */
+class HdemgNsxWriter
+{
+public:
+    HdemgNsxWriter()
+        : pFile(NULL), pBuffer(NULL), bufferSize(0), used(0), flushed(0), channelCount(0), sampleRate(0.0),
+          frameBytes(0), period(0), countsPerUnit(1.0f), expectedTime(0), inSegment(false), failed(false), framesWritten(0),
+          writeIndex(false), checkpointNs(0), lastCheckpointNs(0), checkpointQueued(false), preallocated(false) {}
+
+    ~HdemgNsxWriter() { Close(); }
+
+    /**
+        Creates the file and writes the basic and extended headers.
+
+        \arg pPath         - file name, e.g. "session.ns5"
+        \arg channels      - channels per frame of the blocks that will be written
+        \arg rate          - frame rate in Hz, must divide the NIP clock
+        \arg pElectrodeIds - distinct electrode ID of each channel from 1, NULL for 1..channels
+        \arg settings      - header contents and buffer size
+
+        \return true if the file was created
+      */
+    bool Open(const char * pPath, uint32_t channels, double rate, const uint16_t * pElectrodeIds,
+              const HdemgNsxWriterSettings & settings = HdemgNsxWriterSettings())
+    {
+        Close();
+
+        uint32_t ticks = (rate > 0.0) ? (uint32_t)(HDEMG_NSX_TIME_RESOLUTION / rate + 0.5) : 0;
+        if(!pPath || channels == 0 || channels > 0xFFFF || ticks == 0 || HDEMG_NSX_TIME_RESOLUTION / (double)ticks != rate
+           || (settings.specMinor != 2 && settings.specMinor != 3) || settings.countsPerUnit <= 0.0f)
+        {
+            printf("ERROR: invalid NSx writer configuration channels[%u] rate[%.3f]\n", channels, rate);
+            return false;
+        }
+        std::vector<bool> seen(pElectrodeIds ? 0x10000 : 0, false);
+        for(uint32_t c=0; pElectrodeIds && c<channels; ++c)
+        {
+            // the connector bank and pin are derived from the ID
+            if(pElectrodeIds[c] < 1)
+            {
+                printf("ERROR: invalid electrode ID [%u] of channel [%u], IDs start at 1\n", pElectrodeIds[c], c);
+                return false;
+            }
+            // openNSx.m selects channels by ID
+            if(seen[pElectrodeIds[c]])
+            {
+                printf("ERROR: electrode ID [%u] of channel [%u] is used by another channel\n", pElectrodeIds[c], c);
+                return false;
+            }
+            seen[pElectrodeIds[c]] = true;
+        }
+
+        char digestPath[HDEMG_NSX_INDEX_MAX_PATH];
+        if((settings.writeIndex && !HdemgNsxIndexPath(pPath, indexPath, sizeof(indexPath)))
+           || (settings.digestFrames && !HdemgNsxDigestPath(pPath, digestPath, sizeof(digestPath)))
+           || (settings.checkpointMs && !HdemgNsxJournalPath(pPath, journalPath, sizeof(journalPath))))
+        {
+            printf("ERROR: NSx file name is too long [%s]\n", pPath);
+            return false;
+        }
+
+        uint32_t headerBytes = (uint32_t)(sizeof(HdemgNsxBasicHeader) + channels * sizeof(HdemgNsxChannelHeader));
+        channelCount  = channels;
+        sampleRate    = rate;
+        frameBytes    = channels * sizeof(int16_t);
+        countsPerUnit = settings.countsPerUnit;
+        writeIndex    = settings.writeIndex;
+        period        = ticks;
+
+        // the buffer holds the headers and at least a data header and one frame
+        size_t minimum = headerBytes + sizeof(HdemgNsxDataHeader) + frameBytes;
+        bufferSize = (settings.bufferBytes > minimum) ? settings.bufferBytes : minimum;
+        bufferSize = (bufferSize + HDEMG_NSX_BUFFER_ALIGNMENT - 1) / HDEMG_NSX_BUFFER_ALIGNMENT * HDEMG_NSX_BUFFER_ALIGNMENT;
+
+        preallocated = false;
+        if(settings.asyncWrite)
+        {
+            // pool buffers start with up to one partial sector of the previous write
+            HdemgAsyncWriterSettings pool = settings.async;
+            pool.bufferBytes = (uint32_t)bufferSize + HDEMG_ASYNC_ALIGNMENT;
+            if(settings.preallocateBytes > pool.preallocateBytes)
+                pool.preallocateBytes = settings.preallocateBytes;
+            if(!async.Open(pPath, pool) || !(pBuffer = async.Acquire(&bufferSize)))
+            {
+                async.Close();
+                return false;
+            }
+        }
+        else
+        {
+            pFile = fopen(pPath, "wb");
+            if(!pFile)
+            {
+                printf("ERROR: cannot create [%s]\n", pPath);
+                return false;
+            }
+            setvbuf(pFile, NULL, _IONBF, 0);
+            preallocated = settings.preallocateBytes && HdemgNsxPreallocate(pFile, settings.preallocateBytes);
+
+            storage.assign(bufferSize + HDEMG_NSX_BUFFER_ALIGNMENT, 0);
+            uintptr_t base = (uintptr_t)&storage[0];
+            pBuffer = &storage[0] + ((HDEMG_NSX_BUFFER_ALIGNMENT - base % HDEMG_NSX_BUFFER_ALIGNMENT) % HDEMG_NSX_BUFFER_ALIGNMENT);
+        }
+
+        used          = 0;
+        flushed       = 0;
+        inSegment     = false;
+        failed        = false;
+        framesWritten = 0;
+        segments.clear();
+        index.SetSession(0, 0);
+        stats.Configure(channels, settings.minDigital, settings.maxDigital);
+
+        HdemgNsxBasicHeader basic;
+        memset(&basic, 0, sizeof(basic));
+        memcpy(basic.fileType, HDEMG_NSX_FILE_TYPE, sizeof(basic.fileType));
+        basic.specMajor      = HDEMG_NSX_SPEC_MAJOR;
+        basic.specMinor      = settings.specMinor;
+        basic.headerBytes    = headerBytes;
+        basic.period         = period;
+        basic.timeResolution = HDEMG_NSX_TIME_RESOLUTION;
+        basic.channelCount   = channels;
+        basic.origin         = Now();
+        origin               = basic.origin;
+        if(settings.pLabel)
+            HdemgNsxSetField(basic.label, sizeof(basic.label), settings.pLabel);
+        else
+            snprintf(basic.label, sizeof(basic.label), "%u S/s", HDEMG_NSX_TIME_RESOLUTION / period);
+        HdemgNsxSetField(basic.comment, sizeof(basic.comment), settings.pComment);
+        Append(&basic, sizeof(basic));
+
+        for(uint32_t c=0; c<channels; ++c)
+        {
+            HdemgNsxChannelHeader ext;
+            memset(&ext, 0, sizeof(ext));
+            uint16_t id = pElectrodeIds ? pElectrodeIds[c] : (uint16_t)(c + 1);
+            ext.type[0]        = 'C';
+            ext.type[1]        = 'C';
+            ext.electrodeId    = id;
+            ext.connectorBank  = (uint8_t)((id - 1) / 128 + 1);
+            ext.connectorPin   = (uint8_t)((id - 1) % 128 + 1);
+            ext.minDigital     = settings.minDigital;
+            ext.maxDigital     = settings.maxDigital;
+            ext.minAnalog      = settings.minAnalog;
+            ext.maxAnalog      = settings.maxAnalog;
+            ext.highFreqCorner = settings.highFreqCorner;
+            ext.highFreqOrder  = settings.highFreqOrder;
+            ext.highFilterType = settings.highFreqCorner ? 1 : 0;
+            ext.lowFreqCorner  = settings.lowFreqCorner;
+            ext.lowFreqOrder   = settings.lowFreqOrder;
+            ext.lowFilterType  = settings.lowFreqCorner ? 1 : 0;
+            snprintf(ext.label, sizeof(ext.label), "elec%u", id);
+            HdemgNsxSetField(ext.units, sizeof(ext.units), settings.pUnits);
+            Append(&ext, sizeof(ext));
+        }
+
+        // without a digest or a journal the recording goes on
+        if(settings.digestFrames)
+            digest.Create(digestPath, channels, period, settings.digestFrames, origin);
+        checkpointNs     = (uint64_t)settings.checkpointMs * 1000000;
+        lastCheckpointNs = HdemgNowNs();
+        checkpointQueued = false;
+        if(checkpointNs && !journal.Create(journalPath, channels, period, headerBytes, origin))
+            checkpointNs = 0;
+        return true;
+    }
+
+    /**
+        Sets the origin time of the basic header to now, for a file that was opened ahead of
+        its first frame. The headers are still in the buffer, so nothing is rewritten on the
+        disk except the journal header.
+
+        \return false once frames were written
+      */
+    bool StampOrigin()
+    {
+        if(!IsOpen() || failed || flushed != 0 || framesWritten != 0)
+            return false;
+        origin = Now();
+        memcpy(pBuffer + offsetof(HdemgNsxBasicHeader, origin), &origin, sizeof(origin));
+        digest.SetOrigin(origin);
+        lastCheckpointNs = HdemgNowNs();
+        if(checkpointNs && !journal.Create(journalPath, channelCount, period, journal.Header().headerBytes, origin))
+            checkpointNs = 0;
+        return true;
+    }
+
+    /**
+        Appends the frames of a block. A block that does not continue the previous one in
+        NIP time starts a new data packet.
+
+        \arg block - channel count and rate must match Open()
+
+        \return false if the block does not match or the file could not be written
+      */
+    bool Write(const HdemgBlock & block)
+    {
+        return Write(block, 0, block.frameCount);
+    }
+
+    /**
+        Appends frames [first, first + count) of a block, e.g. the part of a block that
+        belongs to this file of a split recording.
+
+        \return false if the block does not match or the file could not be written
+      */
+    bool Write(const HdemgBlock & block, uint32_t first, uint32_t count)
+    {
+        if(!IsOpen() || failed)
+            return false;
+        if(block.channelCount != channelCount || block.sampleRate != sampleRate || first + count > block.frameCount)
+        {
+            printf("ERROR: NSx writer block mismatch channels[%u] rate[%.3f]\n", block.channelCount, block.sampleRate);
+            return false;
+        }
+        if(count == 0)
+            return true;
+
+        uint32_t startTime = block.FrameTime(first);
+        if(!inSegment || (first == 0 ? !HdemgIsContiguous(block, expectedTime) : startTime != expectedTime))
+            StartSegment(startTime);
+
+        uint32_t done = 0;
+        while(done < count && !failed)
+        {
+            uint32_t room = (uint32_t)((bufferSize - used) / frameBytes);
+            if(room == 0)
+            {
+                WriteBuffer();
+                continue;
+            }
+            uint32_t n = count - done;
+            if(n > room)
+                n = room;
+            HdemgFloatToInt16((int16_t *)(pBuffer + used), block.Frame(first + done), countsPerUnit, n * channelCount);
+            digest.Add((const int16_t *)(pBuffer + used), n);
+            stats.Add((const int16_t *)(pBuffer + used), n);
+            used += (size_t)n * frameBytes;
+            done += n;
+        }
+
+        segments.back().dataPoints += count;
+        framesWritten += count;
+        expectedTime   = block.FrameTime(first + count);
+
+        if(checkpointNs && HdemgNowNs() - lastCheckpointNs >= checkpointNs)
+            Checkpoint();
+        if(journal.DataSyncFailed())
+            failed = true;
+        return !failed;
+    }
+
+    /**
+        Writes the buffered frames and has them made durable and recorded in the journal in
+        the background. Called by Write() every checkpointMs. A checkpoint that is still
+        waiting for the disk makes this one be skipped.
+
+        \return false if the file could not be written
+      */
+    bool Checkpoint()
+    {
+        lastCheckpointNs = HdemgNowNs();
+        if(!IsOpen() || failed || !checkpointNs)
+            return false;
+        WriteBuffer();
+        if(failed)
+            return false;
+        if(!async.IsOpen())
+        {
+            journal.Post(segments, flushed, pFile);
+            return true;
+        }
+
+        // in order with the writes: fdatasync of everything submitted, then the journal
+        if(checkpointQueued)
+            return true;
+        checkpointQueued = true;
+        std::vector<HdemgNsxSegment> list = segments;
+        uint64_t                     end  = flushed;
+        return async.Queue([this, list, end]() { journal.Checkpoint(list, end); checkpointQueued = false; }, true);
+    }
+
+    //! \brief ends the current data packet, the next block starts a new one even if it is contiguous
+    void Pause()
+    {
+        if(inSegment)
+            PatchDataPoints(segments.back());
+        inSegment = false;
+    }
+
+    /**
+        Writes the buffered frames and the current DataPoints, so that the file is complete
+        up to the last block written.
+
+        \return false if the file could not be written
+      */
+    bool Flush()
+    {
+        if(!IsOpen() || failed)
+            return false;
+        WriteBuffer();
+        if(inSegment)
+            PatchDataPoints(segments.back());
+        if(async.IsOpen() && !async.Flush())
+            failed = true;
+        if(writeIndex && !failed)
+        {
+            index.Build(segments, channelCount, period, flushed, origin);
+            index.SetStats(stats.Stats());
+            index.Save(indexPath);
+        }
+        return !failed;
+    }
+
+    //! \brief flushes and closes the file
+    void Close()
+    {
+        if(!IsOpen())
+            return;
+        Flush();
+
+        // the journal goes once the patched headers are on the disk
+        if(checkpointNs)
+            journal.Close(!failed && Sync());
+        checkpointNs = 0;
+        digest.Close();
+        if(pFile)
+        {
+            // give back the reserved space the recording did not use
+            if(preallocated && !failed)
+                HdemgNsxTruncate(pFile, flushed);
+            fclose(pFile);
+        }
+        async.Close();
+        pFile     = NULL;
+        pBuffer   = NULL;
+        inSegment = false;
+    }
+
+    bool     IsOpen() const        { return pFile != NULL || async.IsOpen(); }
+    bool     Failed() const        { return failed; }           //!< a write error occurred, the writer stopped
+    uint32_t ChannelCount() const  { return channelCount; }
+    uint64_t FramesWritten() const { return framesWritten; }
+    uint64_t FileBytes() const     { return flushed + used; }   //!< size of the file after the next flush
+
+    //! \brief data packets written so far, the last one may still grow
+    const std::vector<HdemgNsxSegment> & Segments() const { return segments; }
+
+    //! \brief QC statistics of every channel of the frames written so far
+    const std::vector<HdemgChannelStats> & Stats() const { return stats.Stats(); }
+
+    //! \brief records the place of the file in a split recording in its sidecar index
+    void SetSession(uint32_t file, uint64_t framesBefore) { index.SetSession(file, framesBefore); }
+
+    //! \brief queue depth and write latency with asyncWrite
+    HdemgAsyncWriterStats AsyncStats() const { return async.Stats(); }
+
+private:
+    static HdemgNsxTime Now()
+    {
+        int64_t ms = (int64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::system_clock::now().time_since_epoch()).count();
+        time_t seconds = (time_t)(ms / 1000);
+        struct tm utc;
+#if defined(_WIN32)
+        gmtime_s(&utc, &seconds);
+#else
+        gmtime_r(&seconds, &utc);
+#endif
+        HdemgNsxTime t;
+        t.year        = (uint16_t)(utc.tm_year + 1900);
+        t.month       = (uint16_t)(utc.tm_mon + 1);
+        t.dayOfWeek   = (uint16_t)utc.tm_wday;
+        t.day         = (uint16_t)utc.tm_mday;
+        t.hour        = (uint16_t)utc.tm_hour;
+        t.minute      = (uint16_t)utc.tm_min;
+        t.second      = (uint16_t)utc.tm_sec;
+        t.millisecond = (uint16_t)(ms % 1000);
+        return t;
+    }
+
+    void Append(const void * pData, size_t bytes)
+    {
+        if(bufferSize - used < bytes)
+            WriteBuffer();
+        memcpy(pBuffer + used, pData, bytes);
+        used += bytes;
+    }
+
+    void StartSegment(uint32_t timestamp)
+    {
+        Pause();
+
+        // keep the data header in one piece so its DataPoints can be patched in the buffer
+        if(bufferSize - used < sizeof(HdemgNsxDataHeader) + frameBytes)
+            WriteBuffer();
+
+        HdemgNsxSegment segment;
+        segment.headerOffset = flushed + used;
+        segment.timestamp    = timestamp;
+        segment.dataPoints   = 0;
+        segments.push_back(segment);
+        digest.StartSegment(timestamp);
+
+        HdemgNsxDataHeader header;
+        header.id         = HDEMG_NSX_DATA_HEADER_ID;
+        header.timestamp  = timestamp;
+        header.dataPoints = 0;
+        Append(&header, sizeof(header));
+        inSegment = true;
+    }
+
+    void WriteBuffer()
+    {
+        if(used == 0 || failed)
+            return;
+        if(async.IsOpen())
+        {
+            // the next buffer is taken right away, it may wait for a write to complete
+            async.Submit(used);
+            flushed += used;
+            used     = 0;
+            pBuffer  = async.Acquire(&bufferSize);
+            if(!pBuffer)
+                failed = true;
+            return;
+        }
+        if(fwrite(pBuffer, 1, used, pFile) != used)
+        {
+            printf("ERROR: NSx write failed at offset [%llu]\n", (unsigned long long)flushed);
+            failed = true;
+            return;
+        }
+        flushed += used;
+        used     = 0;
+    }
+
+    bool Sync()
+    {
+        if(async.IsOpen() ? async.Flush(true) : HdemgNsxSync(pFile))
+            return true;
+        printf("ERROR: cannot sync NSx file\n");
+        failed = true;
+        return false;
+    }
+
+    void PatchDataPoints(const HdemgNsxSegment & segment)
+    {
+        const uint64_t field = segment.headerOffset + offsetof(HdemgNsxDataHeader, dataPoints);
+        if(failed)
+            return;
+        if(segment.headerOffset >= flushed)
+        {
+            memcpy(pBuffer + (field - flushed), &segment.dataPoints, sizeof(uint32_t));
+            return;
+        }
+        if(async.IsOpen())
+        {
+            if(!async.Patch(field, &segment.dataPoints, sizeof(uint32_t)))
+                failed = true;
+            return;
+        }
+        if(!HdemgNsxSeek(pFile, field) || fwrite(&segment.dataPoints, sizeof(uint32_t), 1, pFile) != 1
+           || !HdemgNsxSeek(pFile, flushed))
+        {
+            printf("ERROR: cannot update NSx data header at offset [%llu]\n", (unsigned long long)segment.headerOffset);
+            failed = true;
+        }
+    }
+
+    FILE *                       pFile;
+    HdemgAsyncWriter             async;         // used instead of pFile with asyncWrite
+    std::vector<uint8_t>         storage;       // write buffer with room for alignment
+    uint8_t *                    pBuffer;       // start of the buffer in storage or in the async pool
+    size_t                       bufferSize;
+    size_t                       used;          // bytes waiting in the buffer
+    uint64_t                     flushed;       // bytes already in the file
+    uint32_t                     channelCount;
+    double                       sampleRate;
+    uint32_t                     frameBytes;
+    uint32_t                     period;
+    float                        countsPerUnit;
+    uint32_t                     expectedTime;
+    bool                         inSegment;
+    bool                         failed;
+    uint64_t                     framesWritten;
+    std::vector<HdemgNsxSegment> segments;
+    HdemgNsxTime                 origin;
+    bool                         writeIndex;
+    char                         indexPath[HDEMG_NSX_INDEX_MAX_PATH];
+    char                         journalPath[HDEMG_NSX_INDEX_MAX_PATH];
+    HdemgNsxIndex                index;
+    HdemgNsxJournal              journal;
+    HdemgNsxDigestWriter         digest;
+    HdemgChannelStatsAccumulator stats;
+    uint64_t                     checkpointNs;      // 0 without a journal
+    uint64_t                     lastCheckpointNs;
+    std::atomic<bool>            checkpointQueued;  // on the HdemgAsyncWriter thread
+    bool                         preallocated;      // space reserved past the end of pFile
+};
+
+#endif // HDEMG_NSX_WRITER_H
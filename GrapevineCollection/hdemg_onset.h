@@ -0,0 +1,328 @@
+//
+//  hdemg_onset.h
+//
+//  Contraction onset and offset detection with the Teager-Kaiser energy operator
+//
+//      psi[n] = x[n]^2 - x[n-1] x[n+1]
+//
+//  which responds to the instantaneous amplitude and frequency of the motor unit action
+//  potentials and sharpens the transition from rest to activity compared to the plain
+//  envelope. |psi| is computed for all channels of a frame at once, optionally averaged over
+//  grid regions, and smoothed with a moving average. A double threshold then marks the
+//  activity: the level must stay above mean + k sd of the resting baseline for a minimum
+//  time to start an onset and below it for a minimum time to end it.
+//
+//  Onset and offset events carry the NIP time of the first frame of the run that confirmed
+//  them, even though they are posted a confirmation time later. An onset is stamped with the
+//  newest frame of the moving average window that first crossed the threshold and an offset
+//  with the oldest one, so a sharp change in activity is placed on the frame where it happens
+//  instead of being smeared by half the window; weak changes are stamped up to half a window
+//  on the conservative side. Events are posted to an HdemgEventStream next to the digital
+//  I/O events.
+//
+
+#ifndef HDEMG_ONSET_H
+#define HDEMG_ONSET_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "hdemg_events.h"
+#include "hdemg_frames.h"
+#include "hdemg_simd.h"
+
+//! \brief Parameters of the double threshold detector
+struct HdemgOnsetSettings
+{
+    double smoothingMs;       //!< moving average of |psi|
+    double baselineSeconds;   //!< resting data used for the threshold after Configure() / StartBaseline()
+    double thresholdSd;       //!< threshold = baseline mean + thresholdSd * baseline sd
+    double minOnMs;           //!< time above threshold that confirms an onset
+    double minOffMs;          //!< time below threshold that confirms an offset
+
+    HdemgOnsetSettings()
+        : smoothingMs(25.0), baselineSeconds(2.0), thresholdSd(8.0), minOnMs(25.0), minOffMs(50.0) {}
+};
+
+/*! \brief TKEO double threshold onset detector for channels or grid regions.
+ */
+class HdemgOnsetDetector
+{
+public:
+    HdemgOnsetDetector()
+        : channelCount(0), regionCount(0), smoothFrames(0), baselineFrames(0), minOnFrames(0), minOffFrames(0),
+          thresholdSd(0.0), pEvents(NULL), historyFrames(0), ringPos(0), filled(0), baselineSeen(0),
+          expectedTime(0), streamStarted(false) {}
+
+    /**
+        Sizes the detector.
+
+        \arg channels         - channels per frame
+        \arg rate             - frame rate of the input blocks in Hz
+        \arg pRegionOfChannel - region of every channel (0 .. regions-1, or -1 to ignore the
+                                channel), or NULL to detect every channel on its own
+        \arg regions          - number of regions when pRegionOfChannel is given
+        \arg settings         - detector parameters
+        \arg pEventStream     - receives the onset and offset events
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, double rate, const int32_t * pRegionOfChannel, uint32_t regions,
+                   const HdemgOnsetSettings & settings, HdemgEventStream * pEventStream)
+    {
+        if(channels == 0 || rate <= 0.0 || !pEventStream || settings.smoothingMs <= 0.0
+           || settings.baselineSeconds <= 0.0 || settings.minOnMs < 0.0 || settings.minOffMs < 0.0
+           || (pRegionOfChannel && (regions == 0 || regions > 0xFFFF)) || (!pRegionOfChannel && channels > 0xFFFF))
+        {
+            printf("ERROR: invalid onset detector configuration\n");
+            return false;
+        }
+
+        channelCount = channels;
+        regionCount  = pRegionOfChannel ? regions : channels;
+        regionOf.clear();
+        regionScale.assign(regionCount, 0.0f);
+        if(pRegionOfChannel)
+        {
+            regionOf.assign(pRegionOfChannel, pRegionOfChannel + channels);
+            for(uint32_t c=0; c<channels; ++c)
+            {
+                if(regionOf[c] >= (int32_t)regions)
+                {
+                    printf("ERROR: channel [%u] is in region [%d] of [%u]\n", c, regionOf[c], regions);
+                    return false;
+                }
+                if(regionOf[c] >= 0)
+                    regionScale[regionOf[c]] += 1.0f;
+            }
+            for(uint32_t r=0; r<regions; ++r)
+                regionScale[r] = (regionScale[r] > 0.0f) ? 1.0f / regionScale[r] : 0.0f;
+        }
+
+        smoothFrames   = std::max(1u, (uint32_t)(settings.smoothingMs * 1e-3 * rate + 0.5));
+        baselineFrames = std::max(2u, (uint32_t)(settings.baselineSeconds * rate + 0.5));
+        minOnFrames    = std::max(1u, (uint32_t)(settings.minOnMs * 1e-3 * rate + 0.5));
+        minOffFrames   = std::max(1u, (uint32_t)(settings.minOffMs * 1e-3 * rate + 0.5));
+        thresholdSd    = settings.thresholdSd;
+        pEvents        = pEventStream;
+
+        prev1.assign(channels, 0.0f);
+        prev2.assign(channels, 0.0f);
+        psi.assign(channels, 0.0f);
+        energy.assign(regionCount, 0.0f);
+        ring.assign((size_t)smoothFrames * regionCount, 0.0f);
+        ringSum.assign(regionCount, 0.0);
+        baseSum.assign(regionCount, 0.0);
+        baseSumSq.assign(regionCount, 0.0);
+        threshold.assign(regionCount, 0.0f);
+        active.assign(regionCount, 0);
+        run.assign(regionCount, 0);
+        runStart.assign(regionCount, 0);
+
+        StartBaseline();
+        return true;
+    }
+
+    //! \brief Learns the thresholds again from the next baselineSeconds of (resting) data
+    void StartBaseline()
+    {
+        std::fill(baseSum.begin(), baseSum.end(), 0.0);
+        std::fill(baseSumSq.begin(), baseSumSq.end(), 0.0);
+        std::fill(active.begin(), active.end(), 0);
+        std::fill(run.begin(), run.end(), 0);
+        baselineSeen = 0;
+        Reset();
+    }
+
+    //! \brief Sets the threshold of a region directly (in |psi| units) and ends the baseline
+    void SetThreshold(uint32_t region, float level)
+    {
+        if(region < regionCount)
+            threshold[region] = level;
+        baselineSeen = baselineFrames;
+    }
+
+    //! \brief Clears the operator and moving average history, e.g. after a gap in the stream
+    void Reset()
+    {
+        std::fill(ring.begin(), ring.end(), 0.0f);
+        std::fill(ringSum.begin(), ringSum.end(), 0.0);
+        std::fill(run.begin(), run.end(), 0);
+        historyFrames = 0;
+        ringPos       = 0;
+        filled        = 0;
+        streamStarted = false;
+    }
+
+    /**
+        Adds a block of frames. Events are posted from within this call.
+      */
+    bool Process(const HdemgBlock & in)
+    {
+        if(in.channelCount != channelCount)
+        {
+            printf("ERROR: onset block has [%u] channels, expected [%u]\n", in.channelCount, channelCount);
+            return false;
+        }
+
+        if(streamStarted && !HdemgIsContiguous(in, expectedTime))
+            Reset();
+        streamStarted = true;
+        expectedTime  = in.EndTime();
+
+        const uint32_t nCh   = channelCount;
+        const uint32_t nReg  = regionCount;
+        const double   ticks = in.TicksPerFrame();
+
+        // psi of frame f-1 is known at frame f; the window reaches smoothFrames-1 frames further back
+        const uint32_t newestTicks = (uint32_t)(ticks + 0.5);
+        const uint32_t oldestTicks = (uint32_t)(smoothFrames * ticks + 0.5);
+
+        for(uint32_t f=0; f<in.frameCount; ++f)
+        {
+            const float * HDEMG_RESTRICT x  = in.Frame(f);
+            float * HDEMG_RESTRICT       x1 = &prev1[0];
+            float * HDEMG_RESTRICT       x2 = &prev2[0];
+            float * HDEMG_RESTRICT       p  = &psi[0];
+
+            for(uint32_t c=0; c<nCh; ++c)
+                p[c] = fabsf(x1[c] * x1[c] - x2[c] * x[c]);
+            memcpy(x2, x1, nCh * sizeof(float));
+            memcpy(x1, x, nCh * sizeof(float));
+            if(historyFrames < 2)
+            {
+                historyFrames++;
+                continue;
+            }
+
+            // per region energy
+            const float * e = p;
+            if(!regionOf.empty())
+            {
+                std::fill(energy.begin(), energy.end(), 0.0f);
+                for(uint32_t c=0; c<nCh; ++c)
+                    if(regionOf[c] >= 0)
+                        energy[regionOf[c]] += p[c];
+                for(uint32_t r=0; r<nReg; ++r)
+                    energy[r] *= regionScale[r];
+                e = &energy[0];
+            }
+
+            // moving average
+            float * HDEMG_RESTRICT slot = &ring[(size_t)ringPos * nReg];
+            double * HDEMG_RESTRICT sum = &ringSum[0];
+            for(uint32_t r=0; r<nReg; ++r)
+            {
+                sum[r] += (double)e[r] - slot[r];
+                slot[r] = e[r];
+            }
+            if(++ringPos == smoothFrames)
+                ringPos = 0;
+            if(filled < smoothFrames)
+            {
+                filled++;
+                continue;
+            }
+
+            const float scale = 1.0f / smoothFrames;
+            if(baselineSeen < baselineFrames)
+            {
+                for(uint32_t r=0; r<nReg; ++r)
+                {
+                    double level = sum[r] * scale;
+                    baseSum[r]   += level;
+                    baseSumSq[r] += level * level;
+                }
+                if(++baselineSeen == baselineFrames)
+                    SetBaselineThresholds();
+                continue;
+            }
+
+            uint32_t time = in.FrameTime(f);
+            Detect(time - newestTicks, time - oldestTicks);
+        }
+        return true;
+    }
+
+    uint32_t RegionCount() const             { return regionCount; }
+    bool     BaselineDone() const            { return baselineSeen >= baselineFrames; }
+    float    Threshold(uint32_t region) const { return threshold[region]; }
+    bool     Active(uint32_t region) const    { return active[region] != 0; }
+
+private:
+    void SetBaselineThresholds()
+    {
+        const double n = (double)baselineFrames;
+        for(uint32_t r=0; r<regionCount; ++r)
+        {
+            double mean = baseSum[r] / n;
+            double sd   = sqrt(std::max(0.0, baseSumSq[r] / n - mean * mean));
+            threshold[r] = (float)(mean + thresholdSd * sd);
+        }
+    }
+
+    //! \brief double threshold state machine of every region, given the NIP times of the
+    //! newest and the oldest frame of the moving average window
+    void Detect(uint32_t newest, uint32_t oldest)
+    {
+        const float scale = 1.0f / smoothFrames;
+        for(uint32_t r=0; r<regionCount; ++r)
+        {
+            bool above = (float)(ringSum[r] * scale) > threshold[r];
+            if(above == (active[r] != 0))
+            {
+                run[r] = 0;
+                continue;
+            }
+
+            if(run[r]++ == 0)
+                runStart[r] = active[r] ? oldest : newest;
+            if(run[r] < (active[r] ? minOffFrames : minOnFrames))
+                continue;
+
+            active[r] = !active[r];
+            run[r]    = 0;
+
+            HdemgEvent event;
+            event.time   = runStart[r];
+            event.kind   = active[r] ? HDEMG_EVENT_ONSET : HDEMG_EVENT_OFFSET;
+            event.source = (uint16_t)r;
+            event.value  = 0;
+            pEvents->Post(event);
+        }
+    }
+
+    uint32_t              channelCount;
+    uint32_t              regionCount;
+    uint32_t              smoothFrames;
+    uint32_t              baselineFrames;
+    uint32_t              minOnFrames;
+    uint32_t              minOffFrames;
+    double                thresholdSd;
+    HdemgEventStream *    pEvents;
+    std::vector<int32_t>  regionOf;       // [channel] -> region, empty for one region per channel
+    std::vector<float>    regionScale;    // 1 / channels of the region
+    std::vector<float>    prev1;          // x[n-1]
+    std::vector<float>    prev2;          // x[n-2]
+    std::vector<float>    psi;            // |psi| of frame n-1, [channel]
+    std::vector<float>    energy;         // |psi| averaged per region
+    std::vector<float>    ring;           // [smoothFrames][region] moving average history
+    std::vector<double>   ringSum;
+    std::vector<double>   baseSum;        // baseline statistics of the smoothed level
+    std::vector<double>   baseSumSq;
+    std::vector<float>    threshold;      // [region]
+    std::vector<uint8_t>  active;         // [region] between onset and offset
+    std::vector<uint32_t> run;            // frames on the other side of the threshold
+    std::vector<uint32_t> runStart;       // NIP time of the first of those frames
+    uint32_t              historyFrames;  // frames of operator history after a reset (0 - 2)
+    uint32_t              ringPos;
+    uint32_t              filled;
+    uint32_t              baselineSeen;
+    uint32_t              expectedTime;
+    bool                  streamStarted;
+};
+
+#endif // HDEMG_ONSET_H
@@ -0,0 +1,347 @@
+//
+//  hdemg_quality.h
+//
+//  Online channel quality monitor. Statistics of every channel are accumulated block by
+//  block and evaluated at a fixed rate into a quality report with a per-channel good/bad
+//  mask:
+//
+//      line noise      power of the mains fundamental relative to the channel variance
+//      saturation      fraction of samples at or beyond the amplifier rail
+//      flatline        standard deviation below a floor (open input, shorted contact)
+//      neighbours      best Pearson correlation with the 4-connected grid neighbours; an
+//                      electrode that lost contact no longer follows its neighbours
+//
+//  The mask can be handed to HdemgSpatialFilter::SetChannelMask() and
+//  HdemgDecoder::SetChannelMask(), which exclude bad channels without reallocating.
+//
+//  The mains phase is taken from the NIP time of every frame, so gaps in the stream do not
+//  disturb the line noise estimate and the statistics simply continue after a gap.
+//
+
+#ifndef HDEMG_QUALITY_H
+#define HDEMG_QUALITY_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "hdemg_frames.h"
+#include "hdemg_grid.h"
+
+//! \defgroup HdemgQualityFlags
+//! \{
+//! \brief Reasons for a channel to be marked bad, combined in HdemgQualityReport::flags
+static const uint8_t HDEMG_QUALITY_LINE_NOISE    = 0x01;
+static const uint8_t HDEMG_QUALITY_SATURATED     = 0x02;
+static const uint8_t HDEMG_QUALITY_FLAT          = 0x04;
+static const uint8_t HDEMG_QUALITY_UNCORRELATED  = 0x08;
+//! \}
+
+//! \brief Thresholds of the quality checks, the defaults suit raw counts of surface grids
+struct HdemgQualitySettings
+{
+    double reportSeconds;          //!< interval between reports
+    double mainsHz;                //!< mains frequency for the line noise check
+    double maxLineRatio;           //!< largest acceptable mains power / channel variance
+    float  saturationCounts;       //!< absolute value that counts as saturated
+    double maxSaturationRate;      //!< largest acceptable fraction of saturated samples
+    double flatRms;                //!< standard deviation below which a channel is flat
+    double minNeighbourCorrelation;//!< best neighbour correlation a channel needs
+
+    HdemgQualitySettings()
+        : reportSeconds(1.0), mainsHz(50.0), maxLineRatio(0.5), saturationCounts(32000.0f),
+          maxSaturationRate(0.001), flatRms(0.5), minNeighbourCorrelation(0.2) {}
+};
+
+/*! \brief Result of one evaluation interval. All arrays are indexed by frame channel.
+ */
+struct HdemgQualityReport
+{
+    uint32_t time;                    //!< NIP time of the last frame of the interval
+    uint64_t arrivalNs;               //!< arrival of the block holding that frame
+    uint32_t channelCount;
+    uint32_t frameCount;              //!< frames evaluated in the interval
+    uint32_t badCount;
+    std::vector<float>   lineRatio;
+    std::vector<float>   saturationRate;
+    std::vector<float>   rms;         //!< standard deviation in input units
+    std::vector<float>   neighbourCorrelation;  //!< best neighbour, 1 for channels without neighbours
+    std::vector<uint8_t> flags;       //!< HDEMG_QUALITY_* reasons
+    std::vector<uint8_t> good;        //!< 1 for usable channels, 0 for bad ones
+};
+
+//! \brief Called every time a report is complete
+typedef void (*HdemgQualityCallback)(const HdemgQualityReport & report, void * pUser);
+
+/*! \brief Incremental per-channel quality statistics with a periodic mask.
+ */
+class HdemgQualityMonitor
+{
+public:
+    HdemgQualityMonitor()
+        : channelCount(0), sampleRate(0.0), reportFrames(0), accumulated(0), oscCos(0.0), oscSin(0.0),
+          oscCosSq(0.0), oscSinSq(0.0), oscCosSin(0.0), pCallback(NULL), pUser(NULL) {}
+
+    /**
+        Sizes the monitor.
+
+        \arg pGrid      - electrode positions for the neighbour check, or NULL to skip it
+        \arg channels   - channels per frame
+        \arg rate       - frame rate of the input blocks in Hz
+        \arg settings   - thresholds and report interval
+        \arg callback   - function receiving every report
+        \arg pUserData  - passed through to the callback
+
+        \return true if the configuration is valid
+      */
+    bool Configure(const HdemgGridGeometry * pGrid, uint32_t channels, double rate,
+                   const HdemgQualitySettings & settings, HdemgQualityCallback callback, void * pUserData)
+    {
+        if(channels == 0 || rate <= 0.0 || !callback || settings.reportSeconds * rate < 1.0
+           || settings.mainsHz <= 0.0 || settings.mainsHz >= 0.5 * rate || (pGrid && pGrid->ChannelSpan() > channels))
+        {
+            printf("ERROR: invalid quality monitor configuration\n");
+            return false;
+        }
+
+        config       = settings;
+        channelCount = channels;
+        sampleRate   = rate;
+        reportFrames = (uint32_t)(settings.reportSeconds * rate + 0.5);
+        pCallback    = callback;
+        pUser        = pUserData;
+
+        // every pair of horizontally or vertically adjacent electrodes once
+        pairA.clear();
+        pairB.clear();
+        if(pGrid)
+        {
+            for(uint32_t r=0; r<pGrid->rows; ++r)
+            {
+                for(uint32_t c=0; c<pGrid->cols; ++c)
+                {
+                    int32_t ch = pGrid->Channel((int32_t)r, (int32_t)c);
+                    if(ch == HDEMG_GRID_NO_ELECTRODE)
+                        continue;
+                    int32_t right = pGrid->Channel((int32_t)r, (int32_t)c + 1);
+                    int32_t down  = pGrid->Channel((int32_t)r + 1, (int32_t)c);
+                    if(right != HDEMG_GRID_NO_ELECTRODE)
+                    {
+                        pairA.push_back((uint32_t)ch);
+                        pairB.push_back((uint32_t)right);
+                    }
+                    if(down != HDEMG_GRID_NO_ELECTRODE)
+                    {
+                        pairA.push_back((uint32_t)ch);
+                        pairB.push_back((uint32_t)down);
+                    }
+                }
+            }
+        }
+
+        sum.assign(channels, 0.0);
+        sumSq.assign(channels, 0.0);
+        sumCos.assign(channels, 0.0);
+        sumSin.assign(channels, 0.0);
+        saturated.assign(channels, 0);
+        pairSum.assign(pairA.size(), 0.0);
+        frame.assign(channels, 0.0);
+
+        report.channelCount = channels;
+        report.lineRatio.assign(channels, 0.0f);
+        report.saturationRate.assign(channels, 0.0f);
+        report.rms.assign(channels, 0.0f);
+        report.neighbourCorrelation.assign(channels, 1.0f);
+        report.flags.assign(channels, 0);
+        report.good.assign(channels, 1);
+        report.badCount = 0;
+
+        Reset();
+        return true;
+    }
+
+    //! \brief Starts a new interval, the last report stays available
+    void Reset()
+    {
+        std::fill(sum.begin(), sum.end(), 0.0);
+        std::fill(sumSq.begin(), sumSq.end(), 0.0);
+        std::fill(sumCos.begin(), sumCos.end(), 0.0);
+        std::fill(sumSin.begin(), sumSin.end(), 0.0);
+        std::fill(saturated.begin(), saturated.end(), 0);
+        std::fill(pairSum.begin(), pairSum.end(), 0.0);
+        oscCos      = 0.0;
+        oscSin      = 0.0;
+        oscCosSq    = 0.0;
+        oscSinSq    = 0.0;
+        oscCosSin   = 0.0;
+        accumulated = 0;
+    }
+
+    /**
+        Adds a block to the statistics and delivers a report at every interval boundary.
+        Boundaries are aligned to the NIP clock like the sliding windows of the other stages.
+      */
+    bool Process(const HdemgBlock & in)
+    {
+        if(in.channelCount != channelCount)
+        {
+            printf("ERROR: quality monitor block has [%u] channels, expected [%u]\n", in.channelCount, channelCount);
+            return false;
+        }
+
+        const uint32_t nCh    = channelCount;
+        const uint32_t nPairs = (uint32_t)pairA.size();
+        const double   ticks  = in.TicksPerFrame();
+        const float    rail   = config.saturationCounts;
+
+        // mains phase of the first frame from the NIP time, then rotation frame by frame
+        const double step  = 2.0 * HDEMG_PI * config.mainsHz / sampleRate;
+        const double start = 2.0 * HDEMG_PI * fmod(config.mainsHz * in.startTime / HDEMG_NIP_CLOCK_HZ, 1.0);
+        const double cStep = cos(step), sStep = sin(step);
+        double c1 = cos(start), s1 = sin(start);
+
+        for(uint32_t f=0; f<in.frameCount; ++f)
+        {
+            const float * x = in.Frame(f);
+            const double  co = c1, si = s1;
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                double v = x[c];
+                frame[c]   = v;
+                sum[c]    += v;
+                sumSq[c]  += v * v;
+                sumCos[c] += v * co;
+                sumSin[c] += v * si;
+                saturated[c] += (fabsf(x[c]) >= rail);
+            }
+            for(uint32_t p=0; p<nPairs; ++p)
+                pairSum[p] += frame[pairA[p]] * frame[pairB[p]];
+
+            oscCos    += co;
+            oscSin    += si;
+            oscCosSq  += co * co;
+            oscSinSq  += si * si;
+            oscCosSin += co * si;
+            accumulated++;
+
+            double cn = c1 * cStep - s1 * sStep;
+            s1 = s1 * cStep + c1 * sStep;
+            c1 = cn;
+
+            uint32_t frameIndex = (uint32_t)(in.FrameTime(f) / ticks + 0.5);
+            if((frameIndex + 1) % reportFrames == 0 && accumulated >= reportFrames / 2)
+            {
+                Evaluate(in.FrameTime(f), in.arrivalNs);
+                Reset();
+            }
+        }
+        return true;
+    }
+
+    //! \brief the most recent report; good is all ones until the first report
+    const HdemgQualityReport & Report() const { return report; }
+    uint32_t ReportFrames() const { return reportFrames; }
+
+private:
+    void Evaluate(uint32_t time, uint64_t arrivalNs)
+    {
+        const uint32_t nCh = channelCount;
+        const double   n   = (double)accumulated;
+
+        // least squares fit of a*cos + b*sin to the mean-free signal over the interval; the
+        // 2x2 normal equations are shared by all channels
+        const double ccv = oscCosSq - oscCos * oscCos / n;
+        const double ssv = oscSinSq - oscSin * oscSin / n;
+        const double csv = oscCosSin - oscCos * oscSin / n;
+        const double det = ccv * ssv - csv * csv;
+
+        std::vector<double> & variance = frame;   // reused as scratch, no allocation
+        for(uint32_t c=0; c<nCh; ++c)
+        {
+            const double mean = sum[c] / n;
+            variance[c] = std::max(0.0, sumSq[c] / n - mean * mean);
+
+            double lineRatio = 0.0;
+            if(variance[c] > 0.0 && det > 0.0)
+            {
+                const double xc = sumCos[c] - mean * oscCos;
+                const double xs = sumSin[c] - mean * oscSin;
+                const double a  = (ssv * xc - csv * xs) / det;
+                const double b  = (ccv * xs - csv * xc) / det;
+                lineRatio = 0.5 * (a * a + b * b) / variance[c];
+            }
+
+            report.lineRatio[c]            = (float)lineRatio;
+            report.saturationRate[c]       = (float)(saturated[c] / n);
+            report.rms[c]                  = (float)sqrt(variance[c]);
+            report.neighbourCorrelation[c] = pairA.empty() ? 1.0f : -1.0f;
+        }
+
+        for(size_t p=0; p<pairA.size(); ++p)
+        {
+            const uint32_t a = pairA[p], b = pairB[p];
+            double r = 0.0;
+            if(variance[a] > 0.0 && variance[b] > 0.0)
+            {
+                double cov = pairSum[p] / n - (sum[a] / n) * (sum[b] / n);
+                r = cov / sqrt(variance[a] * variance[b]);
+            }
+            report.neighbourCorrelation[a] = std::max(report.neighbourCorrelation[a], (float)r);
+            report.neighbourCorrelation[b] = std::max(report.neighbourCorrelation[b], (float)r);
+        }
+
+        report.badCount = 0;
+        for(uint32_t c=0; c<nCh; ++c)
+        {
+            uint8_t flags = 0;
+            if(report.lineRatio[c] > config.maxLineRatio)
+                flags |= HDEMG_QUALITY_LINE_NOISE;
+            if(report.saturationRate[c] > config.maxSaturationRate)
+                flags |= HDEMG_QUALITY_SATURATED;
+            if(report.rms[c] < config.flatRms)
+                flags |= HDEMG_QUALITY_FLAT;
+
+            // -1 means the channel has no neighbour on the grid
+            if(report.neighbourCorrelation[c] == -1.0f)
+                report.neighbourCorrelation[c] = 1.0f;
+            else if(report.neighbourCorrelation[c] < config.minNeighbourCorrelation)
+                flags |= HDEMG_QUALITY_UNCORRELATED;
+
+            report.flags[c] = flags;
+            report.good[c]  = (flags == 0);
+            report.badCount += (flags != 0);
+        }
+
+        report.time       = time;
+        report.arrivalNs  = arrivalNs;
+        report.frameCount = accumulated;
+        pCallback(report, pUser);
+    }
+
+    HdemgQualitySettings  config;
+    uint32_t              channelCount;
+    double                sampleRate;
+    uint32_t              reportFrames;
+    uint32_t              accumulated;    // frames in the current interval
+    std::vector<uint32_t> pairA;          // adjacent electrode pairs
+    std::vector<uint32_t> pairB;
+    std::vector<double>   sum;            // [channel] sums over the interval
+    std::vector<double>   sumSq;
+    std::vector<double>   sumCos;         // x * cos(mains phase)
+    std::vector<double>   sumSin;
+    std::vector<uint32_t> saturated;
+    std::vector<double>   pairSum;        // [pair] x_a * x_b
+    std::vector<double>   frame;          // current frame in double, scratch in Evaluate()
+    double                oscCos;         // sums of the oscillator itself for the line fit
+    double                oscSin;
+    double                oscCosSq;
+    double                oscSinSq;
+    double                oscCosSin;
+    HdemgQualityCallback  pCallback;
+    void *                pUser;
+    HdemgQualityReport    report;
+};
+
+#endif // HDEMG_QUALITY_H
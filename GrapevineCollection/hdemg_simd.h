@@ -0,0 +1,259 @@
+//
+//  hdemg_simd.h
+//
+//  Small vector kernels shared by the HD-EMG processing stages. Every stage keeps its
+//  data sample-major, so the inner loops below run across channels of a single frame.
+//  An AVX or SSE2 path is used when the compiler targets it (-mavx / x86-64 default),
+//  otherwise the plain loops are left to the auto-vectorizer.
+//
+
+#ifndef HDEMG_SIMD_H
+#define HDEMG_SIMD_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX__)
+  #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+  #include <emmintrin.h>
+  #define HDEMG_SSE2 1
+#endif
+
+#if defined(__SSE4_2__)
+  #include <nmmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+  #define HDEMG_RESTRICT __restrict
+#else
+  #define HDEMG_RESTRICT __restrict__
+#endif
+
+/**
+    acc[i] += a * x[i] for i in [0, n)
+  */
+inline void
+HdemgAxpy(float * HDEMG_RESTRICT acc, const float * HDEMG_RESTRICT x, float a, uint32_t n)
+{
+    uint32_t i = 0;
+#if defined(__AVX__)
+    __m256 va = _mm256_set1_ps(a);
+    for(; i+8<=n; i+=8)
+        _mm256_storeu_ps(acc+i, _mm256_add_ps(_mm256_loadu_ps(acc+i), _mm256_mul_ps(va, _mm256_loadu_ps(x+i))));
+#elif defined(HDEMG_SSE2)
+    __m128 va = _mm_set1_ps(a);
+    for(; i+4<=n; i+=4)
+        _mm_storeu_ps(acc+i, _mm_add_ps(_mm_loadu_ps(acc+i), _mm_mul_ps(va, _mm_loadu_ps(x+i))));
+#endif
+    for(; i<n; ++i)
+        acc[i] += a * x[i];
+}
+
+/**
+    dst[i] = a * x[i] for i in [0, n)
+  */
+inline void
+HdemgScale(float * HDEMG_RESTRICT dst, const float * HDEMG_RESTRICT x, float a, uint32_t n)
+{
+    uint32_t i = 0;
+#if defined(__AVX__)
+    __m256 va = _mm256_set1_ps(a);
+    for(; i+8<=n; i+=8)
+        _mm256_storeu_ps(dst+i, _mm256_mul_ps(va, _mm256_loadu_ps(x+i)));
+#elif defined(HDEMG_SSE2)
+    __m128 va = _mm_set1_ps(a);
+    for(; i+4<=n; i+=4)
+        _mm_storeu_ps(dst+i, _mm_mul_ps(va, _mm_loadu_ps(x+i)));
+#endif
+    for(; i<n; ++i)
+        dst[i] = a * x[i];
+}
+
+/**
+    Returns the dot product of a and b over [0, n). Partial sums are kept per vector lane
+    and reduced at the end, so the result does not depend on memory alignment.
+  */
+inline float
+HdemgDot(const float * HDEMG_RESTRICT a, const float * HDEMG_RESTRICT b, uint32_t n)
+{
+    uint32_t i   = 0;
+    float    sum = 0.0f;
+#if defined(__AVX__)
+    __m256 vs = _mm256_setzero_ps();
+    for(; i+8<=n; i+=8)
+        vs = _mm256_add_ps(vs, _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vs);
+    for(int k=0; k<8; ++k)
+        sum += lanes[k];
+#elif defined(HDEMG_SSE2)
+    __m128 vs = _mm_setzero_ps();
+    for(; i+4<=n; i+=4)
+        vs = _mm_add_ps(vs, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+    float lanes[4];
+    _mm_storeu_ps(lanes, vs);
+    for(int k=0; k<4; ++k)
+        sum += lanes[k];
+#endif
+    for(; i<n; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+/**
+    Dot products of four rows a0..a3 with the same vector x over [0, n). x is loaded once
+    for all four rows, which is how the stages apply a small matrix to a block of vectors.
+
+    \arg pOut - receives the four results
+  */
+inline void
+HdemgDot4(const float * a0, const float * a1, const float * a2, const float * a3,
+          const float * HDEMG_RESTRICT x, uint32_t n, float * pOut)
+{
+    uint32_t i = 0;
+    float    s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+#if defined(__AVX__)
+    __m256 v0 = _mm256_setzero_ps(), v1 = _mm256_setzero_ps(), v2 = _mm256_setzero_ps(), v3 = _mm256_setzero_ps();
+    for(; i+8<=n; i+=8)
+    {
+        __m256 vx = _mm256_loadu_ps(x+i);
+        v0 = _mm256_add_ps(v0, _mm256_mul_ps(_mm256_loadu_ps(a0+i), vx));
+        v1 = _mm256_add_ps(v1, _mm256_mul_ps(_mm256_loadu_ps(a1+i), vx));
+        v2 = _mm256_add_ps(v2, _mm256_mul_ps(_mm256_loadu_ps(a2+i), vx));
+        v3 = _mm256_add_ps(v3, _mm256_mul_ps(_mm256_loadu_ps(a3+i), vx));
+    }
+    float lanes[4][8];
+    _mm256_storeu_ps(lanes[0], v0);
+    _mm256_storeu_ps(lanes[1], v1);
+    _mm256_storeu_ps(lanes[2], v2);
+    _mm256_storeu_ps(lanes[3], v3);
+    for(int k=0; k<8; ++k)
+    {
+        s0 += lanes[0][k];
+        s1 += lanes[1][k];
+        s2 += lanes[2][k];
+        s3 += lanes[3][k];
+    }
+#elif defined(HDEMG_SSE2)
+    __m128 v0 = _mm_setzero_ps(), v1 = _mm_setzero_ps(), v2 = _mm_setzero_ps(), v3 = _mm_setzero_ps();
+    for(; i+4<=n; i+=4)
+    {
+        __m128 vx = _mm_loadu_ps(x+i);
+        v0 = _mm_add_ps(v0, _mm_mul_ps(_mm_loadu_ps(a0+i), vx));
+        v1 = _mm_add_ps(v1, _mm_mul_ps(_mm_loadu_ps(a1+i), vx));
+        v2 = _mm_add_ps(v2, _mm_mul_ps(_mm_loadu_ps(a2+i), vx));
+        v3 = _mm_add_ps(v3, _mm_mul_ps(_mm_loadu_ps(a3+i), vx));
+    }
+    float lanes[4][4];
+    _mm_storeu_ps(lanes[0], v0);
+    _mm_storeu_ps(lanes[1], v1);
+    _mm_storeu_ps(lanes[2], v2);
+    _mm_storeu_ps(lanes[3], v3);
+    for(int k=0; k<4; ++k)
+    {
+        s0 += lanes[0][k];
+        s1 += lanes[1][k];
+        s2 += lanes[2][k];
+        s3 += lanes[3][k];
+    }
+#endif
+    for(; i<n; ++i)
+    {
+        s0 += a0[i] * x[i];
+        s1 += a1[i] * x[i];
+        s2 += a2[i] * x[i];
+        s3 += a3[i] * x[i];
+    }
+    pOut[0] = s0;
+    pOut[1] = s1;
+    pOut[2] = s2;
+    pOut[3] = s3;
+}
+
+/**
+    dst[i] = x[i] * scale rounded to the nearest integer and saturated to the int16 range,
+    for i in [0, n). Used to store filtered or raw frames as NSx counts.
+  */
+inline void
+HdemgFloatToInt16(int16_t * HDEMG_RESTRICT dst, const float * HDEMG_RESTRICT x, float scale, uint32_t n)
+{
+    uint32_t i = 0;
+#if defined(__AVX__)
+    __m256 va  = _mm256_set1_ps(scale);
+    __m256 vlo = _mm256_set1_ps(-32768.0f);
+    __m256 vhi = _mm256_set1_ps(32767.0f);
+    for(; i+16<=n; i+=16)
+    {
+        // clamp first, cvtps returns 0x80000000 for out of range values of either sign
+        __m256  a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(va, _mm256_loadu_ps(x+i)), vlo), vhi);
+        __m256  b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(va, _mm256_loadu_ps(x+i+8)), vlo), vhi);
+        __m128i a0 = _mm_cvtps_epi32(_mm256_castps256_ps128(a));
+        __m128i a1 = _mm_cvtps_epi32(_mm256_extractf128_ps(a, 1));
+        __m128i b0 = _mm_cvtps_epi32(_mm256_castps256_ps128(b));
+        __m128i b1 = _mm_cvtps_epi32(_mm256_extractf128_ps(b, 1));
+        _mm_storeu_si128((__m128i *)(dst+i),   _mm_packs_epi32(a0, a1));
+        _mm_storeu_si128((__m128i *)(dst+i+8), _mm_packs_epi32(b0, b1));
+    }
+#elif defined(HDEMG_SSE2)
+    __m128 va  = _mm_set1_ps(scale);
+    __m128 vlo = _mm_set1_ps(-32768.0f);
+    __m128 vhi = _mm_set1_ps(32767.0f);
+    for(; i+8<=n; i+=8)
+    {
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(va, _mm_loadu_ps(x+i)), vlo), vhi);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(va, _mm_loadu_ps(x+i+4)), vlo), vhi);
+        _mm_storeu_si128((__m128i *)(dst+i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+#endif
+    for(; i<n; ++i)
+    {
+        float v = x[i] * scale;
+        v = (v < -32768.0f) ? -32768.0f : (v > 32767.0f ? 32767.0f : v);
+        dst[i] = (int16_t)lrintf(v);
+    }
+}
+
+/**
+    CRC32C (Castagnoli) of a buffer, continuing from crc. Uses the SSE4.2 crc32 instruction
+    when the compiler targets it.
+  */
+inline uint32_t
+HdemgCrc32c(const void * pData, size_t bytes, uint32_t crc = 0)
+{
+    const uint8_t * p = (const uint8_t *)pData;
+    crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    for(; bytes >= 8; bytes -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+    }
+    for(; bytes > 0; --bytes, ++p)
+        crc = _mm_crc32_u8(crc, *p);
+#else
+    struct Table
+    {
+        uint32_t v[256];
+        Table()
+        {
+            for(uint32_t i=0; i<256; ++i)
+            {
+                uint32_t c = i;
+                for(int k=0; k<8; ++k)
+                    c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+                v[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    for(; bytes > 0; --bytes, ++p)
+        crc = table.v[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+#endif
+    return ~crc;
+}
+
+#endif // HDEMG_SIMD_H
@@ -0,0 +1,325 @@
+//
+//  hdemg_spatial_filter.h
+//
+//  Derives bipolar and Laplacian montages from monopolar grid recordings. A montage is
+//  compiled once against an HdemgGridGeometry into a sparse list of stencil taps (input
+//  channel, weight) per output channel. Outputs are only generated for grid positions
+//  where every electrode of the stencil exists.
+//
+//  To keep the inner loops contiguous the block is transposed to channel-major, every
+//  stencil tap is applied as a vector multiply-add over all frames of the block, and the
+//  result is transposed back into a caller supplied HdemgBlock.
+//
+//  Bad channels (see hdemg_quality.h) are excluded by SetChannelMask(), which only changes
+//  tap weights: a stencil loses its bad neighbours and the remaining ones are scaled so the
+//  stencil still sums to zero, and a stencil whose center is bad outputs zero.
+//
+
+#ifndef HDEMG_SPATIAL_FILTER_H
+#define HDEMG_SPATIAL_FILTER_H
+
+#include <string.h>
+#include <vector>
+
+#include "hdemg_frames.h"
+#include "hdemg_grid.h"
+#include "hdemg_simd.h"
+
+//! \defgroup HdemgMontages
+//! \{
+//! \brief Spatial filters. "Vertical" runs along a column (across rows), "horizontal" along a row.
+static const uint32_t HDEMG_MONTAGE_MONOPOLAR       = 0; // x[r][c]
+static const uint32_t HDEMG_MONTAGE_SD_VERTICAL     = 1; // x[r][c] - x[r+1][c]
+static const uint32_t HDEMG_MONTAGE_SD_HORIZONTAL   = 2; // x[r][c] - x[r][c+1]
+static const uint32_t HDEMG_MONTAGE_DD_VERTICAL     = 3; // -x[r-1][c] + 2x[r][c] - x[r+1][c]
+static const uint32_t HDEMG_MONTAGE_DD_HORIZONTAL   = 4; // -x[r][c-1] + 2x[r][c] - x[r][c+1]
+static const uint32_t HDEMG_MONTAGE_NSLT            = 5; // 4x[r][c] - sum of the 4 nearest neighbours
+static const uint32_t HDEMG_MONTAGE_IB2             = 6; // inverse binomial 2nd order 3x3 kernel
+
+static const char * HdemgMontageLabels[] =
+{
+    "Monopolar",
+    "SD vertical",
+    "SD horizontal",
+    "DD vertical",
+    "DD horizontal",
+    "NSLT",
+    "IB2"
+};
+//! \}
+
+//! \brief One weighted input of a stencil
+struct HdemgStencilTap
+{
+    uint32_t channel;
+    float    weight;
+};
+
+/*! \brief Applies one montage of one grid to blocks of frames.
+ */
+class HdemgSpatialFilter
+{
+public:
+    HdemgSpatialFilter() : montage(HDEMG_MONTAGE_MONOPOLAR), inChannels(0), maxFrames(0) {}
+
+    /**
+        Compiles a montage into stencil taps and sizes the scratch buffers.
+
+        \arg grid           - position of every electrode within the input frames
+        \arg montageType    - one of the HDEMG_MONTAGE_* values
+        \arg inputChannels  - channels per input frame (must cover all grid channels)
+        \arg maxBlockFrames - largest block that will be passed to Process()
+
+        \return true if at least one output channel could be formed
+      */
+    bool Configure(const HdemgGridGeometry & grid, uint32_t montageType, uint32_t inputChannels, uint32_t maxBlockFrames)
+    {
+        if(montageType > HDEMG_MONTAGE_IB2 || maxBlockFrames == 0 || grid.ChannelSpan() > inputChannels)
+        {
+            printf("ERROR: invalid spatial filter configuration\n");
+            return false;
+        }
+
+        montage    = montageType;
+        inChannels = inputChannels;
+        maxFrames  = maxBlockFrames;
+
+        // relative (row, col, weight) terms of the stencil
+        std::vector<int32_t> dr, dc;
+        std::vector<float>   w;
+        StencilTerms(montageType, dr, dc, w);
+
+        taps.clear();
+        tapStart.clear();
+        outRow.clear();
+        outCol.clear();
+
+        // channels that take part in at least one stencil, in the order they are transposed
+        std::vector<int32_t> slotOfChannel(inputChannels, -1);
+        usedChannels.clear();
+
+        for(uint32_t r=0; r<grid.rows; ++r)
+        {
+            for(uint32_t c=0; c<grid.cols; ++c)
+            {
+                bool complete = true;
+                for(size_t t=0; t<w.size() && complete; ++t)
+                    complete = grid.Channel((int32_t)r + dr[t], (int32_t)c + dc[t]) != HDEMG_GRID_NO_ELECTRODE;
+                if(!complete)
+                    continue;
+
+                tapStart.push_back((uint32_t)taps.size());
+                outRow.push_back(r);
+                outCol.push_back(c);
+                for(size_t t=0; t<w.size(); ++t)
+                {
+                    int32_t ch = grid.Channel((int32_t)r + dr[t], (int32_t)c + dc[t]);
+                    if(slotOfChannel[ch] < 0)
+                    {
+                        slotOfChannel[ch] = (int32_t)usedChannels.size();
+                        usedChannels.push_back((uint32_t)ch);
+                    }
+
+                    // taps refer to rows of the channel-major scratch buffer
+                    HdemgStencilTap tap;
+                    tap.channel = (uint32_t)slotOfChannel[ch];
+                    tap.weight  = w[t];
+                    taps.push_back(tap);
+                }
+            }
+        }
+        tapStart.push_back((uint32_t)taps.size());
+        baseWeight.resize(taps.size());
+        for(size_t t=0; t<taps.size(); ++t)
+            baseWeight[t] = taps[t].weight;
+        outActive.assign(outRow.size(), 1);
+
+        if(outRow.empty())
+        {
+            printf("ERROR: the %s montage does not fit on a [%u x %u] grid\n", HdemgMontageLabels[montageType], grid.rows, grid.cols);
+            return false;
+        }
+
+        planeIn.assign((size_t)usedChannels.size() * maxBlockFrames, 0.0f);
+        planeOut.assign((size_t)outRow.size() * maxBlockFrames, 0.0f);
+        return true;
+    }
+
+    /**
+        Applies the montage to a block.
+
+        \arg in        - monopolar input frames
+        \arg out       - preallocated output block (see AllocateOutput()). Outputs are written
+                         to channels [outOffset, outOffset + OutputCount()) of every frame so
+                         several grids can share one output block.
+        \arg outOffset - first output channel
+
+        \return false if the blocks do not match the configuration
+      */
+    bool Process(const HdemgBlock & in, HdemgBlock & out, uint32_t outOffset = 0)
+    {
+        const uint32_t nFrames = in.frameCount;
+        const uint32_t nUsed   = (uint32_t)usedChannels.size();
+        const uint32_t nOut    = OutputCount();
+
+        if(in.channelCount != inChannels || nFrames > maxFrames || nFrames > out.capacity
+           || outOffset + nOut > out.channelCount)
+        {
+            printf("ERROR: spatial filter block mismatch\n");
+            return false;
+        }
+
+        // gather the used channels into contiguous time series
+        for(uint32_t f=0; f<nFrames; ++f)
+        {
+            const float * pFrame = in.Frame(f);
+            for(uint32_t s=0; s<nUsed; ++s)
+                planeIn[(size_t)s * maxFrames + f] = pFrame[usedChannels[s]];
+        }
+
+        // every tap is one multiply-add over the whole block
+        for(uint32_t o=0; o<nOut; ++o)
+        {
+            float * pDst = &planeOut[(size_t)o * maxFrames];
+            const HdemgStencilTap & first = taps[tapStart[o]];
+            HdemgScale(pDst, &planeIn[(size_t)first.channel * maxFrames], first.weight, nFrames);
+            for(uint32_t t=tapStart[o]+1; t<tapStart[o+1]; ++t)
+                HdemgAxpy(pDst, &planeIn[(size_t)taps[t].channel * maxFrames], taps[t].weight, nFrames);
+        }
+
+        // scatter back to sample-major frames
+        for(uint32_t f=0; f<nFrames; ++f)
+        {
+            float * pFrame = out.Frame(f) + outOffset;
+            for(uint32_t o=0; o<nOut; ++o)
+                pFrame[o] = planeOut[(size_t)o * maxFrames + f];
+        }
+
+        out.frameCount = nFrames;
+        out.startTime  = in.startTime;
+        out.sampleRate = in.sampleRate;
+        out.arrivalNs  = in.arrivalNs;
+        return true;
+    }
+
+    /**
+        Excludes bad input channels by reweighting the stencils, no buffers are reallocated.
+
+        \arg pGood - one entry per input channel, nonzero for usable channels (e.g.
+                     HdemgQualityReport::good), or NULL to use every channel again
+
+        \return number of outputs that are zero because their stencil has no usable form
+      */
+    uint32_t SetChannelMask(const uint8_t * pGood)
+    {
+        uint32_t inactive = 0;
+        for(uint32_t o=0; o<OutputCount(); ++o)
+        {
+            // positive taps are the stencil center, negative taps its reference
+            float positive = 0.0f, negative = 0.0f, kept = 0.0f;
+            bool  centerGood = true;
+            for(uint32_t t=tapStart[o]; t<tapStart[o+1]; ++t)
+            {
+                bool good = !pGood || pGood[usedChannels[taps[t].channel]];
+                if(baseWeight[t] > 0.0f)
+                {
+                    positive  += baseWeight[t];
+                    centerGood = centerGood && good;
+                }
+                else
+                {
+                    negative -= baseWeight[t];
+                    if(good)
+                        kept -= baseWeight[t];
+                }
+            }
+
+            bool active = centerGood && (negative == 0.0f || kept > 0.0f);
+            float refScale = (kept > 0.0f) ? negative / kept : 0.0f;
+            for(uint32_t t=tapStart[o]; t<tapStart[o+1]; ++t)
+            {
+                bool good = !pGood || pGood[usedChannels[taps[t].channel]];
+                if(!active || !good)
+                    taps[t].weight = 0.0f;
+                else
+                    taps[t].weight = (baseWeight[t] > 0.0f) ? baseWeight[t] : baseWeight[t] * refScale;
+            }
+            outActive[o] = active;
+            inactive += !active;
+        }
+        return inactive;
+    }
+
+    //! \brief one entry per output, 0 for outputs switched off by SetChannelMask()
+    const uint8_t * OutputMask() const { return &outActive[0]; }
+
+    //! \brief sizes a block that can hold the output of this filter alone
+    bool AllocateOutput(HdemgBlock & out) const
+    {
+        return out.Allocate(OutputCount(), maxFrames, HDEMG_NIP_CLOCK_HZ);
+    }
+
+    uint32_t OutputCount() const            { return (uint32_t)outRow.size(); }
+    uint32_t OutputRow(uint32_t o) const    { return outRow[o]; }   //!< grid row of the stencil center
+    uint32_t OutputCol(uint32_t o) const    { return outCol[o]; }   //!< grid column of the stencil center
+    uint32_t Montage() const                { return montage; }
+
+private:
+    static void StencilTerms(uint32_t type, std::vector<int32_t> & dr, std::vector<int32_t> & dc, std::vector<float> & w)
+    {
+        dr.clear(); dc.clear(); w.clear();
+        switch(type)
+        {
+            case HDEMG_MONTAGE_MONOPOLAR:
+                AddTerm(dr, dc, w, 0, 0, 1.0f);
+                break;
+            case HDEMG_MONTAGE_SD_VERTICAL:
+                AddTerm(dr, dc, w, 0, 0, 1.0f);  AddTerm(dr, dc, w, 1, 0, -1.0f);
+                break;
+            case HDEMG_MONTAGE_SD_HORIZONTAL:
+                AddTerm(dr, dc, w, 0, 0, 1.0f);  AddTerm(dr, dc, w, 0, 1, -1.0f);
+                break;
+            case HDEMG_MONTAGE_DD_VERTICAL:
+                AddTerm(dr, dc, w, -1, 0, -1.0f); AddTerm(dr, dc, w, 0, 0, 2.0f); AddTerm(dr, dc, w, 1, 0, -1.0f);
+                break;
+            case HDEMG_MONTAGE_DD_HORIZONTAL:
+                AddTerm(dr, dc, w, 0, -1, -1.0f); AddTerm(dr, dc, w, 0, 0, 2.0f); AddTerm(dr, dc, w, 0, 1, -1.0f);
+                break;
+            case HDEMG_MONTAGE_NSLT:
+                AddTerm(dr, dc, w, 0, 0, 4.0f);
+                AddTerm(dr, dc, w, -1, 0, -1.0f); AddTerm(dr, dc, w, 1, 0, -1.0f);
+                AddTerm(dr, dc, w, 0, -1, -1.0f); AddTerm(dr, dc, w, 0, 1, -1.0f);
+                break;
+            case HDEMG_MONTAGE_IB2:
+                AddTerm(dr, dc, w, 0, 0, 12.0f);
+                AddTerm(dr, dc, w, -1, 0, -2.0f); AddTerm(dr, dc, w, 1, 0, -2.0f);
+                AddTerm(dr, dc, w, 0, -1, -2.0f); AddTerm(dr, dc, w, 0, 1, -2.0f);
+                AddTerm(dr, dc, w, -1, -1, -1.0f); AddTerm(dr, dc, w, -1, 1, -1.0f);
+                AddTerm(dr, dc, w, 1, -1, -1.0f);  AddTerm(dr, dc, w, 1, 1, -1.0f);
+                break;
+        }
+    }
+
+    static void AddTerm(std::vector<int32_t> & dr, std::vector<int32_t> & dc, std::vector<float> & w,
+                        int32_t r, int32_t c, float weight)
+    {
+        dr.push_back(r);
+        dc.push_back(c);
+        w.push_back(weight);
+    }
+
+    uint32_t                     montage;
+    uint32_t                     inChannels;
+    uint32_t                     maxFrames;
+    std::vector<HdemgStencilTap> taps;          // all stencils back to back, masked weights
+    std::vector<float>           baseWeight;    // [tap] weight with every channel usable
+    std::vector<uint8_t>         outActive;     // [output] stencil has a usable form
+    std::vector<uint32_t>        tapStart;      // [output] -> first tap, plus end marker
+    std::vector<uint32_t>        outRow;
+    std::vector<uint32_t>        outCol;
+    std::vector<uint32_t>        usedChannels;  // [scratch row] -> input channel
+    std::vector<float>           planeIn;       // channel-major input scratch
+    std::vector<float>           planeOut;      // channel-major output scratch
+};
+
+#endif // HDEMG_SPATIAL_FILTER_H
@@ -0,0 +1,329 @@
+//
+//  hdemg_spectrum.h
+//
+//  Streaming Welch power spectral density and the spectral fatigue indices mean frequency
+//  (MNF) and median frequency (MDF) for every channel.
+//
+//  Hann windowed segments of fftSize frames are taken every hop frames and transformed with
+//  HdemgBatchedRealFft. The PSD published for a segment is the mean of the periodograms of
+//  the last `segments` segments. MNF and MDF are computed from that PSD within a frequency
+//  band, so they track the signal with a time resolution of about segments * hop frames.
+//
+//  As in hdemg_features.h, segments end on NIP aligned hop boundaries, so results do not
+//  depend on how the stream is cut into blocks. HdemgWriteFrequencyTrack() writes the
+//  results as text lines keyed by NIP time.
+//
+
+#ifndef HDEMG_SPECTRUM_H
+#define HDEMG_SPECTRUM_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "hdemg_fft.h"
+#include "hdemg_frames.h"
+
+static const uint32_t HDEMG_SPECTRUM_MAX_SEGMENTS = 64;
+
+/*! \brief Averaged spectrum of all channels at one point in time.
+ */
+struct HdemgSpectrumFrame
+{
+    uint32_t time;             //!< NIP time of the last frame of the newest segment
+    uint64_t arrivalNs;        //!< arrival of the block holding that frame (see HdemgBlock)
+    uint32_t channelCount;
+    uint32_t binCount;         //!< fftSize / 2 + 1
+    double   binHz;            //!< frequency step between bins
+    uint32_t segmentCount;     //!< periodograms averaged into psd (less than configured after a gap)
+    std::vector<float> psd;            //!< one-sided PSD in units^2/Hz, [bin][channel]
+    std::vector<float> meanFrequency;  //!< MNF in Hz within the analysis band, [channel]
+    std::vector<float> medianFrequency;//!< MDF in Hz within the analysis band, [channel]
+    std::vector<float> bandPower;      //!< power within the analysis band in units^2, [channel]
+
+    inline const float * Bin(uint32_t k) const { return &psd[(size_t)k * channelCount]; }
+};
+
+//! \brief Called every time a segment has been evaluated
+typedef void (*HdemgSpectrumCallback)(const HdemgSpectrumFrame & frame, void * pUser);
+
+/*! \brief Welch PSD with MNF / MDF tracking.
+ */
+class HdemgSpectrumEngine
+{
+public:
+    HdemgSpectrumEngine()
+        : channelCount(0), fftSize(0), hopFrames(0), segmentCount(0), binLow(0), binHigh(0), ringPos(0), filled(0),
+          periodogramPos(0), periodograms(0), psdScale(0.0f), expectedTime(0), streamStarted(false),
+          pCallback(NULL), pUser(NULL) {}
+
+    /**
+        Sizes the engine.
+
+        \arg channels    - channels per frame
+        \arg sampleRate  - frame rate of the input blocks in Hz
+        \arg size        - segment length in frames, a power of two
+        \arg hop         - frames between consecutive segments (size / 2 for 50% overlap)
+        \arg segments    - periodograms averaged per PSD (1 - HDEMG_SPECTRUM_MAX_SEGMENTS)
+        \arg bandLowHz   - lower edge of the band used for MNF / MDF
+        \arg bandHighHz  - upper edge of the band used for MNF / MDF
+        \arg callback    - receives the spectrum frames
+        \arg pUserData   - passed through to the callback
+
+        \return true if the configuration is valid
+      */
+    bool Configure(uint32_t channels, double sampleRate, uint32_t size, uint32_t hop, uint32_t segments,
+                   double bandLowHz, double bandHighHz, HdemgSpectrumCallback callback, void * pUserData)
+    {
+        if(channels == 0 || sampleRate <= 0.0 || hop == 0 || segments == 0 || segments > HDEMG_SPECTRUM_MAX_SEGMENTS
+           || bandLowHz < 0.0 || bandHighHz <= bandLowHz || !callback)
+        {
+            printf("ERROR: invalid spectrum configuration\n");
+            return false;
+        }
+        if(!fft.Configure(size, channels))
+            return false;
+
+        channelCount = channels;
+        fftSize      = size;
+        hopFrames    = hop;
+        segmentCount = segments;
+
+        const uint32_t bins = fft.BinCount();
+        const double   df   = sampleRate / size;
+        binLow  = (uint32_t)std::min(ceil(bandLowHz / df), (double)(bins - 1));
+        binHigh = (uint32_t)std::min(floor(bandHighHz / df), (double)(bins - 1));
+        if(binHigh <= binLow)
+        {
+            printf("ERROR: spectrum band [%.1f - %.1f] Hz is narrower than one bin\n", bandLowHz, bandHighHz);
+            return false;
+        }
+
+        // periodic Hann window, PSD scale 1 / (fs * sum(w^2))
+        window.resize(size);
+        double windowPower = 0.0;
+        for(uint32_t n=0; n<size; ++n)
+        {
+            window[n]    = (float)(0.5 - 0.5 * cos(2.0 * HDEMG_PI * n / size));
+            windowPower += (double)window[n] * window[n];
+        }
+        psdScale = (float)(1.0 / (sampleRate * windowPower));
+
+        ring.assign((size_t)size * channels, 0.0f);
+        segment.assign((size_t)size * channels, 0.0f);
+        spectrumRe.assign((size_t)bins * channels, 0.0f);
+        spectrumIm.assign((size_t)bins * channels, 0.0f);
+        history.assign((size_t)segments * bins * channels, 0.0f);
+
+        frame.channelCount = channels;
+        frame.binCount     = bins;
+        frame.binHz        = df;
+        frame.psd.assign((size_t)bins * channels, 0.0f);
+        frame.meanFrequency.assign(channels, 0.0f);
+        frame.medianFrequency.assign(channels, 0.0f);
+        frame.bandPower.assign(channels, 0.0f);
+
+        pCallback = callback;
+        pUser     = pUserData;
+        Reset();
+        return true;
+    }
+
+    //! \brief Clears the segment history, e.g. after a gap in the stream
+    void Reset()
+    {
+        std::fill(ring.begin(), ring.end(), 0.0f);
+        ringPos        = 0;
+        filled         = 0;
+        periodogramPos = 0;
+        periodograms   = 0;
+        streamStarted  = false;
+    }
+
+    /**
+        Adds a block of frames and evaluates every segment that ends inside it.
+      */
+    bool Process(const HdemgBlock & in)
+    {
+        if(in.channelCount != channelCount)
+        {
+            printf("ERROR: spectrum block has [%u] channels, expected [%u]\n", in.channelCount, channelCount);
+            return false;
+        }
+
+        const double ticks = in.TicksPerFrame();
+        if(streamStarted && !HdemgIsContiguous(in, expectedTime))
+            Reset();
+        streamStarted = true;
+
+        for(uint32_t f=0; f<in.frameCount; ++f)
+        {
+            memcpy(&ring[(size_t)ringPos * channelCount], in.Frame(f), channelCount * sizeof(float));
+            if(++ringPos == fftSize)
+                ringPos = 0;
+            if(filled < fftSize)
+                filled++;
+
+            // segments end on NIP aligned hop boundaries
+            uint32_t time       = in.FrameTime(f);
+            uint32_t frameIndex = (uint32_t)(time / ticks + 0.5);
+            if(filled == fftSize && (frameIndex + 1) % hopFrames == 0)
+                Evaluate(time, in.arrivalNs);
+        }
+
+        expectedTime = in.EndTime();
+        return true;
+    }
+
+    uint32_t BinCount() const { return fft.BinCount(); }
+
+private:
+    void Evaluate(uint32_t time, uint64_t arrivalNs)
+    {
+        const uint32_t nCh  = channelCount;
+        const uint32_t bins = fft.BinCount();
+
+        // oldest frame first, windowed
+        for(uint32_t n=0; n<fftSize; ++n)
+        {
+            uint32_t pos = ringPos + n;
+            if(pos >= fftSize)
+                pos -= fftSize;
+            HdemgScale(&segment[(size_t)n * nCh], &ring[(size_t)pos * nCh], window[n], nCh);
+        }
+        fft.Transform(&segment[0], &spectrumRe[0], &spectrumIm[0]);
+
+        // one-sided periodogram into the history slot
+        float * HDEMG_RESTRICT p = &history[(size_t)periodogramPos * bins * nCh];
+        for(uint32_t k=0; k<bins; ++k)
+        {
+            const float * HDEMG_RESTRICT re = &spectrumRe[(size_t)k * nCh];
+            const float * HDEMG_RESTRICT im = &spectrumIm[(size_t)k * nCh];
+            float * HDEMG_RESTRICT       pk = p + (size_t)k * nCh;
+            float scale = (k == 0 || k == bins - 1) ? psdScale : 2.0f * psdScale;
+            for(uint32_t c=0; c<nCh; ++c)
+                pk[c] = scale * (re[c] * re[c] + im[c] * im[c]);
+        }
+        if(++periodogramPos == segmentCount)
+            periodogramPos = 0;
+        if(periodograms < segmentCount)
+            periodograms++;
+
+        // Welch average of the stored periodograms
+        float * HDEMG_RESTRICT psd = &frame.psd[0];
+        const size_t           len = (size_t)bins * nCh;
+        memcpy(psd, &history[0], len * sizeof(float));
+        for(uint32_t s=1; s<periodograms; ++s)
+            HdemgAxpy(psd, &history[(size_t)s * len], 1.0f, (uint32_t)len);
+        const float inv = 1.0f / periodograms;
+        for(size_t i=0; i<len; ++i)
+            psd[i] *= inv;
+
+        Track();
+
+        frame.time         = time;
+        frame.arrivalNs    = arrivalNs;
+        frame.segmentCount = periodograms;
+        pCallback(frame, pUser);
+    }
+
+    //! \brief MNF, MDF and band power from the averaged PSD
+    void Track()
+    {
+        const uint32_t nCh = channelCount;
+        const double   df  = frame.binHz;
+        std::vector<double> & power  = trackPower;
+        std::vector<double> & moment = trackMoment;
+        power.assign(nCh, 0.0);
+        moment.assign(nCh, 0.0);
+
+        for(uint32_t k=binLow; k<=binHigh; ++k)
+        {
+            const float * pk = frame.Bin(k);
+            double        f  = k * df;
+            for(uint32_t c=0; c<nCh; ++c)
+            {
+                power[c]  += pk[c];
+                moment[c] += f * pk[c];
+            }
+        }
+
+        for(uint32_t c=0; c<nCh; ++c)
+        {
+            frame.bandPower[c]     = (float)(power[c] * df);
+            frame.meanFrequency[c] = (power[c] > 0.0) ? (float)(moment[c] / power[c]) : 0.0f;
+
+            // first bin where the cumulative power reaches half, interpolated within the bin
+            double halfPower = 0.5 * power[c];
+            double cum       = 0.0;
+            float  mdf       = 0.0f;
+            for(uint32_t k=binLow; k<=binHigh && power[c] > 0.0; ++k)
+            {
+                double pk = frame.Bin(k)[c];
+                if(cum + pk >= halfPower)
+                {
+                    double frac = (pk > 0.0) ? (halfPower - cum) / pk : 0.0;
+                    mdf = (float)((k - 0.5 + frac) * df);
+                    if(mdf < binLow * df)
+                        mdf = (float)(binLow * df);
+                    break;
+                }
+                cum += pk;
+            }
+            frame.medianFrequency[c] = mdf;
+        }
+    }
+
+    HdemgBatchedRealFft   fft;
+    uint32_t              channelCount;
+    uint32_t              fftSize;
+    uint32_t              hopFrames;
+    uint32_t              segmentCount;
+    uint32_t              binLow;          // analysis band, inclusive
+    uint32_t              binHigh;
+    uint32_t              ringPos;
+    uint32_t              filled;
+    uint32_t              periodogramPos;
+    uint32_t              periodograms;    // valid entries in history
+    float                 psdScale;
+    uint32_t              expectedTime;
+    bool                  streamStarted;
+    std::vector<float>    window;
+    std::vector<float>    ring;            // last fftSize frames, sample-major
+    std::vector<float>    segment;         // windowed segment in time order
+    std::vector<float>    spectrumRe;      // [bin][channel]
+    std::vector<float>    spectrumIm;
+    std::vector<float>    history;         // [segment][bin][channel] periodograms
+    std::vector<double>   trackPower;
+    std::vector<double>   trackMoment;
+    HdemgSpectrumFrame    frame;
+    HdemgSpectrumCallback pCallback;
+    void *                pUser;
+};
+
+/**
+    Writes one line per spectrum frame: NIP time, then MNF of every channel, then MDF of
+    every channel, tab separated. The file loads with dlmread / readmatrix in MATLAB.
+
+    \return false if the write failed
+  */
+inline bool
+HdemgWriteFrequencyTrack(FILE * pFile, const HdemgSpectrumFrame & frame)
+{
+    fprintf(pFile, "%u", frame.time);
+    for(uint32_t c=0; c<frame.channelCount; ++c)
+        fprintf(pFile, "\t%.2f", frame.meanFrequency[c]);
+    for(uint32_t c=0; c<frame.channelCount; ++c)
+        fprintf(pFile, "\t%.2f", frame.medianFrequency[c]);
+    fprintf(pFile, "\n");
+    if(ferror(pFile))
+    {
+        printf("ERROR: could not write frequency track\n");
+        return false;
+    }
+    return true;
+}
+
+#endif // HDEMG_SPECTRUM_H
@@ -0,0 +1,140 @@
+//
+//  line_canceller_check.cpp
+//
+//  Checks that HdemgLineCanceller removes the mains lines independently of the block size.
+//  Synthetic channels of broadband noise plus a 50.3 Hz line with harmonics are cancelled
+//  in 1 ms blocks at 2 kHz (2 frames, the NIP packets of a decimated stream) and at 30 kHz,
+//  and in 10 ms blocks at 30 kHz for comparison. Over the second half of each run the
+//  residual line must be attenuated by at least HDEMG_CHECK_MIN_DB and the tracked
+//  frequency must be within HDEMG_CHECK_MAX_HZ of the true one.
+//
+//      line_canceller_check
+//
+//          prints one line per case and returns 1 if any case fails
+//
+//  g++ -std=c++14 -O3 -march=native line_canceller_check.cpp -o line_canceller_check
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#include "hdemg_line_canceller.h"
+
+static const uint32_t HDEMG_CHECK_CHANNELS  = 67;      // not a multiple of the vector width
+static const uint32_t HDEMG_CHECK_HARMONICS = 5;
+static const double   HDEMG_CHECK_MAINS_HZ  = 50.3;    // off nominal, so the loop has to track
+static const double   HDEMG_CHECK_SECONDS   = 20.0;
+static const double   HDEMG_CHECK_MIN_DB    = 30.0;
+static const double   HDEMG_CHECK_MAX_HZ    = 0.02;
+
+//! \brief attenuation and final frequency of one run
+struct CheckResult
+{
+    double attenuationDb;
+    double frequencyHz;
+    bool   ok;
+};
+
+static double
+Uniform(uint32_t & seed)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return (seed >> 8) / 16777216.0 - 0.5;
+}
+
+static CheckResult
+Run(double rate, uint32_t blockFrames)
+{
+    CheckResult result = { 0.0, 0.0, false };
+
+    HdemgLineCanceller canceller;
+    if(!canceller.Configure(HDEMG_CHECK_CHANNELS, rate, 50.0, HDEMG_CHECK_HARMONICS, HDEMG_LINE_JOINT_REFERENCE,
+                            1.0, blockFrames))
+        return result;
+
+    // per channel and harmonic amplitude and phase of the interference
+    uint32_t seed = 7;
+    std::vector<double> amplitude((size_t)HDEMG_CHECK_HARMONICS * HDEMG_CHECK_CHANNELS);
+    std::vector<double> offset(amplitude.size());
+    for(uint32_t h=0; h<HDEMG_CHECK_HARMONICS; ++h)
+    {
+        for(uint32_t c=0; c<HDEMG_CHECK_CHANNELS; ++c)
+        {
+            amplitude[(size_t)h * HDEMG_CHECK_CHANNELS + c] = (200.0 + 200.0 * Uniform(seed)) / (h + 1);
+            offset[(size_t)h * HDEMG_CHECK_CHANNELS + c]    = 2.0 * HDEMG_PI * Uniform(seed);
+        }
+    }
+
+    HdemgBlock block;
+    block.Allocate(HDEMG_CHECK_CHANNELS, blockFrames, rate);
+    std::vector<float> noise((size_t)HDEMG_CHECK_CHANNELS * blockFrames);
+    std::vector<float> line(noise.size());
+
+    const uint32_t blocks  = (uint32_t)(HDEMG_CHECK_SECONDS * rate / blockFrames);
+    double         linePow = 0.0, residualPow = 0.0;
+    uint64_t       frame   = 0;
+    for(uint32_t b=0; b<blocks; ++b)
+    {
+        for(uint32_t f=0; f<blockFrames; ++f, ++frame)
+        {
+            const double theta = 2.0 * HDEMG_PI * HDEMG_CHECK_MAINS_HZ * frame / rate;
+            for(uint32_t c=0; c<HDEMG_CHECK_CHANNELS; ++c)
+            {
+                double x = 0.0;
+                for(uint32_t h=0; h<HDEMG_CHECK_HARMONICS; ++h)
+                {
+                    const size_t k = (size_t)h * HDEMG_CHECK_CHANNELS + c;
+                    x += amplitude[k] * cos((h + 1) * theta + offset[k]);
+                }
+                const size_t i = (size_t)f * HDEMG_CHECK_CHANNELS + c;
+                noise[i] = (float)(100.0 * Uniform(seed));
+                line[i]  = (float)x;
+                block.samples[i] = noise[i] + line[i];
+            }
+        }
+        block.frameCount = blockFrames;
+        block.startTime  = (uint32_t)((uint64_t)b * blockFrames * HDEMG_NIP_CLOCK_HZ / rate);
+        if(!canceller.Process(block))
+            return result;
+
+        // the output minus the noise is the line left over
+        if(b >= blocks / 2)
+        {
+            for(size_t i=0; i<noise.size(); ++i)
+            {
+                const double r = block.samples[i] - noise[i];
+                linePow     += (double)line[i] * line[i];
+                residualPow += r * r;
+            }
+        }
+    }
+
+    result.attenuationDb = 10.0 * log10(linePow / residualPow);
+    result.frequencyHz   = canceller.Frequency();
+    result.ok            = true;
+    return result;
+}
+
+int main()
+{
+    const struct { double rate; uint32_t blockFrames; } cases[] =
+    {
+        { 2000.0,  2   },  // 1 ms
+        { 30000.0, 30  },  // 1 ms
+        { 30000.0, 300 },  // 10 ms
+    };
+
+    bool passed = true;
+    for(size_t i=0; i<sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        CheckResult result = Run(cases[i].rate, cases[i].blockFrames);
+        bool held = result.ok && result.attenuationDb >= HDEMG_CHECK_MIN_DB
+                    && fabs(result.frequencyHz - HDEMG_CHECK_MAINS_HZ) <= HDEMG_CHECK_MAX_HZ;
+        printf("%5.0f Hz, %3u frame blocks  attenuation %6.1f dB, frequency %7.3f Hz  %s\n",
+               cases[i].rate, cases[i].blockFrames, result.attenuationDb, result.frequencyHz,
+               held ? "ok" : "FAILED");
+        passed = passed && held;
+    }
+    return passed ? 0 : 1;
+}
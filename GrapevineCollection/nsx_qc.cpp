@@ -0,0 +1,136 @@
+//
+//  nsx_qc.cpp
+//
+//  QC report of NSx recordings from the channel statistics in their sidecar indexes
+//  (hdemg_channel_stats.h): mean, standard deviation, RMS, range and clipped samples of
+//  every channel, merged over all files given, e.g. the files of a split session. Files
+//  recorded by HdemgNsxWriter or converted by nsx_to_archive.cpp are not read; the others,
+//  e.g. recorded by Trellis, are read once and their statistics added to the index.
+//
+//      nsx_qc [-v] file.ns5 [file2.ns5 ...]
+//
+//          -v  also print the report of every file
+//
+//  g++ -std=c++14 -O3 -march=native nsx_qc.cpp -o nsx_qc
+//
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "hdemg_channel_stats.h"
+#include "hdemg_frames.h"
+#include "hdemg_nsx_reader.h"
+
+static const double HDEMG_QC_CLIPPED_WARNING = 1e-3;   // fraction of samples at a rail
+
+/**
+    Gets the statistics of one file from its index, or reads the file and stores them there
+
+    \return false if the file cannot be read
+  */
+static bool
+FileStats(const HdemgNsxReader & reader, const char * pPath, std::vector<HdemgChannelStats> & stats)
+{
+    stats = reader.Index().Stats();
+    if(!stats.empty())
+        return true;
+
+    stats = HdemgNsxReadStats(reader);
+
+    char indexPath[HDEMG_NSX_INDEX_MAX_PATH];
+    if(reader.BasicHeader() && HdemgNsxIndexPath(pPath, indexPath, sizeof(indexPath)))
+    {
+        HdemgNsxIndex index = reader.Index();
+        index.SetStats(stats);
+        index.Save(indexPath);
+    }
+    return true;
+}
+
+//! \brief prints one line per channel in the analog units of the file
+static void
+PrintReport(const HdemgNsxReader & reader, const std::vector<HdemgChannelStats> & stats)
+{
+    const HdemgNsxChannelHeader * pFirst = reader.ChannelHeader(0);
+    char                          units[17] = "counts";
+    if(pFirst && pFirst->maxDigital != pFirst->minDigital)
+    {
+        memcpy(units, pFirst->units, sizeof(pFirst->units));
+        units[sizeof(pFirst->units)] = 0;
+    }
+
+    printf("  chan  elec        mean         std         rms         min         max  clipped  [%s]\n", units);
+    uint32_t flagged = 0;
+    for(uint32_t c=0; c<stats.size(); ++c)
+    {
+        // analog = minAnalog + (digital - minDigital) * scale, in the range of each channel
+        const HdemgNsxChannelHeader * pExt   = reader.ChannelHeader(c);
+        double                        scale  = 1.0;
+        double                        offset = 0.0;
+        if(pExt && pExt->maxDigital != pExt->minDigital)
+        {
+            scale  = (double)(pExt->maxAnalog - pExt->minAnalog) / (pExt->maxDigital - pExt->minDigital);
+            offset = pExt->minAnalog - pExt->minDigital * scale;
+        }
+
+        const HdemgChannelStats & s = stats[c];
+        double mean = offset + s.mean * scale;
+        double sd   = s.StdDev() * scale;
+        bool   warn = s.ClippedFraction() > HDEMG_QC_CLIPPED_WARNING;
+        printf("  %4u  %4u  %10.2f  %10.2f  %10.2f  %10.2f  %10.2f  %6.3f%%%s\n", c, reader.ElectrodeId(c),
+               mean, sd, sqrt(sd * sd + mean * mean), offset + s.minimum * scale, offset + s.maximum * scale,
+               100.0 * s.ClippedFraction(), warn ? "  !" : "");
+        if(warn)
+            flagged++;
+    }
+    printf("  %u channels with more than %.1f%% clipped samples\n", flagged, 100.0 * HDEMG_QC_CLIPPED_WARNING);
+}
+
+int main(int argc, char * argv[])
+{
+    bool                      verbose = false;
+    std::vector<const char *> files;
+    for(int i=1; i<argc; ++i)
+    {
+        if(strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else
+            files.push_back(argv[i]);
+    }
+    if(files.empty())
+    {
+        printf("usage: %s [-v] file.ns5 [file2.ns5 ...]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<HdemgChannelStats> total;
+    HdemgNsxReader                 first;
+    uint64_t                       start = HdemgNowNs();
+    for(size_t k=0; k<files.size(); ++k)
+    {
+        HdemgNsxReader                 reader;
+        std::vector<HdemgChannelStats> stats;
+        if(!reader.Open(files[k]) || !FileStats(reader, files[k], stats))
+            return 1;
+        if(!HdemgMergeChannelStats(total, stats))
+        {
+            printf("ERROR: [%s] has [%u] channels, the files before have [%zu]\n", files[k], reader.ChannelCount(), total.size());
+            return 1;
+        }
+        printf("%s: %llu frames (%.1f s)\n", files[k], (unsigned long long)(stats.empty() ? 0 : stats[0].count),
+               (stats.empty() ? 0 : stats[0].count) / reader.SampleRate());
+        if(verbose)
+            PrintReport(reader, stats);
+        if(k == 0)
+            first.Open(files[k]);
+    }
+
+    if(files.size() > 1 || !verbose)
+    {
+        printf("%zu files, %llu frames\n", files.size(), (unsigned long long)(total.empty() ? 0 : total[0].count));
+        PrintReport(first, total);
+    }
+    printf("report in %.3f s\n", (HdemgNowNs() - start) * 1e-9);
+    return 0;
+}
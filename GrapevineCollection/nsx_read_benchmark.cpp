@@ -0,0 +1,170 @@
+//
+//  nsx_read_benchmark.cpp
+//
+//  Times HdemgNsxReader on a (multi-gigabyte) NSx file for the access patterns that are
+//  slow with openNSx.m. benchmark_openNSx.m runs the same reads in MATLAB so the two can be
+//  compared line by line.
+//
+//      nsx_read_benchmark make <file> <channels> <seconds>
+//          writes a synthetic 30 ksps file with HdemgNsxWriter, paused half way
+//
+//      nsx_read_benchmark <file> [subset channels]
+//          open, full read, channel subset, every 4th channel, skip factor, channel-major
+//          int16 with HdemgNsxDeinterleaver and random one second windows
+//
+//  g++ -std=c++14 -O3 -march=native -pthread nsx_read_benchmark.cpp -o nsx_read_benchmark
+//
+
+#include <stdlib.h>
+#include <vector>
+
+#include "hdemg_nsx_deinterleave.h"
+#include "hdemg_nsx_reader.h"
+#include "hdemg_nsx_writer.h"
+
+static double
+Seconds(uint64_t startNs)
+{
+    return (HdemgNowNs() - startNs) * 1e-9;
+}
+
+static int
+MakeFile(const char * pPath, uint32_t channels, uint32_t seconds)
+{
+    HdemgNsxWriter writer;
+    if(!writer.Open(pPath, channels, HDEMG_NIP_CLOCK_HZ, NULL))
+        return 1;
+
+    const uint32_t blockFrames = 300;   // 10 ms, as delivered by HdemgFrameAssembler
+    HdemgBlock block;
+    block.Allocate(channels, blockFrames, HDEMG_NIP_CLOCK_HZ);
+
+    uint64_t start = HdemgNowNs();
+    uint32_t time  = 0;
+    uint32_t seed  = 1;
+    for(uint32_t b=0; b<seconds * 100; ++b)
+    {
+        if(b == seconds * 50)
+            time += HDEMG_NIP_CLOCK_HZ;     // one second pause, starts a second data packet
+        block.frameCount = blockFrames;
+        block.startTime  = time;
+        for(uint32_t i=0; i<blockFrames * channels; ++i)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            block.samples[i] = (float)((int32_t)(seed >> 16) % 2000);
+        }
+        if(!writer.Write(block))
+            return 1;
+        time += blockFrames;
+    }
+    writer.Close();
+
+    double elapsed = Seconds(start);
+    printf("wrote %.2f GB in %.2f s (%.0f MB/s incl. synthesis), %u data packets\n",
+           writer.FileBytes() * 1e-9, elapsed, writer.FileBytes() * 1e-6 / elapsed, (uint32_t)writer.Segments().size());
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    if(argc >= 5 && strcmp(argv[1], "make") == 0)
+        return MakeFile(argv[2], (uint32_t)atoi(argv[3]), (uint32_t)atoi(argv[4]));
+    if(argc < 2)
+    {
+        printf("usage: %s make <file> <channels> <seconds>\n       %s <file> [subset channels]\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    uint64_t start = HdemgNowNs();
+    HdemgNsxReader reader;
+    if(!reader.Open(argv[1]))
+        return 1;
+    printf("open                 %8.3f s  spec %u.%u, %u channels at %.0f Hz, %u data packets, %.2f GB\n",
+           Seconds(start), reader.SpecMajor(), reader.SpecMinor(), reader.ChannelCount(), reader.SampleRate(),
+           reader.SegmentCount(), reader.FileSize() * 1e-9);
+
+    const uint32_t channels = reader.ChannelCount();
+    const uint32_t subset   = (argc > 2) ? (uint32_t)atoi(argv[2]) : (channels < 16 ? channels : 16);
+    const uint32_t chunk    = (uint32_t)reader.SampleRate();   // frames per gather, one second
+    std::vector<int16_t>  buffer((size_t)chunk * channels);
+    std::vector<uint32_t> firstSubset(subset), everyFourth;
+    for(uint32_t j=0; j<subset; ++j)
+        firstSubset[j] = j;
+    for(uint32_t c=0; c<channels; c+=4)
+        everyFourth.push_back(c);
+
+    struct Pass
+    {
+        const char *     pName;
+        const uint32_t * pChannels;
+        uint32_t         channels;
+        uint32_t         step;
+    };
+    const Pass passes[] = {
+        { "all channels",       NULL,            channels,                     1 },
+        { "first channels",     &firstSubset[0], subset,                       1 },
+        { "every 4th channel",  &everyFourth[0], (uint32_t)everyFourth.size(), 1 },
+        { "all, skipfactor 15", NULL,            channels,                     15 },
+    };
+
+    for(uint32_t p=0; p<sizeof(passes)/sizeof(passes[0]); ++p)
+    {
+        start = HdemgNowNs();
+        uint64_t frames = 0;
+        int64_t  check  = 0;
+        for(uint32_t s=0; s<reader.SegmentCount(); ++s)
+        {
+            uint32_t total = reader.Segment(s).dataPoints;
+            for(uint32_t first=0; first<total; first+=chunk)
+            {
+                uint32_t n   = (total - first < chunk) ? total - first : chunk;
+                uint32_t got = reader.Read(s, first, n, passes[p].pChannels, passes[p].channels, &buffer[0], passes[p].step);
+                frames += got;
+                check  += buffer[(size_t)(got - 1) * passes[p].channels];
+            }
+        }
+        double elapsed = Seconds(start);
+        printf("%-20s %8.3f s  %llu frames x %u channels, %.0f MB/s of file (check %lld)\n", passes[p].pName, elapsed,
+               (unsigned long long)frames, passes[p].channels, reader.FileSize() * 1e-6 / elapsed, (long long)check);
+    }
+
+    // channel-major int16, ten seconds at a time
+    HdemgNsxDeinterleaver deinterleaver;
+    deinterleaver.Start();
+    std::vector<int16_t> rows((size_t)chunk * 10 * channels);
+    start = HdemgNowNs();
+    int64_t check = 0;
+    for(uint32_t s=0; s<reader.SegmentCount(); ++s)
+    {
+        uint32_t total = reader.Segment(s).dataPoints;
+        for(uint32_t first=0; first<total; first+=chunk * 10)
+        {
+            uint32_t n = (total - first < chunk * 10) ? total - first : chunk * 10;
+            deinterleaver.Read(reader, s, first, n, NULL, 0, &rows[0], n);
+            check += rows[n - 1];
+        }
+    }
+    double elapsed = Seconds(start);
+    printf("channel-major int16  %8.3f s  %u threads, %.0f MB/s of file (check %lld)\n", elapsed,
+           deinterleaver.ThreadCount(), reader.FileSize() * 1e-6 / elapsed, (long long)check);
+
+    // one second windows at random times through zero-copy views
+    start = HdemgNowNs();
+    uint32_t seed  = 7;
+    check = 0;
+    uint32_t windows = 0;
+    for(uint32_t k=0; k<200; ++k)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        uint32_t s = seed % reader.SegmentCount();
+        uint32_t total = reader.Segment(s).dataPoints;
+        if(total < chunk)
+            continue;
+        HdemgNsxView view = reader.View(s, (seed >> 8) % (total - chunk + 1), chunk);
+        for(uint32_t i=0; i<view.frameCount; ++i)
+            check += view.Frame(i)[0];
+        windows++;
+    }
+    printf("random 1 s windows   %8.3f s  %u windows, channel 0 (check %lld)\n", Seconds(start), windows, (long long)check);
+    return 0;
+}
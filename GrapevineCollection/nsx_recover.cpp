@@ -0,0 +1,165 @@
+//
+//  nsx_recover.cpp
+//
+//  Repairs NSx files whose recording was interrupted, from the journal HdemgNsxWriter keeps
+//  next to them ("<file>.jnl", see hdemg_nsx_journal.h). The data is not read: DataPoints of
+//  every data packet is patched from the last committed checkpoint, the file is cut to the
+//  data that checkpoint covers, the sidecar index is rewritten and the journal is removed.
+//  At most the last checkpointMs of the recording are lost. The channel statistics of the
+//  index (hdemg_channel_stats.h) and a min/max digest that was being written
+//  (hdemg_nsx_digest.h, it has no trailer) do not match the repaired data; both are made
+//  again from the repaired file, which is the only step that reads the data.
+//
+//      nsx_recover file.ns5 [file2.ns5 ...]
+//
+//  g++ -std=c++14 -O2 nsx_recover.cpp -o nsx_recover
+//
+
+#include "hdemg_frames.h"
+#include "hdemg_nsx_digest.h"
+#include "hdemg_nsx_index.h"
+#include "hdemg_nsx_journal.h"
+#include "hdemg_nsx_reader.h"
+
+/**
+    Computes the channel statistics of a repaired file and stores them in its index
+  */
+static void
+RebuildStats(const HdemgNsxReader & reader, const char * pIndexPath)
+{
+    HdemgNsxIndex index = reader.Index();
+    index.SetStats(HdemgNsxReadStats(reader));
+    if(!index.Save(pIndexPath))
+        printf("ERROR: cannot store the channel statistics in [%s]\n", pIndexPath);
+}
+
+/**
+    Makes the digest of a repaired file again if it had one, with the same bucket size
+  */
+static void
+RebuildDigest(const HdemgNsxReader & reader, const char * pPath)
+{
+    char digestPath[HDEMG_NSX_INDEX_MAX_PATH];
+    if(!HdemgNsxDigestPath(pPath, digestPath, sizeof(digestPath)))
+        return;
+    FILE * pDigest = fopen(digestPath, "rb");
+    if(!pDigest)
+        return;
+    HdemgNsxDigestHeader header;
+    uint32_t bucketFrames = HDEMG_NSX_DIGEST_BUCKET_FRAMES;
+    if(fread(&header, sizeof(header), 1, pDigest) == 1 && memcmp(header.magic, HDEMG_NSX_DIGEST_MAGIC, 8) == 0
+       && header.bucketFrames)
+        bucketFrames = header.bucketFrames;
+    fclose(pDigest);
+
+    if(!HdemgNsxDigestBuild(reader, digestPath, bucketFrames))
+        printf("ERROR: cannot rebuild [%s]\n", digestPath);
+}
+
+/**
+    Repairs one file
+
+    \return true if the file was repaired
+  */
+static bool
+RecoverFile(const char * pPath)
+{
+    char journalPath[HDEMG_NSX_INDEX_MAX_PATH];
+    char indexPath[HDEMG_NSX_INDEX_MAX_PATH];
+    if(!HdemgNsxJournalPath(pPath, journalPath, sizeof(journalPath)) || !HdemgNsxIndexPath(pPath, indexPath, sizeof(indexPath)))
+        return false;
+
+    HdemgNsxJournal journal;
+    if(!journal.Load(journalPath))
+    {
+        printf("ERROR: no journal for [%s], the file was closed or not written with a journal\n", pPath);
+        return false;
+    }
+
+    FILE * pFile = fopen(pPath, "r+b");
+    if(!pFile)
+    {
+        printf("ERROR: cannot open [%s]\n", pPath);
+        return false;
+    }
+
+    // the journal must belong to this file
+    const HdemgNsxJournalHeader & header = journal.Header();
+    HdemgNsxBasicHeader basic;
+    if(fread(&basic, sizeof(basic), 1, pFile) != 1 || memcmp(basic.fileType, HDEMG_NSX_FILE_TYPE, sizeof(basic.fileType)) != 0
+       || basic.channelCount != header.channelCount || basic.period != header.period
+       || basic.headerBytes != header.headerBytes || memcmp(&basic.origin, &header.origin, sizeof(basic.origin)) != 0)
+    {
+        printf("ERROR: [%s] does not match its journal\n", journalPath);
+        fclose(pFile);
+        return false;
+    }
+
+    const std::vector<HdemgNsxSegment> & segments = journal.Segments();
+    const uint64_t frameBytes = (uint64_t)header.channelCount * sizeof(int16_t);
+    const uint64_t end        = journal.DataEnd();
+    if(segments.empty())
+    {
+        printf("ERROR: [%s] was interrupted before its first checkpoint, nothing to recover\n", pPath);
+        fclose(pFile);
+        return false;
+    }
+
+    bool ok = true;
+    for(size_t s=0; s<segments.size() && ok; ++s)
+    {
+        const HdemgNsxSegment & segment = segments[s];
+        ok = segment.DataOffset() + segment.dataPoints * frameBytes <= end
+             && HdemgNsxSeek(pFile, segment.headerOffset + offsetof(HdemgNsxDataHeader, dataPoints))
+             && fwrite(&segment.dataPoints, sizeof(uint32_t), 1, pFile) == 1;
+    }
+    ok = ok && HdemgNsxTruncate(pFile, end) && HdemgNsxSync(pFile);
+    fclose(pFile);
+    if(!ok)
+    {
+        printf("ERROR: cannot repair [%s]\n", pPath);
+        return false;
+    }
+
+    // a stale index still gives the place of the file in a split session
+    HdemgNsxIndex index;
+    index.Load(indexPath, header.channelCount, header.period, end, header.origin);
+    index.Build(segments, header.channelCount, header.period, end, header.origin);
+    index.Save(indexPath);
+    remove(journalPath);
+
+    HdemgNsxReader reader;
+    if(reader.Open(pPath))
+    {
+        RebuildStats(reader, indexPath);
+        RebuildDigest(reader, pPath);
+    }
+
+    uint64_t frames = 0;
+    for(size_t s=0; s<segments.size(); ++s)
+        frames += segments[s].dataPoints;
+    printf("%s: %zu data packets, %llu frames (%.1f s) after %u checkpoints, %llu bytes\n", pPath, segments.size(),
+           (unsigned long long)frames, frames * (double)header.period / HDEMG_NSX_TIME_RESOLUTION, journal.Checkpoints(),
+           (unsigned long long)end);
+    return true;
+}
+
+int main(int argc, char * argv[])
+{
+    if(argc < 2)
+    {
+        printf("usage: %s file.ns5 [file2.ns5 ...]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t failed = 0;
+    for(int i=1; i<argc; ++i)
+    {
+        uint64_t start = HdemgNowNs();
+        if(!RecoverFile(argv[i]))
+            failed++;
+        else
+            printf("  repaired in %.3f s\n", (HdemgNowNs() - start) * 1e-9);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+//
+//  nsx_to_archive.cpp
+//
+//  Converts NSx files to chunked HD-EMG archives (hdemg_archive.h), so single channels or
+//  short time windows of long recordings can be read without touching the whole file.
+//
+//      nsx_to_archive [-f frames] [-c channels] [-z] [-v] file.ns5 [file2.ns5 ...]
+//
+//          -f  frames per chunk window (default 4096)
+//          -c  channels per chunk (default 32)
+//          -z  compress the chunks losslessly (hdemg_codec.h)
+//          -v  print the compression ratio of every channel
+//
+//  file.ns5 becomes file.hda. Every data packet of the NSx file starts a new run of chunks,
+//  the counts are copied unchanged and the analog scale of the first channel is kept in the
+//  archive header. Each archive is read back and its chunk checksums verified.
+//
+//  The QC statistics of every channel (hdemg_channel_stats.h) are taken along the way and
+//  stored in the sidecar index of the NSx file, where nsx_qc.cpp reports them from.
+//
+//  g++ -std=c++14 -O3 -march=native nsx_to_archive.cpp -o nsx_to_archive
+//
+
+#include <stdlib.h>
+#include <string>
+
+#include "hdemg_archive.h"
+#include "hdemg_channel_stats.h"
+#include "hdemg_nsx_reader.h"
+
+static const uint32_t HDEMG_CONVERT_BLOCK_FRAMES = 8192;
+
+/**
+    Converts one file
+
+    \return true if the archive was written and verified
+  */
+static bool
+ConvertFile(const char * pPath, const HdemgArchiveSettings & shape, bool verbose)
+{
+    HdemgNsxReader reader;
+    if(!reader.Open(pPath))
+        return false;
+
+    std::string out(pPath);
+    size_t dot = out.find_last_of('.');
+    if(dot != std::string::npos && out.find_first_of("/\\", dot) == std::string::npos)
+        out.resize(dot);
+    out += ".hda";
+
+    HdemgArchiveSettings settings = shape;
+    const HdemgNsxChannelHeader * pExt = reader.ChannelHeader(0);
+    std::string units;
+    if(pExt && pExt->maxDigital != pExt->minDigital)
+        settings.unitsPerCount = (double)(pExt->maxAnalog - pExt->minAnalog) / (pExt->maxDigital - pExt->minDigital);
+    if(pExt)
+        units.assign(pExt->units, strnlen(pExt->units, sizeof(pExt->units)));
+    settings.pUnits        = units.c_str();
+    settings.countsPerUnit = 1.0f;
+
+    HdemgArchiveWriter writer;
+    if(!writer.Open(out.c_str(), reader.ChannelCount(), reader.SampleRate(), settings))
+        return false;
+
+    HdemgChannelStatsAccumulator stats;
+    HdemgNsxConfigureStats(reader, stats);
+
+    HdemgBlock block;
+    bool       ok = true;
+    for(uint32_t s=0; s<reader.SegmentCount() && ok; ++s)
+    {
+        uint32_t frames = reader.Segment(s).dataPoints;
+        for(uint32_t f=0; f<frames && ok; f+=HDEMG_CONVERT_BLOCK_FRAMES)
+        {
+            uint32_t n = (frames - f < HDEMG_CONVERT_BLOCK_FRAMES) ? frames - f : HDEMG_CONVERT_BLOCK_FRAMES;
+            ok = reader.ReadBlock(s, f, n, NULL, 0, block) && writer.Write(block);
+
+            HdemgNsxView view = reader.View(s, f, n);
+            stats.Add(view.pData, view.frameCount);
+        }
+    }
+    writer.Close();
+    ok = ok && !writer.Failed();
+
+    HdemgArchiveReader check;
+    if(ok && check.Open(out.c_str()))
+    {
+        for(uint32_t k=0; k<check.ChunkCount() && ok; ++k)
+            ok = check.Verify(k);
+    }
+    else
+        ok = false;
+
+    if(!ok)
+    {
+        printf("ERROR: conversion of [%s] failed\n", pPath);
+        remove(out.c_str());
+        return false;
+    }
+    printf("%s -> %s, %u chunks\n", pPath, out.c_str(), check.ChunkCount());
+
+    char indexPath[HDEMG_NSX_INDEX_MAX_PATH];
+    if(reader.BasicHeader() && HdemgNsxIndexPath(pPath, indexPath, sizeof(indexPath)))
+    {
+        HdemgNsxIndex index = reader.Index();
+        index.SetStats(stats.Stats());
+        index.Save(indexPath);
+    }
+    if(settings.codec != HDEMG_ARCHIVE_CODEC_RAW)
+    {
+        double worst = 1e30, best = 0.0;
+        for(uint32_t c=0; c<reader.ChannelCount(); ++c)
+        {
+            double ratio = writer.CompressionRatio(c);
+            worst = (ratio < worst) ? ratio : worst;
+            best  = (ratio > best) ? ratio : best;
+            if(verbose)
+                printf("  channel %3u (elec %3u)  ratio %.2f\n", c, reader.ElectrodeId(c), ratio);
+        }
+        printf("  compression ratio %.2f .. %.2f per channel\n", worst, best);
+    }
+    return true;
+}
+
+int main(int argc, char * argv[])
+{
+    HdemgArchiveSettings      shape;
+    bool                      verbose = false;
+    std::vector<const char *> files;
+    for(int i=1; i<argc; ++i)
+    {
+        if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            shape.chunkFrames = (uint32_t)atoi(argv[++i]);
+        else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            shape.chunkChannels = (uint32_t)atoi(argv[++i]);
+        else if(strcmp(argv[i], "-z") == 0)
+            shape.codec = HDEMG_ARCHIVE_CODEC_DELTA;
+        else if(strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else
+            files.push_back(argv[i]);
+    }
+    if(files.empty() || shape.chunkFrames == 0 || shape.chunkChannels == 0)
+    {
+        printf("usage: %s [-f frames] [-c channels] [-z] [-v] file.ns5 [file2.ns5 ...]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t failed = 0;
+    for(size_t k=0; k<files.size(); ++k)
+    {
+        if(!ConvertFile(files[k], shape, verbose))
+            failed++;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,350 @@
+//
+//  nsx_to_mat.cpp
+//
+//  Converts NSx files to MATLAB v7.3 (HDF5) MAT-files without loading them into MATLAB.
+//  Every file is streamed chunk by chunk out of its mapping (HdemgNsxReader), so memory use
+//  does not grow with the file size, and several files are converted in parallel.
+//
+//      nsx_to_mat [-z level] [-j jobs] file.ns5 [file2.ns5 ...]
+//
+//          -z  deflate level 1-9 with the HDF5 shuffle filter, 0 (default) stores raw
+//          -j  files converted at the same time (default: hardware threads)
+//
+//  file.ns5 becomes file.mat with the variables
+//
+//      Data          int16 [channels x frames], all data packets one after the other
+//      Timestamp     double [1 x packets], NIP time of the first frame of each packet
+//      DataPoints    double [1 x packets], frames in each packet
+//      SamplingFreq  double
+//      ChannelID     uint16 [channels x 1], electrode IDs
+//      Scale         double [channels x 1], analog units per count
+//
+//  Data also carries the HDF5 attributes scale, units and sampling_rate for other readers.
+//  Chunks are filtered (shuffle, deflate) on the conversion threads and stored with
+//  H5Dwrite_chunk, since HDF5 itself only runs one call at a time.
+//
+//  g++ -std=c++14 -O3 -march=native -pthread -I/usr/include/hdf5/serial nsx_to_mat.cpp
+//      -o nsx_to_mat -L/usr/lib/x86_64-linux-gnu/hdf5/serial -lhdf5 -lz
+//
+
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hdf5.h>
+#include <zlib.h>
+
+#include "hdemg_nsx_reader.h"
+
+static const uint32_t HDEMG_MAT_CHUNK_FRAMES   = 8192;
+static const uint32_t HDEMG_MAT_CHUNK_CHANNELS = 16;
+static const hsize_t  HDEMG_MAT_USERBLOCK      = 512;
+
+// HDF5 builds are usually not thread-safe, every library call goes through this lock
+static std::mutex g_hdf5;
+
+/**
+    Adds the MATLAB_class attribute that tells MATLAB how to load a dataset
+  */
+static bool
+SetMatlabClass(hid_t object, const char * pClass)
+{
+    hid_t type  = H5Tcopy(H5T_C_S1);
+    H5Tset_size(type, strlen(pClass));
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t attr  = H5Acreate2(object, "MATLAB_class", type, space, H5P_DEFAULT, H5P_DEFAULT);
+    bool  ok    = attr >= 0 && H5Awrite(attr, type, pClass) >= 0;
+    if(attr >= 0)
+        H5Aclose(attr);
+    H5Sclose(space);
+    H5Tclose(type);
+    return ok;
+}
+
+/**
+    Writes a MATLAB [rows x cols] matrix. MATLAB is column-major, so the HDF5 dimensions
+    are {cols, rows}.
+  */
+static bool
+WriteMatrix(hid_t file, const char * pName, const char * pClass, hid_t type, uint32_t rows, uint32_t cols, const void * pData)
+{
+    hsize_t dims[2] = { cols, rows };
+    hid_t space = H5Screate_simple(2, dims, NULL);
+    hid_t set   = H5Dcreate2(file, pName, type, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    bool  ok    = set >= 0 && (rows * cols == 0 || H5Dwrite(set, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, pData) >= 0)
+                  && SetMatlabClass(set, pClass);
+    if(set >= 0)
+        H5Dclose(set);
+    H5Sclose(space);
+    return ok;
+}
+
+static bool
+WriteAttribute(hid_t object, const char * pName, hid_t type, hsize_t count, const void * pData)
+{
+    hid_t space = H5Screate_simple(1, &count, NULL);
+    hid_t attr  = H5Acreate2(object, pName, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    bool  ok    = attr >= 0 && H5Awrite(attr, type, pData) >= 0;
+    if(attr >= 0)
+        H5Aclose(attr);
+    H5Sclose(space);
+    return ok;
+}
+
+/**
+    Writes the 128 byte MAT-file header into the HDF5 user block, which is what makes
+    MATLAB's load() accept the file as a v7.3 MAT-file.
+  */
+static bool
+WriteMatHeader(const char * pPath)
+{
+    char header[128];
+    memset(header, ' ', 116);
+    time_t now = time(NULL);
+    char   date[64];
+    strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Y", localtime(&now));
+    int n = snprintf(header, 116, "MATLAB 7.3 MAT-file, Platform: nsx_to_mat, Created on: %s HDF5 schema 1.00 .", date);
+    if(n > 0 && n < 116)
+        header[n] = ' ';
+    memset(header + 116, 0, 8);     // no subsystem data
+    header[124] = 0x00;             // version 0x0200
+    header[125] = 0x02;
+    header[126] = 'I';              // written little endian
+    header[127] = 'M';
+
+    FILE * pFile = fopen(pPath, "r+b");
+    if(!pFile)
+        return false;
+    bool ok = fwrite(header, 1, sizeof(header), pFile) == sizeof(header);
+    return (fclose(pFile) == 0) && ok;
+}
+
+/**
+    Applies the HDF5 shuffle filter for 2 byte elements: all low bytes, then all high bytes
+  */
+static void
+Shuffle16(const int16_t * pSrc, size_t count, uint8_t * pDst)
+{
+    const uint8_t * pBytes = (const uint8_t *)pSrc;
+    for(size_t i=0; i<count; ++i)
+    {
+        pDst[i]         = pBytes[2 * i];
+        pDst[count + i] = pBytes[2 * i + 1];
+    }
+}
+
+static bool
+ConvertFile(const char * pPath, int level)
+{
+    HdemgNsxReader reader;
+    if(!reader.Open(pPath))
+        return false;
+
+    std::string out(pPath);
+    size_t dot = out.find_last_of('.');
+    size_t sep = out.find_last_of("/\\");
+    if(dot != std::string::npos && (sep == std::string::npos || dot > sep))
+        out.erase(dot);
+    out += ".mat";
+
+    const uint32_t channels = reader.ChannelCount();
+    const uint32_t packets  = reader.SegmentCount();
+    uint64_t total = 0;
+    std::vector<double>   timestamps(packets), dataPoints(packets);
+    for(uint32_t s=0; s<packets; ++s)
+    {
+        timestamps[s] = reader.Segment(s).timestamp;
+        dataPoints[s] = reader.Segment(s).dataPoints;
+        total        += reader.Segment(s).dataPoints;
+    }
+
+    std::vector<uint16_t> ids(channels);
+    std::vector<double>   scale(channels, 1.0);
+    std::string           units;
+    for(uint32_t c=0; c<channels; ++c)
+    {
+        ids[c] = reader.ElectrodeId(c);
+        const HdemgNsxChannelHeader * pExt = reader.ChannelHeader(c);
+        if(pExt && pExt->maxDigital != pExt->minDigital)
+            scale[c] = (double)(pExt->maxAnalog - pExt->minAnalog) / (pExt->maxDigital - pExt->minDigital);
+        if(pExt && c == 0)
+            units.assign(pExt->units, strnlen(pExt->units, sizeof(pExt->units)));
+    }
+    double rate = reader.SampleRate();
+
+    // Data is {frames, channels} in HDF5, i.e. the sample-major layout of the NSx file
+    // (HDF5 does not allow chunks larger than a fixed size dataset, nor empty chunks, so a
+    // file without frames gets an empty contiguous Data)
+    const uint32_t chunkChannels = (channels < HDEMG_MAT_CHUNK_CHANNELS) ? channels : HDEMG_MAT_CHUNK_CHANNELS;
+    const uint32_t chunkFrames   = (total < HDEMG_MAT_CHUNK_FRAMES) ? (uint32_t)total : HDEMG_MAT_CHUNK_FRAMES;
+    hsize_t dims[2]  = { total, channels };
+    hsize_t chunk[2] = { chunkFrames, chunkChannels };
+    hid_t   file, data;
+    {
+        std::lock_guard<std::mutex> lock(g_hdf5);
+        hid_t fcpl = H5Pcreate(H5P_FILE_CREATE);
+        H5Pset_userblock(fcpl, HDEMG_MAT_USERBLOCK);
+        file = H5Fcreate(out.c_str(), H5F_ACC_TRUNC, fcpl, H5P_DEFAULT);
+        H5Pclose(fcpl);
+        if(file < 0)
+        {
+            printf("ERROR: cannot create [%s]\n", out.c_str());
+            return false;
+        }
+
+        hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+        if(total > 0)
+            H5Pset_chunk(dcpl, 2, chunk);
+        if(total > 0 && level > 0)
+        {
+            H5Pset_shuffle(dcpl);
+            H5Pset_deflate(dcpl, (unsigned)level);
+        }
+        hid_t space = H5Screate_simple(2, dims, NULL);
+        data = H5Dcreate2(file, "Data", H5T_STD_I16LE, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+        H5Sclose(space);
+        H5Pclose(dcpl);
+
+        hid_t str = H5Tcopy(H5T_C_S1);
+        H5Tset_size(str, units.empty() ? 1 : units.size());
+        bool ok = data >= 0 && SetMatlabClass(data, "int16")
+                  && WriteAttribute(data, "scale", H5T_NATIVE_DOUBLE, channels, &scale[0])
+                  && WriteAttribute(data, "sampling_rate", H5T_NATIVE_DOUBLE, 1, &rate)
+                  && WriteAttribute(data, "units", str, 1, units.empty() ? "" : units.c_str())
+                  && WriteMatrix(file, "Timestamp", "double", H5T_NATIVE_DOUBLE, 1, packets, timestamps.data())
+                  && WriteMatrix(file, "DataPoints", "double", H5T_NATIVE_DOUBLE, 1, packets, dataPoints.data())
+                  && WriteMatrix(file, "SamplingFreq", "double", H5T_NATIVE_DOUBLE, 1, 1, &rate)
+                  && WriteMatrix(file, "ChannelID", "uint16", H5T_NATIVE_UINT16, channels, 1, &ids[0])
+                  && WriteMatrix(file, "Scale", "double", H5T_NATIVE_DOUBLE, channels, 1, &scale[0]);
+        H5Tclose(str);
+        if(!ok)
+        {
+            printf("ERROR: cannot write the variables of [%s]\n", out.c_str());
+            if(data >= 0)
+                H5Dclose(data);
+            H5Fclose(file);
+            remove(out.c_str());
+            return false;
+        }
+    }
+
+    // one chunk in the file layout, its shuffled copy and its compressed form
+    const size_t chunkValues = (size_t)chunkFrames * chunkChannels;
+    std::vector<int16_t> raw(chunkValues);
+    std::vector<uint8_t> shuffled(chunkValues * sizeof(int16_t));
+    std::vector<uint8_t> packed(compressBound((uLong)shuffled.size()));
+
+    // frames of all packets are numbered consecutively; walk them one chunk row at a time
+    bool     ok    = true;
+    uint32_t seg   = 0;
+    uint32_t frame = 0;
+    for(uint64_t row=0; row<total && ok; row+=chunkFrames)
+    {
+        uint32_t rowFrames = (uint32_t)((total - row < chunkFrames) ? total - row : chunkFrames);
+        for(uint32_t c0=0; c0<channels && ok; c0+=chunkChannels)
+        {
+            uint32_t n = (channels - c0 < chunkChannels) ? channels - c0 : chunkChannels;
+            std::fill(raw.begin(), raw.end(), 0);   // edge chunks are stored at full size
+
+            uint32_t s = seg, f = frame;
+            for(uint32_t i=0; i<rowFrames; ++i)
+            {
+                while(f >= reader.Segment(s).dataPoints)
+                {
+                    s++;
+                    f = 0;
+                }
+                HdemgNsxView view = reader.View(s, f, 1);
+                memcpy(&raw[(size_t)i * chunkChannels], view.pData + c0, n * sizeof(int16_t));
+                f++;
+            }
+            if(c0 + chunkChannels >= channels)
+            {
+                seg   = s;
+                frame = f;
+            }
+
+            const void * pChunk = &raw[0];
+            size_t       bytes  = chunkValues * sizeof(int16_t);
+            if(level > 0)
+            {
+                Shuffle16(&raw[0], chunkValues, &shuffled[0]);
+                uLongf size = (uLongf)packed.size();
+                if(compress2(&packed[0], &size, &shuffled[0], (uLong)shuffled.size(), level) != Z_OK)
+                {
+                    printf("ERROR: compression failed in [%s]\n", pPath);
+                    ok = false;
+                    break;
+                }
+                pChunk = &packed[0];
+                bytes  = size;
+            }
+
+            hsize_t offset[2] = { row, c0 };
+            std::lock_guard<std::mutex> lock(g_hdf5);
+            if(H5Dwrite_chunk(data, H5P_DEFAULT, 0, offset, bytes, pChunk) < 0)
+            {
+                printf("ERROR: cannot write [%s]\n", out.c_str());
+                ok = false;
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(g_hdf5);
+        H5Dclose(data);
+        H5Fclose(file);
+    }
+    if(ok && WriteMatHeader(out.c_str()))
+        return true;
+    remove(out.c_str());
+    return false;
+}
+
+int main(int argc, char * argv[])
+{
+    int      level = 0;
+    uint32_t jobs  = std::thread::hardware_concurrency();
+    std::vector<const char *> files;
+    for(int i=1; i<argc; ++i)
+    {
+        if(strcmp(argv[i], "-z") == 0 && i + 1 < argc)
+            level = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            jobs = (uint32_t)atoi(argv[++i]);
+        else
+            files.push_back(argv[i]);
+    }
+    if(files.empty() || level < 0 || level > 9)
+    {
+        printf("usage: %s [-z level] [-j jobs] file.ns5 [file2.ns5 ...]\n", argv[0]);
+        return 1;
+    }
+    if(jobs == 0)
+        jobs = 1;
+
+    std::atomic<uint32_t> next(0);
+    std::atomic<uint32_t> failed(0);
+    std::vector<std::thread> threads;
+    for(uint32_t t=0; t<jobs && t<files.size(); ++t)
+    {
+        threads.push_back(std::thread([&]()
+        {
+            for(uint32_t k=next++; k<files.size(); k=next++)
+            {
+                uint64_t start = HdemgNowNs();
+                bool     ok    = ConvertFile(files[k], level);
+                printf("%s %s (%.1f s)\n", ok ? "converted" : "FAILED", files[k], (HdemgNowNs() - start) * 1e-9);
+                if(!ok)
+                    failed++;
+            }
+        }));
+    }
+    for(size_t t=0; t<threads.size(); ++t)
+        threads[t].join();
+    return failed ? 1 : 0;
+}
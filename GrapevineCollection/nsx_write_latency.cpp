@@ -0,0 +1,117 @@
+//
+//  nsx_write_latency.cpp
+//
+//  Checks that journal checkpoints (checkpointMs, hdemg_nsx_journal.h) do not hold up
+//  HdemgNsxWriter::Write() on the acquisition thread. 256 channels are written in 10 ms
+//  blocks at real-time pace, with and without checkpoints, through stdio and through the
+//  async writer; the worst Write() with checkpoints must stay at the level without them,
+//  within twice that level plus HDEMG_LATENCY_SLACK_MS for scheduling noise.
+//
+//      nsx_write_latency <directory> [seconds]
+//
+//          writes <directory>/latency.ns5 four times, 10 s each by default, and returns 1
+//          if a run with checkpoints is slower than its run without them
+//
+//  g++ -std=c++14 -O3 -march=native -pthread nsx_write_latency.cpp -o nsx_write_latency
+//
+
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hdemg_nsx_writer.h"
+
+static const uint32_t HDEMG_LATENCY_CHANNELS     = 256;
+static const uint32_t HDEMG_LATENCY_BLOCK_FRAMES = 300;     // 10 ms, as delivered by HdemgFrameAssembler
+static const double   HDEMG_LATENCY_SLACK_MS     = 0.5;     // scheduling noise allowed on top of the worst case
+
+//! \brief worst and slow Write() calls of one run
+struct LatencyResult
+{
+    double   worstMs;
+    uint32_t over2Ms;       //!< calls longer than 2 ms
+    bool     ok;
+};
+
+static LatencyResult
+Run(const std::string & path, bool async, uint32_t checkpointMs, uint32_t seconds)
+{
+    LatencyResult result = { 0.0, 0, false };
+
+    HdemgNsxWriterSettings settings;
+    settings.asyncWrite   = async;
+    settings.checkpointMs = checkpointMs;
+    HdemgNsxWriter writer;
+    if(!writer.Open(path.c_str(), HDEMG_LATENCY_CHANNELS, HDEMG_NIP_CLOCK_HZ, NULL, settings))
+        return result;
+
+    HdemgBlock block;
+    block.Allocate(HDEMG_LATENCY_CHANNELS, HDEMG_LATENCY_BLOCK_FRAMES, HDEMG_NIP_CLOCK_HZ);
+    uint32_t seed = 1;
+    for(size_t i=0; i<block.samples.size(); ++i)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        block.samples[i] = (float)((int32_t)(seed >> 16) % 2000);
+    }
+
+    const uint32_t blocks = seconds * 100;
+    const uint64_t period = 10000000;   // ns per block
+    uint64_t       start  = HdemgNowNs();
+    result.ok = true;
+    for(uint32_t b=0; b<blocks && result.ok; ++b)
+    {
+        uint64_t due = start + b * period;
+        while(HdemgNowNs() < due)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+        block.frameCount = HDEMG_LATENCY_BLOCK_FRAMES;
+        block.startTime  = b * HDEMG_LATENCY_BLOCK_FRAMES;
+        uint64_t t0 = HdemgNowNs();
+        result.ok   = writer.Write(block);
+        double   ms = (HdemgNowNs() - t0) * 1e-6;
+        result.worstMs  = (ms > result.worstMs) ? ms : result.worstMs;
+        result.over2Ms += (ms > 2.0);
+    }
+    writer.Close();
+    result.ok = result.ok && !writer.Failed();
+    return result;
+}
+
+int main(int argc, char * argv[])
+{
+    if(argc < 2)
+    {
+        printf("usage: %s <directory> [seconds]\n", argv[0]);
+        return 1;
+    }
+    std::string path    = std::string(argv[1]) + "/latency.ns5";
+    uint32_t    seconds = (argc > 2) ? (uint32_t)atoi(argv[2]) : 10;
+    if(seconds == 0)
+        seconds = 1;
+
+    bool passed = true;
+    for(int async=0; async<2; ++async)
+    {
+        LatencyResult without = Run(path, async != 0, 0, seconds);
+        LatencyResult with    = Run(path, async != 0, HDEMG_NSX_CHECKPOINT_MS, seconds);
+        if(!without.ok || !with.ok)
+        {
+            printf("ERROR: cannot write [%s]\n", path.c_str());
+            return 1;
+        }
+        bool held = with.worstMs <= 2.0 * without.worstMs + HDEMG_LATENCY_SLACK_MS;
+        printf("%-5s  worst Write() %6.2f ms (%u over 2 ms) without checkpoints, %6.2f ms (%u over 2 ms) with  %s\n",
+               async ? "async" : "sync", without.worstMs, without.over2Ms, with.worstMs, with.over2Ms,
+               held ? "ok" : "FAILED");
+        passed = passed && held;
+    }
+
+    char sidecar[HDEMG_NSX_INDEX_MAX_PATH];
+    remove(path.c_str());
+    if(HdemgNsxIndexPath(path.c_str(), sidecar, sizeof(sidecar)))
+        remove(sidecar);
+    if(HdemgNsxDigestPath(path.c_str(), sidecar, sizeof(sidecar)))
+        remove(sidecar);
+    return passed ? 0 : 1;
+}